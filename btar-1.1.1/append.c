@@ -0,0 +1,516 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include "main.h"
+#include "mytar.h"
+#include "readtar.h"
+#include "block.h"
+#include "filters.h"
+#include "filememory.h"
+#include "directory.h"
+#include "indexshard.h"
+#include "parity.h"
+#include "append.h"
+
+/* With --append, the new blocks go after the last block of the btar, and
+ * the members after it are written again: the parity of a group not yet
+ * full, the xorblocks, the index and the rest of the lists. The xorblocks
+ * go on from those in the btar. The index, the deleted list and the
+ * signatures keep the entries of the btar that the appended ones do not
+ * replace, first, so the blocks of the index entries keep growing. */
+
+extern struct filter *filter;
+extern struct filter *defilter;
+
+struct block *
+read_member(int fd, const struct directory_entry *e)
+{
+    struct block *b = block_new(e->size + 1);
+
+    if (pread_all(fd, b->data, e->size, e->offset + 512) == -1)
+        fatal_error_no_core("error: cannot read the member %s of the btar",
+                e->name);
+    b->writer_pos = e->size;
+    b->total_written = e->size;
+    return b;
+}
+
+/* The raw data of a list member, after its defilters */
+struct block *
+read_raw_member(int fd, const struct directory_entry *e)
+{
+    struct block *b = read_member(fd, e);
+    struct filter *mydefilter;
+    struct file_memory *fm;
+    struct block *raw;
+
+    if (defilter)
+        mydefilter = defilter;
+    else
+        mydefilter = defilters_from_extensions(e->name);
+
+    fm = filter_range(mydefilter, b, 0, b->total_written);
+    raw = fm->bo;
+    free(fm);
+    block_free(b);
+
+    if (mydefilter != defilter)
+        free_filters(mydefilter);
+
+    return raw;
+}
+
+static struct block *
+join_blocks(struct block *a, struct block *b)
+{
+    if (!a)
+        return b;
+    a->lastblock->nextblock = b;
+    a->lastblock = b->lastblock;
+    a->total_written += b->total_written;
+    return a;
+}
+
+/* The index, as a single member or in shards joined back */
+struct block *
+read_raw_index(int fd, const struct directory *dir)
+{
+    const struct directory_entry *e;
+    struct block *raw = 0;
+    int i;
+
+    e = directory_find(dir, "index.tar");
+    if (e)
+        return read_raw_member(fd, e);
+
+    for(i=0; ; ++i)
+    {
+        char prefix[100];
+
+        snprintf(prefix, sizeof prefix, "indexshard%i.tar", i);
+        e = directory_find(dir, prefix);
+        if (!e)
+            break;
+        raw = join_blocks(raw, read_raw_member(fd, e));
+    }
+
+    return raw;
+}
+
+/* The -R or --parity of the btar, given that of the command line if any */
+static void
+check_redundancy(int fd, const struct directory *dir)
+{
+    int k = 0, n = 0, xor = 0;
+    size_t i;
+
+    for(i=0; i < dir->nentries; ++i)
+    {
+        const struct directory_entry *e = &dir->entries[i];
+        int g, j;
+
+        if (k == 0 && sscanf(e->name, "parity%d_%d", &g, &j) == 2)
+        {
+            size_t len = parity_header_max();
+            char *text = malloc(len);
+            int nblocks;
+            unsigned long long *sizes;
+            size_t start;
+
+            if (!text)
+                fatal_error("Cannot allocate");
+            if (len > e->size)
+                len = e->size;
+            if (pread_all(fd, text, len, e->offset + 512) == -1 ||
+                    !parity_header_parse(text, len, &k, &n, &nblocks,
+                        &sizes, &start))
+                fatal_error_no_core("error: the parity member %s of the btar "
+                        "is damaged", e->name);
+            free(sizes);
+            free(text);
+        }
+        else if (strcmp(e->name, "xorblock") == 0)
+            xor = 1;
+        else if (sscanf(e->name, "xorblock%d_%d", &g, &j) == 2)
+            xor = j;
+    }
+
+    if ((command_line.parity_k || command_line.xorblock) &&
+            (command_line.parity_k != k || command_line.parity_n != n ||
+             command_line.xorblock != xor))
+        fatal_error_no_core("error: -R and --parity should be as in the btar, "
+                "or not given");
+
+    command_line.parity_k = k;
+    command_line.parity_n = n;
+    command_line.xorblock = xor;
+}
+
+/* The blocks end at the first member that is not a block, nor the parity of
+ * a full group */
+static void
+find_end(struct append *a)
+{
+    size_t i;
+
+    a->nblocks = 0;
+    a->end = 0;
+    for(i=0; i < a->dir.nentries; ++i)
+    {
+        const struct directory_entry *e = &a->dir.entries[i];
+        unsigned long long padded = e->size;
+        int b, g, j;
+
+        if (sscanf(e->name, "block%d", &b) == 1)
+        {
+            if (b != a->nblocks)
+                fatal_error_no_core("error: the btar has the block %i where "
+                        "the block %i should be", b, a->nblocks);
+            a->nblocks++;
+        }
+        else if (!(sscanf(e->name, "parity%d_%d", &g, &j) == 2 &&
+                    (g + 1) * command_line.parity_n <= a->nblocks))
+            break;
+
+        if (padded % 512)
+            padded += 512 - padded % 512;
+        a->end = e->offset + 512 + padded;
+    }
+}
+
+void
+append_load(struct append *a, int fd)
+{
+    const struct directory_entry *e;
+    size_t i;
+
+    if (!directory_load(&a->dir, fd))
+        fatal_error_no_core("error: the btar to append to has no directory "
+                "of members");
+
+    e = directory_find(&a->dir, "block0.tar");
+    if (e && strcmp(e->name + sizeof "block0.tar" - 1,
+                get_filter_extensions(filter)) != 0)
+        fatal_error_no_core("error: the blocks of the btar are filtered as "
+                "%s, and not as the -F given", e->name);
+
+    check_redundancy(fd, &a->dir);
+    find_end(a);
+
+    a->index = read_raw_index(fd, &a->dir);
+    if (!a->index)
+        fatal_error_no_core("error: the btar to append to has no index");
+
+    a->deleted = 0;
+    e = directory_find(&a->dir, "deleted.tar");
+    if (e)
+        a->deleted = read_raw_member(fd, e);
+
+    a->signatures = 0;
+    e = directory_find(&a->dir, "signatures.tar");
+    if (e)
+        a->signatures = read_raw_member(fd, e);
+
+    a->xorblocks = 0;
+    if (command_line.xorblock)
+    {
+        a->xorblocks = malloc(command_line.xorblock * sizeof(*a->xorblocks));
+        if (!a->xorblocks)
+            fatal_error("Cannot allocate");
+        for(i=0; i < (size_t) command_line.xorblock; ++i)
+        {
+            char name[100];
+
+            if (command_line.xorblock == 1)
+                snprintf(name, sizeof name, "xorblock");
+            else
+                snprintf(name, sizeof name, "xorblock%i_%i", (int) i,
+                        command_line.xorblock);
+            e = directory_find(&a->dir, name);
+            if (!e || strcmp(e->name, name) != 0)
+                fatal_error_no_core("error: the btar has no member %s", name);
+            a->xorblocks[i] = read_member(fd, e);
+        }
+    }
+
+    a->replaced.names = 0;
+    a->replaced.n = 0;
+    a->replaced.allocated = 0;
+
+    if (command_line.debug)
+        fprintf(stderr, "Appending to the btar of %i blocks, from byte %llu\n",
+                a->nblocks, a->end);
+}
+
+static void
+names_add(struct append_names *s, const char *name)
+{
+    const size_t allocstep = 1000;
+    size_t len = strlen(name);
+
+    if (s->n == s->allocated)
+    {
+        s->names = realloc(s->names,
+                (s->allocated + allocstep) * sizeof(*s->names));
+        if (!s->names)
+            fatal_error("Cannot realloc");
+        s->allocated += allocstep;
+    }
+
+    /* The directories are there with and without the final slash */
+    s->names[s->n] = strdup(name);
+    if (!s->names[s->n])
+        fatal_error("Cannot allocate");
+    if (len > 1 && name[len-1] == '/')
+        s->names[s->n][len-1] = '\0';
+    s->n++;
+}
+
+static int
+compare_names(const void *p1, const void *p2)
+{
+    return strcmp(*(char * const *) p1, *(char * const *) p2);
+}
+
+static int
+names_find(const struct append_names *s, const char *name)
+{
+    char *key = strdup(name);
+    size_t len = strlen(name);
+    int found;
+
+    if (!key)
+        fatal_error("Cannot allocate");
+    if (len > 1 && key[len-1] == '/')
+        key[len-1] = '\0';
+    found = bsearch(&key, s->names, s->n, sizeof(*s->names),
+            compare_names) != 0;
+    free(key);
+    return found;
+}
+
+static enum readtar_newfile_result
+names_new_file_cb(const struct readtar_file *file, void *userdata)
+{
+    names_add((struct append_names *) userdata, file->name);
+    return READTAR_SKIPDATA;
+}
+
+static void
+skip_new_data_cb(const char *data, size_t len, void *userdata)
+{
+    data = data;
+    len = len;
+    userdata = userdata;
+}
+
+static void
+names_from_tar(struct append_names *s, const struct block *b)
+{
+    struct readtar rt;
+    struct readtar_callbacks cb = { names_new_file_cb, skip_new_data_cb, s };
+
+    init_readtar(&rt, &cb);
+    for(; b != 0; b = b->nextblock)
+        process_this_tar_data(&rt, b->data, b->writer_pos);
+}
+
+/* The names in the appended index and deleted list. Their entries in
+ * the lists of the btar are not kept. */
+void
+append_set_replaced(struct append *a, const struct block *index,
+        const struct block *deleted)
+{
+    names_from_tar(&a->replaced, index);
+    if (deleted)
+        names_from_tar(&a->replaced, deleted);
+    qsort(a->replaced.names, a->replaced.n, sizeof(*a->replaced.names),
+            compare_names);
+}
+
+struct range
+{
+    unsigned long long start;
+    unsigned long long end;
+};
+
+struct merge_state
+{
+    const struct append_names *replaced;
+    struct range *kept;
+    size_t nkept;
+    size_t allocated;
+    unsigned long long pos; /* Of the record given to readtar */
+    unsigned long long entry_start;
+    int have_entry_start;
+};
+
+static enum readtar_newfile_result
+merge_new_file_cb(const struct readtar_file *file, void *userdata)
+{
+    struct merge_state *ms = (struct merge_state *) userdata;
+    unsigned long long padded = file->size;
+
+    if (padded % 512)
+        padded += 512 - padded % 512;
+
+    if (!names_find(ms->replaced, file->name))
+    {
+        const size_t allocstep = 1000;
+
+        if (ms->nkept == ms->allocated)
+        {
+            ms->kept = realloc(ms->kept,
+                    (ms->allocated + allocstep) * sizeof(*ms->kept));
+            if (!ms->kept)
+                fatal_error("Cannot realloc");
+            ms->allocated += allocstep;
+        }
+        ms->kept[ms->nkept].start = ms->entry_start;
+        ms->kept[ms->nkept].end = ms->pos + 512 + padded;
+        ms->nkept++;
+    }
+    ms->have_entry_start = 0;
+
+    return READTAR_SKIPDATA;
+}
+
+static size_t
+copy_range(char *out, const struct block *b, unsigned long long start,
+        unsigned long long end)
+{
+    unsigned long long pos = 0;
+    size_t copied = 0;
+
+    for(; b != 0 && pos < end; b = b->nextblock)
+    {
+        unsigned long long bstart = pos;
+        unsigned long long bend = pos + b->writer_pos;
+
+        if (bstart < start)
+            bstart = start;
+        if (bend > end)
+            bend = end;
+
+        if (bstart < bend)
+        {
+            memcpy(out + copied, b->data + (bstart - pos), bend - bstart);
+            copied += bend - bstart;
+        }
+
+        pos += b->writer_pos;
+    }
+    return copied;
+}
+
+/* The entries of the 'old' tar not replaced, with their long name headers,
+ * and then the whole 'new' tar, or the tar end */
+struct block *
+append_merge(const struct append *a, const struct block *old,
+        const struct block *new)
+{
+    struct merge_state ms;
+    struct readtar rt;
+    struct readtar_callbacks cb = { merge_new_file_cb, skip_new_data_cb, &ms };
+    const struct block *b;
+    char record[512];
+    size_t inrecord = 0;
+    unsigned long long size = 0;
+    struct block *merged;
+    size_t i;
+
+    ms.replaced = &a->replaced;
+    ms.kept = 0;
+    ms.nkept = 0;
+    ms.allocated = 0;
+    ms.pos = 0;
+    ms.have_entry_start = 0;
+
+    /* Record by record, to know where each entry starts */
+    init_readtar(&rt, &cb);
+    for(b = old; b != 0; b = b->nextblock)
+    {
+        size_t j = 0;
+
+        while (j < b->writer_pos)
+        {
+            size_t n = sizeof record - inrecord;
+            if (n > b->writer_pos - j)
+                n = b->writer_pos - j;
+            memcpy(record + inrecord, b->data + j, n);
+            inrecord += n;
+            j += n;
+
+            if (inrecord < sizeof record)
+                continue;
+            if (rt.state == IN_HEADER && !ms.have_entry_start)
+            {
+                ms.entry_start = ms.pos;
+                ms.have_entry_start = 1;
+            }
+            process_this_tar_data(&rt, record, sizeof record);
+            ms.pos += sizeof record;
+            inrecord = 0;
+        }
+    }
+
+    for(i=0; i < ms.nkept; ++i)
+        size += ms.kept[i].end - ms.kept[i].start;
+    size += new ? new->total_written : 1024;
+
+    merged = block_new(size + 1);
+    for(i=0; i < ms.nkept; ++i)
+        merged->writer_pos += copy_range(merged->data + merged->writer_pos,
+                old, ms.kept[i].start, ms.kept[i].end);
+    if (new)
+        merged->writer_pos += copy_range(merged->data + merged->writer_pos,
+                new, 0, new->total_written);
+    else
+    {
+        memset(merged->data + merged->writer_pos, 0, 1024);
+        merged->writer_pos += 1024;
+    }
+    merged->total_written = merged->writer_pos;
+
+    if (command_line.debug)
+        fprintf(stderr, "Kept %zu entries of the btar list\n", ms.nkept);
+
+    free(ms.kept);
+    return merged;
+}
+
+void
+append_free(struct append *a)
+{
+    size_t i;
+
+    directory_free(&a->dir);
+    block_free(a->index);
+    block_free(a->deleted);
+    block_free(a->signatures);
+    for(i=0; a->xorblocks && i < (size_t) command_line.xorblock; ++i)
+        block_free(a->xorblocks[i]);
+    free(a->xorblocks);
+    for(i=0; i < a->replaced.n; ++i)
+        free(a->replaced.names[i]);
+    free(a->replaced.names);
+}
@@ -0,0 +1,32 @@
+struct block;
+
+struct append_names
+{
+    char **names;
+    size_t n;
+    size_t allocated;
+};
+
+struct append
+{
+    struct directory dir; /* Of the btar before appending */
+    int nblocks; /* Already in the btar */
+    unsigned long long end; /* Of the members kept */
+    struct block *index; /* The raw lists of the btar, or 0 */
+    struct block *deleted;
+    struct block *signatures;
+    struct block **xorblocks; /* As in the btar, command_line.xorblock */
+    struct append_names replaced; /* By the appended index or deleted list */
+};
+
+void append_load(struct append *a, int fd);
+void append_set_replaced(struct append *a, const struct block *index,
+        const struct block *deleted);
+struct block * append_merge(const struct append *a, const struct block *old,
+        const struct block *new);
+void append_free(struct append *a);
+
+/* Any member of a btar, as it is there, or defiltered */
+struct block * read_member(int fd, const struct directory_entry *e);
+struct block * read_raw_member(int fd, const struct directory_entry *e);
+struct block * read_raw_index(int fd, const struct directory *dir);
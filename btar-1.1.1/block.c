@@ -73,6 +73,19 @@ block_realloc_set(struct block *b, size_t len, char c)
     }
 }
 
+/* Room for 'len' bytes in all, keeping the data there */
+void
+block_reserve(struct block *b, size_t len)
+{
+    if (len > b->allocated)
+    {
+        b->data = realloc(b->data, len);
+        if (!b->data)
+            fatal_error("Cannot realloc");
+        b->allocated = len;
+    }
+}
+
 struct block *
 block_new_never_back(size_t allocate)
 {
@@ -224,10 +237,18 @@ block_reset_pos_if_possible(struct block *b)
 
 int
 block_reader_to_fd(struct block_reader *r, int fd)
+{
+    return block_reader_to_fd_max(r, fd, r->b->writer_pos - r->pos);
+}
+
+int
+block_reader_to_fd_max(struct block_reader *r, int fd, size_t max)
 {
     size_t left = r->b->writer_pos - r->pos;
     ssize_t nwritten;
 
+    if (left > max)
+        left = max;
     if (left == 0)
         return 0;
 
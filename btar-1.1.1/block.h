@@ -30,6 +30,8 @@ struct block_reader * block_reader_new(struct block *b);
 int block_reader_can_read(struct block_reader *r);
 void block_reset_pos_if_possible(struct block *b);
 int block_reader_to_fd(struct block_reader *r, int fd);
+int block_reader_to_fd_max(struct block_reader *r, int fd, size_t max);
 int block_are_readers_done(struct block *b);
 void block_reader_free(struct block_reader *br);
 void block_realloc_set(struct block *b, size_t len, char c);
+void block_reserve(struct block *b, size_t len);
@@ -27,6 +27,10 @@
 #include "main.h"
 #include "filters.h"
 #include "blockprocess.h"
+#include "parity.h"
+#include "checksums.h"
+#include "checkpoint.h"
+#include "repository.h"
 
 extern struct filter *filter;
 
@@ -59,9 +63,59 @@ block_process_new(int nblock)
     bp->nblock = nblock;
     bp->has_read = 0;
     bp->finished_read_ack = 0;
+    bp->frame_written = 0;
+    bp->frames = 0;
+    bp->nframes = 0;
+    bp->allocated_frames = 0;
+    bp->raw_crc = 0;
+    bp->crc = 0;
     return bp;
 }
 
+/* A new filter for the block, or for its next frame */
+static void
+start_block_filter(struct block_process *bp)
+{
+    int res;
+
+    assert(bp->fd_filterin == -1 && bp->fd_filterout == -1);
+
+    if (command_line.frame_size)
+    {
+        if (bp->nframes == bp->allocated_frames)
+        {
+            bp->allocated_frames = bp->allocated_frames ?
+                bp->allocated_frames * 2 : 16;
+            bp->frames = realloc(bp->frames,
+                    bp->allocated_frames * sizeof(*bp->frames));
+            if (!bp->frames)
+                fatal_error("Cannot realloc");
+        }
+        bp->frames[bp->nframes++] = bp->bo->writer_pos;
+        bp->frame_written = 0;
+    }
+
+    run_filters(filter, &bp->fd_filterin, &bp->fd_filterout);
+    /* Otherwise the next execing filters will get them */
+    set_cloexec(bp->fd_filterin);
+    set_cloexec(bp->fd_filterout);
+
+    res = fcntl(bp->fd_filterin, F_SETFL, O_NONBLOCK);
+    if (res == -1)
+        error("Cannot fcntl");
+}
+
+/* The filter of a frame was closed at the frame end, and there is more
+ * to come for the block */
+static int
+block_process_between_frames(const struct block_process *bp)
+{
+    return command_line.frame_size &&
+        bp->frame_written == command_line.frame_size &&
+        !bp->closed_in &&
+        bp->bi->total_written < command_line.blocksize;
+}
+
 int
 block_process_can_read(const struct block_process *bp)
 {
@@ -125,6 +179,8 @@ block_process_reset(struct block_process *bp, int nblock)
     bp->block_finished = 1;
     bp->has_read = 0;
     bp->finished_read_ack = 0;
+    bp->nframes = 0;
+    bp->raw_crc = 0;
 }
 
 void
@@ -190,26 +246,23 @@ check_read_fds(struct block_process *bp, fd_set *readfds, int should_read)
                     close(bp->fd_filterin);
                     bp->fd_filterin = -1;
                 }
+                /* Or the last frame had already ended */
+                else if (bp->fd_filterout == -1)
+                    bp->block_finished = 1;
             }
         }
         else
         {
             bp->block_finished = 0;
             bp->has_read = 1;
-            if (filter && bp->fd_filterin == -1)
+            if (command_line.checkpoint_file)
+                checkpoint_track(b->data + b->writer_pos - nread, nread);
+            /* The next frame may still wait for the filter of the last */
+            if (filter && bp->fd_filterin == -1 && bp->fd_filterout == -1)
             {
-                assert(bp->fd_filterout == -1);
                 if (command_line.debug)
                     fprintf(stderr, "Starting block %i\n", bp->nblock);
-                run_filters(filter, &bp->fd_filterin, &bp->fd_filterout);
-                /* Otherwise the next execing filters will get them */
-		set_cloexec(bp->fd_filterin);
-		set_cloexec(bp->fd_filterout);
-
-                int res;
-                res = fcntl(bp->fd_filterin, F_SETFL, O_NONBLOCK);
-                if (res == -1)
-                    error("Cannot fcntl");
+                start_block_filter(bp);
             }
         }
 
@@ -237,7 +290,15 @@ check_read_fds(struct block_process *bp, fd_set *readfds, int should_read)
             close(bp->fd_filterout);
             bp->fd_filterout = -1;
 
-            bp->block_finished = 1;
+            if (bp->fd_filterin == -1 && block_reader_can_read(bp->br_to_filter))
+            {
+                if (command_line.debug > 1)
+                    fprintf(stderr, "Starting frame %i of block %i\n",
+                            bp->nframes, bp->nblock);
+                start_block_filter(bp);
+            }
+            else if (!block_process_between_frames(bp))
+                bp->block_finished = 1;
         }
     }
 }
@@ -247,9 +308,21 @@ check_write_fds(struct block_process *bp, fd_set *writefds)
 {
     if (bp->fd_filterin >= 0 && FD_ISSET(bp->fd_filterin, writefds))
     {
-        int nwritten = block_reader_to_fd(bp->br_to_filter, bp->fd_filterin);
+        const char *data = bp->bi->data + bp->br_to_filter->pos;
+        int nwritten;
+
+        if (command_line.frame_size)
+            nwritten = block_reader_to_fd_max(bp->br_to_filter, bp->fd_filterin,
+                    command_line.frame_size - bp->frame_written);
+        else
+            nwritten = block_reader_to_fd(bp->br_to_filter, bp->fd_filterin);
         if (nwritten == -1 && errno != EINTR)
             fatal_errno("Failed write to filter");
+        if (nwritten > 0)
+        {
+            bp->frame_written += nwritten;
+            bp->raw_crc = crc32c(bp->raw_crc, data, nwritten);
+        }
 
         if (bp->bi->total_written == command_line.blocksize &&
                 !block_reader_can_read(bp->br_to_filter))
@@ -262,31 +335,46 @@ check_write_fds(struct block_process *bp, fd_set *writefds)
             close(bp->fd_filterin);
             bp->fd_filterin = -1;
         }
+        else if (command_line.frame_size &&
+                bp->frame_written == command_line.frame_size)
+        {
+            /* The frame ends; the next gets its filter once this is out */
+            close(bp->fd_filterin);
+            bp->fd_filterin = -1;
+        }
     }
 }
 
+/* The xorblock is one byte longer than the longest block, and that last
+ * byte stays zero. Its memory grows by doubling, up to the block size. */
 void
 xor_to_xorblock(struct block_process *bp, struct block *xorblock)
 {
-    size_t mysize = bp->bo->writer_pos;
-    size_t xorsize = mysize + 1 /* next expand byte */;
-    size_t oldsize = xorblock->allocated;
-    size_t i;
-    char expand_byte;
+    xor_data_to_xorblock(bp->bo->data, bp->bo->writer_pos, xorblock);
+}
 
-    assert(oldsize > 0);
+void
+xor_data_to_xorblock(const char *data, size_t mysize, struct block *xorblock)
+{
+    size_t used = xorblock->writer_pos;
 
-    expand_byte = xorblock->data[oldsize-1];
+    if (mysize + 1 > xorblock->allocated)
+    {
+        size_t len = xorblock->allocated * 2;
 
-    block_realloc_set(xorblock, xorsize, expand_byte);
+        if (len > command_line.blocksize + 1)
+            len = command_line.blocksize + 1;
+        if (len < mysize + 1)
+            len = mysize + 1;
+        block_realloc_set(xorblock, len, 0);
+    }
 
-    for(i=0; i < mysize; ++i)
-        xorblock->data[i] ^= bp->bo->data[i];
+    xor_region((unsigned char *) xorblock->data,
+            (const unsigned char *) data, mysize);
 
-    /* Xor the last byte (expand_byte), that works for
-     * any next byte there may be. */
-    for(i=mysize; i < xorblock->allocated; ++i)
-        xorblock->data[i] ^= 0;
+    if (used < mysize + 1)
+        used = mysize + 1;
+    xorblock->writer_pos = used;
 }
 
 void
@@ -299,8 +387,12 @@ dump_block_to_tar(struct block_process *bp, struct mytar *tar)
         fprintf(stderr, "Writing block %i to the btar stream\n", bp->nblock);
 
     /* Start of block file - header */
-    snprintf(filename, sizeof filename, "block%i.tar%s", bp->nblock,
-            get_filter_extensions(filter));
+    if (command_line.repository)
+        snprintf(filename, sizeof filename, "block%i.tar%s.chunks",
+                bp->nblock, repository_extensions());
+    else
+        snprintf(filename, sizeof filename, "block%i.tar%s", bp->nblock,
+                get_filter_extensions(filter));
 
     mytar_new_file(tar);
     mytar_set_filename(tar, filename);
@@ -320,6 +412,10 @@ dump_block_to_tar(struct block_process *bp, struct mytar *tar)
     if (res == -1)
         error("Failed to write header");
 
+    bp->crc = crc32c(0, bp->bo->data, bp->bo->writer_pos);
+    if (!filter && !command_line.repository)
+        bp->raw_crc = bp->crc;
+
     /* The block body - all in bo */
     res = mytar_write_data(tar, bp->bo->data, bp->bo->writer_pos);
     if (res == -1)
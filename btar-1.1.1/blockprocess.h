@@ -11,6 +11,12 @@ struct block_process
     int nblock;
     int has_read;
     int finished_read_ack; /* to keep track of the caller having acked */
+    size_t frame_written; /* To the filter of the current frame */
+    unsigned long long *frames; /* Where each frame starts in bo */
+    int nframes;
+    int allocated_frames;
+    unsigned int raw_crc; /* Of the block tar, before the filter */
+    unsigned int crc; /* Of the block member, after dump_block_to_tar */
 };
 
 struct block_process * block_process_new(int nblock);
@@ -28,3 +34,4 @@ int block_process_finished(struct block_process *bp);
 int block_process_finished_reading(struct block_process *bp);
 int block_process_has_read(struct block_process *bp);
 void xor_to_xorblock(struct block_process *bp, struct block *xorblock);
+void xor_data_to_xorblock(const char *data, size_t len, struct block *xorblock);
@@ -0,0 +1,200 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include "main.h"
+#include "bufread.h"
+
+/* A read buffer for the btar archive. The reads are big, and aligned to the
+ * buffer size in the file, so the 512 byte tar headers do not cost a read()
+ * each. Skipping goes through the buffer first, and then lseek()s, or drops
+ * what comes next if the input is a pipe. */
+
+void
+bufread_init(struct bufread *b, int fd, size_t allocate)
+{
+    off_t pos;
+
+    b->fd = fd;
+    b->data = malloc(allocate);
+    if (!b->data)
+        fatal_error("Cannot allocate");
+    b->allocated = allocate;
+    b->pos = 0;
+    b->len = 0;
+    b->to_drop = 0;
+    b->eof = 0;
+
+    pos = lseek(fd, 0, SEEK_CUR);
+    b->can_seek = (pos != -1);
+    b->offset = b->can_seek ? (unsigned long long) pos : 0;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (b->can_seek)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+void
+bufread_free(struct bufread *b)
+{
+    free(b->data);
+    b->data = 0;
+}
+
+size_t
+bufread_available(const struct bufread *b)
+{
+    return b->len - b->pos;
+}
+
+const char *
+bufread_data(const struct bufread *b)
+{
+    return b->data + b->pos;
+}
+
+void
+bufread_consume(struct bufread *b, size_t n)
+{
+    assert(n <= b->len - b->pos);
+    b->pos += n;
+    b->offset += n;
+}
+
+/* To be called when the fd can be read. Returns what read() returned. */
+ssize_t
+bufread_fill(struct bufread *b)
+{
+    unsigned long long filepos;
+    size_t toread;
+    size_t oldlen;
+    ssize_t nread;
+
+    if (b->pos == b->len)
+    {
+        b->pos = 0;
+        b->len = 0;
+    }
+    oldlen = b->len;
+
+    /* Whatever is in the buffer, comes before the file position */
+    filepos = b->offset + (b->len - b->pos);
+    toread = b->allocated - b->len;
+    if (toread > b->allocated - filepos % b->allocated)
+        toread = b->allocated - filepos % b->allocated;
+    if (toread == 0)
+        return 0;
+
+    nread = read(b->fd, b->data + b->len, toread);
+    if (nread == -1)
+        return -1;
+    if (nread == 0)
+    {
+        b->eof = 1;
+        return 0;
+    }
+
+    b->len += nread;
+    if (b->to_drop > 0)
+    {
+        size_t drop = nread;
+
+        if (drop > b->to_drop)
+            drop = b->to_drop;
+        memmove(b->data + oldlen, b->data + oldlen + drop, nread - drop);
+        b->len -= drop;
+        b->to_drop -= drop;
+    }
+    return nread;
+}
+
+/* Whether bufread_fill() makes sense: nothing buffered, and not at the end */
+int
+bufread_needs_fill(const struct bufread *b)
+{
+    return !b->eof && b->pos == b->len;
+}
+
+void
+bufread_skip(struct bufread *b, unsigned long long n)
+{
+    size_t inbuffer = b->len - b->pos;
+
+    if (n <= inbuffer)
+    {
+        bufread_consume(b, n);
+        return;
+    }
+
+    bufread_consume(b, inbuffer);
+    n -= inbuffer;
+
+    if (b->can_seek)
+    {
+        if (lseek(b->fd, n, SEEK_CUR) == -1)
+            fatal_errno("Cannot lseek the btar");
+    }
+    else
+        b->to_drop += n;
+    b->offset += n;
+}
+
+/* Only forward, for pipes */
+void
+bufread_seek(struct bufread *b, unsigned long long offset)
+{
+    if (offset >= b->offset)
+        bufread_skip(b, offset - b->offset);
+    else
+    {
+        if (lseek(b->fd, offset, SEEK_SET) == -1)
+            fatal_errno("Cannot lseek the btar");
+        b->pos = 0;
+        b->len = 0;
+        b->to_drop = 0;
+        b->offset = offset;
+        b->eof = 0;
+    }
+}
+
+unsigned long long
+bufread_tell(const struct bufread *b)
+{
+    return b->offset;
+}
+
+/* The region is going to be read soon */
+void
+bufread_will_need(struct bufread *b, unsigned long long offset,
+        unsigned long long len)
+{
+#ifdef POSIX_FADV_WILLNEED
+    if (b->can_seek)
+        posix_fadvise(b->fd, offset, len, POSIX_FADV_WILLNEED);
+#else
+    b = b;
+    offset = offset;
+    len = len;
+#endif
+}
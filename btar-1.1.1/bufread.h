@@ -0,0 +1,25 @@
+struct bufread
+{
+    int fd;
+    char *data;
+    size_t allocated;
+    size_t pos;
+    size_t len;
+    unsigned long long offset; /* in the file, of data[pos] */
+    unsigned long long to_drop; /* skipped, still to come from the pipe */
+    int can_seek;
+    int eof;
+};
+
+void bufread_init(struct bufread *b, int fd, size_t allocate);
+void bufread_free(struct bufread *b);
+size_t bufread_available(const struct bufread *b);
+const char * bufread_data(const struct bufread *b);
+void bufread_consume(struct bufread *b, size_t n);
+ssize_t bufread_fill(struct bufread *b);
+int bufread_needs_fill(const struct bufread *b);
+void bufread_skip(struct bufread *b, unsigned long long n);
+void bufread_seek(struct bufread *b, unsigned long long offset);
+unsigned long long bufread_tell(const struct bufread *b);
+void bufread_will_need(struct bufread *b, unsigned long long offset,
+        unsigned long long len);
@@ -0,0 +1,426 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include "main.h"
+#include "mytar.h"
+#include "filters.h"
+#include "directory.h"
+#include "frames.h"
+#include "checksums.h"
+#include "checkpoint.h"
+
+/* A checkpoint is written after a complete block of -c, every
+ * --checkpoint-interval seconds, and lets --resume go on from it. It is a
+ * text log:
+ *    btar-checkpoint 2
+ *    settings <the options that change the btar layout>
+ * and then, for every checkpoint, the members, checksums and frames written
+ * since the one before, and where the btar goes:
+ *    member <header offset> <data size> <name>
+ *    checksum <block> <raw crc> <filtered crc>
+ *    frames <block> <n> <start>...
+ *    blocks <complete blocks> <btar bytes up to them>
+ *    entry <start> <next header> <name>
+ * Only those lines are appended and synced, so a checkpoint costs the same
+ * at any point of a big btar. The entry line closes a checkpoint; the lines
+ * after the last one are of a checkpoint not completed, and are left out.
+ * The first checkpoint of a run, also after --resume, writes the whole log
+ * again.
+ *
+ * The entry is that of the block tar holding the last byte of the blocks:
+ * the traverse of the resume has to find it at the same place, or the files
+ * changed. It is known by following the headers of the block tar, as it is
+ * read from the traverse. */
+
+static const char checkpoint_magic[] = "btar-checkpoint 2";
+
+static struct
+{
+    unsigned long long pos; /* In the block tar */
+    unsigned long long next; /* Where the next header starts */
+    unsigned long long start; /* Of the last entry, with its long names */
+    char *name;
+    int in_entry; /* After a long name header */
+    char header[512];
+    size_t inheader;
+    char *longname;
+    size_t longname_len;
+    size_t longname_left;
+} tracker;
+
+/* The entries at each block end, waiting for the block to be written */
+static struct checkpoint_entry *ends;
+static int nends;
+
+static struct checkpoint_entry resume_entry;
+static int resuming;
+
+/* What the log has already, once started in this run */
+static struct
+{
+    int started;
+    size_t members;
+    int checksums;
+    int frames;
+} logged;
+
+static void
+settings_line(char *buf, size_t len)
+{
+    snprintf(buf, len, "settings %llu %llu %i %i %i %i %s", command_line.blocksize,
+            command_line.frame_size, command_line.parity_k, command_line.parity_n,
+            command_line.xorblock, command_line.add_create_index,
+            get_filter_extensions(filter));
+}
+
+static void
+track_header()
+{
+    const struct header_gnu_tar *h = (const struct header_gnu_tar *) tracker.header;
+    unsigned long long size = read_size(h->size);
+    char name[sizeof h->name + 1];
+
+    if (!tracker.in_entry)
+        tracker.start = tracker.pos - 512;
+
+    tracker.next = tracker.pos + size;
+    if (size % 512)
+        tracker.next += 512 - size % 512;
+
+    switch(h->typeflag[0])
+    {
+        case 'L':
+            free(tracker.longname);
+            tracker.longname = malloc(size + 1);
+            if (!tracker.longname)
+                fatal_error("Cannot allocate");
+            tracker.longname_len = 0;
+            tracker.longname_left = size;
+            tracker.in_entry = 1;
+            break;
+        case 'K':
+            tracker.in_entry = 1;
+            break;
+        default:
+            free(tracker.name);
+            if (tracker.longname)
+            {
+                tracker.longname[tracker.longname_len] = '\0';
+                tracker.name = tracker.longname;
+                tracker.longname = 0;
+            }
+            else
+            {
+                strcpyn(name, h->name, sizeof name);
+                tracker.name = strdup(name);
+                if (!tracker.name)
+                    fatal_error("Cannot allocate");
+            }
+            tracker.in_entry = 0;
+            break;
+    }
+}
+
+/* A block end in the middle of long name headers gets no checkpoint */
+static void
+track_block_end()
+{
+    struct checkpoint_entry *e;
+
+    if (tracker.in_entry || !tracker.name || strchr(tracker.name, '\n'))
+        return;
+
+    ends = realloc(ends, (nends + 1) * sizeof(*ends));
+    if (!ends)
+        fatal_error("Cannot realloc");
+    e = &ends[nends++];
+    e->block = tracker.pos / command_line.blocksize;
+    e->start = tracker.start;
+    e->next = tracker.next;
+    e->name = strdup(tracker.name);
+    if (!e->name)
+        fatal_error("Cannot allocate");
+}
+
+/* The block tar, as read from the traverse. A call never goes
+ * over a block end. */
+void
+checkpoint_track(const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n;
+
+        if (tracker.pos < tracker.next)
+        {
+            n = tracker.next - tracker.pos;
+            if (n > len)
+                n = len;
+            if (tracker.longname_left > 0)
+            {
+                size_t l = n;
+                if (l > tracker.longname_left)
+                    l = tracker.longname_left;
+                memcpy(tracker.longname + tracker.longname_len, data, l);
+                tracker.longname_len += l;
+                tracker.longname_left -= l;
+            }
+        }
+        else
+        {
+            n = sizeof tracker.header - tracker.inheader;
+            if (n > len)
+                n = len;
+            memcpy(tracker.header + tracker.inheader, data, n);
+            tracker.inheader += n;
+        }
+        tracker.pos += n;
+        data += n;
+        len -= n;
+
+        if (tracker.inheader == sizeof tracker.header)
+        {
+            tracker.inheader = 0;
+            track_header();
+        }
+
+        if (tracker.pos % command_line.blocksize == 0)
+            track_block_end();
+    }
+}
+
+/* The lines of a checkpoint, from what the log does not have yet */
+static void
+write_log(FILE *out, int blocks, unsigned long long offset,
+        const struct checkpoint_entry *e, const struct directory *d,
+        const struct frame_table *f, const struct checksum_table *c)
+{
+    size_t i;
+    int j, k;
+
+    for(i=logged.members; i < d->nentries; ++i)
+        fprintf(out, "member %llu %llu %s\n", d->entries[i].offset,
+                d->entries[i].size, d->entries[i].name);
+    for(j=logged.checksums; j < c->nblocks; ++j)
+        if (c->blocks[j].known)
+            fprintf(out, "checksum %i %08x %08x\n", j, c->blocks[j].raw,
+                    c->blocks[j].filtered);
+    for(j=logged.frames; j < f->nblocks; ++j)
+    {
+        fprintf(out, "frames %i %i", j, f->blocks[j].nframes);
+        for(k=0; k < f->blocks[j].nframes; ++k)
+            fprintf(out, " %llu", f->blocks[j].starts[k]);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "blocks %i %llu\n", blocks, offset);
+    fprintf(out, "entry %llu %llu %s\n", e->start, e->next, e->name);
+
+    logged.members = d->nentries;
+    logged.checksums = c->nblocks;
+    logged.frames = f->nblocks;
+}
+
+/* Called when 'blocks' blocks are in the btar, up to 'offset'. Returns 0
+ * if there was no entry known for that block end. */
+int
+checkpoint_write(const char *path, int blocks, unsigned long long offset,
+        const struct directory *d, const struct frame_table *f,
+        const struct checksum_table *c)
+{
+    const struct checkpoint_entry *e = 0;
+    FILE *out;
+    int j;
+
+    for(j=0; j < nends; ++j)
+        if (ends[j].block == blocks)
+            e = &ends[j];
+    if (!e)
+        return 0;
+
+    if (logged.started)
+    {
+        out = fopen(path, "a");
+        if (!out)
+            fatal_errno("Cannot open the checkpoint file %s", path);
+        write_log(out, blocks, offset, e, d, f, c);
+        if (fflush(out) != 0 || fsync(fileno(out)) == -1 || fclose(out) != 0)
+            fatal_errno("Cannot write the checkpoint file %s", path);
+    }
+    else
+    {
+        char settings[PATH_MAX];
+        char *tmpname;
+
+        tmpname = malloc(strlen(path) + sizeof ".new");
+        if (!tmpname)
+            fatal_error("Cannot allocate");
+        strcpy(tmpname, path);
+        strcat(tmpname, ".new");
+
+        out = fopen(tmpname, "w");
+        if (!out)
+            fatal_errno("Cannot open the checkpoint file %s", tmpname);
+
+        settings_line(settings, sizeof settings);
+        fprintf(out, "%s\n%s\n", checkpoint_magic, settings);
+        write_log(out, blocks, offset, e, d, f, c);
+
+        if (fflush(out) != 0 || fsync(fileno(out)) == -1 || fclose(out) != 0)
+            fatal_errno("Cannot write the checkpoint file %s", tmpname);
+        if (rename(tmpname, path) == -1)
+            fatal_errno("Cannot rename the checkpoint file %s", tmpname);
+        free(tmpname);
+        logged.started = 1;
+    }
+
+    if (command_line.debug)
+        fprintf(stderr, "Checkpoint of %i blocks, at %s\n", blocks, e->name);
+
+    /* The older ends are of no use any more */
+    for(j=0; j < nends && ends[j].block <= blocks; ++j)
+        free(ends[j].name);
+    memmove(ends, ends + j, (nends - j) * sizeof(*ends));
+    nends -= j;
+
+    return 1;
+}
+
+static void
+bad_checkpoint(const char *path, const char *line)
+{
+    fatal_error_no_core("error: wrong line in the checkpoint file %s: %s",
+            path, line);
+}
+
+/* Loads the checkpoint for --resume, and the tracker goes on from it.
+ * The tables should be just initialised. */
+void
+checkpoint_load(const char *path, int *blocks, unsigned long long *offset,
+        struct directory *d, struct frame_table *f, struct checksum_table *c)
+{
+    char settings[PATH_MAX];
+    FILE *in;
+    char *line = 0;
+    size_t allocated = 0;
+    ssize_t len;
+    int nline = 0;
+    int have_blocks = 0;
+    unsigned long long *starts = 0;
+    off_t complete = 0;
+
+    in = fopen(path, "r");
+    if (!in)
+        fatal_errno("Cannot open the checkpoint file %s", path);
+
+    settings_line(settings, sizeof settings);
+
+    /* Up to the end of the last entry line */
+    while ((len = getline(&line, &allocated, in)) != -1)
+        if (strncmp(line, "entry ", 6) == 0 && line[len-1] == '\n')
+            complete = ftello(in);
+    rewind(in);
+
+    while ((nline < 2 || ftello(in) < complete) &&
+            (len = getline(&line, &allocated, in)) != -1)
+    {
+        unsigned long long a, b;
+        unsigned int raw, filtered;
+        int block, n, i, pos;
+
+        if (len > 0 && line[len-1] == '\n')
+            line[len-1] = '\0';
+        ++nline;
+
+        if (nline == 1)
+        {
+            if (strcmp(line, checkpoint_magic) != 0)
+                fatal_error_no_core("error: %s is not a btar checkpoint", path);
+        }
+        else if (nline == 2)
+        {
+            if (strcmp(line, settings) != 0)
+                fatal_error_no_core("error: the checkpoint %s was made with "
+                        "other options (%s)", path, line);
+        }
+        else if (sscanf(line, "blocks %i %llu", blocks, offset) == 2)
+            have_blocks = 1;
+        else if (sscanf(line, "entry %llu %llu %n", &a, &b, &pos) == 2)
+        {
+            resume_entry.start = a;
+            resume_entry.next = b;
+            free(resume_entry.name);
+            resume_entry.name = strdup(line + pos);
+            if (!resume_entry.name)
+                fatal_error("Cannot allocate");
+        }
+        else if (sscanf(line, "member %llu %llu %n", &a, &b, &pos) == 2)
+            directory_add(d, line + pos, a, b);
+        else if (sscanf(line, "checksum %i %x %x", &block, &raw, &filtered) == 3)
+            checksum_table_add(c, block, raw, filtered);
+        else if (sscanf(line, "frames %i %i%n", &block, &n, &pos) == 2
+                && n >= 0)
+        {
+            starts = realloc(starts, (n + 1) * sizeof(*starts));
+            if (!starts)
+                fatal_error("Cannot realloc");
+            for(i=0; i < n; ++i)
+            {
+                int used;
+                if (sscanf(line + pos, " %llu%n", &starts[i], &used) != 1)
+                    bad_checkpoint(path, line);
+                pos += used;
+            }
+            frame_table_add(f, block, starts, n);
+        }
+        else
+            bad_checkpoint(path, line);
+    }
+    free(line);
+    free(starts);
+    fclose(in);
+
+    if (!have_blocks || !resume_entry.name)
+        fatal_error_no_core("error: the checkpoint file %s is incomplete", path);
+
+    resume_entry.block = *blocks;
+    resuming = 1;
+
+    tracker.pos = (unsigned long long) *blocks * command_line.blocksize;
+    tracker.next = resume_entry.next;
+    tracker.start = resume_entry.start;
+    tracker.name = strdup(resume_entry.name);
+    if (!tracker.name)
+        fatal_error("Cannot allocate");
+
+    if (command_line.debug)
+        fprintf(stderr, "Resuming after %i blocks, at %s\n", *blocks,
+                resume_entry.name);
+}
+
+/* For the traverse: 0 if not resuming */
+const struct checkpoint_entry *
+checkpoint_resume_entry()
+{
+    if (!resuming)
+        return 0;
+    return &resume_entry;
+}
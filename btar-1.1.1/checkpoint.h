@@ -0,0 +1,19 @@
+struct directory;
+struct frame_table;
+struct checksum_table;
+
+struct checkpoint_entry
+{
+    int block; /* The number of blocks before it */
+    unsigned long long start; /* Of the entry in the block tar */
+    unsigned long long next; /* Header after the entry */
+    char *name;
+};
+
+void checkpoint_track(const char *data, size_t len);
+int checkpoint_write(const char *path, int blocks, unsigned long long offset,
+        const struct directory *d, const struct frame_table *f,
+        const struct checksum_table *c);
+void checkpoint_load(const char *path, int *blocks, unsigned long long *offset,
+        struct directory *d, struct frame_table *f, struct checksum_table *c);
+const struct checkpoint_entry * checkpoint_resume_entry();
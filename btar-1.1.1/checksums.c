@@ -0,0 +1,299 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+/* The SSE4.2 crc is built whatever the -march, and used if the cpu has it */
+#define X86_DISPATCH
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#include "main.h"
+#include "mytar.h"
+#include "directory.h"
+#include "loadindex.h"
+#include "checksums.h"
+
+/* Every block gets the CRC32C of its tar data, before the filters, and of
+ * the block member data, after them. The 'checksums' member has them as
+ * text:
+ *    btar-checksums crc32c\n
+ *    <block> <crc of the block tar> <crc of the member>\n
+ * with the crcs in hexadecimal. */
+
+static const char checksums_name[] = "checksums";
+static const char checksums_magic[] = "btar-checksums crc32c";
+
+static unsigned int crc32c_table[8][256];
+static int crc32c_ready = 0;
+
+static void
+crc32c_init()
+{
+    unsigned int i;
+    int j;
+
+    for(i=0; i < 256; ++i)
+    {
+        unsigned int c = i;
+
+        for(j=0; j < 8; ++j)
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        crc32c_table[0][i] = c;
+    }
+    for(i=0; i < 256; ++i)
+        for(j=1; j < 8; ++j)
+            crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^
+                crc32c_table[0][crc32c_table[j-1][i] & 0xff];
+    crc32c_ready = 1;
+}
+
+#ifdef X86_DISPATCH
+/* On the inverted crc, as the loops in crc32c() */
+__attribute__((target("sse4.2")))
+static unsigned int
+crc32c_sse42(unsigned int crc, const unsigned char *p, size_t len)
+{
+    for(; len >= 8; len -= 8, p += 8)
+    {
+        unsigned long long v;
+
+        memcpy(&v, p, sizeof v);
+        crc = (unsigned int) _mm_crc32_u64(crc, v);
+    }
+    for(; len > 0; --len)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+/* Goes on with the CRC32C 'crc' of the data before, 0 at the start. With
+ * SSE4.2 or the ARM crc instructions, 8 bytes at a time in hardware; else
+ * 8 bytes at a time from tables. */
+unsigned int
+crc32c(unsigned int crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    crc = ~crc;
+
+#if defined(X86_DISPATCH)
+    if (__builtin_cpu_supports("sse4.2"))
+        return ~crc32c_sse42(crc, p, len);
+#elif defined(__ARM_FEATURE_CRC32) && defined(__aarch64__)
+    for(; len >= 8; len -= 8, p += 8)
+    {
+        unsigned long long v;
+
+        memcpy(&v, p, sizeof v);
+        crc = __crc32cd(crc, v);
+    }
+    for(; len > 0; --len)
+        crc = __crc32cb(crc, *p++);
+    return ~crc;
+#endif
+
+    if (!crc32c_ready)
+        crc32c_init();
+    for(; len >= 8; len -= 8, p += 8)
+    {
+        unsigned int lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 |
+                (unsigned int) p[3] << 24);
+
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+            crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+            crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^
+            crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+    }
+    for(; len > 0; --len)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+
+    return ~crc;
+}
+
+void
+checksum_table_init(struct checksum_table *t)
+{
+    t->blocks = 0;
+    t->nblocks = 0;
+}
+
+void
+checksum_table_add(struct checksum_table *t, int block, unsigned int raw,
+        unsigned int filtered)
+{
+    struct block_checksum *bc;
+
+    if (block >= t->nblocks)
+    {
+        int i;
+
+        t->blocks = realloc(t->blocks, (block + 1) * sizeof(*t->blocks));
+        if (!t->blocks)
+            fatal_error("Cannot realloc");
+        for(i = t->nblocks; i <= block; ++i)
+            t->blocks[i].known = 0;
+        t->nblocks = block + 1;
+    }
+
+    bc = &t->blocks[block];
+    bc->raw = raw;
+    bc->filtered = filtered;
+    bc->known = 1;
+}
+
+void
+checksum_table_to_tar(struct checksum_table *t, struct mytar *tar)
+{
+    size_t len;
+    size_t allocated = sizeof checksums_magic + 1 + t->nblocks * 30;
+    char *text;
+    ssize_t res;
+    int i;
+
+    if (command_line.debug)
+        fprintf(stderr, "Writing the checksums of %i blocks\n", t->nblocks);
+
+    text = malloc(allocated);
+    if (!text)
+        fatal_error("Cannot allocate");
+
+    len = snprintf(text, allocated, "%s\n", checksums_magic);
+    for(i=0; i < t->nblocks; ++i)
+        if (t->blocks[i].known)
+            len += snprintf(text + len, allocated - len, "%i %08x %08x\n", i,
+                    t->blocks[i].raw, t->blocks[i].filtered);
+
+    mytar_new_file(tar);
+    mytar_set_filename(tar, (char *) checksums_name);
+    mytar_set_gid(tar, getgid());
+    mytar_set_uid(tar, getuid());
+    mytar_set_size(tar, len);
+    mytar_set_mode(tar, 0644 | S_IFREG);
+    mytar_set_mtime(tar, time(NULL));
+    mytar_set_filetype(tar, S_IFREG);
+    res = mytar_write_header(tar);
+    if (res == -1)
+        error("Failed to write header");
+
+    res = mytar_write_data(tar, text, len);
+    if (res == -1)
+        error("Could not write the checksums data");
+    assert((size_t) res == len);
+
+    res = mytar_write_end(tar);
+    if (res == -1)
+        error("Could not write mytar file end");
+
+    free(text);
+}
+
+/* Returns 1 if the archive has a checksums member, found through its
+ * directory. Moves the fd position. */
+int
+checksum_table_load(struct checksum_table *t, int fd, const struct directory *dir)
+{
+    unsigned long long size;
+    char *name;
+    char *text;
+    size_t got = 0;
+    int res;
+
+    checksum_table_init(t);
+
+    name = tar_find_member(fd, dir, checksums_name, &size);
+    if (!name)
+        return 0;
+    free(name);
+
+    text = malloc(size + 1);
+    if (!text)
+        fatal_error("Cannot allocate");
+    while (got < size)
+    {
+        ssize_t nread = read(fd, text + got, size - got);
+        if (nread == -1)
+            fatal_errno("Cannot read the checksums of the btar");
+        if (nread == 0)
+            fatal_error("Unexpected end of btar reading the checksums");
+        got += nread;
+    }
+    text[size] = '\0';
+
+    res = checksum_table_parse(t, text);
+    free(text);
+    return res;
+}
+
+/* From the text of the checksums member, ended by a zero */
+int
+checksum_table_parse(struct checksum_table *t, const char *text)
+{
+    const char *line;
+
+    if (strncmp(text, checksums_magic, sizeof checksums_magic - 1) != 0)
+    {
+        if (command_line.debug)
+            fprintf(stderr, "Wrong btar checksums member\n");
+        return 0;
+    }
+
+    line = strchr(text, '\n');
+    while (line && *++line != '\0')
+    {
+        int block;
+        unsigned int raw, filtered;
+
+        if (sscanf(line, "%i %x %x", &block, &raw, &filtered) != 3 || block < 0)
+            break;
+        checksum_table_add(t, block, raw, filtered);
+        line = strchr(line, '\n');
+    }
+
+    if (command_line.debug)
+        fprintf(stderr, "Loaded the checksums of %i blocks\n", t->nblocks);
+
+    return 1;
+}
+
+/* Returns 1 if the checksums of the block are known */
+int
+checksum_table_find(const struct checksum_table *t, int block,
+        unsigned int *raw, unsigned int *filtered)
+{
+    if (block < 0 || block >= t->nblocks || !t->blocks[block].known)
+        return 0;
+    if (raw)
+        *raw = t->blocks[block].raw;
+    if (filtered)
+        *filtered = t->blocks[block].filtered;
+    return 1;
+}
+
+void
+checksum_table_free(struct checksum_table *t)
+{
+    free(t->blocks);
+    checksum_table_init(t);
+}
@@ -0,0 +1,27 @@
+struct mytar;
+struct directory;
+
+struct block_checksum
+{
+    unsigned int raw; /* CRC32C of the block tar */
+    unsigned int filtered; /* CRC32C of the block member data */
+    int known;
+};
+
+struct checksum_table
+{
+    struct block_checksum *blocks;
+    int nblocks;
+};
+
+unsigned int crc32c(unsigned int crc, const void *data, size_t len);
+void checksum_table_init(struct checksum_table *t);
+void checksum_table_add(struct checksum_table *t, int block, unsigned int raw,
+        unsigned int filtered);
+void checksum_table_to_tar(struct checksum_table *t, struct mytar *tar);
+int checksum_table_load(struct checksum_table *t, int fd,
+        const struct directory *dir);
+int checksum_table_parse(struct checksum_table *t, const char *text);
+int checksum_table_find(const struct checksum_table *t, int block,
+        unsigned int *raw, unsigned int *filtered);
+void checksum_table_free(struct checksum_table *t);
@@ -0,0 +1,73 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+#include "checksums.h"
+
+/* as checksums.c will depend on it */
+struct command_line command_line;
+
+int
+test(const char *what, const void *data, size_t len, unsigned int expected)
+{
+    unsigned int crc;
+    size_t i;
+
+    crc = crc32c(0, data, len);
+    printf(" crc32c(%s) = %08x, expected %08x\n", what, crc, expected);
+    if (crc != expected)
+        return 1;
+
+    /* The same, going on from every split */
+    for(i=0; i <= len; ++i)
+    {
+        crc = crc32c(crc32c(0, data, i), (const char *) data + i, len - i);
+        if (crc != expected)
+        {
+            printf(" crc32c(%s) split at %zu = %08x\n", what, i, crc);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main()
+{
+    unsigned char buffer[32];
+    int failed = 0;
+    int i;
+
+    /* The check value of CRC-32C, and the vectors of RFC 3720 B.4 */
+    failed |= test("\"123456789\"", "123456789", 9, 0xe3069283);
+    failed |= test("\"\"", "", 0, 0);
+
+    memset(buffer, 0, sizeof buffer);
+    failed |= test("32 zeros", buffer, sizeof buffer, 0x8a9136aa);
+    memset(buffer, 0xff, sizeof buffer);
+    failed |= test("32 0xff", buffer, sizeof buffer, 0x62a8ab43);
+    for(i=0; i < 32; ++i)
+        buffer[i] = i;
+    failed |= test("0 to 31", buffer, sizeof buffer, 0x46dd794e);
+    for(i=0; i < 32; ++i)
+        buffer[i] = 31 - i;
+    failed |= test("31 to 0", buffer, sizeof buffer, 0x113fdb5c);
+
+    return failed;
+}
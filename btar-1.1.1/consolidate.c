@@ -0,0 +1,1194 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include "main.h"
+#include "mytar.h"
+#include "readtar.h"
+#include "block.h"
+#include "blockprocess.h"
+#include "filters.h"
+#include "filememory.h"
+#include "loadindex.h"
+#include "directory.h"
+#include "indexshard.h"
+#include "frames.h"
+#include "checksums.h"
+#include "parity.h"
+#include "restoreplan.h"
+#include "append.h"
+#include "consolidate.h"
+
+/* --consolidate makes a full btar out of a full one and its differentials,
+ * without the files. The restore plan of their indices and deleted lists
+ * tells which entry of their tar streams gives each file at the end, as
+ * extracting them all with -H. The new tar stream is theirs one after the
+ * other, with only those entries. A block that has nothing else goes to
+ * the new btar as it is, filtered; what is kept of the other blocks is
+ * filtered again into new blocks. The index is theirs, with the links to
+ * where the entries went. */
+
+extern struct filter *filter;
+extern struct filter *filterindex;
+extern struct filter *defilter;
+
+/* From traverse.c */
+extern const char rdiff_extension[];
+extern const size_t rdiff_extension_len;
+
+/* An entry kept, by where its headers start in the old blocks and in the
+ * new tar stream */
+struct kept_entry
+{
+    int block;
+    unsigned long long offset;
+    unsigned long long out;
+    unsigned long long data; /* Where its data starts in the new tar stream */
+};
+
+struct source
+{
+    const char *name;
+    int fd;
+    struct directory dir;
+    int nblocks;
+    struct frame_table frames;
+    struct checksum_table checksums;
+    int has_signatures;
+    struct kept_entry *kept;
+    size_t nkept;
+    size_t allocated;
+    int copied; /* Blocks, for -v */
+    int repacked;
+};
+
+/* What becomes of each record of a block */
+enum
+{
+    RECORD_DROP,
+    RECORD_KEEP,
+    RECORD_UNKNOWN /* Headers of an entry not yet complete */
+};
+
+struct consolidate
+{
+    struct source *sources;
+    int nsources;
+
+    /* The tar stream of the btar being read */
+    struct source *src;
+    int block;
+    long record; /* The one given to readtar */
+    struct readtar rt;
+    unsigned long long pos; /* Of the record given to readtar */
+    unsigned long long entry_end; /* Of the data of the last entry */
+    int entry_kept;
+    int in_header;
+    unsigned long long header_start;
+    int header_block;
+    unsigned long long header_offset; /* In header_block */
+    long header_record; /* In the block read, -1 if in 'pending' */
+    char *pending; /* Headers coming from the blocks before */
+    size_t npending;
+    int pending_kept; /* -1 until known */
+    char *records; /* What becomes of each record of the block */
+    size_t allocated_records;
+    unsigned long long block_out; /* The new tar stream at the block start */
+    unsigned long long kept_records; /* Of the block, so far */
+
+    /* The new btar */
+    struct mytar *tar;
+    struct directory dir;
+    struct frame_table frames;
+    struct checksum_table checksums;
+    struct parity parity;
+    struct block **xorblocks;
+    int nblocks;
+    unsigned long long *starts; /* Of each new block, in the new tar stream */
+    unsigned long long total; /* Of the new tar stream, 'repack' included */
+    struct block *repack; /* The new block being filled */
+    int trailing_zeros; /* Records at the end of the new tar stream */
+
+    /* A block all kept but for the headers it ends with, until the next
+     * block tells whether they are kept */
+    struct block *held;
+    char *held_data;
+    size_t held_len;
+    size_t held_kept; /* Before the headers */
+    int held_block;
+};
+
+static const char zero_record[512];
+
+static int
+is_zero_record(const char *record)
+{
+    return memcmp(record, zero_record, sizeof zero_record) == 0;
+}
+
+/* A block chain in a single piece of memory */
+static char *
+flatten(const struct block *b, size_t *len)
+{
+    const struct block *p;
+    char *data;
+
+    *len = 0;
+    for(p = b; p != 0; p = p->nextblock)
+        *len += p->writer_pos;
+    data = malloc(*len + 1);
+    if (!data)
+        fatal_error("Cannot allocate");
+    *len = 0;
+    for(p = b; p != 0; p = p->nextblock)
+    {
+        memcpy(data + *len, p->data, p->writer_pos);
+        *len += p->writer_pos;
+    }
+    return data;
+}
+
+static void
+write_member(struct consolidate *cs, char *name, const char *data, size_t len)
+{
+    ssize_t res;
+
+    mytar_new_file(cs->tar);
+    mytar_set_filename(cs->tar, name);
+    mytar_set_gid(cs->tar, getgid());
+    mytar_set_uid(cs->tar, getuid());
+    mytar_set_size(cs->tar, len);
+    mytar_set_mode(cs->tar, 0644 | S_IFREG);
+    mytar_set_mtime(cs->tar, time(NULL));
+    mytar_set_filetype(cs->tar, S_IFREG);
+    res = mytar_write_header(cs->tar);
+    if (res == -1)
+        error("Failed to write header");
+
+    res = mytar_write_data(cs->tar, data, len);
+    if (res == -1)
+        error("Could not write mytar data");
+
+    res = mytar_write_end(cs->tar);
+    if (res == -1)
+        error("Could not write mytar file end");
+
+    directory_add_member(&cs->dir, cs->tar);
+}
+
+/* A block member of the new btar, with 'rawlen' bytes of tar stream */
+static void
+write_block(struct consolidate *cs, const char *data, size_t len,
+        size_t rawlen, unsigned int raw_crc,
+        const unsigned long long *frames, int nframes)
+{
+    char name[PATH_MAX];
+
+    if (command_line.debug)
+        fprintf(stderr, "Writing block %i to the btar stream\n", cs->nblocks);
+
+    snprintf(name, sizeof name, "block%i.tar%s", cs->nblocks,
+            get_filter_extensions(filter));
+    write_member(cs, name, data, len);
+
+    checksum_table_add(&cs->checksums, cs->nblocks, raw_crc,
+            crc32c(0, data, len));
+    if (nframes > 0)
+        frame_table_add(&cs->frames, cs->nblocks, frames, nframes);
+    if (cs->xorblocks)
+        xor_data_to_xorblock(data, len,
+                cs->xorblocks[cs->nblocks % command_line.xorblock]);
+    if (command_line.parity_k)
+    {
+        parity_add_block(&cs->parity, data, len);
+        if (parity_group_full(&cs->parity))
+            parity_to_tar(&cs->parity, cs->tar, &cs->dir);
+    }
+
+    cs->starts = realloc(cs->starts, (cs->nblocks + 2) * sizeof(*cs->starts));
+    if (!cs->starts)
+        fatal_error("Cannot realloc");
+    cs->starts[cs->nblocks + 1] = cs->starts[cs->nblocks] + rawlen;
+    cs->nblocks++;
+}
+
+/* The new block filled so far, through -F, frame by frame with
+ * --frame-size */
+static void
+flush_repack(struct consolidate *cs)
+{
+    struct block *r = cs->repack;
+    unsigned long long framesize = cs->frames.framesize;
+    unsigned long long *frames = 0;
+    int nframes = 0;
+    char *data = 0;
+    size_t len = 0;
+    unsigned long long start;
+
+    if (r->writer_pos == 0)
+        return;
+    r->total_written = r->writer_pos;
+    if (framesize == 0)
+        framesize = r->writer_pos;
+
+    for(start = 0; start < r->writer_pos; start += framesize)
+    {
+        unsigned long long end = start + framesize;
+        struct file_memory *fm;
+        char *frame;
+        size_t n;
+
+        if (end > r->writer_pos)
+            end = r->writer_pos;
+
+        fm = filter_range(filter, r, start, end);
+        frame = flatten(fm->bo, &n);
+        file_memory_free(fm);
+
+        if (cs->frames.framesize)
+        {
+            frames = realloc(frames, (nframes + 1) * sizeof(*frames));
+            if (!frames)
+                fatal_error("Cannot realloc");
+            frames[nframes++] = len;
+        }
+
+        data = realloc(data, len + n + 1);
+        if (!data)
+            fatal_error("Cannot realloc");
+        memcpy(data + len, frame, n);
+        len += n;
+        free(frame);
+    }
+
+    write_block(cs, data, len, r->writer_pos,
+            crc32c(0, r->data, r->writer_pos), frames, nframes);
+    free(data);
+    free(frames);
+    r->writer_pos = 0;
+}
+
+/* Tar stream for the blocks filtered again */
+static void
+repack_add(struct consolidate *cs, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = command_line.blocksize - cs->repack->writer_pos;
+
+        if (n > len)
+            n = len;
+        memcpy(cs->repack->data + cs->repack->writer_pos, data, n);
+        cs->repack->writer_pos += n;
+        cs->total += n;
+        data += n;
+        len -= n;
+
+        if (cs->repack->writer_pos == command_line.blocksize)
+            flush_repack(cs);
+    }
+}
+
+/* Kept records filtered again, minding the zeros at the end */
+static void
+repack_records(struct consolidate *cs, const char *data, size_t len)
+{
+    size_t r;
+
+    for(r=0; r < len; r += 512)
+    {
+        repack_add(cs, data + r, 512);
+        if (is_zero_record(data + r))
+            cs->trailing_zeros++;
+        else
+            cs->trailing_zeros = 0;
+    }
+}
+
+/* The block member as it is, after the new block being filled */
+static void
+copy_block(struct consolidate *cs, int b, const struct block *member,
+        const char *data, size_t len)
+{
+    struct source *src = cs->src;
+    const struct frame_block *fb = 0;
+    size_t nrecords = len / 512;
+    size_t zeros = 0;
+
+    flush_repack(cs);
+
+    /* The frames are of use only if they are of the size of the rest */
+    if (src->frames.framesize == cs->frames.framesize &&
+            b < src->frames.nblocks && src->frames.blocks[b].nframes > 0)
+        fb = &src->frames.blocks[b];
+
+    write_block(cs, member->data, member->writer_pos, len,
+            crc32c(0, data, len), fb ? fb->starts : 0,
+            fb ? fb->nframes : 0);
+    cs->total += len;
+
+    while (zeros < nrecords &&
+            is_zero_record(data + (nrecords - zeros - 1) * 512))
+        ++zeros;
+    if (zeros == nrecords)
+        cs->trailing_zeros += zeros;
+    else
+        cs->trailing_zeros = zeros;
+    src->copied++;
+}
+
+/* With 'copy', the headers the block held ends with are kept, and it goes
+ * as it is; else what it has before them is filtered again */
+static void
+release_held(struct consolidate *cs, int copy)
+{
+    if (!cs->held)
+        return;
+
+    cs->total -= cs->held_kept;
+    if (copy)
+        copy_block(cs, cs->held_block, cs->held, cs->held_data,
+                cs->held_len);
+    else
+    {
+        repack_records(cs, cs->held_data, cs->held_kept);
+        cs->src->repacked++;
+    }
+
+    free(cs->held_data);
+    block_free(cs->held);
+    cs->held = 0;
+    cs->held_data = 0;
+}
+
+static void
+add_kept(struct source *src, const struct kept_entry *k)
+{
+    const size_t allocstep = 1000;
+
+    if (src->nkept == src->allocated)
+    {
+        src->kept = realloc(src->kept,
+                (src->allocated + allocstep) * sizeof(*src->kept));
+        if (!src->kept)
+            fatal_error("Cannot realloc");
+        src->allocated += allocstep;
+    }
+    src->kept[src->nkept++] = *k;
+}
+
+static enum readtar_newfile_result
+consolidate_new_file_cb(const struct readtar_file *file, void *userdata)
+{
+    struct consolidate *cs = (struct consolidate *) userdata;
+    int is_dir = file->header->typeflag[0] == '5';
+    unsigned long long padded = file->size;
+    unsigned long long out;
+    char *name;
+    size_t len;
+    int keep;
+    long r;
+
+    name = strdup(file->name);
+    if (!name)
+        fatal_error("Cannot allocate");
+    len = strlen(name);
+    /* The indices have the directories without the final slash */
+    if (len > 1 && name[len - 1] == '/')
+        name[--len] = '\0';
+
+    if (is_dir)
+        keep = restore_plan_kept(name);
+    else
+    {
+        const struct IndexElem *e = index_find_element(name);
+
+        /* The entries that --append made old are not where the index
+         * says */
+        keep = restore_plan_wants(name);
+        if (keep && e && e->block >= 0 && e->offset >= 0 &&
+                (e->block != cs->header_block ||
+                 (unsigned long long) e->offset != cs->header_offset))
+            keep = 0;
+    }
+
+    if (keep && len > rdiff_extension_len &&
+            strcmp(name + len - rdiff_extension_len, rdiff_extension) == 0)
+        fatal_error_no_core("error: cannot consolidate the rsync patch %s",
+                name);
+    free(name);
+
+    if (padded % 512)
+        padded += 512 - padded % 512;
+    cs->entry_end = cs->pos + 512 + padded;
+    cs->entry_kept = keep;
+    cs->in_header = 0;
+
+    out = cs->block_out + 512 * cs->kept_records;
+    if (cs->header_record < 0)
+    {
+        cs->pending_kept = keep;
+        if (keep)
+            cs->block_out += cs->npending;
+    }
+
+    for(r = cs->header_record < 0 ? 0 : cs->header_record; r <= cs->record;
+            ++r)
+    {
+        cs->records[r] = keep ? RECORD_KEEP : RECORD_DROP;
+        if (keep)
+            cs->kept_records++;
+    }
+
+    if (keep && !is_dir)
+    {
+        struct kept_entry k;
+
+        k.block = cs->header_block;
+        k.offset = cs->header_offset;
+        k.out = out;
+        k.data = out + (cs->pos + 512 - cs->header_start);
+        add_kept(cs->src, &k);
+    }
+
+    return READTAR_SKIPDATA;
+}
+
+static void
+consolidate_new_data_cb(const char *data, size_t len, void *userdata)
+{
+    data = data;
+    len = len;
+    userdata = userdata;
+}
+
+/* Record by record, to know where each entry starts and whether it is
+ * kept */
+static void
+parse_block(struct consolidate *cs, const char *data, size_t len)
+{
+    size_t nrecords = len / 512;
+    size_t r;
+
+    if (nrecords > cs->allocated_records)
+    {
+        cs->records = realloc(cs->records, nrecords);
+        if (!cs->records)
+            fatal_error("Cannot realloc");
+        cs->allocated_records = nrecords;
+    }
+    cs->block_out = cs->total;
+    cs->kept_records = 0;
+
+    for(r=0; r < nrecords; ++r)
+    {
+        const char *record = data + r * 512;
+
+        cs->record = r;
+        if (cs->pos < cs->entry_end)
+            cs->records[r] = cs->entry_kept ? RECORD_KEEP : RECORD_DROP;
+        else if (!cs->in_header && is_zero_record(record))
+            cs->records[r] = RECORD_KEEP; /* Padding to the block end */
+        else
+        {
+            if (!cs->in_header)
+            {
+                cs->in_header = 1;
+                cs->header_start = cs->pos;
+                cs->header_block = cs->block;
+                cs->header_offset = r * 512;
+                cs->header_record = r;
+            }
+            cs->records[r] = RECORD_UNKNOWN;
+        }
+        if (cs->records[r] == RECORD_KEEP)
+            cs->kept_records++;
+
+        process_this_tar_data(&cs->rt, record, 512);
+        cs->pos += 512;
+    }
+}
+
+static void
+consolidate_block(struct consolidate *cs, int b)
+{
+    struct source *src = cs->src;
+    const struct directory_entry *e;
+    struct filter *mydefilter;
+    struct file_memory *fm;
+    struct block *member;
+    char prefix[100];
+    char *data;
+    size_t len;
+    size_t nrecords;
+    unsigned int raw, filtered;
+    int copy = 1;
+    int hold;
+    size_t r;
+
+    snprintf(prefix, sizeof prefix, "block%i.tar", b);
+    e = directory_find(&src->dir, prefix);
+    member = read_member(src->fd, e);
+    if (checksum_table_find(&src->checksums, b, &raw, &filtered) &&
+            crc32c(0, member->data, member->writer_pos) != filtered)
+        fatal_error_no_core("error: the block %i of %s is damaged", b,
+                src->name);
+
+    if (defilter)
+        mydefilter = defilter;
+    else
+        mydefilter = defilters_from_extensions(e->name);
+    fm = filter_range(mydefilter, member, 0, member->total_written);
+    data = flatten(fm->bo, &len);
+    file_memory_free(fm);
+    if (mydefilter != defilter)
+        free_filters(mydefilter);
+
+    if (len % 512 != 0)
+        fatal_error_no_core("error: the block %i of %s is not a tar of whole "
+                "records", b, src->name);
+    nrecords = len / 512;
+
+    cs->block = b;
+    parse_block(cs, data, len);
+
+    if (cs->pending && cs->pending_kept < 0)
+    {
+        /* The headers go on after the whole block */
+        release_held(cs, 0);
+        cs->pending = realloc(cs->pending, cs->npending + len);
+        if (!cs->pending)
+            fatal_error("Cannot realloc");
+        memcpy(cs->pending + cs->npending, data, len);
+        cs->npending += len;
+        src->repacked++;
+        free(data);
+        block_free(member);
+        return;
+    }
+    else if (cs->pending)
+    {
+        /* The block held has the headers pending */
+        if (cs->held && cs->pending_kept)
+            release_held(cs, 1);
+        else
+        {
+            release_held(cs, 0);
+            if (cs->pending_kept)
+            {
+                repack_add(cs, cs->pending, cs->npending);
+                cs->trailing_zeros = 0;
+            }
+        }
+        free(cs->pending);
+        cs->pending = 0;
+        cs->npending = 0;
+    }
+
+    for(r=0; r < nrecords; ++r)
+        if (cs->records[r] != RECORD_KEEP)
+            copy = 0;
+
+    /* Its last headers may be kept, and then it all is */
+    hold = !copy && cs->in_header && cs->header_record >= 0;
+    for(r=0; hold && r < (size_t) cs->header_record; ++r)
+        if (cs->records[r] != RECORD_KEEP)
+            hold = 0;
+
+    if (copy)
+        copy_block(cs, b, member, data, len);
+    else if (!hold)
+    {
+        for(r=0; r < nrecords; ++r)
+        {
+            if (cs->records[r] == RECORD_KEEP)
+                repack_records(cs, data + r * 512, 512);
+        }
+        src->repacked++;
+    }
+
+    if (!copy && cs->in_header)
+    {
+        cs->npending = len - cs->header_record * 512;
+        cs->pending = malloc(cs->npending);
+        if (!cs->pending)
+            fatal_error("Cannot allocate");
+        memcpy(cs->pending, data + cs->header_record * 512, cs->npending);
+        cs->pending_kept = -1;
+        cs->header_record = -1;
+    }
+
+    if (hold)
+    {
+        /* The new tar stream goes on after what it has before them */
+        cs->held = member;
+        cs->held_data = data;
+        cs->held_len = len;
+        cs->held_kept = len - cs->npending;
+        cs->held_block = b;
+        cs->total += cs->held_kept;
+        return;
+    }
+
+    free(data);
+    block_free(member);
+}
+
+static void
+plan_deleted(const char *name, int is_dir)
+{
+    char *n = strdup(name);
+    size_t len;
+
+    (void) is_dir;
+    if (!n)
+        fatal_error("Cannot allocate");
+    len = strlen(n);
+    if (len > 1 && n[len - 1] == '/')
+        n[len - 1] = '\0';
+    restore_plan_deleted(n);
+    free(n);
+}
+
+static void
+open_source(struct source *src, const char *name)
+{
+    const char *extensions = get_filter_extensions(filter);
+    size_t i;
+
+    memset(src, 0, sizeof *src);
+    src->name = name;
+    src->fd = open(name, O_RDONLY);
+    if (src->fd == -1)
+        fatal_errno("Cannot open the btar file %s", name);
+    set_cloexec(src->fd);
+
+    if (!directory_load(&src->dir, src->fd))
+        fatal_error_no_core("error: the btar %s has no directory of members",
+                name);
+
+    /* The blocks copied have to be as the new ones */
+    for(i=0; i < src->dir.nentries; ++i)
+    {
+        const char *member = src->dir.entries[i].name;
+        char expected[PATH_MAX];
+        int b;
+
+        if (sscanf(member, "block%i.tar", &b) != 1)
+            continue;
+        if (b != src->nblocks)
+            fatal_error_no_core("error: the blocks of %s are not in order",
+                    name);
+        snprintf(expected, sizeof expected, "block%i.tar%s", b, extensions);
+        if (strcmp(member, expected) != 0)
+            fatal_error_no_core("error: the blocks of %s are filtered as %s, "
+                    "and not as the -F given", name, member);
+        src->nblocks++;
+    }
+
+    frame_table_load(&src->frames, src->fd, &src->dir);
+    checksum_table_load(&src->checksums, src->fd, &src->dir);
+    src->has_signatures = directory_find(&src->dir, "signatures.tar") != 0;
+}
+
+/* The btars have to be planned in order */
+static void
+plan_source(struct source *src, int i)
+{
+    const struct IndexElem *ptr;
+    size_t nelems;
+    size_t j;
+
+    if (lseek(src->fd, 0, SEEK_SET) == -1)
+        fatal_errno("Cannot seek the btar file %s", src->name);
+    if (load_index_from_tar(src->fd, 0) == -2)
+        fatal_error_no_core("error: the btar %s has no index", src->name);
+
+    ptr = index_get_elements(&nelems);
+    for(j=0; j < nelems; ++j)
+        restore_plan_add(ptr[j].name, i);
+    free_index();
+
+    if (lseek(src->fd, 0, SEEK_SET) == -1)
+        fatal_errno("Cannot seek the btar file %s", src->name);
+    load_deleted_from_tar(src->fd, plan_deleted);
+}
+
+static void
+consolidate_source(struct consolidate *cs, int i)
+{
+    struct source *src = &cs->sources[i];
+    struct readtar_callbacks cb = { consolidate_new_file_cb,
+        consolidate_new_data_cb, cs };
+    int b;
+
+    restore_plan_set_archive(i);
+    if (lseek(src->fd, 0, SEEK_SET) == -1)
+        fatal_errno("Cannot seek the btar file %s", src->name);
+    load_index_from_tar(src->fd, 0);
+    index_sort();
+
+    cs->src = src;
+    init_readtar(&cs->rt, &cb);
+    cs->pos = 0;
+    cs->entry_end = 0;
+    cs->in_header = 0;
+    cs->header_record = -1;
+
+    for(b=0; b < src->nblocks; ++b)
+        consolidate_block(cs, b);
+
+    /* Headers without an entry */
+    release_held(cs, 0);
+    free(cs->pending);
+    cs->pending = 0;
+    cs->npending = 0;
+    free_index();
+
+    if (command_line.verbose)
+        fprintf(stderr, "%s: %i blocks copied, %i filtered again\n",
+                src->name, src->copied, src->repacked);
+}
+
+/* The new block with the byte 'pos' of the new tar stream */
+static int
+block_of(const struct consolidate *cs, unsigned long long pos)
+{
+    int low = 0;
+    int high = cs->nblocks - 1;
+
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+
+        if (cs->starts[mid] <= pos)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+/* The crossing, if the blocks where the data goes on are of the same size */
+static void
+add_crossing(const struct consolidate *cs, char *link, size_t len,
+        unsigned long long data, unsigned long long size)
+{
+    int first = block_of(cs, data);
+    int last;
+    unsigned long long c, bs;
+    int b;
+    size_t linklen = strlen(link);
+
+    if (size == 0 || data + size <= cs->starts[first + 1])
+        return;
+
+    last = block_of(cs, data + size - 1);
+    c = cs->starts[first + 1] - data;
+    bs = cs->starts[first + 2] - cs->starts[first + 1];
+    for(b = first + 1; b < last; ++b)
+        if (cs->starts[b + 1] - cs->starts[b] != bs)
+            return;
+    if ((size - 1 - c) / bs != (unsigned long long) (last - first - 1))
+        return;
+
+    snprintf(link + linklen, len - linklen, ";c=%llu:%llu", c, bs);
+}
+
+static const struct kept_entry *
+find_kept(const struct source *src, int block, unsigned long long offset)
+{
+    size_t low = 0;
+    size_t high = src->nkept;
+
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        const struct kept_entry *k = &src->kept[mid];
+
+        if (k->block == block && k->offset == offset)
+            return k;
+        if (k->block < block || (k->block == block && k->offset < offset))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return 0;
+}
+
+struct list_state
+{
+    const struct consolidate *cs;
+    const struct source *src;
+    struct mytar *tar;
+    int signatures;
+    unsigned long long left; /* Of the data being written */
+};
+
+static void
+new_block_link(const struct list_state *ls, char *out, size_t len,
+        const char *name, const char *link)
+{
+    const char *size = strrchr(link, '_');
+    const char *offset = strstr(link, ";o=");
+    size_t linklen = strlen(link);
+    const struct kept_entry *k;
+    int b;
+    int res;
+
+    if (!size || !offset)
+        fatal_error_no_core("error: the index of %s has not the offsets of "
+                "the entries", ls->src->name);
+
+    k = find_kept(ls->src, block_name_to_int(link),
+            strtoull(offset + 3, 0, 10));
+    if (!k)
+        fatal_error_no_core("error: the index entry %s is not in the blocks "
+                "of %s", name, ls->src->name);
+
+    b = block_of(ls->cs, k->out);
+    res = snprintf(out, len, "block%i.tar%s_%llu;o=%llu", b,
+            get_filter_extensions(filter), strtoull(size + 1, 0, 10),
+            k->out - ls->cs->starts[b]);
+    if (res < 0 || (size_t) res >= len)
+        fatal_error("Block link too long");
+
+    if (strstr(link, ";c="))
+        add_crossing(ls->cs, out, len, k->data, strtoull(size + 1, 0, 10));
+
+    if (linklen > 2 && strcmp(link + linklen - 2, ";s") == 0)
+        strncat(out, ";s", len - strlen(out) - 1);
+}
+
+static enum readtar_newfile_result
+list_new_file_cb(const struct readtar_file *file, void *userdata)
+{
+    struct list_state *ls = (struct list_state *) userdata;
+    const struct header_gnu_tar *h = file->header;
+    char link[PATH_MAX];
+    char *name;
+    size_t len;
+    int keep;
+    ssize_t res;
+
+    ls->left = 0;
+
+    name = strdup(file->name);
+    if (!name)
+        fatal_error("Cannot allocate");
+    len = strlen(name);
+    if (len > 1 && name[len - 1] == '/')
+        name[len - 1] = '\0';
+    keep = restore_plan_wants(name);
+    free(name);
+    if (!keep)
+        return READTAR_SKIPDATA;
+
+    if (ls->signatures)
+    {
+        if (h->typeflag[0] != '0')
+            return READTAR_SKIPDATA;
+    }
+    else if (h->typeflag[0] == '0')
+        fatal_error_no_core("error: the index of %s is of the old format",
+                ls->src->name);
+    else if (h->typeflag[0] != '2' && h->typeflag[0] != '5')
+        return READTAR_SKIPDATA;
+
+    mytar_new_file(ls->tar);
+    mytar_set_filename(ls->tar, file->name);
+    mytar_set_mode(ls->tar, read_octal_number(h->mode, sizeof h->mode));
+    mytar_set_size(ls->tar, 0);
+    mytar_set_uid(ls->tar, read_octal_number(h->uid, sizeof h->uid));
+    mytar_set_gid(ls->tar, read_octal_number(h->gid, sizeof h->gid));
+    mytar_set_uname(ls->tar, h->uname);
+    mytar_set_gname(ls->tar, h->gname);
+    mytar_set_mtime(ls->tar, read_octal_number(h->mtime, sizeof h->mtime));
+    mytar_set_atime(ls->tar, read_octal_number(h->mtime, sizeof h->mtime));
+
+    if (h->typeflag[0] == '0')
+    {
+        mytar_set_filetype(ls->tar, S_IFREG);
+        mytar_set_size(ls->tar, file->size);
+        ls->left = file->size;
+    }
+    else if (h->typeflag[0] == '5')
+        mytar_set_filetype(ls->tar, S_IFDIR);
+    else
+    {
+        mytar_set_filetype(ls->tar, S_IFLNK);
+        new_block_link(ls, link, sizeof link, file->name, file->linkname);
+        mytar_set_linkname(ls->tar, link);
+    }
+
+    res = mytar_write_header(ls->tar);
+    if (res == -1)
+        error("Cannot write the index tar");
+
+    return ls->left > 0 ? READTAR_NORMAL : READTAR_SKIPDATA;
+}
+
+static void
+list_new_data_cb(const char *data, size_t len, void *userdata)
+{
+    struct list_state *ls = (struct list_state *) userdata;
+    ssize_t res;
+
+    if (ls->left == 0)
+        return;
+
+    res = mytar_write_data(ls->tar, data, len);
+    if (res == -1)
+        error("Could not write mytar data");
+    ls->left -= len;
+
+    if (ls->left == 0)
+    {
+        res = mytar_write_end(ls->tar);
+        if (res == -1)
+            error("Could not write mytar file end");
+    }
+}
+
+/* The index, or the signatures, of the entries kept */
+static void
+write_list(const struct consolidate *cs, int fd, int signatures)
+{
+    struct list_state ls;
+    struct readtar_callbacks cb = { list_new_file_cb, list_new_data_cb, &ls };
+    int i;
+
+    ls.cs = cs;
+    ls.tar = mytar_new();
+    mytar_open_fd(ls.tar, fd);
+    ls.signatures = signatures;
+    ls.left = 0;
+
+    for(i=0; i < cs->nsources; ++i)
+    {
+        const struct directory_entry *e;
+        const struct block *b;
+        struct block *raw;
+        struct readtar rt;
+
+        ls.src = &cs->sources[i];
+        if (signatures)
+        {
+            e = directory_find(&ls.src->dir, "signatures.tar");
+            raw = e ? read_raw_member(ls.src->fd, e) : 0;
+        }
+        else
+            raw = read_raw_index(ls.src->fd, &ls.src->dir);
+        if (!raw)
+            continue;
+
+        restore_plan_set_archive(i);
+        init_readtar(&rt, &cb);
+        for(b = raw; b != 0; b = b->nextblock)
+            process_this_tar_data(&rt, b->data, b->writer_pos);
+        block_free(raw);
+    }
+
+    if (mytar_write_archive_end(ls.tar) == -1)
+        error("Could not write the archive end");
+    free(ls.tar);
+}
+
+static struct file_memory *
+list_to_memory(const struct consolidate *cs, int signatures)
+{
+    struct file_memory *fm;
+    int mypipe[2];
+    int pid;
+
+    if (pipe(mypipe) == -1)
+        error("Cannot pipe");
+
+    pid = fork();
+    if (pid == -1)
+        error("Cannot fork");
+    if (pid == 0)
+    {
+        close(mypipe[0]);
+        write_list(cs, mypipe[1], signatures);
+        close(mypipe[1]);
+        exit(0);
+    }
+    close(mypipe[1]);
+
+    fm = file_memory_new(mypipe[0]);
+    file_memory_read_all(fm);
+    return fm;
+}
+
+static void
+write_list_member(struct consolidate *cs, struct file_memory *raw,
+        const char *namepattern)
+{
+    struct file_memory *fm;
+
+    fm = filter_range(filterindex, raw->bo, 0, raw->bo->total_written);
+    file_memory_to_tar(fm, namepattern, get_filter_extensions(filterindex),
+            cs->tar);
+    directory_add_member(&cs->dir, cs->tar);
+    file_memory_free(fm);
+}
+
+static void
+write_xorblocks(struct consolidate *cs)
+{
+    int i;
+
+    for(i=0; cs->xorblocks && i < command_line.xorblock; ++i)
+    {
+        char name[100];
+
+        if (command_line.xorblock == 1)
+            snprintf(name, sizeof name, "xorblock");
+        else
+            snprintf(name, sizeof name, "xorblock%i_%i", i,
+                    command_line.xorblock);
+        write_member(cs, name, cs->xorblocks[i]->data,
+                cs->xorblocks[i]->writer_pos);
+        block_free(cs->xorblocks[i]);
+    }
+    free(cs->xorblocks);
+    cs->xorblocks = 0;
+}
+
+void
+consolidate(int outfd)
+{
+    struct consolidate cs;
+    struct file_memory *im;
+    int has_signatures = 0;
+    int i;
+
+    memset(&cs, 0, sizeof cs);
+    for(cs.nsources = 0; command_line.input_files[cs.nsources];
+            ++cs.nsources);
+    cs.sources = malloc(cs.nsources * sizeof(*cs.sources));
+    if (!cs.sources)
+        fatal_error("Cannot allocate");
+
+    for(i=0; i < cs.nsources; ++i)
+    {
+        open_source(&cs.sources[i], command_line.input_files[i]);
+        plan_source(&cs.sources[i], i);
+        has_signatures |= cs.sources[i].has_signatures;
+
+        /* Without --frame-size, that of the btars, for their blocks copied
+         * to keep their frames; if the new blocks can have frames too */
+        if (!command_line.frame_size && filters_concatenate(filter))
+            command_line.frame_size = cs.sources[i].frames.framesize;
+    }
+
+    cs.tar = mytar_new();
+    mytar_open_fd(cs.tar, outfd);
+    directory_init(&cs.dir);
+    frame_table_init(&cs.frames, command_line.frame_size);
+    checksum_table_init(&cs.checksums);
+    if (command_line.parity_k)
+        parity_init(&cs.parity, command_line.parity_k, command_line.parity_n);
+    if (command_line.xorblock)
+    {
+        cs.xorblocks = malloc(command_line.xorblock * sizeof(*cs.xorblocks));
+        if (!cs.xorblocks)
+            fatal_error("Cannot allocate");
+        for(i=0; i < command_line.xorblock; ++i)
+        {
+            cs.xorblocks[i] = block_new(1);
+            cs.xorblocks[i]->data[0] = 0;
+        }
+    }
+    cs.starts = malloc(sizeof(*cs.starts));
+    if (!cs.starts)
+        fatal_error("Cannot allocate");
+    cs.starts[0] = 0;
+    cs.repack = block_new(command_line.blocksize + 1);
+
+    for(i=0; i < cs.nsources; ++i)
+        consolidate_source(&cs, i);
+
+    /* The tar end, if the last entry kept was not followed by it */
+    for(; cs.trailing_zeros < 2; cs.trailing_zeros++)
+        repack_add(&cs, zero_record, sizeof zero_record);
+    flush_repack(&cs);
+
+    if (command_line.parity_k)
+    {
+        parity_to_tar(&cs.parity, cs.tar, &cs.dir);
+        parity_free(&cs.parity);
+    }
+    write_xorblocks(&cs);
+
+    im = list_to_memory(&cs, 0);
+    if (command_line.index_shard_depth)
+        index_shards_to_tar(im, filterindex, cs.nblocks, cs.tar, &cs.dir);
+    else
+        write_list_member(&cs, im, "index.tar%s");
+    file_memory_free(im);
+
+    if (command_line.frame_size)
+    {
+        frame_table_to_tar(&cs.frames, cs.tar);
+        directory_add_member(&cs.dir, cs.tar);
+    }
+    checksum_table_to_tar(&cs.checksums, cs.tar);
+    directory_add_member(&cs.dir, cs.tar);
+
+    /* The files deleted are not in the new btar, so there is no deleted
+     * list */
+    if (has_signatures)
+    {
+        struct file_memory *sm = list_to_memory(&cs, 1);
+
+        if (sm->bo->total_written > 1024)
+            write_list_member(&cs, sm, "signatures.tar%s");
+        file_memory_free(sm);
+    }
+
+    directory_to_tar(&cs.dir, cs.tar);
+    if (mytar_write_archive_end(cs.tar) == -1)
+        error("Could not write the archive end");
+
+    for(i=0; i < cs.nsources; ++i)
+    {
+        close(cs.sources[i].fd);
+        directory_free(&cs.sources[i].dir);
+        frame_table_free(&cs.sources[i].frames);
+        checksum_table_free(&cs.sources[i].checksums);
+        free(cs.sources[i].kept);
+    }
+    free(cs.sources);
+    free(cs.records);
+    free(cs.starts);
+    block_free(cs.repack);
+    directory_free(&cs.dir);
+    frame_table_free(&cs.frames);
+    checksum_table_free(&cs.checksums);
+    free(cs.tar);
+    restore_plan_free();
+}
@@ -0,0 +1 @@
+void consolidate(int outfd);
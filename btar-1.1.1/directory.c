@@ -0,0 +1,306 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include "main.h"
+#include "mytar.h"
+#include "directory.h"
+
+/* The directory is the last member of a btar archive. It lists the offset and
+ * size of every other member, as lines of text:
+ *    <header offset> <data size> <name>\n
+ * The text is padded with zeros up to a 512 byte record, and then comes the
+ * locator: a last record holding the offset of the directory header itself.
+ * As the archive ends with two zero records, the locator can always be found
+ * 1536 bytes before the end of the file, and the directory stays a plain
+ * tar member. */
+
+static const char directory_name[] = "directory";
+static const char locator_magic[] = "btar-directory";
+
+void
+directory_init(struct directory *d)
+{
+    d->entries = 0;
+    d->nentries = 0;
+    d->allocated = 0;
+}
+
+void
+directory_add(struct directory *d, const char *name,
+        unsigned long long offset, unsigned long long size)
+{
+    const size_t allocstep = 1000;
+    struct directory_entry *e;
+
+    if (d->nentries == d->allocated)
+    {
+        d->entries = realloc(d->entries,
+                (d->allocated + allocstep) * sizeof(*d->entries));
+        if (!d->entries)
+            fatal_error("Cannot realloc");
+        d->allocated += allocstep;
+    }
+
+    e = &d->entries[d->nentries++];
+    e->name = strdup(name);
+    if (!e->name)
+        fatal_error("Cannot allocate");
+    e->offset = offset;
+    e->size = size;
+}
+
+/* To be called just after writing a member to 'tar'. The offset recorded is
+ * that of its last header, even if a long name header came before. */
+void
+directory_add_member(struct directory *d, const struct mytar *tar)
+{
+    char name[sizeof tar->header.name + 1];
+    unsigned long long size = read_size(tar->header.size);
+    unsigned long long padded = size;
+
+    if (padded % 512)
+        padded += 512 - (padded % 512);
+
+    strcpyn(name, tar->header.name, sizeof name);
+    directory_add(d, name, tar->total_written - padded - 512, size);
+}
+
+void
+directory_to_tar(struct directory *d, struct mytar *tar)
+{
+    unsigned long long offset = tar->total_written;
+    size_t len = 0;
+    size_t allocated = 512;
+    char *text;
+    size_t i;
+    ssize_t res;
+
+    if (command_line.debug)
+        fprintf(stderr, "Writing the directory of %zu members\n", d->nentries);
+
+    text = malloc(allocated);
+    if (!text)
+        fatal_error("Cannot allocate");
+
+    for(i=0; i < d->nentries; ++i)
+    {
+        const struct directory_entry *e = &d->entries[i];
+        int n;
+
+        /* Enough room for the line and the locator record */
+        while (allocated - len < strlen(e->name) + 50 + 512)
+        {
+            allocated *= 2;
+            text = realloc(text, allocated);
+            if (!text)
+                fatal_error("Cannot realloc");
+        }
+
+        n = snprintf(text + len, allocated - len, "%llu %llu %s\n",
+                e->offset, e->size, e->name);
+        len += n;
+    }
+
+    /* Pad to a record, and add the locator */
+    if (allocated < len + 1024)
+    {
+        allocated = len + 1024;
+        text = realloc(text, allocated);
+        if (!text)
+            fatal_error("Cannot realloc");
+    }
+    if (len % 512 > 0)
+    {
+        memset(text + len, 0, 512 - len % 512);
+        len += 512 - len % 512;
+    }
+    memset(text + len, 0, 512);
+    snprintf(text + len, 512, "%s %llu %zu\n", locator_magic, offset,
+            d->nentries);
+    len += 512;
+
+    mytar_new_file(tar);
+    mytar_set_filename(tar, (char *) directory_name);
+    mytar_set_gid(tar, getgid());
+    mytar_set_uid(tar, getuid());
+    mytar_set_size(tar, len);
+    mytar_set_mode(tar, 0644 | S_IFREG);
+    mytar_set_mtime(tar, time(NULL));
+    mytar_set_filetype(tar, S_IFREG);
+    res = mytar_write_header(tar);
+    if (res == -1)
+        error("Failed to write header");
+
+    res = mytar_write_data(tar, text, len);
+    if (res == -1)
+        error("Could not write the directory data");
+    assert((size_t) res == len);
+
+    res = mytar_write_end(tar);
+    if (res == -1)
+        error("Could not write mytar file end");
+
+    free(text);
+}
+
+/* Returns -1 on error or if the file ends before 'n' bytes */
+int
+pread_all(int fd, void *buf, size_t n, unsigned long long offset)
+{
+    char *p = buf;
+
+    while (n > 0)
+    {
+        ssize_t res = pread(fd, p, n, offset);
+        if (res == -1 || res == 0)
+            return -1;
+        p += res;
+        n -= res;
+        offset += res;
+    }
+    return 0;
+}
+
+/* Returns 1 if the archive in 'fd' has a valid directory. It does not
+ * move the fd position. */
+int
+directory_load(struct directory *d, int fd)
+{
+    struct stat st;
+    char locator[513];
+    struct header_gnu_tar h;
+    unsigned long long offset;
+    unsigned long long size;
+    size_t nentries;
+    char *text;
+    char *line;
+    int res;
+
+    directory_init(d);
+
+    res = fstat(fd, &st);
+    if (res == -1 || !S_ISREG(st.st_mode) || st.st_size < 4 * 512)
+        return 0;
+
+    if (pread_all(fd, locator, 512, st.st_size - 3 * 512) == -1)
+        return 0;
+    locator[512] = '\0';
+
+    if (strncmp(locator, locator_magic, sizeof locator_magic - 1) != 0)
+        return 0;
+
+    res = sscanf(locator + sizeof locator_magic - 1, "%llu %zu",
+            &offset, &nentries);
+    if (res != 2 || offset + 512 > (unsigned long long) st.st_size)
+        return 0;
+
+    /* The locator must point to our own header, or the archive
+     * has been moved around (appended to a file, for example) */
+    if (pread_all(fd, &h, sizeof h, offset) == -1)
+        return 0;
+    if (strncmp(h.name, directory_name, sizeof h.name) != 0 ||
+            calc_checksum(&h) != (int) read_octal_number(h.checksum, sizeof h.checksum))
+    {
+        if (command_line.debug)
+            fprintf(stderr, "The btar directory locator does not match its header\n");
+        return 0;
+    }
+
+    size = read_size(h.size);
+    if (size < 512 || offset + 512 + size > (unsigned long long) st.st_size)
+        return 0;
+
+    text = malloc(size - 512 + 1);
+    if (!text)
+        fatal_error("Cannot allocate");
+    if (pread_all(fd, text, size - 512, offset + 512) == -1)
+    {
+        free(text);
+        return 0;
+    }
+    text[size - 512] = '\0';
+
+    line = text;
+    while (*line != '\0')
+    {
+        unsigned long long eoffset, esize;
+        int namestart;
+        char *end = strchr(line, '\n');
+
+        if (!end)
+            break;
+        *end = '\0';
+
+        res = sscanf(line, "%llu %llu %n", &eoffset, &esize, &namestart);
+        if (res != 2)
+        {
+            if (command_line.debug)
+                fprintf(stderr, "Wrong btar directory line: %s\n", line);
+            free(text);
+            directory_free(d);
+            return 0;
+        }
+        directory_add(d, line + namestart, eoffset, esize);
+        line = end + 1;
+    }
+    free(text);
+
+    if (d->nentries != nentries)
+    {
+        if (command_line.debug)
+            fprintf(stderr, "The btar directory has %zu entries and not %zu\n",
+                    d->nentries, nentries);
+        directory_free(d);
+        return 0;
+    }
+
+    if (command_line.debug)
+        fprintf(stderr, "Loaded the btar directory of %zu members\n", d->nentries);
+
+    return 1;
+}
+
+const struct directory_entry *
+directory_find(const struct directory *d, const char *prefix)
+{
+    size_t i;
+    size_t len = strlen(prefix);
+
+    for(i=0; i < d->nentries; ++i)
+        if (strncmp(d->entries[i].name, prefix, len) == 0)
+            return &d->entries[i];
+
+    return 0;
+}
+
+void
+directory_free(struct directory *d)
+{
+    size_t i;
+
+    for(i=0; i < d->nentries; ++i)
+        free(d->entries[i].name);
+    free(d->entries);
+    directory_init(d);
+}
@@ -0,0 +1,26 @@
+struct mytar;
+
+struct directory_entry
+{
+    char *name;
+    unsigned long long offset; /* of the tar header of the member */
+    unsigned long long size; /* of the member data */
+};
+
+struct directory
+{
+    struct directory_entry *entries;
+    size_t nentries;
+    size_t allocated;
+};
+
+void directory_init(struct directory *d);
+void directory_add(struct directory *d, const char *name,
+        unsigned long long offset, unsigned long long size);
+void directory_add_member(struct directory *d, const struct mytar *tar);
+void directory_to_tar(struct directory *d, struct mytar *tar);
+int directory_load(struct directory *d, int fd);
+const struct directory_entry * directory_find(const struct directory *d,
+        const char *prefix);
+void directory_free(struct directory *d);
+int pread_all(int fd, void *buf, size_t n, unsigned long long offset);
@@ -18,14 +18,15 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <fnmatch.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 
 #include "main.h"
 #include "loadindex.h"
@@ -35,9 +36,24 @@
 #include "block.h"
 #include "rsync.h"
 #include "extract.h"
+#include "directory.h"
+#include "writers.h"
+#include "bufread.h"
+#include "restoreplan.h"
+#include "pathmatch.h"
+#include "sparsefile.h"
+#include "frames.h"
+#include "checksums.h"
+#include "repository.h"
 
 static char *blocks;
+/* Where the first wanted entry starts, in each block tar */
+static unsigned long long *block_offsets;
 static int allocated_blocks = 0;
+/* Where the blocks can start being defiltered, with --frame-size */
+static struct frame_table frames;
+/* Of the block members, to tell the damaged ones */
+static struct checksum_table checksums;
 
 /* From main.c */
 extern struct filter *defilter;
@@ -53,16 +69,23 @@ set_block_seen(int block)
     {
         int before = allocated_blocks;
         int after = block+1;
+        int i;
         allocated_blocks = after;
         blocks = realloc(blocks, after);
         if (!blocks)
             fatal_error("Cannot realloc");
         memset(blocks + before, 0, after - before);
+        block_offsets = realloc(block_offsets, after * sizeof(*block_offsets));
+        if (!block_offsets)
+            fatal_error("Cannot realloc");
+        for(i = before; i < after; ++i)
+            block_offsets[i] = ULLONG_MAX;
     }
 }
 
+/* 'offset' is where the entry starts in the first block, or -1 */
 static void
-set_blocks(int block, int nblocks)
+set_blocks(int block, int nblocks, long long offset)
 {
     int i;
 
@@ -70,10 +93,24 @@ set_blocks(int block, int nblocks)
 
     for(i=0; i < nblocks; ++i)
     {
+        unsigned long long o = (i == 0 && offset >= 0) ? offset : 0;
+
         blocks[block+i] = 1;
+        if (o < block_offsets[block+i])
+            block_offsets[block+i] = o;
     }
 }
 
+/* How much of the block tar we can skip, if we start reading it */
+static unsigned long long
+block_offset(int block)
+{
+    if (block >= allocated_blocks || block_offsets[block] == ULLONG_MAX)
+        return 0;
+
+    return block_offsets[block];
+}
+
 static int
 should_process_block(int block)
 {
@@ -86,24 +123,445 @@ should_process_block(int block)
     return blocks[block];
 }
 
+/* With --range, a block may start in the middle of the data of a file
+ * we want, and the internal tar has to start there, without a header */
+struct range_resume
+{
+    int block;
+    char *name;
+    unsigned long long pos; /* Of the file data at the block start */
+    unsigned long long size;
+};
+
+static struct range_resume *range_resumes;
+static int nrange_resumes;
+
+static void
+add_range_resume(int block, const char *name, unsigned long long pos,
+        unsigned long long size)
+{
+    struct range_resume *r;
+
+    range_resumes = realloc(range_resumes,
+            (nrange_resumes + 1) * sizeof(*range_resumes));
+    if (!range_resumes)
+        fatal_error("Cannot realloc");
+
+    r = &range_resumes[nrange_resumes++];
+    r->block = block;
+    r->name = strdup(name);
+    if (!r->name)
+        fatal_error("Cannot allocate");
+    r->pos = pos;
+    r->size = size;
+}
+
+static const struct range_resume *
+find_range_resume(int block)
+{
+    int i;
+
+    for(i=0; i < nrange_resumes; ++i)
+        if (range_resumes[i].block == block)
+            return &range_resumes[i];
+    return 0;
+}
+
+static void
+free_range_resumes()
+{
+    int i;
+
+    for(i=0; i < nrange_resumes; ++i)
+        free(range_resumes[i].name);
+    free(range_resumes);
+    range_resumes = 0;
+    nrange_resumes = 0;
+}
+
+/* The block holding the byte 'pos' of the file */
 static int
-matches_paths(const char *path)
+file_pos_block(const struct IndexElem *e, unsigned long long pos)
 {
-    if (command_line.paths)
+    if (pos < (unsigned long long) e->crossing)
+        return e->block;
+    return e->block + 1 + (pos - e->crossing) / e->crossing_blocksize;
+}
+
+/* Selects only the blocks of the file with the --range bytes, if the
+ * index knows where its data crosses the blocks. Returns 0 if the file
+ * has none of those bytes. */
+static int
+set_range_blocks(const struct IndexElem *e)
+{
+    unsigned long long first = command_line.range_offset;
+    unsigned long long last = first + command_line.range_length - 1;
+    int firstblock, lastblock;
+
+    if (first >= e->size)
+    {
+        set_block_seen(e->block);
+        return 0;
+    }
+
+    if (e->crossing < 0 || e->crossing_blocksize == 0)
+    {
+        set_blocks(e->block, e->nblocks > 0 ? e->nblocks : 1, e->offset);
+        return 1;
+    }
+
+    /* Not to process the rest of the file, if it is the last one */
+    set_block_seen(file_pos_block(e, e->size - 1));
+
+    if (last >= e->size)
+        last = e->size - 1;
+
+    firstblock = file_pos_block(e, first);
+    lastblock = file_pos_block(e, last);
+
+    if (command_line.debug)
+        fprintf(stderr, "  The range of \"%s\" is in blocks %i to %i\n",
+                e->name, firstblock, lastblock);
+
+    if (firstblock == e->block)
+        set_blocks(firstblock, lastblock - firstblock + 1, e->offset);
+    else
+    {
+        set_blocks(firstblock, lastblock - firstblock + 1, 0);
+        add_range_resume(firstblock, e->name, e->crossing +
+                (unsigned long long) (firstblock - e->block - 1) *
+                e->crossing_blocksize, e->size);
+    }
+    return 1;
+}
+
+/* The traverse paths, compiled by extract(). The index one also matches
+ * the names with the rdiff extension */
+static struct path_matcher paths_matcher;
+static struct path_matcher index_matcher;
+
+/* With --verify, what was found wrong in the btar */
+struct verify_state
+{
+    struct checksum_table computed; /* Checked at the end, from a pipe */
+    int have_index;
+    int failures;
+    int first_block;
+    char *first_path;
+    char *path; /* The last entry of the internal tar */
+    unsigned long long entries;
+    int blocks;
+    unsigned long long bytes; /* Of the btar */
+    const struct readtar *intar;
+    unsigned long long bad_headers; /* Of intar, already told */
+    char **deleted; /* The deleted list of the btar, sorted */
+    size_t ndeleted;
+    unsigned long long block_start; /* In intar, of the block given */
+    unsigned long long block_skip; /* Its data before the intar restarted */
+    unsigned long long prev_block_start; /* Of the block before it */
+    unsigned long long prev_block_skip;
+    int seen_directory; /* The members of the btar besides the blocks */
+    int seen_checksums;
+    int seen_index;
+    unsigned long long btar_bad_headers; /* Of the btar tar, at its end */
+    int btar_at_end;
+    int intar_at_end; /* After all its entries, and its zero records */
+};
+
+static struct verify_state verify;
+static int verify_failed = 0;
+
+/* Extracting, the blocks not matching their checksum */
+static int damaged_blocks = 0;
+
+/* The entry whose data the block starts with, according to the index */
+static const char *
+verify_block_path(int block)
+{
+    const struct IndexElem *ptr;
+    const struct IndexElem *best = 0;
+    size_t nelems;
+    size_t i;
+
+    if (!verify.have_index)
+        return 0;
+
+    ptr = index_get_elements(&nelems);
+    for(i=0; i < nelems; ++i)
+    {
+        const struct IndexElem *e = &ptr[i];
+        int nblocks = e->nblocks > 0 ? e->nblocks : 1;
+
+        if (e->block < 0 || e->block > block || e->block + nblocks <= block)
+            continue;
+        if (!best || e->block < best->block ||
+                (e->block == best->block && e->offset < best->offset))
+            best = e;
+    }
+
+    return best ? best->name : 0;
+}
+
+/* Block -1 is for what fails of the btar as a whole */
+static void
+verify_fail(int block, const char *path, const char *what)
+{
+    if (block < 0)
+        fprintf(stderr, "The btar: %s\n", what);
+    else if (path)
+        fprintf(stderr, "Block %i, %s: %s\n", block, path, what);
+    else
+        fprintf(stderr, "Block %i: %s\n", block, what);
+
+    if (verify.failures++ == 0)
+    {
+        verify.first_block = block;
+        verify.first_path = path ? strdup(path) : 0;
+    }
+}
+
+static void
+verify_block_checksums(int block, unsigned int raw, unsigned int filtered,
+        int failed)
+{
+    unsigned int expected_raw, expected_filtered;
+
+    if (!checksum_table_find(&checksums, block, &expected_raw,
+                &expected_filtered))
+        return;
+
+    if (filtered != expected_filtered)
+        verify_fail(block, verify_block_path(block),
+                "the block member does not match its checksum");
+    else if (raw != expected_raw && !failed)
+        verify_fail(block, verify_block_path(block),
+                "the defiltered block does not match its checksum");
+}
+
+/* Once all the output of the defilter of a block went through the
+ * internal tar */
+static void
+verify_headers(int block)
+{
+    if (verify.intar->bad_headers > verify.bad_headers)
+        verify_fail(block, verify.path, "damaged tar headers after this entry");
+    verify.bad_headers = verify.intar->bad_headers;
+}
+
+/* With 'failed', the defilter did not give all the block */
+static void
+verify_block_done(int block, unsigned int raw, int failed)
+{
+    unsigned int filtered = 0;
+
+    ++verify.blocks;
+    verify_headers(block);
+    if (failed)
+        verify_fail(block, verify_block_path(block), "the defilter failed");
+
+    if (!checksum_table_find(&verify.computed, block, 0, &filtered))
+        return;
+
+    if (checksums.nblocks > 0)
+    {
+        verify_block_checksums(block, raw, filtered, failed);
+        verify.computed.blocks[block].known = 0;
+    }
+    else
+        checksum_table_add(&verify.computed, block, raw, filtered);
+}
+
+static void
+verify_add_deleted(const char *name, int is_dir)
+{
+    (void) is_dir;
+
+    verify.deleted = realloc(verify.deleted,
+            (verify.ndeleted + 1) * sizeof(*verify.deleted));
+    if (!verify.deleted)
+        fatal_error("Cannot realloc");
+    verify.deleted[verify.ndeleted] = strdup(name);
+    if (!verify.deleted[verify.ndeleted])
+        fatal_error("Cannot allocate");
+    verify.ndeleted++;
+}
+
+static int
+compare_names(const void *p1, const void *p2)
+{
+    return strcmp(*(char * const *) p1, *(char * const *) p2);
+}
+
+static int
+verify_is_deleted(const char *name)
+{
+    return bsearch(&name, verify.deleted, verify.ndeleted,
+            sizeof(*verify.deleted), compare_names) != 0;
+}
+
+static enum readtar_newfile_result
+verify_new_file(const struct readtar_file *file, int block)
+{
+    verify_headers(block);
+    free(verify.path);
+    verify.path = strdup(file->name);
+    ++verify.entries;
+
+    /* The index has the regular files and the symlinks */
+    if (verify.have_index && (file->header->typeflag[0] == '0' ||
+                file->header->typeflag[0] == '2'))
     {
-        int i = 0;
-        while(command_line.paths[i] != 0)
+        struct IndexElem *e = index_find_element(file->name);
+        unsigned long long start = verify.intar->header_start;
+        unsigned long long offset = start - verify.block_start +
+            verify.block_skip;
+
+        /* The long name headers may start in the block before */
+        if (start < verify.block_start)
         {
-            if (command_line.debug > 1)
-                fprintf(stderr,
-                        "Check traverse path: \"%s\" matches \"%s\"?\n",
-                        path, command_line.paths[i]);
-            if(fnmatch(command_line.paths[i],
-                        path, 0) == 0)
-                return 1;
-            ++i;
+            --block;
+            offset = start - verify.prev_block_start + verify.prev_block_skip;
         }
-        return 0;
+
+        /* On --append, the entries stored again or deleted later */
+        if (e && (e->block > block || (e->block == block && e->offset >= 0 &&
+                        offset < (unsigned long long) e->offset)))
+            return READTAR_SKIPDATA;
+        if (!e && verify_is_deleted(file->name))
+            return READTAR_SKIPDATA;
+
+        if (!e)
+            verify_fail(block, file->name, "not in the index");
+        else if (file->header->typeflag[0] == '0' && e->size != file->size)
+            verify_fail(block, file->name, "its size is not that in the index");
+        else if (e->block != block)
+            verify_fail(block, file->name, "not in the block of the index");
+        if (e)
+            e->seen = 1;
+    }
+
+    return READTAR_SKIPDATA;
+}
+
+/* The members of the btar, as they pass */
+static void
+verify_member(const char *name)
+{
+    if (strcmp(name, "directory") == 0)
+        verify.seen_directory = 1;
+    else if (strcmp(name, "checksums") == 0)
+        verify.seen_checksums = 1;
+    else if (strncmp(name, "index.tar", sizeof("index.tar")-1) == 0 ||
+            strncmp(name, "indexshard", sizeof("indexshard")-1) == 0)
+        verify.seen_index = 1;
+}
+
+/* What a cut or foreign file gives, even with all its blocks fine */
+static void
+verify_btar()
+{
+    if (verify.btar_bad_headers > 0)
+        verify_fail(-1, 0, "damaged tar headers between its members");
+    if (verify.blocks == 0)
+        verify_fail(-1, 0, "no block members");
+
+    /* Without -N, as created without -N */
+    if (command_line.add_create_index && !verify.seen_index)
+        verify_fail(-1, 0, "no index; it may be cut, or need -N");
+    if (command_line.add_create_index && !verify.seen_checksums)
+        verify_fail(-1, 0, "no checksums; it may be cut");
+    if (command_line.add_create_index && !verify.seen_directory)
+        verify_fail(-1, 0, "no directory; it may be cut");
+    if (!verify.btar_at_end)
+        verify_fail(-1, 0, "no end of archive records; it may be cut");
+
+    /* With paths, the last blocks may not be read */
+    if (verify.blocks > 0 && !command_line.paths && !verify.intar_at_end)
+        verify_fail(verify.blocks - 1, verify.path,
+                "the internal tar ends in the middle of an entry, or "
+                "without its end of archive records");
+}
+
+static void
+verify_end(double seconds)
+{
+    const struct IndexElem *ptr;
+    size_t nelems;
+    size_t i;
+    int b;
+
+    /* From a pipe, the checksums came at the end */
+    for(b=0; b < verify.computed.nblocks; ++b)
+        if (verify.computed.blocks[b].known)
+            verify_block_checksums(b, verify.computed.blocks[b].raw,
+                    verify.computed.blocks[b].filtered, 0);
+
+    ptr = index_get_elements(&nelems);
+    for(i=0; verify.have_index && i < nelems; ++i)
+        if (!ptr[i].seen && !ptr[i].is_dir)
+            verify_fail(ptr[i].block, ptr[i].name, "in the index, not in the blocks");
+
+    verify_btar();
+
+    fprintf(stderr, "Verified %i blocks, %llu entries, %llu bytes in %.1f s "
+            "(%.1f MiB/s)%s%s\n", verify.blocks, verify.entries, verify.bytes,
+            seconds, seconds > 0 ? verify.bytes / seconds / (1024*1024) : 0.,
+            checksums.nblocks > 0 ? "" : ", without checksums",
+            verify.have_index ? "" : ", without index");
+
+    if (verify.failures > 0)
+    {
+        if (verify.first_block < 0)
+            fprintf(stderr, "%i failures; the first of the btar as a whole\n",
+                    verify.failures);
+        else if (verify.first_path)
+            fprintf(stderr, "%i failures; the first at block %i, %s\n",
+                    verify.failures, verify.first_block, verify.first_path);
+        else
+            fprintf(stderr, "%i failures; the first at block %i\n",
+                    verify.failures, verify.first_block);
+        verify_failed = 1;
+    }
+
+    checksum_table_free(&verify.computed);
+    free(verify.first_path);
+    free(verify.path);
+    for(i=0; i < verify.ndeleted; ++i)
+        free(verify.deleted[i]);
+    free(verify.deleted);
+}
+
+int
+verify_failures()
+{
+    return verify_failed;
+}
+
+int
+damaged_blocks_skipped()
+{
+    return damaged_blocks;
+}
+
+/* For -O, the wanted files not yet output, according to the index.
+ * At 0 we can stop decoding. -1 if unknown. */
+static int stdout_files_left = -1;
+
+static void
+stdout_file_done()
+{
+    if (stdout_files_left > 0)
+        --stdout_files_left;
+}
+
+static int
+matches_paths(const char *path)
+{
+    if (command_line.paths)
+    {
+        if (command_line.debug > 1)
+            fprintf(stderr, "Check traverse paths: \"%s\"?\n", path);
+        return path_matcher_match(&paths_matcher, path);
     }
     /* In case of no traverse path, extract all */
     return 1;
@@ -119,9 +577,26 @@ struct intar_state
     char *name;
     struct mytar *tar;
     int fd;
+    int to_writer; /* fd goes to a writer process */
+    int range; /* Only the --range bytes go to fd */
+    struct sparse_file sparse; /* For fd, if we write it */
     struct rsync_patch *rsync_patch;
+    int block; /* Giving the data, with --verify */
+};
+
+/* Directory times are set at the end, as creating the files inside
+ * changes them */
+struct directory_time
+{
+    char *name;
+    int atime;
+    int mtime;
 };
 
+static struct directory_time *directory_times;
+static size_t ndirectory_times;
+static size_t allocated_directory_times;
+
 static void
 set_mtime(const struct intar_state *is)
 {
@@ -140,12 +615,193 @@ set_mtime(const struct intar_state *is)
                 strerror(errno));
 }
 
+static void
+add_directory_time(const char *name, int atime, int mtime)
+{
+    const size_t allocstep = 1000;
+    struct directory_time *d;
+
+    if (ndirectory_times == allocated_directory_times)
+    {
+        directory_times = realloc(directory_times,
+                (allocated_directory_times + allocstep) * sizeof(*directory_times));
+        if (!directory_times)
+            fatal_error("Cannot realloc");
+        allocated_directory_times += allocstep;
+    }
+
+    d = &directory_times[ndirectory_times++];
+    d->name = strdup(name);
+    if (!d->name)
+        fatal_error("Cannot allocate");
+    d->atime = atime;
+    d->mtime = mtime;
+}
+
+static void
+apply_directory_times()
+{
+    size_t i;
+
+    /* The subdirectories come after their parent */
+    for(i = ndirectory_times; i > 0; --i)
+    {
+        struct directory_time *d = &directory_times[i-1];
+        struct timeval t[2];
+        int res;
+
+        t[0].tv_sec = d->atime;
+        t[0].tv_usec = 0;
+        t[1].tv_sec = d->mtime;
+        t[1].tv_usec = 0;
+        res = lutimes(d->name, t);
+        /* With -H, the deleted list of an appended btar may have
+         * removed it after its blocks */
+        if (res == -1 && !(errno == ENOENT && command_line.should_delete))
+            fprintf(stderr, "Cannot set times to %s: %s\n", d->name,
+                    strerror(errno));
+        free(d->name);
+    }
+    free(directory_times);
+    directory_times = 0;
+    ndirectory_times = 0;
+    allocated_directory_times = 0;
+}
+
+/* Also for a file cut by the end of the data */
+static void
+end_writer_file(struct intar_state *is)
+{
+    if (is->to_writer)
+    {
+        writers_file_end(is->fd);
+        is->fd = -1;
+        is->to_writer = 0;
+    }
+    if (is->range)
+    {
+        if (is->fd != 1)
+            close(is->fd);
+        is->fd = -1;
+        is->range = 0;
+        is->writing = 0;
+        stdout_file_done();
+    }
+    /* A file we write ourselves, cut */
+    if (command_line.action == EXTRACT && is->fd >= 0 && !is->rsync_patch)
+    {
+        if (sparse_file_end(&is->sparse) == -1)
+            fatal_errno("Cannot write to file");
+        close(is->fd);
+        is->fd = -1;
+        is->writing = 0;
+    }
+}
+
+/* After a damaged block, the entry being written stays cut. In a tar
+ * output it gets zeros, for the entries after it. */
+static void
+cut_writer_file(struct intar_state *is)
+{
+    if (is->writing && !is->range && is->nread < is->expected_size)
+    {
+        fprintf(stderr, "An entry is cut by the damaged block\n");
+        if (command_line.action == EXTRACT_TO_TAR)
+        {
+            static const char zeros[512];
+
+            while (is->nread < is->expected_size)
+            {
+                size_t n = is->expected_size - is->nread < sizeof zeros ?
+                    is->expected_size - is->nread : sizeof zeros;
+
+                if (mytar_write_data(is->tar, zeros, n) == -1)
+                    fatal_errno("Cannot write to extraction tar");
+                is->nread += n;
+            }
+            if (mytar_write_end(is->tar) == -1)
+                fatal_errno("Cannot write to extraction tar");
+        }
+        else if (command_line.action == EXTRACT_TO_STDOUT)
+            stdout_file_done();
+    }
+    end_writer_file(is);
+    is->writing = 0;
+}
+
+/* With --range, the file data at 'pos' is the first to come. The range
+ * goes to stdout on -O, or is written in place into the file on -x. */
+static enum readtar_newfile_result
+start_range_file(struct intar_state *is, const char *name,
+        unsigned long long size, unsigned long long pos, int mode)
+{
+    is->writing = 0;
+
+    /* Not even counted as wanted */
+    if (size <= command_line.range_offset)
+        return READTAR_SKIPDATA;
+
+    if (command_line.action == EXTRACT)
+    {
+        is->fd = open(name, O_CREAT | O_WRONLY, mode);
+        if (is->fd == -1)
+        {
+            fprintf(stderr, "Cannot open %s: %s\n", name, strerror(errno));
+            return READTAR_SKIPDATA;
+        }
+    }
+    else
+        is->fd = 1;
+
+    is->range = 1;
+    is->writing = 1;
+    is->expected_size = size;
+    is->nread = pos;
+    return READTAR_NORMAL;
+}
+
+static void
+range_data(struct intar_state *is, const char *data, size_t len)
+{
+    unsigned long long from = is->nread;
+    unsigned long long to = is->nread + len;
+    unsigned long long range_end = command_line.range_offset +
+        command_line.range_length;
+
+    if (from < command_line.range_offset)
+        from = command_line.range_offset;
+    if (to > range_end)
+        to = range_end;
+
+    while (from < to)
+    {
+        ssize_t res;
+        const char *p = data + (from - is->nread);
+
+        if (is->fd == 1)
+            res = write(1, p, to - from);
+        else
+            res = pwrite(is->fd, p, to - from, from);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res == -1)
+            fatal_errno("Cannot write the range");
+        from += res;
+    }
+
+    is->nread += len;
+    if (is->nread >= range_end || is->nread == is->expected_size)
+        end_writer_file(is);
+}
+
 static void
 intar_new_data_cb(const char *data, size_t len, void *userdata)
 {
     struct intar_state *is = (struct intar_state *) userdata;
 
-    if (is->writing)
+    if (is->writing && is->range)
+        range_data(is, data, len);
+    else if (is->writing)
     {
         ssize_t res;
         if (command_line.action == EXTRACT_TO_TAR)
@@ -162,22 +818,41 @@ intar_new_data_cb(const char *data, size_t len, void *userdata)
                     fatal_errno("Cannot write to extraction tar");
             }
         }
+        else if (command_line.action == EXTRACT_TO_STDOUT)
+        {
+            res = write_all(1, data, len);
+            if ((size_t) res != len)
+                fatal_errno("Cannot write to stdout");
+
+            is->nread += len;
+            if (is->nread == is->expected_size)
+            {
+                is->writing = 0;
+                stdout_file_done();
+            }
+        }
         else if (command_line.action == EXTRACT)
         {
             assert(is->fd >= 0);
-            if (is->rsync_patch)
+            if (is->to_writer)
+            {
+                writers_data(is->fd, data, len);
+            }
+            else if (is->rsync_patch)
             {
                 rsync_patch_work(is->rsync_patch, data, len);
             }
             else
             {
-                res = write_all(is->fd, data, len);
+                res = sparse_file_write(&is->sparse, data, len);
                 if ((size_t) res != len)
                     fatal_errno("Cannot write to file");
             }
 
             is->nread += len;
-            if (is->nread == is->expected_size)
+            if (is->nread == is->expected_size && is->to_writer)
+                end_writer_file(is);
+            else if (is->nread == is->expected_size)
             {
                 if (is->rsync_patch)
                 {
@@ -190,6 +865,8 @@ intar_new_data_cb(const char *data, size_t len, void *userdata)
                     rsync_patch_free(is->rsync_patch);
                     is->rsync_patch = 0;
                 }
+                else if (sparse_file_end(&is->sparse) == -1)
+                    fatal_errno("Cannot write to file");
                 close(is->fd);
                 set_mtime(is);
                 is->fd = -1;
@@ -232,17 +909,31 @@ intar_new_file_cb(const struct readtar_file *file, void *userdata)
 
     int matches_rdiff;
 
-    matches_rdiff = matches_rdiff_extension(file->name, basename);
+    if (command_line.action == VERIFY)
+        return verify_new_file(file, is->block);
+
+    /* The rdiff patches are not the file, to output them alone */
+    if (command_line.action == EXTRACT_TO_STDOUT || command_line.range)
+        matches_rdiff = 0;
+    else
+        matches_rdiff = matches_rdiff_extension(file->name, basename);
 
-    if (matches_paths(file->name) || (matches_rdiff &&
-                matches_paths(basename)))
+    if ((matches_paths(file->name) || (matches_rdiff &&
+                matches_paths(basename))) &&
+            (file->header->typeflag[0] == '5' || restore_plan_wants(file->name)))
     {
         free(is->name);
         is->name = 0;
+        end_writer_file(is);
 
         if (command_line.verbose)
             fprintf(stderr, "%s\n", file->name);
 
+        if (command_line.range && file->header->typeflag[0] == '0')
+            return start_range_file(is, file->name, file->size, 0,
+                    read_octal_number(file->header->mode,
+                        sizeof(file->header->mode)));
+
         if (command_line.action == EXTRACT)
         {
             char newbase[PATH_MAX];
@@ -250,6 +941,11 @@ intar_new_file_cb(const struct readtar_file *file, void *userdata)
             const struct header_gnu_tar *h = file->header;
 
             int mode = read_octal_number(h->mode, sizeof(h->mode));
+            int uid = read_octal_number(h->uid, sizeof(h->uid));
+            int gid = read_octal_number(h->gid, sizeof(h->gid));
+
+            is->atime = read_octal_number(h->atime, sizeof(h->atime));
+            is->mtime = read_octal_number(h->mtime, sizeof(h->mtime));
 
             if (h->typeflag[0] == '0')
             {
@@ -295,6 +991,23 @@ intar_new_file_cb(const struct readtar_file *file, void *userdata)
 
                 if (!matches_rdiff)
                 {
+                    /* A writer does it all, if we have them */
+                    is->fd = writers_file(file->name, file->size, mode, uid,
+                            gid, is->atime, is->mtime);
+                    if (is->fd >= 0)
+                    {
+                        is->to_writer = 1;
+                        is->writing = 1;
+                        is->expected_size = file->size;
+                        is->nread = 0;
+                        if (is->expected_size == 0)
+                        {
+                            end_writer_file(is);
+                            is->writing = 0;
+                        }
+                        return READTAR_NORMAL;
+                    }
+
                     if (command_line.debug)
                         fprintf(stderr, "Creating file %s\n",  file->name);
                     is->fd = open(file->name, O_CREAT | O_TRUNC | O_WRONLY, mode);
@@ -305,6 +1018,7 @@ intar_new_file_cb(const struct readtar_file *file, void *userdata)
                         is->writing = 0;
                         return READTAR_SKIPDATA;
                     }
+                    sparse_file_start(&is->sparse, is->fd, file->size);
                 }
 
                 res = chmod(matches_rdiff ? basename : file->name, mode);
@@ -331,12 +1045,15 @@ intar_new_file_cb(const struct readtar_file *file, void *userdata)
             }
             else if (h->typeflag[0] == '2')
             {
+                is->writing = 0;
+                if (writers_symlink(file->name, file->linkname, uid, gid,
+                            is->atime, is->mtime) == 0)
+                    return READTAR_NORMAL;
+
                 res = symlink(file->linkname, file->name);
                 if (res == -1)
                     fprintf(stderr, "Could not create symlink %s: %s\n", file->name,
                             strerror(errno));
-
-                is->writing = 0;
             }
             else if (h->typeflag[0] == '5')
             {
@@ -355,20 +1072,19 @@ intar_new_file_cb(const struct readtar_file *file, void *userdata)
                 return READTAR_SKIPDATA;
             }
 
-            res = lchown(matches_rdiff ? basename : file->name,
-                    read_octal_number(h->uid, sizeof(h->uid)),
-                    read_octal_number(h->gid, sizeof(h->gid)));
+            res = lchown(matches_rdiff ? basename : file->name, uid, gid);
             if (res == -1)
                 fprintf(stderr, "Cannot set uid/gid to %s: %s\n",
                         matches_rdiff ? basename : file->name,
                         strerror(errno));
 
+            if (h->typeflag[0] == '5')
+                add_directory_time(file->name, is->atime, is->mtime);
+            else
             {
                 struct timeval t[2];
-                is->atime = read_octal_number(h->atime, sizeof(h->atime));
                 t[0].tv_sec = is->atime;
                 t[0].tv_usec = 0;
-                is->mtime = read_octal_number(h->mtime, sizeof(h->mtime));
                 t[1].tv_sec = is->mtime;
                 t[1].tv_usec = 0;
                 res = lutimes(matches_rdiff ? basename : file->name, t);
@@ -378,6 +1094,24 @@ intar_new_file_cb(const struct readtar_file *file, void *userdata)
                             strerror(errno));
             }
         }
+        else if (command_line.action == EXTRACT_TO_STDOUT)
+        {
+            const struct header_gnu_tar *h = file->header;
+
+            is->writing = 0;
+            if (h->typeflag[0] == '5')
+                return READTAR_SKIPDATA;
+
+            if (h->typeflag[0] != '0' || file->size == 0)
+            {
+                stdout_file_done();
+                return READTAR_SKIPDATA;
+            }
+
+            is->writing = 1;
+            is->expected_size = file->size;
+            is->nread = 0;
+        }
         else if (command_line.action == EXTRACT_TO_TAR)
         {
             if (matches_rdiff)
@@ -416,23 +1150,7 @@ deletedtar_new_file_cb(const struct readtar_file *file, void *userdata)
     int res;
     int should_delete;
 
-    if (command_line.paths == 0)
-        should_delete = 1;
-    else
-    {
-        int j = 0;
-        should_delete = 0;
-        while(command_line.paths[j] != 0)
-        {
-            should_delete = 0;
-            if(fnmatch(command_line.paths[j], file->name, 0) == 0)
-            {
-                should_delete = 1;
-                break;
-            }
-            ++j;
-        }
-    }
+    should_delete = matches_paths(file->name);
 
     if (should_delete)
     {
@@ -462,49 +1180,550 @@ deletedtar_new_file_cb(const struct readtar_file *file, void *userdata)
     return READTAR_SKIPDATA;
 }
 
-struct block_extraction_state
+/* When mangling, the index is written again for the new block size. The
+ * tar stream inside the blocks does not change, so the position of each
+ * entry in it tells the new block, with the start of the old one. The old
+ * blocks may not all have the same size, after --append. */
+struct index_rewrite_state
 {
+    struct mytar *tar;
+    unsigned long long *old_starts; /* In the tar stream, of each old block */
+    int old_nblocks;
+    unsigned long long old_total;
+    char *data; /* Old format entries, block name and signature */
     unsigned long long nread;
     unsigned long long expected_size;
-    int should_read;
+};
+
+static void
+rewrite_block_link(char *out, size_t len, const char *link,
+        const struct index_rewrite_state *is)
+{
+    int block = block_name_to_int(link);
+    const char *size = strrchr(link, '_');
+    const char *offset = strstr(link, ";o=");
+    const char *crossing = strstr(link, ";c=");
+    size_t linklen = strlen(link);
+    int res;
+
+    if (!size)
+        fatal_error("Wrong block link in the index: %s", link);
+
+    if (block < 0 || block >= is->old_nblocks)
+        fatal_error("Cannot know where the block %i of the input btar starts",
+                block);
+
+    if (offset)
+    {
+        unsigned long long pos = is->old_starts[block] +
+            strtoull(offset + 3, 0, 10);
+        unsigned long long c, cblocksize;
+
+        res = snprintf(out, len, "block%llu.tar%s_%llu;o=%llu",
+                pos / command_line.blocksize, get_filter_extensions(filter),
+                strtoull(size + 1, 0, 10), pos % command_line.blocksize);
+
+        /* The crossing tells the length of the headers, to know where the
+         * data starts in the new blocks */
+        if (res >= 0 && (size_t) res < len && crossing &&
+                sscanf(crossing + 3, "%llu:%llu", &c, &cblocksize) == 2)
+        {
+            unsigned long long headers = cblocksize -
+                (strtoull(offset + 3, 0, 10) + c) % cblocksize;
+            index_link_add_crossing(out, len, pos + headers,
+                    strtoull(size + 1, 0, 10));
+        }
+    }
+    else
+        res = snprintf(out, len, "block%llu.tar%s_%llu",
+                is->old_starts[block] / command_line.blocksize,
+                get_filter_extensions(filter), strtoull(size + 1, 0, 10));
+    if (res < 0 || (size_t) res >= len)
+        fatal_error("Block link too long");
+
+    if (linklen > 2 && strcmp(link + linklen - 2, ";s") == 0)
+        strncat(out, ";s", len - strlen(out) - 1);
+}
+
+/* The blocks come in order, each defiltered to the end before the next */
+static void
+index_rewrite_block_data(struct index_rewrite_state *is, int block, size_t len)
+{
+    while (is->old_nblocks <= block)
+    {
+        is->old_starts = realloc(is->old_starts,
+                (is->old_nblocks + 1) * sizeof(*is->old_starts));
+        if (!is->old_starts)
+            fatal_error("Cannot realloc");
+        is->old_starts[is->old_nblocks++] = is->old_total;
+    }
+    is->old_total += len;
+}
+
+static void
+index_rewrite_new_data_cb(const char *data, size_t len, void *userdata)
+{
+    struct index_rewrite_state *is = (struct index_rewrite_state *) userdata;
+    char link[PATH_MAX];
+    size_t namelen;
+    ssize_t res;
+
+    if (!is->data)
+        return;
+
+    memcpy(is->data + is->nread, data, len);
+    is->nread += len;
+    if (is->nread < is->expected_size)
+        return;
+
+    /* The block name, \0, and the signature */
+    namelen = strnlen(is->data, is->expected_size);
+    if (namelen == is->expected_size)
+        fatal_error("Wrong old format entry in the index");
+    rewrite_block_link(link, sizeof link, is->data, is);
+
+    mytar_set_size(is->tar, strlen(link) + is->expected_size - namelen);
+    res = mytar_write_header(is->tar);
+    if (res == -1)
+        error("Cannot write the index tar");
+    res = mytar_write_data(is->tar, link, strlen(link));
+    if (res == -1)
+        error("Cannot write the index tar - mytar_write_data");
+    res = mytar_write_data(is->tar, is->data + namelen,
+            is->expected_size - namelen);
+    if (res == -1)
+        error("Cannot write the index tar - mytar_write_data");
+    res = mytar_write_end(is->tar);
+    if (res == -1)
+        error("Cannot write the index tar - mytar_write_end");
+
+    free(is->data);
+    is->data = 0;
+}
+
+static enum readtar_newfile_result
+index_rewrite_new_file_cb(const struct readtar_file *file, void *userdata)
+{
+    struct index_rewrite_state *is = (struct index_rewrite_state *) userdata;
+    const struct header_gnu_tar *h = file->header;
+    char link[PATH_MAX];
+    ssize_t res;
+
+    /* The same types as the index loader knows */
+    if (h->typeflag[0] != '2' && h->typeflag[0] != '5'
+            && h->typeflag[0] != '0')
+        return READTAR_SKIPDATA;
+
+    mytar_new_file(is->tar);
+    mytar_set_filename(is->tar, file->name);
+    mytar_set_mode(is->tar, read_octal_number(h->mode, sizeof h->mode));
+    mytar_set_size(is->tar, 0);
+    mytar_set_uid(is->tar, read_octal_number(h->uid, sizeof h->uid));
+    mytar_set_gid(is->tar, read_octal_number(h->gid, sizeof h->gid));
+    mytar_set_uname(is->tar, h->uname);
+    mytar_set_gname(is->tar, h->gname);
+    mytar_set_mtime(is->tar, read_octal_number(h->mtime, sizeof h->mtime));
+    mytar_set_atime(is->tar, read_octal_number(h->mtime, sizeof h->mtime));
+
+    if (h->typeflag[0] == '0')
+    {
+        mytar_set_filetype(is->tar, S_IFREG);
+        is->data = malloc(file->size);
+        if (!is->data)
+            fatal_error("Cannot allocate");
+        is->nread = 0;
+        is->expected_size = file->size;
+        return READTAR_NORMAL;
+    }
+
+    if (h->typeflag[0] == '5')
+        mytar_set_filetype(is->tar, S_IFDIR);
+    else
+    {
+        mytar_set_filetype(is->tar, S_IFLNK);
+        rewrite_block_link(link, sizeof link, file->linkname, is);
+        mytar_set_linkname(is->tar, link);
+    }
+
+    res = mytar_write_header(is->tar);
+    if (res == -1)
+        error("Cannot write the index tar");
+
+    return READTAR_SKIPDATA;
+}
+
+enum {
+    max_defilter_pids = 8
+};
+
+/* A member being defiltered. Up to -j of them run at once, but their output
+ * is processed in the order of the members: until a defilter is the first
+ * one, what it gives is kept in memory. */
+struct block_defilter
+{
+    int in_use;
     int filter_in;
     int filter_out;
     struct block *to_filterin;
+    struct block_reader *br_to_filterin;
     int close_filter_in;
-    struct readtar intar;
-    struct intar_state intar_state;
+    struct block *output;
+    int started; /* The internal tar is prepared for our output */
+    int restart_intar;
+    int block;
+    unsigned long long frame_offset; /* Block tar data not defiltered */
+    unsigned int raw_crc; /* Of the output, with --verify */
+    int held; /* The member waits for its checksum, to start the filters */
+    char *name; /* Of the member, for the filters */
+    int skipped; /* Damaged, and not defiltered */
+    int resync; /* The internal tar goes on at the first entry in it */
+    int resync_next; /* Resyncing, and no entry starts in it */
+    int pids[max_defilter_pids]; /* With --verify; 0 once reaped */
+    int npids;
+    volatile int failed; /* Some filter exited with error */
     enum {
         BES_BLOCK,
         BES_INDEX,
-        BES_DELETER
+        BES_DELETER,
+        BES_SIGNATURES
     } blocktype;
+};
+
+struct block_extraction_state
+{
+    unsigned long long nread;
+    unsigned long long expected_size;
+    int should_read;
+    int continues_block; /* The last member read was a block */
+    int resync; /* A damaged block was skipped */
+    struct block_defilter *defilters;
+    int ndefilters;
+    int first; /* Oldest defilter in use */
+    int next; /* To be used for the next member */
+    struct block_defilter *reading; /* That of the member in the btar, if any */
+    struct readtar intar;
+    struct intar_state intar_state;
+    unsigned long long intar_skip; /* Block data before the wanted entries */
+    unsigned long long member_skip; /* Frames before the wanted entries */
+    int check_crc; /* The block member read has a checksum */
+    unsigned int expected_crc;
+    unsigned int crc; /* Of the block member read so far */
+    char *member_text; /* The checksums member, with --verify from a pipe */
+    char *chunk_list; /* The block member, with --repository */
+    char *chunk_member; /* Its name */
+    struct readtar indexin;
+    struct index_rewrite_state index_rewrite;
     int outindex;
     int outdeleted;
+    int outsignatures;
 };
 
+/* Where the first entry of the block starts, by the index, to go on after a
+ * damaged block; ULLONG_MAX if none starts in it. Without the index, the
+ * internal tar looks for the next valid header. */
+static unsigned long long
+first_entry_offset(int block)
+{
+    const struct IndexElem *ptr;
+    size_t nelems;
+    size_t i;
+    unsigned long long offset = ULLONG_MAX;
+
+    ptr = index_get_elements(&nelems);
+    for(i=0; i < nelems; ++i)
+        if (ptr[i].block == block && ptr[i].offset >= 0 &&
+                (unsigned long long) ptr[i].offset < offset)
+            offset = ptr[i].offset;
+
+    if (offset == ULLONG_MAX)
+        return nelems > 0 ? ULLONG_MAX : block_offset(block);
+    return offset > block_offset(block) ? offset : block_offset(block);
+}
+
+/* Where the internal tar starts in the block, if it restarts there */
+static unsigned long long
+intar_start(const struct block_defilter *df)
+{
+    if (df->resync)
+        return first_entry_offset(df->block);
+    return block_offset(df->block);
+}
+
+/* For the child exit hook of --verify */
+static struct block_defilter *hooked_defilters;
+static int nhooked_defilters;
+
+static int
+filter_failed(int status)
+{
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+/* From the SIGCHLD handler */
+static int
+defilter_exit_hook(int pid, int status)
+{
+    int i, j;
+
+    for(i=0; i < nhooked_defilters; ++i)
+    {
+        struct block_defilter *df = &hooked_defilters[i];
+
+        for(j=0; j < df->npids; ++j)
+            if (df->pids[j] == pid)
+            {
+                df->pids[j] = 0;
+                if (filter_failed(status))
+                    df->failed = 1;
+                return 1;
+            }
+    }
+    return 0;
+}
+
+/* The output of the filters may end before they are reaped */
+static void
+wait_defilter(struct block_defilter *df)
+{
+    sigset_t chld, oldmask;
+    int j;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &oldmask);
+    for(j=0; j < df->npids; ++j)
+    {
+        int status;
+
+        if (df->pids[j] == 0)
+            continue;
+        if (waitpid(df->pids[j], &status, 0) == -1)
+            error("Error on waitpid");
+        if (filter_failed(status))
+            df->failed = 1;
+        df->pids[j] = 0;
+    }
+    df->npids = 0;
+    sigprocmask(SIG_SETMASK, &oldmask, 0);
+}
+
+static void
+run_defilter(struct block_defilter *df, const char *name)
+{
+    struct filter *mydefilter;
+    sigset_t oldmask;
+    int res;
+
+    if (defilter)
+        mydefilter = defilter;
+    else
+        mydefilter = defilters_from_extensions(name);
+
+    /* Verifying, a failing filter is told per block, not fatal. Until
+     * the pids are known, the child handler must not reap them. */
+    if (command_line.action == VERIFY)
+    {
+        sigset_t chld;
+
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &chld, &oldmask);
+        record_filter_pids(df->pids, max_defilter_pids);
+    }
+    run_filters(mydefilter, &df->filter_in, &df->filter_out);
+    if (command_line.action == VERIFY)
+    {
+        df->npids = end_record_filter_pids();
+        sigprocmask(SIG_SETMASK, &oldmask, 0);
+    }
+    res = fcntl(df->filter_in, F_SETFL, O_NONBLOCK);
+    if (res == -1)
+        error("Cannot fcntl");
+    /* Or the filters of the other members would keep this one open */
+    set_cloexec(df->filter_in);
+    set_cloexec(df->filter_out);
+
+    if (mydefilter != defilter)
+        free_filters(mydefilter);
+}
+
+/* The data of the block is dropped, and the internal tar goes on at the
+ * next block defiltered */
+static void
+skip_damaged_block(struct block_extraction_state *bes,
+        struct block_defilter *df)
+{
+    fprintf(stderr, "The block %i is damaged: its checksum does not match. "
+            "Skipping it\n", df->block);
+    ++damaged_blocks;
+
+    df->skipped = 1;
+    df->to_filterin->writer_pos = 0;
+    df->br_to_filterin->pos = 0;
+    bes->resync = 1;
+}
+
+/* The chunks of the block go to its defilter from a child of their own */
+static void
+start_chunks_writer(struct block_extraction_state *bes,
+        struct block_defilter *df)
+{
+    int pid;
+    int i;
+
+    pid = fork();
+    if (pid == -1)
+        error("Cannot fork");
+    if (pid == 0)
+    {
+        /* Or the defilters would not see the end of their input */
+        for(i=0; i < bes->ndefilters; ++i)
+        {
+            struct block_defilter *other = &bes->defilters[i];
+
+            if (other->filter_out >= 0)
+                close(other->filter_out);
+            if (other != df && other->filter_in >= 0)
+                close(other->filter_in);
+        }
+        if (fcntl(df->filter_in, F_SETFL, 0) == -1)
+            error("Cannot fcntl");
+        repository_chunks_to_fd(bes->chunk_member, bes->chunk_list,
+                df->filter_in);
+        close(df->filter_in);
+        exit(0);
+    }
+
+    close(df->filter_in);
+    df->filter_in = -1;
+}
+
 static void
 block_extraction_new_data_cb(const char *data, size_t len, void *userdata)
 {
     struct block_extraction_state *bes = (struct block_extraction_state *) userdata;
-    if (bes->should_read)
+    if (bes->should_read && bes->member_text)
+    {
+        memcpy(bes->member_text + bes->nread, data, len);
+        bes->nread += len;
+        if (bes->nread == bes->expected_size)
+        {
+            bes->member_text[bes->nread] = '\0';
+            checksum_table_parse(&checksums, bes->member_text);
+            free(bes->member_text);
+            bes->member_text = 0;
+        }
+    }
+    else if (bes->should_read)
     {
-        struct block *b = bes->to_filterin;
+        struct block_defilter *df = bes->reading;
+        size_t skip = 0;
         size_t res;
 
-        res = block_fill_from_memory(b, data, len);
-        assert(res == len);
+        assert(df);
+        if (bes->check_crc)
+            bes->crc = crc32c(bes->crc, data, len);
+        if (bes->member_skip > 0)
+        {
+            skip = len;
+            if (skip > bes->member_skip)
+                skip = bes->member_skip;
+            bes->member_skip -= skip;
+        }
+        if (bes->chunk_list)
+            memcpy(bes->chunk_list + bes->nread, data, len);
+        else if (!df->skipped)
+        {
+            res = block_fill_from_memory(df->to_filterin, data + skip,
+                    len - skip);
+            assert(res == len - skip);
+        }
 
         bes->nread += len;
 
         if (bes->nread == bes->expected_size)
         {
+            if (command_line.action == VERIFY)
+                checksum_table_add(&verify.computed, df->block, 0, bes->crc);
+            else if (bes->check_crc && bes->crc != bes->expected_crc &&
+                    df->held)
+                skip_damaged_block(bes, df);
+            else if (bes->check_crc && bes->crc != bes->expected_crc)
+                fatal_error_no_core("The block %i is damaged: its checksum "
+                        "does not match", df->block);
+
+            if (df->held)
+            {
+                df->held = 0;
+                if (!df->skipped)
+                    run_defilter(df, df->name);
+                free(df->name);
+                df->name = 0;
+            }
+
+            if (bes->chunk_list)
+            {
+                bes->chunk_list[bes->nread] = '\0';
+                if (!df->skipped)
+                    start_chunks_writer(bes, df);
+                free(bes->chunk_list);
+                bes->chunk_list = 0;
+            }
+
             /* This will make the select() loop not fill the to_filter_in block
              * until this is cleared */
-            bes->close_filter_in = 1;
+            df->close_filter_in = 1;
+            bes->reading = 0;
         }
     }
 }
 
+/* With 'hold', the filters start only once the member matches its
+ * checksum, so a damaged one is never defiltered */
+static struct block_defilter *
+start_defilter(struct block_extraction_state *bes, const char *name,
+        int blocktype, int hold)
+{
+    struct block_defilter *df = &bes->defilters[bes->next];
+
+    assert(!df->in_use);
+    bes->next = (bes->next + 1) % bes->ndefilters;
+
+    df->held = hold && bes->expected_size > 0;
+    df->skipped = 0;
+    df->resync = 0;
+    df->resync_next = 0;
+    df->npids = 0;
+    df->failed = 0;
+    if (df->held)
+    {
+        df->filter_in = -1;
+        df->filter_out = -1;
+        df->name = strdup(name);
+        if (!df->name)
+            fatal_error("Cannot allocate");
+        block_reserve(df->to_filterin, bes->expected_size);
+    }
+    else
+        run_defilter(df, name);
+
+    df->in_use = 1;
+    df->started = 0;
+    df->restart_intar = 0;
+    df->block = -1;
+    df->frame_offset = 0;
+    df->raw_crc = 0;
+    df->blocktype = blocktype;
+    df->close_filter_in = 0;
+
+    if (bes->expected_size == 0)
+        df->close_filter_in = 1;
+    else
+        bes->reading = df;
+
+    return df;
+}
+
 static enum readtar_newfile_result
 block_extraction_new_file_cb(const struct readtar_file *file, void *userdata)
 {
@@ -512,48 +1731,72 @@ block_extraction_new_file_cb(const struct readtar_file *file, void *userdata)
 
     int block;
     int should_read = 0;
+    int hold;
    
     bes->expected_size = file->size;
     bes->nread = 0;
+    bes->check_crc = 0;
+    /* Left from a truncated member */
+    free(bes->chunk_list);
+    bes->chunk_list = 0;
+
+    if (command_line.action == VERIFY)
+        verify_member(file->name);
 
     if (strncmp(file->name, "block", 5) == 0)
     {
         block = block_name_to_int(file->name);
-        bes->blocktype = BES_BLOCK;
 
         if (should_process_block(block))
         {
-            int res;
-            struct filter *mydefilter;
+            struct block_defilter *df;
 
             if (command_line.debug)
             {
                 fprintf(stderr, "Processing block %i\n", block);
             }
 
-            if (!bes->should_read)
+            if (repository_is_chunk_list(file->name))
             {
-                struct readtar_callbacks icb = { intar_new_file_cb,
-                    intar_new_data_cb,
-                    &bes->intar_state};
-                if (command_line.debug)
-                    fprintf(stderr, "Restart internal tar due to block change\n");
-                init_readtar(&bes->intar, &icb);
+                size_t len = strlen(file->name) - (sizeof ".chunks" - 1);
+
+                if (!command_line.repository)
+                    fatal_error_no_core("error: the block %i is in a "
+                            "repository; give it with --repository", block);
+                /* The defilter is that of the chunks */
+                free(bes->chunk_member);
+                bes->chunk_member = strdup(file->name);
+                bes->chunk_list = malloc(file->size + 1);
+                if (!bes->chunk_member || !bes->chunk_list)
+                    fatal_error("Cannot allocate");
+                bes->chunk_member[len] = '\0';
             }
+            bes->check_crc = checksum_table_find(&checksums, block, 0,
+                    &bes->expected_crc) || command_line.action == VERIFY;
+            bes->crc = 0;
+            /* Extracting, a damaged block is skipped, and not defiltered */
+            hold = bes->check_crc && (command_line.action == EXTRACT ||
+                    command_line.action == EXTRACT_TO_TAR ||
+                    command_line.action == EXTRACT_TO_STDOUT);
+            df = start_defilter(bes, bes->chunk_list ? bes->chunk_member :
+                    file->name, BES_BLOCK, hold);
+            df->block = block;
+            /* The internal tar restarts once the blocks before are done */
+            df->restart_intar = !bes->continues_block || bes->resync;
+            df->resync = bes->resync;
+            bes->resync = 0;
             should_read = 1;
 
-            if (defilter)
-                mydefilter = defilter;
-            else
-                mydefilter = defilters_from_extensions(file->name);
-
-            run_filters(mydefilter, &bes->filter_in, &bes->filter_out);
-            res = fcntl(bes->filter_in, F_SETFL, O_NONBLOCK);
-            if (res == -1)
-                error("Cannot fcntl");
-
-            if (mydefilter != defilter)
-                free_filters(mydefilter);
+            /* Then it can also start at the frame of the wanted entries */
+            bes->member_skip = 0;
+            if (df->restart_intar && !find_range_resume(block))
+            {
+                bes->member_skip = frame_table_find(&frames, block,
+                        intar_start(df), &df->frame_offset);
+                if (command_line.debug && bes->member_skip > 0)
+                    fprintf(stderr, "Defiltering block %i from its frame at %llu\n",
+                            block, df->frame_offset);
+            }
         }
         else
         {
@@ -562,28 +1805,38 @@ block_extraction_new_file_cb(const struct readtar_file *file, void *userdata)
         }
     }
     /* Check the prefix */
-    else if (strncmp(file->name, "index.tar", sizeof("index.tar")-1) == 0)
+    else if (strncmp(file->name, "index.tar", sizeof("index.tar")-1) == 0 ||
+            strncmp(file->name, "indexshard", sizeof("indexshard")-1) == 0)
     {
+        /* The shards come in order, and together make the index tar */
         if (bes->outindex >= 0)
         {
-            int res;
-            struct filter *mydefilter;
-
             should_read = 1;
-            bes->blocktype = BES_INDEX;
-
-            if (defilter)
-                mydefilter = defilter;
-            else
-                mydefilter = defilters_from_extensions(file->name);
-
-            run_filters(mydefilter, &bes->filter_in, &bes->filter_out);
-            res = fcntl(bes->filter_in, F_SETFL, O_NONBLOCK);
-            if (res == -1)
-                error("Cannot fcntl");
-
-            if (mydefilter != defilter)
-                free_filters(mydefilter);
+            start_defilter(bes, file->name, BES_INDEX, 0);
+        }
+    }
+    else if (strncmp(file->name, "signatures.tar", sizeof("signatures.tar")-1) == 0)
+    {
+        /* Only of interest when mangling; extraction does not need them */
+        if (bes->outsignatures >= 0)
+        {
+            should_read = 1;
+            start_defilter(bes, file->name, BES_SIGNATURES, 0);
+        }
+    }
+    else if (strcmp(file->name, "checksums") == 0 &&
+            command_line.action == VERIFY && checksums.nblocks == 0)
+    {
+        /* Not loaded through the directory; it is plain text */
+        bes->member_text = malloc(file->size + 1);
+        if (!bes->member_text)
+            fatal_error("Cannot allocate");
+        should_read = 1;
+        if (file->size == 0)
+        {
+            free(bes->member_text);
+            bes->member_text = 0;
+            should_read = 0;
         }
     }
     else if (strncmp(file->name, "deleted.tar", sizeof("deleted.tar")-1) == 0)
@@ -592,48 +1845,316 @@ block_extraction_new_file_cb(const struct readtar_file *file, void *userdata)
         if ((command_line.should_delete && command_line.action == EXTRACT) ||
                 bes->outdeleted >= 0)
         {
-            int res;
-            struct filter *mydefilter;
-
             should_read = 1;
-            bes->blocktype = BES_DELETER;
-
-            if (defilter)
-                mydefilter = defilter;
-            else
-                mydefilter = defilters_from_extensions(file->name);
-
-            run_filters(mydefilter, &bes->filter_in, &bes->filter_out);
-            res = fcntl(bes->filter_in, F_SETFL, O_NONBLOCK);
-            if (res == -1)
-                error("Cannot fcntl");
-
-            if (mydefilter != defilter)
-                free_filters(mydefilter);
-
-            /* Keep the callbacks, restart the intar */
-            static const struct readtar_callbacks dcb = { deletedtar_new_file_cb,
-                deletedtar_new_data_cb, 0};
-            init_readtar(&bes->intar, &dcb);
+            start_defilter(bes, file->name, BES_DELETER, 0);
         }
     }
 
     bes->should_read = should_read;
+    /* The parity members between the blocks do not break them */
+    if (should_read || strncmp(file->name, "block", 5) == 0)
+        bes->continues_block = should_read &&
+            strncmp(file->name, "block", 5) == 0;
     if (should_read)
         return READTAR_NORMAL;
     else
         return READTAR_SKIPDATA;
 }
 
+/* The same decision as block_extraction_new_file_cb, for members we may
+ * not even read the header of */
+static int
+member_is_wanted(const struct block_extraction_state *bes, const char *name)
+{
+    if (strncmp(name, "block", 5) == 0)
+        return should_process_block(block_name_to_int(name));
+    else if (strncmp(name, "index.tar", sizeof("index.tar")-1) == 0 ||
+            strncmp(name, "indexshard", sizeof("indexshard")-1) == 0)
+        return bes->outindex >= 0;
+    else if (strncmp(name, "signatures.tar", sizeof("signatures.tar")-1) == 0)
+        return bes->outsignatures >= 0;
+    else if (strncmp(name, "deleted.tar", sizeof("deleted.tar")-1) == 0)
+        return (command_line.should_delete && command_line.action == EXTRACT) ||
+            bes->outdeleted >= 0;
+    return 0;
+}
+
+/* Called at a member boundary of the btar. Moves fd to the next member
+ * we want, according to the directory. */
+static void
+jump_to_next_wanted_member(struct bufread *in, struct block_extraction_state *bes,
+        const struct directory *dir, size_t *next)
+{
+    unsigned long long pos;
+    const struct directory_entry *target = 0;
+    size_t i;
+    int jumped = 0;
+    int jumped_block = 0;
+
+    pos = bufread_tell(in);
+
+    for(; *next < dir->nentries; ++*next)
+    {
+        const struct directory_entry *e = &dir->entries[*next];
+
+        if (e->offset < pos)
+            continue;
+
+        if (member_is_wanted(bes, e->name))
+        {
+            target = e;
+            break;
+        }
+        jumped = 1;
+        if (strncmp(e->name, "block", 5) == 0)
+            jumped_block = 1;
+    }
+
+    if (!jumped)
+        return;
+
+    if (target)
+    {
+        bufread_seek(in, target->offset);
+        bufread_will_need(in, target->offset, 512 + target->size);
+
+        /* And the one after it, to be read ahead while we decode */
+        for(i = *next + 1; i < dir->nentries; ++i)
+        {
+            const struct directory_entry *e = &dir->entries[i];
+
+            if (member_is_wanted(bes, e->name))
+            {
+                bufread_will_need(in, e->offset, 512 + e->size);
+                break;
+            }
+        }
+    }
+    else
+    {
+        struct stat st;
+
+        if (fstat(in->fd, &st) == -1)
+            fatal_errno("Cannot stat the btar");
+        bufread_seek(in, st.st_size);
+    }
+
+    if (command_line.debug > 1)
+        fprintf(stderr, "extract: jumped from %llu to %llu\n",
+                pos, bufread_tell(in));
+
+    /* As if we had seen the skipped members */
+    bes->should_read = 0;
+    if (jumped_block)
+        bes->continues_block = 0;
+}
+
 static void
 process_internal_tar_data(struct block_extraction_state *bes,
         char *data, size_t len)
 {
+    /* No need to parse what comes before the wanted entries */
+    if (bes->intar_skip > 0)
+    {
+        size_t skip = len;
+
+        if (skip > bes->intar_skip)
+            skip = bes->intar_skip;
+        bes->intar_skip -= skip;
+        data += skip;
+        len -= skip;
+        if (len == 0)
+            return;
+    }
+
     process_this_tar_data(&bes->intar, data, len);
 }
 
+/* What a defilter gives, once it is the first */
+static void
+process_defiltered(struct block_extraction_state *bes,
+        struct block_defilter *df, char *data, size_t len)
+{
+    /* This may block, but it's final btar output. */
+    if (df->blocktype == BES_BLOCK)
+    {
+        index_rewrite_block_data(&bes->index_rewrite, df->block, len);
+        if (command_line.action == VERIFY)
+        {
+            df->raw_crc = crc32c(df->raw_crc, data, len);
+            /* The data skipped at the start counts in the offsets */
+            if (bes->intar_state.block != df->block)
+            {
+                verify.prev_block_start = verify.block_start;
+                verify.prev_block_skip = verify.block_skip;
+                verify.block_start = bes->intar.total_data_read;
+                verify.block_skip = bes->intar_skip;
+            }
+        }
+        bes->intar_state.block = df->block;
+
+        if (command_line.action != EXTRACT_TO_TAR ||
+                command_line.paths || command_line.add_create_index)
+            process_internal_tar_data(bes, data, len);
+        else
+        {
+            int res;
+            /* Directly to stdout in case of EXTRACT_TO_TAR */
+            assert(command_line.action == EXTRACT_TO_TAR);
+
+            res = write_all(1, data, len);
+            if (res == -1)
+                fatal_errno("Can't write to stdout");
+        }
+    }
+    else if (df->blocktype == BES_INDEX && bes->outindex >= 0)
+    {
+        assert(command_line.action == EXTRACT_TO_TAR);
+
+        process_this_tar_data(&bes->indexin, data, len);
+    }
+    else if (df->blocktype == BES_DELETER && bes->outdeleted >= 0)
+    {
+        int res;
+        /* Directly to stdout in case of EXTRACT_TO_TAR */
+        assert(command_line.action == EXTRACT_TO_TAR);
+
+        res = write_all(bes->outdeleted, data, len);
+        if (res == -1)
+            fatal_errno("Can't write to outdeleted fd=%i", bes->outdeleted);
+    }
+    else if (df->blocktype == BES_SIGNATURES && bes->outsignatures >= 0)
+    {
+        int res;
+        assert(command_line.action == EXTRACT_TO_TAR);
+
+        res = write_all(bes->outsignatures, data, len);
+        if (res == -1)
+            fatal_errno("Can't write to outsignatures fd=%i", bes->outsignatures);
+    }
+    else
+    {
+        /* To process index and deleter. For simple extractions,
+         * outindex and outdeleted will be -1, and we have to
+         * process that data. */
+        process_internal_tar_data(bes, data, len);
+    }
+}
+
+/* After a block not fully defiltered, the next one starts the internal tar
+ * at its first entry */
+static void
+resync_next_block(struct block_extraction_state *bes)
+{
+    struct block_defilter *df = &bes->defilters[bes->first];
+
+    if (!df->in_use)
+        bes->resync = 1;
+    else if (df->blocktype == BES_BLOCK)
+    {
+        df->restart_intar = 1;
+        df->resync = 1;
+    }
+}
+
+static void
+ignore_signal(int s)
+{
+    (void) s;
+}
+
+/* Called when the first defilter may have changed. Prepares the internal
+ * tar for it, and processes what it gave while waiting. */
+static void
+start_first_defilter(struct block_extraction_state *bes)
+{
+    struct block_defilter *df = &bes->defilters[bes->first];
+    const struct range_resume *resume;
+    struct block *b;
+
+    if (!df->in_use || df->started)
+        return;
+    df->started = 1;
+
+    if (df->blocktype == BES_BLOCK && df->restart_intar)
+    {
+        struct readtar_callbacks icb = { intar_new_file_cb,
+            intar_new_data_cb,
+            &bes->intar_state};
+        if (command_line.debug)
+            fprintf(stderr, "Restart internal tar due to block change\n");
+        if (df->resync)
+            cut_writer_file(&bes->intar_state);
+        else
+            end_writer_file(&bes->intar_state);
+        init_readtar(&bes->intar, &icb);
+        verify.bad_headers = 0;
+
+        /* The index told us where the entries start */
+        bes->intar_skip = intar_start(df) - df->frame_offset;
+        if (intar_start(df) == ULLONG_MAX)
+            df->resync_next = 1;
+        if (command_line.debug && bes->intar_skip > 0)
+            fprintf(stderr, "Skipping the first %llu bytes of the block\n",
+                    bes->intar_skip);
+
+        /* Or that the block starts in the data of the --range file */
+        resume = find_range_resume(df->block);
+        if (resume)
+        {
+            if (command_line.debug)
+                fprintf(stderr, "Resuming %s at %llu\n", resume->name,
+                        resume->pos);
+            bes->intar_skip = 0;
+            readtar_start_in_data(&bes->intar, resume->size - resume->pos);
+            start_range_file(&bes->intar_state, resume->name, resume->size,
+                    resume->pos, 0666);
+        }
+    }
+    else if (df->blocktype == BES_DELETER)
+    {
+        /* Keep the callbacks, restart the intar */
+        static const struct readtar_callbacks dcb = { deletedtar_new_file_cb,
+            deletedtar_new_data_cb, 0};
+        init_readtar(&bes->intar, &dcb);
+
+        /* Deleting goes after what the writers have to create */
+        end_writer_file(&bes->intar_state);
+        writers_wait();
+    }
+
+    for(b = df->output; b; b = b->nextblock)
+        process_defiltered(bes, df, b->data, b->writer_pos);
+    block_free(df->output);
+    df->output = 0;
+}
+
+/* For -O, once all is out. The filters may fail as we stop reading them. */
 static void
-do_block_extraction(int fd, int outindex, int outdeleted)
+stop_defilters(struct block_extraction_state *bes)
+{
+    int i;
+
+    let_children_fail();
+
+    for(i=0; i < bes->ndefilters; ++i)
+    {
+        struct block_defilter *df = &bes->defilters[i];
+
+        if (df->filter_in >= 0)
+            close(df->filter_in);
+        if (df->filter_out >= 0)
+            close(df->filter_out);
+        df->filter_in = -1;
+        df->filter_out = -1;
+        df->in_use = 0;
+    }
+    bes->reading = 0;
+}
+
+static void
+do_block_extraction(int fd, int outindex, int outdeleted, int outsignatures,
+        const struct directory *dir)
 {
     struct readtar rt;
     struct block_extraction_state bes;
@@ -645,8 +2166,11 @@ do_block_extraction(int fd, int outindex, int outdeleted)
         intar_new_data_cb,
         &bes.intar_state};
 
-    struct block_reader *br_to_filterin;
     int closed_in = 0;
+    size_t next_directory_entry = 0;
+    int i;
+    struct bufread in;
+    struct timeval notimeout = { 0, 0 };
 
     char *bufferout = 0;
 
@@ -654,23 +2178,88 @@ do_block_extraction(int fd, int outindex, int outdeleted)
     if (!bufferout)
         fatal_error("Cannot allocate");
 
-    bes.to_filterin = block_new(buffersize);
-    br_to_filterin = block_reader_new(bes.to_filterin);
+    /* Blocks are independent; -j of them can be defiltered at once */
+    bes.ndefilters = command_line.parallelism;
+    if (bes.ndefilters < 1)
+        bes.ndefilters = 1;
+    bes.defilters = malloc(sizeof(*bes.defilters) * bes.ndefilters);
+    if (!bes.defilters)
+        fatal_error("Cannot allocate");
+    for(i=0; i < bes.ndefilters; ++i)
+    {
+        struct block_defilter *df = &bes.defilters[i];
+
+        df->in_use = 0;
+        df->filter_in = -1;
+        df->filter_out = -1;
+        df->to_filterin = block_new(buffersize);
+        df->br_to_filterin = block_reader_new(df->to_filterin);
+        df->close_filter_in = 0;
+        df->output = 0;
+        df->held = 0;
+        df->name = 0;
+    }
+    bes.first = 0;
+    bes.next = 0;
+    bes.reading = 0;
+
+    /* The defilters failing are told by --verify, which goes on. Their
+     * early end must not kill us writing to them. */
+    if (command_line.action == VERIFY)
+    {
+        struct sigaction act;
+
+        act.sa_handler = ignore_signal;
+        sigemptyset(&act.sa_mask);
+        act.sa_flags = SA_RESTART;
+        sigaction(SIGPIPE, &act, 0);
+
+        hooked_defilters = bes.defilters;
+        nhooked_defilters = bes.ndefilters;
+        set_child_exit_hook(defilter_exit_hook);
+    }
 
     init_readtar(&rt, &cb);
-    rt.fd = fd; /* For skip to work */
+    /* The skips go through 'in', not lseek()ing in readtar */
+    bufread_init(&in, fd, buffersize);
 
     bes.nread = 0;
     bes.expected_size = 0;
-    bes.filter_in = -1;
-    bes.filter_out = -1;
-    bes.close_filter_in = 0;
+    bes.should_read = 0;
+    bes.continues_block = 0;
+    bes.resync = 0;
     bes.intar_state.tar = 0;
     bes.intar_state.fd = -1;
     bes.intar_state.name = 0;
     bes.intar_state.rsync_patch = 0;
+    bes.intar_state.to_writer = 0;
+    bes.intar_state.range = 0;
+    bes.intar_skip = 0;
+    bes.member_skip = 0;
+    bes.check_crc = 0;
+    bes.member_text = 0;
+    bes.chunk_list = 0;
+    bes.chunk_member = 0;
+    verify.intar = &bes.intar;
+    bes.intar_state.block = -1;
+    bes.index_rewrite.tar = 0;
+    bes.index_rewrite.old_starts = 0;
+    bes.index_rewrite.old_nblocks = 0;
+    bes.index_rewrite.old_total = 0;
+    bes.index_rewrite.data = 0;
+    if (outindex >= 0)
+    {
+        struct readtar_callbacks ricb = { index_rewrite_new_file_cb,
+            index_rewrite_new_data_cb,
+            &bes.index_rewrite};
+
+        init_readtar(&bes.indexin, &ricb);
+        bes.index_rewrite.tar = mytar_new();
+        mytar_open_fd(bes.index_rewrite.tar, outindex);
+    }
     bes.outindex = outindex;
     bes.outdeleted = outdeleted;
+    bes.outsignatures = outsignatures;
     init_readtar(&bes.intar, &icb);
 
     /* We don't want to create the tar, if we run with
@@ -682,6 +2271,10 @@ do_block_extraction(int fd, int outindex, int outdeleted)
         bes.intar_state.tar = mytar_new();
         mytar_open_fd(bes.intar_state.tar, 1); /* stdout */
     }
+
+    /* Before any filter, so they do not get the writer pipes */
+    if (command_line.action == EXTRACT)
+        writers_start(command_line.writers);
     
     /* Llegint del fitxer btar, hem d'enviar als filtres.
      * El que llegim dels filtres, ho hem de processar i extreure.
@@ -696,6 +2289,9 @@ do_block_extraction(int fd, int outindex, int outdeleted)
      *
      * Hem de vigilar de no llegir més enllà del fitxer, per a gestionar
      * els filtres que van alhora.
+     *
+     * Amb -j, els filtres que no són el primer guarden la sortida en
+     * memòria, i la processem quan els toca.
      * */
 
     while(1)
@@ -706,15 +2302,22 @@ do_block_extraction(int fd, int outindex, int outdeleted)
         int res;
         size_t can_send_to_filterin;
         size_t bytes_to_next_readtar_change;
+        int have_input;
         
         FD_ZERO(&readfds);
         FD_ZERO(&writefds);
 
-        /* Main tar fd. Whatever read, will fill the to_filterin block */
-        can_send_to_filterin = bes.to_filterin->allocated
-            - bes.to_filterin->writer_pos;
+        /* Main tar fd. Whatever read, will fill the to_filterin block of
+         * the member being read. A new member needs a free defilter. */
+        if (bes.reading)
+            can_send_to_filterin = bes.reading->to_filterin->allocated
+                - bes.reading->to_filterin->writer_pos;
+        else if (!bes.defilters[bes.next].in_use)
+            can_send_to_filterin = buffersize;
+        else
+            can_send_to_filterin = 0;
 
-        if (closed_in || bes.close_filter_in)
+        if (closed_in)
             can_send_to_filterin = 0;
 
         if (can_send_to_filterin > buffersize)
@@ -724,165 +2327,278 @@ do_block_extraction(int fd, int outindex, int outdeleted)
         if (can_send_to_filterin > bytes_to_next_readtar_change)
             can_send_to_filterin = bytes_to_next_readtar_change;
 
-        if (fd >= 0 && can_send_to_filterin > 0)
+        /* Between members, we can go straight to the next one we want */
+        if (dir && can_send_to_filterin > 0 &&
+                rt.state == IN_HEADER && rt.data_read == 0)
+            jump_to_next_wanted_member(&in, &bes, dir, &next_directory_entry);
+
+        if (can_send_to_filterin > 0 && bufread_needs_fill(&in))
             addfd(&readfds, fd, &nfds);
 
-        /* From filter. To be processed by inner tar. 
-         * That will send data to stdout. */
-        if (bes.filter_out >= 0)
-            addfd(&readfds, bes.filter_out, &nfds);
+        for(i=0; i < bes.ndefilters; ++i)
+        {
+            struct block_defilter *df = &bes.defilters[i];
+
+            /* From filter. To be processed by inner tar, or kept
+             * until its turn. */
+            if (df->filter_out >= 0)
+                addfd(&readfds, df->filter_out, &nfds);
+
+            /* From the buffer to the filter */
+            if (df->filter_in >= 0 && block_reader_can_read(df->br_to_filterin))
+                addfd(&writefds, df->filter_in, &nfds);
+        }
+
+        /* With input at hand, we only look at the filters */
+        have_input = can_send_to_filterin > 0 && bufread_available(&in) > 0;
 
-        /* From the buffer to the filter */
-        if (block_reader_can_read(br_to_filterin))
-            addfd(&writefds, bes.filter_in, &nfds);
+        if (nfds == 0 && !have_input)
+            break;
 
-        res = select(nfds, &readfds, &writefds, 0, 0);
+        res = select(nfds, &readfds, &writefds, 0, have_input ? &notimeout : 0);
         if (res == -1 && errno == EINTR)
             continue;
 
-        if (fd >= 0 && FD_ISSET(fd, &readfds))
+        if (res > 0 && FD_ISSET(fd, &readfds))
         {
             ssize_t nread;
-            nread = read(fd, bufferout, can_send_to_filterin);
+            nread = bufread_fill(&in);
             if (nread == -1 && errno != EINTR)
-                fatal_errno("Cannot read from filters");
-            if (nread > 0)
+                fatal_errno("Cannot read the btar");
+            if (command_line.debug > 2 && nread > 0)
+                fprintf(stderr, "extract: %zi read from the btar\n", nread);
+        }
+
+        if (can_send_to_filterin > 0 && bufread_available(&in) > 0)
+        {
+            size_t len = bufread_available(&in);
+            unsigned long long skip;
+
+            if (len > can_send_to_filterin)
+                len = can_send_to_filterin;
+            if (command_line.debug > 2)
+                fprintf(stderr, "extract: %zu data to process_this_tar_data\n",
+                        len);
+            /* This may block, but it's final btar output. */
+            process_this_tar_data(&rt, bufread_data(&in), len);
+            bufread_consume(&in, len);
+
+            /* Members not wanted are skipped in the buffer, or seeking */
+            skip = readtar_take_skip(&rt);
+            if (skip > 0)
+                bufread_skip(&in, skip);
+            verify.bytes += len + skip;
+
+            start_first_defilter(&bes);
+        }
+        else if (in.eof && bufread_available(&in) == 0 && !closed_in)
+        {
+            closed_in = 1;
+
+            /* A truncated member; give the filter what we have */
+            if (bes.reading && command_line.action == VERIFY &&
+                    bes.reading->blocktype == BES_BLOCK)
+                verify_fail(bes.reading->block,
+                        verify_block_path(bes.reading->block),
+                        "the block member is truncated");
+            if (bes.reading && bes.reading->held)
             {
-                if (command_line.debug > 2)
-                    fprintf(stderr, "extract: %zi data to process_this_tar_data\n",
-                            nread);
-                /* This may block, but it's final btar output. */
-                process_this_tar_data(&rt, bufferout, nread);
+                /* Its checksum cannot match */
+                skip_damaged_block(&bes, bes.reading);
+                bes.reading->held = 0;
+                free(bes.reading->name);
+                bes.reading->name = 0;
             }
-            else if (nread == 0)
+            if (bes.reading)
             {
-                closed_in = 1;
-
-                if (bes.filter_in == -1)
-                    break;
+                bes.reading->close_filter_in = 1;
+                bes.reading = 0;
             }
         }
 
-        if (bes.filter_out >= 0 && FD_ISSET(bes.filter_out, &readfds))
+        for(i=0; i < bes.ndefilters; ++i)
         {
-            ssize_t nread;
-            nread = read(bes.filter_out, bufferout, buffersize);
-            if (nread == -1 && errno != EINTR)
-                fatal_errno("Cannot read from filters");
-            if (nread > 0)
+            struct block_defilter *df = &bes.defilters[i];
+
+            if (df->filter_out >= 0 && FD_ISSET(df->filter_out, &readfds))
             {
-                if (command_line.debug > 2)
-                    fprintf(stderr, "extract: %zi data to process_internal_tar_data\n",
-                            nread);
+                ssize_t nread;
 
-                /* This may block, but it's final btar output. */
-                if (bes.blocktype == BES_BLOCK)
+                if (i == bes.first)
                 {
-                    if (command_line.action != EXTRACT_TO_TAR ||
-                            command_line.paths || command_line.add_create_index)
-                        process_internal_tar_data(&bes, bufferout, nread);
-                    else
+                    nread = read(df->filter_out, bufferout, buffersize);
+                    if (nread > 0)
                     {
-                        int res;
-                        /* Directly to stdout in case of EXTRACT_TO_TAR */
-                        assert(command_line.action == EXTRACT_TO_TAR);
-
-                        res = write_all(1, bufferout, nread);
-                        if (res == -1)
-                            fatal_errno("Can't write to stdout");
+                        if (command_line.debug > 2)
+                            fprintf(stderr, "extract: %zi data to process_internal_tar_data\n",
+                                    nread);
+                        process_defiltered(&bes, df, bufferout, nread);
                     }
                 }
-                else if (bes.blocktype == BES_INDEX && outindex >= 0)
+                else
                 {
-                    int res;
-                    /* Directly to stdout in case of EXTRACT_TO_TAR */
-                    assert(command_line.action == EXTRACT_TO_TAR);
-
-                    res = write_all(outindex, bufferout, nread);
-                    if (res == -1)
-                        fatal_errno("Can't write to outindex fd=%i", outindex);
+                    if (!df->output)
+                        df->output = block_new(buffersize);
+                    nread = block_fill_from_fd_multi(df->output, df->filter_out,
+                            buffersize);
                 }
-                else if (bes.blocktype == BES_DELETER && outdeleted >= 0)
+                if (nread == -1 && errno != EINTR)
+                    fatal_errno("Cannot read from filters");
+                if (nread == 0)
                 {
-                    int res;
-                    /* Directly to stdout in case of EXTRACT_TO_TAR */
-                    assert(command_line.action == EXTRACT_TO_TAR);
-
-                    res = write_all(outdeleted, bufferout, nread);
-                    if (res == -1)
-                        fatal_errno("Can't write to outdeleted fd=%i", outdeleted);
+                    if (command_line.debug > 1)
+                        fprintf(stderr, "extract: end on filter_out (%i)\n",
+                                df->filter_out);
+                    close(df->filter_out);
+                    df->filter_out = -1;
                 }
-                else
+            }
+
+            if (df->filter_in >= 0 && FD_ISSET(df->filter_in, &writefds))
+            {
+                ssize_t nwritten;
+                nwritten = block_reader_to_fd(df->br_to_filterin, df->filter_in);
+                if (nwritten == -1 && errno == EPIPE &&
+                        command_line.action == VERIFY)
                 {
-                    /* To process index and deleter. For simple extractions,
-                     * outindex and outdeleted will be -1, and we have to
-                     * process that data. */
-                    process_internal_tar_data(&bes, bufferout, nread);
+                    /* The defilter died; the rest of the member is dropped */
+                    df->failed = 1;
+                    df->skipped = 1;
+                    df->to_filterin->writer_pos = 0;
+                    df->br_to_filterin->pos = 0;
+                    close(df->filter_in);
+                    df->filter_in = -1;
                 }
+                else if (nwritten == -1 && errno != EINTR)
+                    fatal_errno("Cannot write to filters");
+
+                if (command_line.debug > 2)
+                    fprintf(stderr, "extract: %zi data sent to filterin\n", nwritten);
             }
-            if (nread == 0)
+
+            if (df->filter_in >= 0 && df->close_filter_in
+                    && !block_reader_can_read(df->br_to_filterin))
             {
                 if (command_line.debug > 1)
-                    fprintf(stderr, "extract: end on filter_out (%i)\n", bes.filter_out);
-                close(bes.filter_out);
-                bes.filter_out = -1;
-                bes.close_filter_in = 0; /* This should make read more from fd */
-
-                if (closed_in)
-                    break;
+                    fprintf(stderr, "extract: close(%i) filter_in\n", df->filter_in);
+                close(df->filter_in);
+                df->filter_in = -1;
             }
         }
 
-        if (bes.filter_in >= 0 && FD_ISSET(bes.filter_in, &writefds))
+        /* The first defilter done lets the next one give its output */
+        while (bes.defilters[bes.first].in_use
+                && !bes.defilters[bes.first].held
+                && &bes.defilters[bes.first] != bes.reading
+                && bes.defilters[bes.first].filter_in == -1
+                && bes.defilters[bes.first].filter_out == -1)
         {
-            ssize_t nwritten;
-            nwritten = block_reader_to_fd(br_to_filterin, bes.filter_in);
-            if (nwritten == -1 && errno != EINTR)
-                fatal_errno("Cannot write to filters");
-            
-            if (command_line.debug > 2)
-                fprintf(stderr, "extract: %zi data sent to filterin\n", nwritten);
+            struct block_defilter *df = &bes.defilters[bes.first];
+            int failed = 0;
 
-            if (!block_reader_can_read(br_to_filterin) && bes.close_filter_in)
+            if (command_line.action == VERIFY)
             {
-                if (command_line.debug > 1)
-                    fprintf(stderr, "extract: close(%i) filter_in\n", bes.filter_in);
-                close(bes.filter_in);
-                bes.filter_in = -1;
+                wait_defilter(df);
+                failed = df->failed;
             }
+            if (command_line.action == VERIFY && df->blocktype == BES_BLOCK)
+                verify_block_done(df->block, df->raw_crc, failed);
+            else if (failed)
+                fatal_error_no_core("The defilter of a non-block member failed");
+            df->in_use = 0;
+            df->close_filter_in = 0;
+            bes.first = (bes.first + 1) % bes.ndefilters;
+
+            /* What the defilter gave may end in the middle of an entry */
+            if ((failed || df->resync_next) && df->blocktype == BES_BLOCK)
+                resync_next_block(&bes);
+            start_first_defilter(&bes);
+        }
+
+        if (closed_in && !bes.defilters[bes.first].in_use)
+            break;
 
+        /* With -O, no need to decode the rest of the block */
+        if (stdout_files_left == 0)
+        {
+            if (command_line.debug)
+                fprintf(stderr, "extract: all the wanted files are out\n");
+            stop_defilters(&bes);
+            break;
         }
     }
 
     if (bes.intar_state.tar)
         mytar_write_archive_end(bes.intar_state.tar);
-
-    block_reader_free(br_to_filterin);
-    block_free(bes.to_filterin);
+    free(bes.member_text);
+
+    verify.btar_bad_headers = rt.bad_headers;
+    verify.btar_at_end = rt.at_end;
+    verify.intar_at_end = bes.intar.at_end && bes.intar.state == IN_HEADER &&
+        bes.intar.data_read == 0;
+    free(bes.chunk_list);
+    free(bes.chunk_member);
+
+    end_writer_file(&bes.intar_state);
+    writers_wait();
+    apply_directory_times();
+
+    /* A btar without index gives an empty one */
+    if (bes.index_rewrite.tar && bes.index_rewrite.tar->total_written > 0)
+        mytar_write_archive_end(bes.index_rewrite.tar);
+    free(bes.index_rewrite.data);
+    free(bes.index_rewrite.old_starts);
+
+    set_child_exit_hook(0);
+    nhooked_defilters = 0;
+    hooked_defilters = 0;
+    for(i=0; i < bes.ndefilters; ++i)
+    {
+        block_reader_free(bes.defilters[i].br_to_filterin);
+        block_free(bes.defilters[i].to_filterin);
+        free(bes.defilters[i].name);
+        block_free(bes.defilters[i].output);
+    }
+    free(bes.defilters);
+    bufread_free(&in);
     free(bufferout);
 }
 
+/* The index has the directories without the trailing slash */
 static int
-fnmatch_with_rdiff_extension(const char *pattern, const char *name, int flags)
+directory_matches_paths(const char *name)
 {
-#ifndef WITH_LIBRSYNC
-    pattern = pattern;
-    name = name;
-    flags = flags;
-    return -1;
-#else
-    char p[PATH_MAX];
-    strcpyn(p, pattern, sizeof p);
-    strncat(p, rdiff_extension, PATH_MAX - strlen(pattern) - 1);
+    char dirname[PATH_MAX];
 
-    return fnmatch(p, name, flags);
-#endif
+    if (matches_paths(name))
+        return 1;
+
+    snprintf(dirname, sizeof dirname, "%s/", name);
+    return matches_paths(dirname);
 }
 
-void extract(int fd, int outindex, int outdeleted)
+void extract(int fd, int outindex, int outdeleted, int outsignatures)
 {
     int res;
     int can_lseek = 1;
+    struct directory dir;
+    int have_directory = 0;
+    int nblocks;
+    int nwanted = 0;
+    struct timeval start_time, end_time;
+
+    frame_table_init(&frames, 0);
+    checksum_table_init(&checksums);
+    memset(&verify, 0, sizeof verify);
+    checksum_table_init(&verify.computed);
+    verify.first_block = -1;
+    gettimeofday(&start_time, 0);
+    path_matcher_init(&paths_matcher, command_line.paths, 0);
+#ifdef WITH_LIBRSYNC
+    path_matcher_init(&index_matcher, command_line.paths, rdiff_extension);
+#else
+    path_matcher_init(&index_matcher, command_line.paths, 0);
+#endif
 
     /* Load the index if possible */
     res = lseek(fd, 0, SEEK_CUR);
@@ -890,65 +2606,191 @@ void extract(int fd, int outindex, int outdeleted)
         can_lseek = 0;
 
     /* We are interested in the index in the case of
-     * having set traverse paths (what to extract).
+     * having set traverse paths (what to extract), or a restore
+     * plan for a series of archives.
      *
-     * We also accept -N, on not processing the indices. */
-    if (command_line.paths && can_lseek && command_line.add_create_index)
+     * We also accept -N, on not processing the indices.
+     *
+     * An index file lets us skip blocks even if we cannot seek. */
+    if ((command_line.paths || restore_plan_active()) &&
+            (can_lseek || command_line.index_file) &&
+            command_line.add_create_index)
     {
-        load_index_from_tar(fd);
+        if (command_line.index_file)
+        {
+            load_index_file(command_line.index_file);
+            nblocks = -1;
+        }
+        else
+            nblocks = load_index_from_tar(fd, command_line.paths);
 
         /* Prepare what files we have to extract. Traverse paths in command line. */
         size_t nelems;
         size_t i;
         const struct IndexElem *ptr = index_get_elements(&nelems);
+        int wanted_directory = 0;
+        const struct IndexElem *previous = 0;
 
         for(i = 0; i < nelems; ++i)
         {
             const struct IndexElem *e = &ptr[i];
-            int j = 0;
+            int matched;
 
             /* Directories have block -1; trick as we can't store any block in their
              * tar header */
             if (e->block == -1)
+            {
+                if (!wanted_directory && directory_matches_paths(e->name))
+                    wanted_directory = 1;
                 continue;
+            }
+
+            if (command_line.debug > 1)
+                fprintf(stderr, "Check future extraction: \"%s\"?\n",
+                        e->name);
+            if (command_line.action == EXTRACT_TO_STDOUT || command_line.range)
+                matched = (command_line.paths == 0 ||
+                        path_matcher_match(&paths_matcher, e->name));
+            else
+                matched = (command_line.paths == 0 ||
+                        path_matcher_match(&index_matcher, e->name));
 
-            while(command_line.paths[j] != 0)
+            if (matched && !restore_plan_wants(e->name))
             {
                 if (command_line.debug > 1)
-                    fprintf(stderr,
-                            "Check future extraction: \"%s\" matches \"%s\"?\n",
-                            e->name, command_line.paths[j]);
+                    fprintf(stderr, "  \"%s\" comes from another archive\n",
+                            e->name);
+                matched = 0;
+            }
 
-                if(fnmatch(command_line.paths[j],
-                            e->name, 0) == 0 ||
-                        fnmatch_with_rdiff_extension(command_line.paths[j],
-                            e->name, 0) == 0)
+            if (matched)
+            {
+                if (command_line.debug)
                 {
-                    if (command_line.debug)
-                    {
-                        fprintf(stderr,
-                                "  Will extract \"%s\", from block %i to %i\n",
-                                e->name, e->block, e->block+e->nblocks-1);
-                    }
-                    set_blocks(e->block, e->nblocks);
+                    fprintf(stderr,
+                            "  Will extract \"%s\", from block %i to %i\n",
+                            e->name, e->block, e->block+e->nblocks-1);
                 }
+                if (command_line.range)
+                    nwanted += set_range_blocks(e);
                 else
-                    set_block_seen(e->block);
-                ++j;
+                {
+                    /* The last file has -1, until the end, and the blocks
+                     * after the last seen are processed anyway */
+                    set_blocks(e->block, e->nblocks > 0 ? e->nblocks : 1,
+                            e->offset);
+                    ++nwanted;
+                }
+            }
+            else
+                set_block_seen(e->block);
+
+            /* A wanted directory header comes just before this entry, with
+             * no offset of its own. We want it even if we do not want the
+             * entry. */
+            if (wanted_directory)
+            {
+                long long o = 0;
+
+                if (previous && previous->block == e->block && previous->offset >= 0)
+                    o = previous->offset;
+                set_blocks(e->block, 1, o);
             }
+            wanted_directory = 0;
+            previous = e;
         }
 
-        res = lseek(fd, 0, SEEK_SET);
-        if (res == -1)
-            fatal_errno("Cannot lseek stdin, while a while ago we could");
+        if (command_line.action == EXTRACT_TO_STDOUT)
+            stdout_files_left = nwanted;
+
+        /* With a sharded index, the blocks of the shards not loaded
+         * should not be extracted either */
+        if (nblocks > 0)
+            set_block_seen(nblocks - 1);
+
+        if (can_lseek)
+        {
+            res = lseek(fd, 0, SEEK_SET);
+            if (res == -1)
+                fatal_errno("Cannot lseek stdin, while a while ago we could");
+
+            have_directory = directory_load(&dir, fd);
+            if (have_directory)
+            {
+                frame_table_load(&frames, fd, &dir);
+                checksum_table_load(&checksums, fd, &dir);
+                res = lseek(fd, 0, SEEK_SET);
+                if (res == -1)
+                    fatal_errno("Cannot lseek the btar");
+            }
+        }
+    }
+    else if (can_lseek)
+    {
+        struct directory d;
+        off_t start = lseek(fd, 0, SEEK_CUR);
+
+        /* Only for the checksums */
+        if (directory_load(&d, fd))
+        {
+            checksum_table_load(&checksums, fd, &d);
+            directory_free(&d);
+            if (lseek(fd, start, SEEK_SET) == -1)
+                fatal_errno("Cannot lseek the btar");
+        }
+
+        if (command_line.action == VERIFY && command_line.add_create_index &&
+                !command_line.index_file)
+        {
+            load_index_from_tar(fd, 0);
+            if (lseek(fd, start, SEEK_SET) == -1)
+                fatal_errno("Cannot lseek the btar");
+
+            load_deleted_from_tar(fd, verify_add_deleted);
+            qsort(verify.deleted, verify.ndeleted, sizeof(*verify.deleted),
+                    compare_names);
+            if (lseek(fd, start, SEEK_SET) == -1)
+                fatal_errno("Cannot lseek the btar");
+        }
+    }
+
+    if (command_line.action == VERIFY && command_line.index_file)
+        load_index_file(command_line.index_file);
+    if (command_line.action == VERIFY)
+    {
+        size_t nelems;
+
+        index_get_elements(&nelems);
+        verify.have_index = nelems > 0;
+        index_sort();
+    }
+
+    do_block_extraction(fd, outindex, outdeleted, outsignatures,
+            have_directory ? &dir : 0);
+
+    if (command_line.action == VERIFY)
+    {
+        gettimeofday(&end_time, 0);
+        verify_end(end_time.tv_sec - start_time.tv_sec +
+                (end_time.tv_usec - start_time.tv_usec) / 1e6);
     }
 
-    do_block_extraction(fd, outindex, outdeleted);
+    if (have_directory)
+        directory_free(&dir);
 
     free(blocks);
     blocks = 0;
+    free(block_offsets);
+    block_offsets = 0;
     allocated_blocks = 0;
 
+    frame_table_free(&frames);
+    checksum_table_free(&checksums);
+    path_matcher_free(&paths_matcher);
+    path_matcher_free(&index_matcher);
+    stdout_files_left = -1;
+    free_range_resumes();
+
     /* This is specially important, or the next call to extract will combine
      * indices */
     free_index();
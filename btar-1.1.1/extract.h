@@ -1 +1,3 @@
-void extract(int fd, int outindex, int outdeleted);
+void extract(int fd, int outindex, int outdeleted, int outsignatures);
+int verify_failures();
+int damaged_blocks_skipped();
@@ -17,6 +17,7 @@
 */
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <sys/select.h>
 #include <limits.h>
 #include <assert.h>
@@ -45,6 +46,13 @@ file_memory_new(int fd)
     return im;
 }
 
+void
+file_memory_free(struct file_memory *im)
+{
+    block_free(im->bo);
+    free(im);
+}
+
 int
 file_memory_finished(struct file_memory *im)
 {
@@ -77,6 +85,31 @@ file_memory_check_readfds(struct file_memory *im, fd_set *fdset)
     }
 }
 
+/* Reads up to the end of the fd, when nothing else has to be served */
+void
+file_memory_read_all(struct file_memory *im)
+{
+    while (!file_memory_finished(im))
+    {
+        fd_set readfds;
+        int nfds = 0;
+        int res;
+
+        FD_ZERO(&readfds);
+        file_memory_prepare_readfds(im, &readfds, &nfds);
+
+        res = select(nfds, &readfds, 0, 0, 0);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            fatal_errno("Failed select reading to memory");
+        }
+
+        file_memory_check_readfds(im, &readfds);
+    }
+}
+
 void
 file_memory_to_tar(struct file_memory *im, const char *namepattern,
         const char *filter_extensions, struct mytar *tar)
@@ -129,3 +162,16 @@ file_memory_to_tar(struct file_memory *im, const char *namepattern,
     if (command_line.debug)
         fprintf(stderr, "File Memory %s written\n", namepattern);
 }
+
+void
+file_memory_to_fd(struct file_memory *im, int fd)
+{
+    struct block *b;
+
+    for(b = im->bo; b != 0; b = b->nextblock)
+    {
+        ssize_t res = write_all(fd, b->data, b->writer_pos);
+        if (res == -1)
+            fatal_errno("Cannot write the file memory");
+    }
+}
@@ -24,6 +24,27 @@
 #include "filters.h"
 #include "main.h"
 
+/* Where the pids of the filters started go, while recording */
+static int *recorded_pids;
+static int nrecorded_pids;
+static int max_recorded_pids;
+
+void
+record_filter_pids(int *pids, int max)
+{
+    recorded_pids = pids;
+    max_recorded_pids = max;
+    nrecorded_pids = 0;
+}
+
+/* Returns how many pids were recorded */
+int
+end_record_filter_pids()
+{
+    recorded_pids = 0;
+    return nrecorded_pids;
+}
+
 void
 add_filter(char * const *args, int fdin, int *fdout, int alsoclose)
 {
@@ -64,6 +85,8 @@ add_filter(char * const *args, int fdin, int *fdout, int alsoclose)
     }
     else
     {
+        if (recorded_pids && nrecorded_pids < max_recorded_pids)
+            recorded_pids[nrecorded_pids++] = pid;
         if (command_line.debug)
         {
             char * const *ptr = args;
@@ -248,6 +271,40 @@ append_filter_spaces(struct filter *f, const char *arg)
     return append_filter(f, args);
 }
 
+/* The filters whose outputs, one after the other, decode as the inputs one
+ * after the other; so the frames of a block need not be told apart */
+static const char *concatenating_filters[] = {
+    "cat", "gzip", "pigz", "bzip2", "pbzip2", "lbzip2", "xz", "pxz",
+    "lzip", "plzip", "zstd", "pzstd", "lz4",
+    0
+};
+
+int
+filters_concatenate(const struct filter *f)
+{
+    for(; f != 0; f = f->next)
+    {
+        const char *name = f->args[0];
+        const char *pos;
+        int i;
+
+        if ((pos = strrchr(name, '/')) != 0)
+            name = pos+1;
+        for(i=0; concatenating_filters[i] != 0; ++i)
+            if (strcmp(name, concatenating_filters[i]) == 0)
+                break;
+        if (concatenating_filters[i] == 0)
+            return 0;
+
+        /* As xz --format=raw, without the headers that mark the streams */
+        for(i=1; f->args[i] != 0; ++i)
+            if (strncmp(f->args[i], "--format", 8) == 0 ||
+                    strncmp(f->args[i], "-F", 2) == 0)
+                return 0;
+    }
+    return 1;
+}
+
 const char *
 get_filter_extensions(struct filter *f)
 {
@@ -12,6 +12,13 @@ run_filters(struct filter *filter, int *fdin, int *fdout);
 void
 run_filters_given_fdin(struct filter *filter, int fdin, int *fdout);
 
+/* The filters started after this keep their pids in 'pids', up to 'max' */
+void
+record_filter_pids(int *pids, int max);
+
+int
+end_record_filter_pids();
+
 struct filter *
 append_filter(struct filter *f, char **args);
 
@@ -27,4 +34,8 @@ free_filters(struct filter *f);
 const char *
 get_filter_extensions(struct filter *f);
 
+/* Whether the frames of --frame-size can be decoded as a whole */
+int
+filters_concatenate(const struct filter *f);
+
 extern struct filter *filter; /* For traverse.c */
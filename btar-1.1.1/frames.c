@@ -0,0 +1,268 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include "main.h"
+#include "mytar.h"
+#include "directory.h"
+#include "loadindex.h"
+#include "frames.h"
+
+/* With --frame-size, every block is filtered in frames, each through new
+ * filter processes, so the concatenated outputs can be defiltered starting at
+ * any frame. The 'frames' member tells where each frame starts, as text:
+ *    btar-frames <frame size>\n
+ *    <block> <start of frame 0> <start of frame 1> ...\n
+ * The frame size is that of the block tar data in each frame. */
+
+static const char frames_name[] = "frames";
+static const char frames_magic[] = "btar-frames";
+
+void
+frame_table_init(struct frame_table *t, unsigned long long framesize)
+{
+    t->framesize = framesize;
+    t->blocks = 0;
+    t->nblocks = 0;
+}
+
+void
+frame_table_add(struct frame_table *t, int block,
+        const unsigned long long *starts, int nframes)
+{
+    struct frame_block *fb;
+
+    if (block >= t->nblocks)
+    {
+        int i;
+
+        t->blocks = realloc(t->blocks, (block + 1) * sizeof(*t->blocks));
+        if (!t->blocks)
+            fatal_error("Cannot realloc");
+        for(i = t->nblocks; i <= block; ++i)
+        {
+            t->blocks[i].starts = 0;
+            t->blocks[i].nframes = 0;
+        }
+        t->nblocks = block + 1;
+    }
+
+    fb = &t->blocks[block];
+    free(fb->starts);
+    fb->starts = malloc(nframes * sizeof(*fb->starts));
+    if (nframes > 0 && !fb->starts)
+        fatal_error("Cannot allocate");
+    memcpy(fb->starts, starts, nframes * sizeof(*fb->starts));
+    fb->nframes = nframes;
+}
+
+void
+frame_table_to_tar(struct frame_table *t, struct mytar *tar)
+{
+    size_t len = 0;
+    size_t allocated = 100;
+    char *text;
+    ssize_t res;
+    int i;
+
+    if (command_line.debug)
+        fprintf(stderr, "Writing the frames of %i blocks\n", t->nblocks);
+
+    text = malloc(allocated);
+    if (!text)
+        fatal_error("Cannot allocate");
+
+    len = snprintf(text, allocated, "%s %llu\n", frames_magic, t->framesize);
+
+    for(i=0; i < t->nblocks; ++i)
+    {
+        const struct frame_block *fb = &t->blocks[i];
+        int j;
+
+        if (fb->nframes == 0)
+            continue;
+
+        while (allocated - len < (size_t) fb->nframes * 21 + 20)
+        {
+            allocated *= 2;
+            text = realloc(text, allocated);
+            if (!text)
+                fatal_error("Cannot realloc");
+        }
+
+        len += snprintf(text + len, allocated - len, "%i", i);
+        for(j=0; j < fb->nframes; ++j)
+            len += snprintf(text + len, allocated - len, " %llu", fb->starts[j]);
+        text[len++] = '\n';
+    }
+
+    mytar_new_file(tar);
+    mytar_set_filename(tar, (char *) frames_name);
+    mytar_set_gid(tar, getgid());
+    mytar_set_uid(tar, getuid());
+    mytar_set_size(tar, len);
+    mytar_set_mode(tar, 0644 | S_IFREG);
+    mytar_set_mtime(tar, time(NULL));
+    mytar_set_filetype(tar, S_IFREG);
+    res = mytar_write_header(tar);
+    if (res == -1)
+        error("Failed to write header");
+
+    res = mytar_write_data(tar, text, len);
+    if (res == -1)
+        error("Could not write the frames data");
+    assert((size_t) res == len);
+
+    res = mytar_write_end(tar);
+    if (res == -1)
+        error("Could not write mytar file end");
+
+    free(text);
+}
+
+/* Returns 1 if the archive has a frames member, found through its
+ * directory. Moves the fd position. */
+int
+frame_table_load(struct frame_table *t, int fd, const struct directory *dir)
+{
+    unsigned long long size;
+    unsigned long long framesize;
+    unsigned long long *starts = 0;
+    int allocated = 0;
+    char *name;
+    char *text;
+    char *line;
+    size_t got = 0;
+    int n;
+
+    frame_table_init(t, 0);
+
+    name = tar_find_member(fd, dir, frames_name, &size);
+    if (!name)
+        return 0;
+    free(name);
+
+    text = malloc(size + 1);
+    if (!text)
+        fatal_error("Cannot allocate");
+    while (got < size)
+    {
+        ssize_t res = read(fd, text + got, size - got);
+        if (res == -1)
+            fatal_errno("Cannot read the frames of the btar");
+        if (res == 0)
+            fatal_error("Unexpected end of btar reading the frames");
+        got += res;
+    }
+    text[size] = '\0';
+
+    if (strncmp(text, frames_magic, sizeof frames_magic - 1) != 0 ||
+            sscanf(text + sizeof frames_magic - 1, "%llu", &framesize) != 1 ||
+            framesize == 0)
+    {
+        if (command_line.debug)
+            fprintf(stderr, "Wrong btar frames member\n");
+        free(text);
+        return 0;
+    }
+    t->framesize = framesize;
+
+    line = strchr(text, '\n');
+    while (line && *++line != '\0')
+    {
+        char *p = line;
+        int block;
+        int nframes = 0;
+
+        line = strchr(line, '\n');
+        if (line)
+            *line = '\0';
+
+        if (sscanf(p, "%i%n", &block, &n) != 1 || block < 0)
+            break;
+        p += n;
+
+        while (1)
+        {
+            unsigned long long start;
+
+            if (sscanf(p, " %llu%n", &start, &n) != 1)
+                break;
+            p += n;
+            if (nframes == allocated)
+            {
+                allocated = allocated ? allocated * 2 : 16;
+                starts = realloc(starts, allocated * sizeof(*starts));
+                if (!starts)
+                    fatal_error("Cannot realloc");
+            }
+            starts[nframes++] = start;
+        }
+
+        frame_table_add(t, block, starts, nframes);
+    }
+    free(starts);
+    free(text);
+
+    if (command_line.debug)
+        fprintf(stderr, "Loaded the frames of %i blocks, of %llu bytes\n",
+                t->nblocks, t->framesize);
+
+    return 1;
+}
+
+/* Where to start defiltering the block to get its tar data at 'offset'.
+ * '*frame_offset' tells where that start is in the block tar. */
+unsigned long long
+frame_table_find(const struct frame_table *t, int block,
+        unsigned long long offset, unsigned long long *frame_offset)
+{
+    const struct frame_block *fb;
+    unsigned long long frame;
+
+    *frame_offset = 0;
+
+    if (block < 0 || block >= t->nblocks)
+        return 0;
+
+    fb = &t->blocks[block];
+    frame = offset / t->framesize;
+    if (fb->nframes == 0)
+        return 0;
+    if (frame >= (unsigned long long) fb->nframes)
+        frame = fb->nframes - 1;
+
+    *frame_offset = frame * t->framesize;
+    return fb->starts[frame];
+}
+
+void
+frame_table_free(struct frame_table *t)
+{
+    int i;
+
+    for(i=0; i < t->nblocks; ++i)
+        free(t->blocks[i].starts);
+    free(t->blocks);
+    frame_table_init(t, 0);
+}
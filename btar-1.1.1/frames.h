@@ -0,0 +1,24 @@
+struct mytar;
+struct directory;
+
+struct frame_block
+{
+    unsigned long long *starts; /* Of each frame, in the filtered block */
+    int nframes;
+};
+
+struct frame_table
+{
+    unsigned long long framesize; /* Of the block tar data in a frame */
+    struct frame_block *blocks;
+    int nblocks;
+};
+
+void frame_table_init(struct frame_table *t, unsigned long long framesize);
+void frame_table_add(struct frame_table *t, int block,
+        const unsigned long long *starts, int nframes);
+void frame_table_to_tar(struct frame_table *t, struct mytar *tar);
+int frame_table_load(struct frame_table *t, int fd, const struct directory *dir);
+unsigned long long frame_table_find(const struct frame_table *t, int block,
+        unsigned long long offset, unsigned long long *frame_offset);
+void frame_table_free(struct frame_table *t);
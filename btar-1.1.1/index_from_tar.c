@@ -29,6 +29,7 @@
 #include "filters.h"
 #include "index_from_tar.h"
 #include "rsync.h"
+#include "loadindex.h"
 
 static
 struct {
@@ -44,21 +45,17 @@ struct {
     unsigned long long until_header_left;
     unsigned long long data_read;
     unsigned long long total_data_read;
-    size_t block;
+    unsigned long long entry_start; /* Of the first header of the entry */
+    int in_entry; /* After a long name header */
 } sm;
 
 static struct mytar *indextar;
+static struct mytar *signaturestar;
 
 static struct rsync_signature *rsync_signature = 0;
 
 char index_filename[PATH_MAX];
 
-void advance_block()
-{
-    while (sm.total_data_read > (sm.block+1) * command_line.blocksize)
-        ++sm.block;
-}
-
 static int
 process_part(const char *data, size_t len)
 {
@@ -109,7 +106,6 @@ process_part(const char *data, size_t len)
             {
                 sm.state = IN_HEADER;
                 sm.data_read = 0;
-                advance_block();
             }
             break;
         case IN_DATA:
@@ -131,41 +127,33 @@ process_part(const char *data, size_t len)
             {
                 sm.state = IN_EXTRA_DATA;
                 sm.data_read = 0;
-                advance_block();
 
                 if (rsync_signature)
                 {
                     size_t siglen;
-                    size_t len;
                     int res;
 
                     /* Mark end of file to rsync */
                     rsync_signature_work(rsync_signature, 0, 0);
 
-                    /* Should output the block name too */
                     siglen = rsync_signature_size(rsync_signature);
-                    len = siglen + strlen(index_filename) + 1 /*\0*/;
-
-                    mytar_set_size(indextar, len);
-                    mytar_write_header(indextar);
 
-                    /* The name, and \0 */
-                    res = mytar_write_data(indextar, index_filename,
-                            strlen(index_filename) + 1);
+                    mytar_set_size(signaturestar, siglen);
+                    res = mytar_write_header(signaturestar);
                     if (res == -1)
-                        error("Cannot write index tar 1 - mytar_write_data");
-                    /* Then the rsync signature */
-                    res = mytar_write_data(indextar, rsync_signature->output,
+                        error("Cannot write signatures tar");
+
+                    res = mytar_write_data(signaturestar, rsync_signature->output,
                             siglen);
                     if (res == -1)
-                        error("Cannot write index tar 2 - mytar_write_data");
+                        error("Cannot write signatures tar - mytar_write_data");
 
                     rsync_signature_free(rsync_signature);
                     rsync_signature = 0;
 
-                    res = mytar_write_end(indextar);
+                    res = mytar_write_end(signaturestar);
                     if (res == -1)
-                        error("Cannot write index tar - mytar_write_end");
+                        error("Cannot write signatures tar - mytar_write_end");
                 }
             }
             break;
@@ -190,6 +178,11 @@ process_part(const char *data, size_t len)
         if (calc_checksum(sh) != checksum)
             error("Failed checksum interpreting tar");
 
+        /* The entry starts at its first header, maybe a long name one */
+        if (!sm.in_entry)
+            sm.entry_start = sm.total_data_read - sizeof sm.header;
+        sm.in_entry = (sh->typeflag[0] == 'L' || sh->typeflag[0] == 'K');
+
         size = read_size(sh->size);
 
         sm.filedata_left = size;
@@ -237,20 +230,21 @@ process_part(const char *data, size_t len)
             if (sm.filedata_left > 0)
                 sm.state = IN_DATA;
             else
-            {
                 sm.state = IN_HEADER;
-                advance_block();
-            }
             return amount_read;
         }
 
 
         mytar_new_file(indextar);
+        if (signaturestar)
+            mytar_new_file(signaturestar);
         if (sm.longfilename)
         {
             if (command_line.debug > 1)
                 fprintf(stderr, "Writing index entry for the file %s\n", sm.longfilename);
             mytar_set_filename(indextar, sm.longfilename);
+            if (signaturestar)
+                mytar_set_filename(signaturestar, sm.longfilename);
             free(sm.longfilename);
             sm.longfilename = 0;
         }
@@ -261,6 +255,8 @@ process_part(const char *data, size_t len)
             if (command_line.debug > 1)
                 fprintf(stderr, "Writing index entry for the file %s\n", name);
             mytar_set_filename(indextar, name);
+            if (signaturestar)
+                mytar_set_filename(signaturestar, name);
         }
 
         mytar_set_mode(indextar, read_octal_number(sh->mode, sizeof sh->mode));
@@ -275,14 +271,11 @@ process_part(const char *data, size_t len)
                 mytar_set_filetype(indextar, S_IFDIR);
                 break;
             case '0':
-                if (command_line.should_rsync &&
+                if (command_line.should_rsync && signaturestar &&
                         sm.filedata_left > command_line.rsync_minimal_size)
                     should_rsync = 1;
 
-                if (should_rsync)
-                    mytar_set_filetype(indextar, S_IFREG);
-                else
-                    mytar_set_filetype(indextar, S_IFLNK);
+                mytar_set_filetype(indextar, S_IFLNK);
                 break;
             case '1':
             case '2':
@@ -297,20 +290,35 @@ process_part(const char *data, size_t len)
         {
             /* Start of block file - header */
             snprintf(index_filename, sizeof index_filename,
-                    "block%zu.tar%s_%llu", sm.block,
+                    "block%llu.tar%s_%llu;o=%llu",
+                    sm.entry_start / command_line.blocksize,
                     get_filter_extensions(filter),
-                    (unsigned long long) size);
-            if (sh->typeflag[0] != '5' && !should_rsync)
+                    (unsigned long long) size,
+                    sm.entry_start % command_line.blocksize);
+            /* The data starts just after this header */
+            if (sh->typeflag[0] == '0')
+                index_link_add_crossing(index_filename, sizeof index_filename,
+                        sm.total_data_read, size);
+            /* The signature will go to its own tar, marked in the index */
+            if (should_rsync)
+                strncat(index_filename, ";s",
+                        sizeof index_filename - strlen(index_filename) - 1);
+            if (sh->typeflag[0] != '5')
                 mytar_set_linkname(indextar, index_filename);
         }
 
+        mytar_write_header(indextar);
+
         if (should_rsync)
         {
             assert(rsync_signature == 0);
+            mytar_set_mode(signaturestar, 0644);
+            mytar_set_uid(signaturestar, read_octal_number(sh->uid, sizeof sh->uid));
+            mytar_set_gid(signaturestar, read_octal_number(sh->gid, sizeof sh->gid));
+            mytar_set_mtime(signaturestar, read_octal_number(sh->mtime, sizeof sh->mtime));
+            mytar_set_filetype(signaturestar, S_IFREG);
             rsync_signature = rsync_signature_new();
         }
-        else
-            mytar_write_header(indextar);
 
         sm.data_read = 0;
         if (sm.filedata_left > 0)
@@ -322,7 +330,6 @@ process_part(const char *data, size_t len)
         else
         {
             sm.state = IN_HEADER;
-            advance_block();
         }
     }
 
@@ -345,7 +352,7 @@ index_from_tar_data(const char *data, size_t len)
 }
 
 void
-index_from_tar(int infd, int outfd)
+index_from_tar(int infd, int outfd, int signaturesfd)
 {
     const int buffersize = 1*1024*1024;
     char *buffer = malloc(buffersize);
@@ -355,6 +362,12 @@ index_from_tar(int infd, int outfd)
     indextar = mytar_new();
     mytar_open_fd(indextar, outfd);
 
+    if (signaturesfd != -1)
+    {
+        signaturestar = mytar_new();
+        mytar_open_fd(signaturestar, signaturesfd);
+    }
+
     while(1)
     {
         int res;
@@ -375,6 +388,8 @@ index_from_tar(int infd, int outfd)
         fprintf(stderr, "index_from_tar: finishing index\n");
 
     mytar_write_archive_end(indextar);
+    if (signaturestar)
+        mytar_write_archive_end(signaturestar);
 
     free(buffer);
 }
@@ -1,2 +1,2 @@
 void
-index_from_tar(int infd, int outfd);
+index_from_tar(int infd, int outfd, int signaturesfd);
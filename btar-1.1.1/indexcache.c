@@ -0,0 +1,298 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "main.h"
+#include "mytar.h"
+#include "loadindex.h"
+#include "filters.h"
+#include "directory.h"
+#include "checksums.h"
+#include "indexcache.h"
+
+/* The index of a btar can be slow to get: it may need decompression or
+ * decryption through the filters. With -C, every index member loaded is kept
+ * decoded under $XDG_CACHE_HOME/btar, in the serialization the index readers
+ * already send through pipes. The cache file starts with a 512 byte record
+ * holding the key: the device, inode, size and mtime of the archive, the
+ * offset and the header checksum of the member, its name, and the defilter
+ * given. Any change there makes another key, and thus another cache file.
+ * The record ends with the CRC32C of the index after it; a cache file not
+ * matching it is taken as not there. */
+
+static const char cache_magic[] = "btar index cache 3";
+
+extern struct filter *defilter;
+
+static unsigned long long
+fnv1a(const char *str)
+{
+    unsigned long long h = 14695981039346656037ULL;
+
+    for(; *str != '\0'; ++str)
+    {
+        h ^= (unsigned char) *str;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int
+cache_directory(char *path, size_t len)
+{
+    const char *base = getenv("XDG_CACHE_HOME");
+    int res;
+
+    if (base && base[0] != '\0')
+        res = snprintf(path, len, "%s", base);
+    else
+    {
+        const char *home = getenv("HOME");
+        if (!home || home[0] == '\0')
+            return 0;
+        res = snprintf(path, len, "%s/.cache", home);
+    }
+    if (res < 0 || (size_t) res + sizeof "/btar" > len)
+        return 0;
+
+    /* The base may not exist yet either */
+    mkdir(path, 0700);
+    strcat(path, "/btar");
+
+    if (mkdir(path, 0700) == -1 && errno != EEXIST)
+    {
+        if (command_line.debug)
+            fprintf(stderr, "Cannot create the index cache directory %s\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+/* 'fd' has to be positioned at the start of the member data. Returns 0 if
+ * the member cannot be cached. */
+int
+index_cache_init(struct index_cache *c, int fd, const char *name,
+        unsigned long long size)
+{
+    struct stat st;
+    struct header_gnu_tar h;
+    off_t offset;
+    char dir[PATH_MAX];
+    size_t len;
+    int res;
+
+    res = fstat(fd, &st);
+    if (res == -1 || !S_ISREG(st.st_mode))
+        return 0;
+
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1 || offset < 512)
+        return 0;
+
+    if (pread(fd, &h, sizeof h, offset - sizeof h) != sizeof h)
+        return 0;
+
+    memset(c->key, 0, sizeof c->key);
+    res = snprintf(c->key, sizeof c->key,
+            "%s\n%llu %llu %llu %llu.%09li %llu %llu %llu %s\n",
+            cache_magic,
+            (unsigned long long) st.st_dev,
+            (unsigned long long) st.st_ino,
+            (unsigned long long) st.st_size,
+            (unsigned long long) st.st_mtime,
+            (long) st.st_mtim.tv_nsec,
+            (unsigned long long) offset,
+            size,
+            read_octal_number(h.checksum, sizeof h.checksum),
+            name);
+    if (res < 0 || (size_t) res >= sizeof c->key)
+        return 0;
+
+    len = res;
+    if (defilter)
+    {
+        const struct filter *f;
+
+        for(f = defilter; f != 0; f = f->next)
+        {
+            char **arg;
+            for(arg = f->args; *arg != 0; ++arg)
+            {
+                res = snprintf(c->key + len, sizeof c->key - len, "%s ", *arg);
+                if (res < 0 || (size_t) res >= sizeof c->key - len)
+                    return 0;
+                len += res;
+            }
+            res = snprintf(c->key + len, sizeof c->key - len, "|");
+            if (res < 0 || (size_t) res >= sizeof c->key - len)
+                return 0;
+            len += res;
+        }
+    }
+
+    if (!cache_directory(dir, sizeof dir))
+        return 0;
+
+    res = snprintf(c->path, sizeof c->path, "%s/%016llx", dir, fnv1a(c->key));
+    if (res < 0 || (size_t) res >= sizeof c->path)
+        return 0;
+
+    c->tmppath[0] = '\0';
+    return 1;
+}
+
+/* The CRC32C of the cache file from 'pos', after the record, up to 'end' */
+static int
+payload_crc(int fd, off_t pos, off_t end, unsigned int *crc)
+{
+    char buffer[65536];
+
+    *crc = 0;
+    while (pos < end)
+    {
+        size_t n = sizeof buffer;
+
+        if (end - pos < (off_t) n)
+            n = end - pos;
+
+        if (pread_all(fd, buffer, n, pos) == -1)
+            return 0;
+        *crc = crc32c(*crc, buffer, n);
+        pos += n;
+    }
+    return 1;
+}
+
+/* Returns 1 if the index has been loaded from the cache */
+int
+index_cache_load(struct index_cache *c)
+{
+    char key[sizeof c->key];
+    struct stat st;
+    unsigned int crc, stored;
+    int fd;
+    ssize_t res;
+
+    fd = open(c->path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+
+    res = read(fd, key, sizeof key);
+    if (res != sizeof key || memcmp(key, c->key, sizeof key) != 0)
+    {
+        if (command_line.debug)
+            fprintf(stderr, "The index cache %s does not match\n", c->path);
+        close(fd);
+        return 0;
+    }
+
+    if (read(fd, &stored, sizeof stored) != sizeof stored ||
+            fstat(fd, &st) == -1 ||
+            !payload_crc(fd, sizeof key + sizeof stored, st.st_size, &crc) ||
+            crc != stored)
+    {
+        if (command_line.debug)
+            fprintf(stderr, "The index cache %s is damaged\n", c->path);
+        close(fd);
+        return 0;
+    }
+
+    if (command_line.debug)
+        fprintf(stderr, "Loading the index from the cache %s\n", c->path);
+
+    recv_index_from_fd(fd);
+    close(fd);
+    return 1;
+}
+
+/* Returns the fd where to send the index to cache, or -1 */
+int
+index_cache_create(struct index_cache *c)
+{
+    unsigned int crc = 0;
+    int fd;
+    int res;
+
+    res = snprintf(c->tmppath, sizeof c->tmppath, "%s.XXXXXX", c->path);
+    if (res < 0 || (size_t) res >= sizeof c->tmppath)
+        return -1;
+
+    fd = mkstemp(c->tmppath);
+    if (fd == -1)
+    {
+        if (command_line.debug)
+            fprintf(stderr, "Cannot create the index cache %s\n", c->tmppath);
+        c->tmppath[0] = '\0';
+        return -1;
+    }
+    set_cloexec(fd);
+
+    /* The CRC comes at the commit */
+    if (write_all(fd, c->key, sizeof c->key) != sizeof c->key ||
+            write_all(fd, &crc, sizeof crc) != sizeof crc)
+    {
+        close(fd);
+        unlink(c->tmppath);
+        c->tmppath[0] = '\0';
+        return -1;
+    }
+
+    return fd;
+}
+
+/* To be called once the whole index has been sent to the cache fd */
+void
+index_cache_commit(struct index_cache *c)
+{
+    struct stat st;
+    unsigned int crc;
+    int fd;
+
+    if (c->tmppath[0] == '\0')
+        return;
+
+    fd = open(c->tmppath, O_RDWR);
+    if (fd == -1 || fstat(fd, &st) == -1 ||
+            !payload_crc(fd, sizeof c->key + sizeof crc, st.st_size, &crc) ||
+            pwrite(fd, &crc, sizeof crc, sizeof c->key) != sizeof crc)
+    {
+        if (command_line.debug)
+            fprintf(stderr, "Cannot write the index cache %s\n", c->tmppath);
+        if (fd != -1)
+            close(fd);
+        unlink(c->tmppath);
+        c->tmppath[0] = '\0';
+        return;
+    }
+    close(fd);
+
+    if (rename(c->tmppath, c->path) == -1)
+    {
+        if (command_line.debug)
+            fprintf(stderr, "Cannot rename the index cache %s\n", c->tmppath);
+        unlink(c->tmppath);
+    }
+    else if (command_line.debug)
+        fprintf(stderr, "Saved the index cache %s\n", c->path);
+    c->tmppath[0] = '\0';
+}
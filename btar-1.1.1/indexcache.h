@@ -0,0 +1,14 @@
+#include <limits.h>
+
+struct index_cache
+{
+    char key[508]; /* Then the CRC32C of the index, for a 512 byte record */
+    char path[PATH_MAX];
+    char tmppath[PATH_MAX];
+};
+
+int index_cache_init(struct index_cache *c, int fd, const char *name,
+        unsigned long long size);
+int index_cache_load(struct index_cache *c);
+int index_cache_create(struct index_cache *c);
+void index_cache_commit(struct index_cache *c);
@@ -0,0 +1,577 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include <limits.h>
+#include <sys/select.h>
+#include "main.h"
+#include "mytar.h"
+#include "readtar.h"
+#include "block.h"
+#include "filters.h"
+#include "filememory.h"
+#include "loadindex.h"
+#include "directory.h"
+#include "indexshard.h"
+
+/* A sharded index is written as consecutive pieces of the index tar,
+ * cut at entry boundaries whenever the first path components of the
+ * names change. Each piece is filtered alone into a member
+ * "indexshard<n>.tar<ext>", and defiltering and joining all of them gives
+ * back the whole index tar.
+ *
+ * Before the shards goes the "indexmap" member, as text:
+ *    btar-indexmap <nshards> <nblocks>\n
+ * and a line per shard:
+ *    <first block> <prefix length> <prefix>\n
+ * The first block is that of the first file of the shard, so the reader
+ * knows where the files of the shard end, even loading it alone. */
+
+/* From traverse.c */
+extern const char rdiff_extension[];
+
+static const char map_magic[] = "btar-indexmap";
+
+struct shard_split
+{
+    struct index_map map;
+    unsigned long long *starts;
+    int allocated;
+    unsigned long long pos; /* Given to readtar */
+    unsigned long long entry_start;
+    int have_entry_start;
+    int block_in_data;
+    char blockname[100];
+    size_t blockname_len;
+};
+
+/* Up to the 'depth'th slash, or the last slash if there are less */
+static size_t
+shard_prefix_len(const char *name, int depth)
+{
+    size_t len = 0;
+    const char *p;
+
+    for(p = name; *p != '\0' && depth > 0; ++p)
+        if (*p == '/')
+        {
+            len = p - name + 1;
+            --depth;
+        }
+
+    return len;
+}
+
+static void
+shard_split_note_block(struct shard_split *s, int block)
+{
+    struct index_shard *shard = &s->map.shards[s->map.nshards-1];
+
+    if (shard->firstblock == -1)
+        shard->firstblock = block;
+}
+
+static void
+shard_split_new_data_cb(const char *data, size_t len, void *userdata)
+{
+    struct shard_split *s = (struct shard_split *) userdata;
+    size_t i;
+
+    if (!s->block_in_data)
+        return;
+
+    /* The data starts by the block name, ending in \0 */
+    for(i=0; i < len; ++i)
+    {
+        if (data[i] == '\0' || s->blockname_len == sizeof s->blockname - 1)
+        {
+            s->blockname[s->blockname_len] = '\0';
+            shard_split_note_block(s, block_name_to_int(s->blockname));
+            s->block_in_data = 0;
+            break;
+        }
+        s->blockname[s->blockname_len++] = data[i];
+    }
+}
+
+static enum readtar_newfile_result
+shard_split_new_file_cb(const struct readtar_file *file, void *userdata)
+{
+    struct shard_split *s = (struct shard_split *) userdata;
+    size_t len = shard_prefix_len(file->name, command_line.index_shard_depth);
+    struct index_shard *shard = 0;
+
+    assert(s->have_entry_start);
+
+    if (s->map.nshards > 0)
+        shard = &s->map.shards[s->map.nshards-1];
+
+    if (!shard || strlen(shard->prefix) != len ||
+            strncmp(shard->prefix, file->name, len) != 0)
+    {
+        const int allocstep = 100;
+
+        if (s->map.nshards == s->allocated)
+        {
+            s->allocated += allocstep;
+            s->map.shards = realloc(s->map.shards,
+                    s->allocated * sizeof(*s->map.shards));
+            s->starts = realloc(s->starts, s->allocated * sizeof(*s->starts));
+            if (!s->map.shards || !s->starts)
+                fatal_error("Cannot realloc");
+        }
+
+        shard = &s->map.shards[s->map.nshards];
+        shard->prefix = malloc(len + 1);
+        if (!shard->prefix)
+            fatal_error("Cannot allocate");
+        strcpyn(shard->prefix, file->name, len + 1);
+        shard->firstblock = -1;
+        /* The first shard takes anything before its first entry */
+        s->starts[s->map.nshards] = s->map.nshards ? s->entry_start : 0;
+        s->map.nshards++;
+
+        if (command_line.debug > 1)
+            fprintf(stderr, "Index shard %i for \"%s\"\n", s->map.nshards - 1,
+                    shard->prefix);
+    }
+
+    if (file->header->typeflag[0] == '2')
+        shard_split_note_block(s, block_name_to_int(file->linkname));
+    else if (file->header->typeflag[0] == '0')
+    {
+        s->block_in_data = 1;
+        s->blockname_len = 0;
+    }
+
+    s->have_entry_start = 0;
+
+    return READTAR_NORMAL;
+}
+
+static void
+shard_split_feed(struct shard_split *s, struct readtar *rt, const char *data,
+        size_t len)
+{
+    /* The entry starts at the first header record, even if it is
+     * one of a long name */
+    if (rt->state == IN_HEADER && !s->have_entry_start)
+    {
+        s->entry_start = s->pos;
+        s->have_entry_start = 1;
+    }
+    process_this_tar_data(rt, data, len);
+    s->pos += len;
+}
+
+static void
+split_index(struct shard_split *s, const struct block *b)
+{
+    struct readtar rt;
+    struct readtar_callbacks cb = { shard_split_new_file_cb,
+        shard_split_new_data_cb, s};
+    char record[512];
+    size_t inrecord = 0;
+
+    s->map.shards = 0;
+    s->map.nshards = 0;
+    s->starts = 0;
+    s->allocated = 0;
+    s->pos = 0;
+    s->have_entry_start = 0;
+    s->block_in_data = 0;
+
+    init_readtar(&rt, &cb);
+
+    /* Record by record, to know where each entry starts */
+    for(; b != 0; b = b->nextblock)
+    {
+        size_t i = 0;
+
+        while (i < b->writer_pos)
+        {
+            size_t n = sizeof record - inrecord;
+            if (n > b->writer_pos - i)
+                n = b->writer_pos - i;
+            memcpy(record + inrecord, b->data + i, n);
+            inrecord += n;
+            i += n;
+
+            if (inrecord == sizeof record)
+            {
+                shard_split_feed(s, &rt, record, inrecord);
+                inrecord = 0;
+            }
+        }
+    }
+    if (inrecord > 0)
+        shard_split_feed(s, &rt, record, inrecord);
+
+    if (s->map.nshards == 0)
+    {
+        /* Empty index. Still one shard, with the tar end. */
+        s->map.shards = malloc(sizeof(*s->map.shards));
+        s->starts = malloc(sizeof(*s->starts));
+        if (!s->map.shards || !s->starts)
+            fatal_error("Cannot allocate");
+        s->map.shards[0].prefix = strdup("");
+        s->map.shards[0].firstblock = -1;
+        s->starts[0] = 0;
+        s->map.nshards = 1;
+    }
+}
+
+static void
+write_range(int fd, const struct block *b, unsigned long long start,
+        unsigned long long end)
+{
+    unsigned long long pos = 0;
+
+    for(; b != 0 && pos < end; b = b->nextblock)
+    {
+        unsigned long long bstart = pos;
+        unsigned long long bend = pos + b->writer_pos;
+
+        if (bstart < start)
+            bstart = start;
+        if (bend > end)
+            bend = end;
+
+        if (bstart < bend)
+        {
+            ssize_t res = write_all(fd, b->data + (bstart - pos), bend - bstart);
+            if (res == -1)
+                fatal_errno("Cannot write to the index shard filter");
+        }
+
+        pos += b->writer_pos;
+    }
+}
+
+/* Filters part of a block chain, as the raw index, and keeps the filter
+ * output in memory */
+struct file_memory *
+filter_range(struct filter *f, const struct block *b, unsigned long long start,
+        unsigned long long end)
+{
+    struct file_memory *fm;
+    int filterin, filterout;
+    int pid;
+
+    run_filters(f, &filterin, &filterout);
+
+    pid = fork();
+    if (pid == -1)
+        error("Cannot fork");
+    else if (pid == 0)
+    {
+        close(filterout);
+        write_range(filterin, b, start, end);
+        close(filterin);
+        exit(0);
+    }
+
+    close(filterin);
+
+    fm = file_memory_new(filterout);
+    file_memory_read_all(fm);
+
+    return fm;
+}
+
+static void
+index_map_to_tar(const struct index_map *m, struct mytar *tar)
+{
+    size_t len = 0;
+    size_t allocated = 100;
+    char *text;
+    ssize_t res;
+    int i;
+
+    text = malloc(allocated);
+    if (!text)
+        fatal_error("Cannot allocate");
+
+    len = snprintf(text, allocated, "%s %i %i\n", map_magic, m->nshards,
+            m->nblocks);
+
+    for(i=0; i < m->nshards; ++i)
+    {
+        const struct index_shard *shard = &m->shards[i];
+        size_t prefixlen = strlen(shard->prefix);
+
+        while (allocated - len < prefixlen + 50)
+        {
+            allocated *= 2;
+            text = realloc(text, allocated);
+            if (!text)
+                fatal_error("Cannot realloc");
+        }
+
+        len += snprintf(text + len, allocated - len, "%i %zu %s\n",
+                shard->firstblock, prefixlen, shard->prefix);
+    }
+
+    mytar_new_file(tar);
+    mytar_set_filename(tar, "indexmap");
+    mytar_set_gid(tar, getgid());
+    mytar_set_uid(tar, getuid());
+    mytar_set_size(tar, len);
+    mytar_set_mode(tar, 0644 | S_IFREG);
+    mytar_set_mtime(tar, time(NULL));
+    mytar_set_filetype(tar, S_IFREG);
+    res = mytar_write_header(tar);
+    if (res == -1)
+        error("Failed to write header");
+
+    res = mytar_write_data(tar, text, len);
+    if (res == -1)
+        error("Could not write the index map data");
+    assert((size_t) res == len);
+
+    res = mytar_write_end(tar);
+    if (res == -1)
+        error("Could not write mytar file end");
+
+    free(text);
+}
+
+void
+index_shards_to_tar(struct file_memory *rawindex, struct filter *f,
+        int nblocks, struct mytar *tar, struct directory *dir)
+{
+    struct shard_split s;
+    int i;
+
+    split_index(&s, rawindex->bo);
+    s.map.nblocks = nblocks;
+
+    if (command_line.debug)
+        fprintf(stderr, "Writing the index in %i shards\n", s.map.nshards);
+
+    index_map_to_tar(&s.map, tar);
+    directory_add_member(dir, tar);
+
+    for(i=0; i < s.map.nshards; ++i)
+    {
+        struct file_memory *fm;
+        char namepattern[PATH_MAX];
+        unsigned long long end = rawindex->bo->total_written;
+
+        if (i + 1 < s.map.nshards)
+            end = s.starts[i+1];
+
+        fm = filter_range(f, rawindex->bo, s.starts[i], end);
+
+        /* file_memory_to_tar will add the extensions */
+        snprintf(namepattern, sizeof namepattern, "indexshard%i.tar%%s", i);
+        file_memory_to_tar(fm, namepattern, get_filter_extensions(f), tar);
+        directory_add_member(dir, tar);
+
+        file_memory_free(fm);
+    }
+
+    free(s.starts);
+    index_map_free(&s.map);
+}
+
+/* The whole raw index, filtered as a single stream, for the index file */
+void
+index_shards_to_fd(struct file_memory *rawindex, struct filter *f, int fd)
+{
+    struct file_memory *fm;
+
+    fm = filter_range(f, rawindex->bo, 0, rawindex->bo->total_written);
+    file_memory_to_fd(fm, fd);
+    file_memory_free(fm);
+}
+
+int
+index_map_load(struct index_map *m, int fd, const struct directory *dir)
+{
+    char *name;
+    unsigned long long size;
+    char *text;
+    char *pos;
+    char *end;
+    size_t nread = 0;
+    int n;
+    int i;
+
+    m->shards = 0;
+    m->nshards = 0;
+
+    name = tar_find_member(fd, dir, "indexmap", &size);
+    if (!name)
+        return 0;
+    free(name);
+
+    text = malloc(size + 1);
+    if (!text)
+        fatal_error("Cannot allocate");
+
+    while (nread < size)
+    {
+        ssize_t res = read(fd, text + nread, size - nread);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            fatal_errno("Cannot read the index map");
+        }
+        if (res == 0)
+            fatal_error("Truncated index map");
+        nread += res;
+    }
+    text[size] = '\0';
+    end = text + size;
+
+    if (sscanf(text, "btar-indexmap %i %i\n%n", &m->nshards, &m->nblocks, &n) != 2
+            || m->nshards <= 0)
+        fatal_error("Wrong index map in the btar");
+
+    m->shards = malloc(m->nshards * sizeof(*m->shards));
+    if (!m->shards)
+        fatal_error("Cannot allocate");
+
+    pos = text + n;
+    for(i=0; i < m->nshards; ++i)
+    {
+        size_t prefixlen;
+        char *next;
+
+        m->shards[i].firstblock = strtol(pos, &next, 10);
+        if (next == pos || *next != ' ')
+            fatal_error("Wrong index map line for shard %i", i);
+        pos = next + 1;
+
+        prefixlen = strtoul(pos, &next, 10);
+        if (next == pos || *next != ' ')
+            fatal_error("Wrong index map line for shard %i", i);
+        pos = next + 1;
+
+        if ((size_t)(end - pos) < prefixlen + 1 || pos[prefixlen] != '\n')
+            fatal_error("Wrong index map prefix for shard %i", i);
+
+        m->shards[i].prefix = malloc(prefixlen + 1);
+        if (!m->shards[i].prefix)
+            fatal_error("Cannot allocate");
+        memcpy(m->shards[i].prefix, pos, prefixlen);
+        m->shards[i].prefix[prefixlen] = '\0';
+        pos += prefixlen + 1;
+    }
+
+    free(text);
+
+    if (command_line.debug)
+        fprintf(stderr, "Loaded the index map of %i shards\n", m->nshards);
+
+    return 1;
+}
+
+void
+index_map_free(struct index_map *m)
+{
+    int i;
+
+    for(i=0; i < m->nshards; ++i)
+        free(m->shards[i].prefix);
+    free(m->shards);
+    m->shards = 0;
+    m->nshards = 0;
+}
+
+/* Could 'pattern' match, with fnmatch and no flags, any name
+ * starting with 'prefix'? In doubt, says yes. */
+static int
+pattern_may_match_prefix(const char *pattern, const char *prefix)
+{
+    const char *p = pattern;
+    const char *k = prefix;
+
+    while (*k != '\0')
+    {
+        if (*p == '\0')
+            return 0;
+        if (*p == '*' || *p == '?' || *p == '[')
+            return 1;
+        if (*p == '\\' && p[1] != '\0')
+            ++p;
+        if (*p != *k)
+            return 0;
+        ++p;
+        ++k;
+    }
+
+    return 1;
+}
+
+int
+index_shard_may_match(const struct index_map *m, int shard, const char **paths)
+{
+    const char *prefix = m->shards[shard].prefix;
+    int i;
+
+    if (!paths)
+        return 1;
+
+    for(i=0; paths[i] != 0; ++i)
+    {
+        if (pattern_may_match_prefix(paths[i], prefix))
+            return 1;
+#ifdef WITH_LIBRSYNC
+        {
+            char p[PATH_MAX];
+            snprintf(p, sizeof p, "%s%s", paths[i], rdiff_extension);
+            if (pattern_may_match_prefix(p, prefix))
+                return 1;
+        }
+#endif
+    }
+
+    return 0;
+}
+
+/* Blocks where the files of the shard may be, are before the returned one */
+int
+index_shard_end_block(const struct index_map *m, int shard)
+{
+    int i;
+
+    for(i = shard + 1; i < m->nshards; ++i)
+        if (m->shards[i].firstblock >= 0)
+            return m->shards[i].firstblock + 1;
+
+    return m->nblocks;
+}
+
+char *
+index_shard_find(int fd, const struct directory *dir, int shard,
+        unsigned long long *size)
+{
+    char prefix[50];
+
+    snprintf(prefix, sizeof prefix, "indexshard%i.tar", shard);
+
+    return tar_find_member(fd, dir, prefix, size);
+}
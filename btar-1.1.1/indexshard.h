@@ -0,0 +1,31 @@
+struct file_memory;
+struct filter;
+struct mytar;
+struct directory;
+struct block;
+
+struct index_shard
+{
+    char *prefix;
+    int firstblock; /* -1 if the shard has no files */
+};
+
+struct index_map
+{
+    struct index_shard *shards;
+    int nshards;
+    int nblocks; /* In the whole archive */
+};
+
+void index_shards_to_tar(struct file_memory *rawindex, struct filter *f,
+        int nblocks, struct mytar *tar, struct directory *dir);
+struct file_memory * filter_range(struct filter *f, const struct block *b,
+        unsigned long long start, unsigned long long end);
+void index_shards_to_fd(struct file_memory *rawindex, struct filter *f, int fd);
+int index_map_load(struct index_map *m, int fd, const struct directory *dir);
+void index_map_free(struct index_map *m);
+int index_shard_may_match(const struct index_map *m, int shard,
+        const char **paths);
+int index_shard_end_block(const struct index_map *m, int shard);
+char * index_shard_find(int fd, const struct directory *dir, int shard,
+        unsigned long long *size);
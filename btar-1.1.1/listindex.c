@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <fnmatch.h>
 
 #include "main.h"
 #include "mytar.h"
@@ -27,6 +28,8 @@
 #include "loadindex.h"
 #include "filters.h"
 #include "listindex.h"
+#include "directory.h"
+#include "indexshard.h"
 
 extern struct filter *defilter;
 
@@ -45,6 +48,16 @@ list_new_file_cb(const struct readtar_file *file, void *userdata)
     /* Silent warnings */
     userdata = userdata;
 
+    if (command_line.paths)
+    {
+        int i;
+        for(i=0; command_line.paths[i] != 0; ++i)
+            if (fnmatch(command_line.paths[i], file->name, 0) == 0)
+                break;
+        if (command_line.paths[i] == 0)
+            return READTAR_SKIPDATA;
+    }
+
     printf("%s\n", file->name);
     return READTAR_SKIPDATA;
 }
@@ -123,21 +136,14 @@ run_index_reader(int fdin, int *fdout, int closechild1)
     }
 }
 
-void listindex(int fd)
+static void
+list_index_member(int fd, const char *name, unsigned long long indexsize)
 {
-    char *name;
     int filterin, filterout;
-    unsigned long long indexsize;
     struct filter *mydefilter;
     char *buffer;
     int wait_fd;
 
-    name = index_find_in_tar(fd, &indexsize);
-    if (!name)
-    {
-        fatal_error_no_core("Cannot find index in btar");
-    }
-
     if (command_line.debug)
         fprintf(stderr, "Index file name in main btar: %s\n", name);
 
@@ -146,8 +152,6 @@ void listindex(int fd)
     else
         mydefilter = defilters_from_extensions(name);
 
-    free(name);
-
     run_filters(mydefilter, &filterin, &filterout);
 
     run_index_reader(filterout, &wait_fd, /*close child */filterin);
@@ -208,5 +212,90 @@ void listindex(int fd)
             break;
     } while(1);
 
+    close(wait_fd);
     free(buffer);
 }
+
+/* With the index cache, the names come from the loaded index */
+static void
+list_loaded_index(int fd)
+{
+    const struct IndexElem *ptr;
+    size_t nelems;
+    size_t i;
+
+    if (load_index_from_tar(fd, command_line.paths) == -2)
+        fatal_error_no_core("Cannot find index in btar");
+
+    ptr = index_get_elements(&nelems);
+    for(i = 0; i < nelems; ++i)
+    {
+        char name[PATH_MAX];
+
+        /* The index tar had the directories with a trailing slash */
+        snprintf(name, sizeof name, ptr[i].is_dir ? "%s/" : "%s", ptr[i].name);
+
+        if (command_line.paths)
+        {
+            int j;
+            for(j=0; command_line.paths[j] != 0; ++j)
+                if (fnmatch(command_line.paths[j], name, 0) == 0)
+                    break;
+            if (command_line.paths[j] == 0)
+                continue;
+        }
+        printf("%s\n", name);
+    }
+}
+
+void listindex(int fd)
+{
+    struct directory dir;
+    int have_directory;
+    struct index_map map;
+    char *name;
+    unsigned long long indexsize;
+
+    if (command_line.action == LIST_INDEX && command_line.index_cache)
+    {
+        list_loaded_index(fd);
+        return;
+    }
+
+    have_directory = directory_load(&dir, fd);
+
+    name = tar_find_member(fd, have_directory ? &dir : 0, "index.tar",
+            &indexsize);
+    if (name)
+    {
+        list_index_member(fd, name, indexsize);
+        free(name);
+    }
+    else if (lseek(fd, 0, SEEK_SET) != -1 &&
+            index_map_load(&map, fd, have_directory ? &dir : 0))
+    {
+        int i;
+
+        /* The index tar (-L) needs all the shards */
+        for(i=0; i < map.nshards; ++i)
+        {
+            if (command_line.action == LIST_INDEX &&
+                    !index_shard_may_match(&map, i, command_line.paths))
+                continue;
+
+            name = index_shard_find(fd, have_directory ? &dir : 0, i,
+                    &indexsize);
+            if (!name)
+                fatal_error("Cannot find the index shard %i in btar", i);
+
+            list_index_member(fd, name, indexsize);
+            free(name);
+        }
+        index_map_free(&map);
+    }
+    else
+        fatal_error_no_core("Cannot find index in btar");
+
+    if (have_directory)
+        directory_free(&dir);
+}
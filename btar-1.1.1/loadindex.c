@@ -26,6 +26,7 @@
 #include "main.h"
 #include "loadindex.h"
 #include "readtar.h"
+#include "directory.h"
 
 static struct Index
 {
@@ -83,8 +84,14 @@ set_block(int block, struct IndexElem *e)
     if (myindex.nelem > 0)
     {
         int prev = myindex.nelem - 1;
-        int prevblock = myindex.ptr[prev].block;
-        myindex.ptr[prev].nblocks = block - prevblock + 1;
+        int prevblock;
+
+        /* The directories in between have no block */
+        while (prev > 0 && myindex.ptr[prev].block == -1)
+            --prev;
+        prevblock = myindex.ptr[prev].block;
+        if (prevblock >= 0)
+            myindex.ptr[prev].nblocks = block - prevblock + 1;
     }
 }
 
@@ -110,6 +117,11 @@ update_entry(struct IndexElem *new_e)
          * it's of little use to update them here. */
         e->block = new_e->block;
         e->nblocks = new_e->nblocks;
+        e->offset = new_e->offset;
+        e->size = new_e->size;
+        e->crossing = new_e->crossing;
+        e->crossing_blocksize = new_e->crossing_blocksize;
+        e->has_signature = new_e->has_signature;
 
         free(e->signature);
         e->signature = new_e->signature;
@@ -173,6 +185,7 @@ loadindex_new_data_cb(const char *data, size_t len, void *userdata)
                     fatal_error("Cannot realloc");
 
                 ls->e.signaturelen = finalsize;
+                ls->e.has_signature = 1;
             }
             ls->e.signature = ls->data;
             ls->data = 0;
@@ -200,6 +213,11 @@ loadindex_new_file_cb(const struct readtar_file *file, void *userdata)
     ls->e.is_dir = (h->typeflag[0] == '5');
     ls->e.signature = 0;
     ls->e.signaturelen = 0;
+    ls->e.has_signature = 0;
+    ls->e.offset = -1;
+    ls->e.size = 0;
+    ls->e.crossing = -1;
+    ls->e.crossing_blocksize = 0;
     ls->e.name = strdup(file->name);
 
     ls->should_read = 0;
@@ -229,7 +247,31 @@ loadindex_new_file_cb(const struct readtar_file *file, void *userdata)
     }
     else
     {
+        size_t len = strlen(file->linkname);
+        const char *offset;
+        const char *size;
+        const char *crossing;
+
         set_block(block_name_to_int(file->linkname), &ls->e);
+
+        size = strrchr(file->linkname, '_');
+        if (size)
+            ls->e.size = strtoull(size + 1, 0, 10);
+
+        /* Where the entry starts in the block tar */
+        offset = strstr(file->linkname, ";o=");
+        if (offset)
+            ls->e.offset = strtoll(offset + 3, 0, 10);
+
+        /* Where its data goes on in the next block */
+        crossing = strstr(file->linkname, ";c=");
+        if (crossing && sscanf(crossing + 3, "%lld:%llu", &ls->e.crossing,
+                    &ls->e.crossing_blocksize) != 2)
+            ls->e.crossing = -1;
+
+        /* The signature went to the signatures member */
+        if (len > 2 && strcmp(file->linkname + len - 2, ";s") == 0)
+            ls->e.has_signature = 1;
     }
 
     ls->e.mtime = read_octal_number(h->mtime, sizeof(h->mtime));
@@ -268,6 +310,88 @@ index_load_from_fd(int fd)
     read_full_tar(fd, &rt);
 }
 
+struct loadsignatures_state
+{
+    char *data;
+    size_t nread;
+    unsigned long long expected_size;
+    char *name;
+};
+
+static void
+loadsignatures_new_data_cb(const char *data, size_t len, void *userdata)
+{
+    struct loadsignatures_state *ls = (struct loadsignatures_state *) userdata;
+    struct IndexElem *e;
+
+    if (!ls->data)
+        return;
+
+    memcpy(ls->data + ls->nread, data, len);
+    ls->nread += len;
+
+    if (ls->nread < ls->expected_size)
+        return;
+
+    /* Only files in the index can use the signature */
+    e = index_find_element(ls->name);
+    if (e)
+    {
+        if (command_line.debug > 1)
+            fprintf(stderr, "index: signature for %s\n", ls->name);
+        free(e->signature);
+        e->signature = ls->data;
+        e->signaturelen = ls->expected_size;
+    }
+    else
+        free(ls->data);
+
+    ls->data = 0;
+    free(ls->name);
+    ls->name = 0;
+}
+
+static enum readtar_newfile_result
+loadsignatures_new_file_cb(const struct readtar_file *file, void *userdata)
+{
+    struct loadsignatures_state *ls = (struct loadsignatures_state *) userdata;
+
+    if (file->header->typeflag[0] != '0' || file->size == 0)
+        return READTAR_SKIPDATA;
+
+    ls->data = malloc(file->size);
+    if (!ls->data)
+        fatal_error("Cannot allocate");
+    ls->nread = 0;
+    ls->expected_size = file->size;
+    free(ls->name);
+    ls->name = strdup(file->name);
+
+    return READTAR_NORMAL;
+}
+
+/* Attach the signatures of the tar in fd to the already loaded (and sorted)
+ * index elements */
+void
+index_load_signatures_from_fd(int fd)
+{
+    struct readtar rt;
+    struct loadsignatures_state ls_state;
+    struct readtar_callbacks cb = { loadsignatures_new_file_cb,
+        loadsignatures_new_data_cb, &ls_state};
+    init_readtar(&rt, &cb);
+
+    ls_state.data = 0;
+    ls_state.nread = 0;
+    ls_state.expected_size = 0;
+    ls_state.name = 0;
+
+    read_full_tar(fd, &rt);
+
+    free(ls_state.data);
+    free(ls_state.name);
+}
+
 void
 index_sort()
 {
@@ -306,9 +430,30 @@ index_get_elements(size_t *nelems)
     return myindex.ptr;
 }
 
+/* Finds the member starting by 'prefix', through the directory if given, or
+ * else reading the headers from the current position on. Leaves fd at the
+ * member data. */
 char *
-index_find_in_tar(int fd, unsigned long long *size)
+tar_find_member(int fd, const struct directory *dir, const char *prefix,
+        unsigned long long *size)
 {
+    size_t prefixlen = strlen(prefix);
+
+    if (dir)
+    {
+        const struct directory_entry *e = directory_find(dir, prefix);
+        off_t res;
+
+        if (!e)
+            return 0;
+
+        *size = e->size;
+        res = lseek(fd, e->offset + 512, SEEK_SET);
+        if (res == -1)
+            error("Error seeking in the index file");
+        return strdup(e->name);
+    }
+
     while(1)
     {
         struct header_gnu_tar h;
@@ -321,8 +466,8 @@ index_find_in_tar(int fd, unsigned long long *size)
             error("Failed read() reading index");
 
         if (command_line.debug > 1)
-            fprintf(stderr, "index_find_in_tar: seen %s\n", h.name);
-        if (!strncmp(h.name,"index", 5))
+            fprintf(stderr, "tar_find_member: seen %s\n", h.name);
+        if (!strncmp(h.name, prefix, prefixlen))
         {
             *size = read_size(h.size);
             return strdup(h.name);
@@ -340,6 +485,36 @@ index_find_in_tar(int fd, unsigned long long *size)
     return 0;
 }
 
+char *
+index_find_in_tar(int fd, unsigned long long *size)
+{
+    struct directory d;
+    char *name;
+    int have_directory;
+
+    /* With a directory at the end, we can go straight to the index */
+    have_directory = directory_load(&d, fd);
+
+    name = tar_find_member(fd, have_directory ? &d : 0, "index.tar", size);
+
+    if (have_directory)
+        directory_free(&d);
+
+    return name;
+}
+
+/* The last file of an index shard, loaded alone, would extend until the end of
+ * the archive. Bound it to the blocks before 'endblock'. */
+void
+index_end_shard(size_t from, int endblock)
+{
+    size_t i;
+
+    for(i = from; i < myindex.nelem; ++i)
+        if (myindex.ptr[i].block >= 0 && myindex.ptr[i].nblocks == -1)
+            myindex.ptr[i].nblocks = endblock - myindex.ptr[i].block;
+}
+
 void
 send_index_to_fd(int fd)
 {
@@ -388,12 +563,44 @@ send_index_to_fd(int fd)
         if ((size_t)res != sizeof myindex.ptr[i].nblocks)
             error("Could not serialize index 4");
 
+        do
+            res = write(fd, &myindex.ptr[i].offset, sizeof myindex.ptr[i].offset);
+        while(res == -1 && errno == EINTR);
+        if ((size_t)res != sizeof myindex.ptr[i].offset)
+            error("Could not serialize index 4");
+
+        do
+            res = write(fd, &myindex.ptr[i].size, sizeof myindex.ptr[i].size);
+        while(res == -1 && errno == EINTR);
+        if ((size_t)res != sizeof myindex.ptr[i].size)
+            error("Could not serialize index 4");
+
+        do
+            res = write(fd, &myindex.ptr[i].crossing, sizeof myindex.ptr[i].crossing);
+        while(res == -1 && errno == EINTR);
+        if ((size_t)res != sizeof myindex.ptr[i].crossing)
+            error("Could not serialize index 4");
+
+        do
+            res = write(fd, &myindex.ptr[i].crossing_blocksize,
+                    sizeof myindex.ptr[i].crossing_blocksize);
+        while(res == -1 && errno == EINTR);
+        if ((size_t)res != sizeof myindex.ptr[i].crossing_blocksize)
+            error("Could not serialize index 4");
+
         do
             res = write(fd, &myindex.ptr[i].is_dir, sizeof myindex.ptr[i].is_dir);
         while(res == -1 && errno == EINTR);
         if ((size_t)res != sizeof myindex.ptr[i].is_dir)
             error("Could not serialize index 4");
 
+        do
+            res = write(fd, &myindex.ptr[i].has_signature,
+                    sizeof myindex.ptr[i].has_signature);
+        while(res == -1 && errno == EINTR);
+        if ((size_t)res != sizeof myindex.ptr[i].has_signature)
+            error("Could not serialize index 4");
+
         tosend = myindex.ptr[i].signaturelen;
 
         do
@@ -462,12 +669,42 @@ recv_index_from_fd(int fd)
         if (res != sizeof e.nblocks)
             error("Could not deserialize index (nblocks)");
 
+        do
+            res = read(fd, &e.offset, sizeof e.offset);
+        while(res == -1 && errno == EINTR);
+        if (res != sizeof e.offset)
+            error("Could not deserialize index (offset)");
+
+        do
+            res = read(fd, &e.size, sizeof e.size);
+        while(res == -1 && errno == EINTR);
+        if (res != sizeof e.size)
+            error("Could not deserialize index (size)");
+
+        do
+            res = read(fd, &e.crossing, sizeof e.crossing);
+        while(res == -1 && errno == EINTR);
+        if (res != sizeof e.crossing)
+            error("Could not deserialize index (crossing)");
+
+        do
+            res = read(fd, &e.crossing_blocksize, sizeof e.crossing_blocksize);
+        while(res == -1 && errno == EINTR);
+        if (res != sizeof e.crossing_blocksize)
+            error("Could not deserialize index (crossing)");
+
         do
             res = read(fd, &e.is_dir , sizeof e.is_dir);
         while(res == -1 && errno == EINTR);
         if (res != sizeof e.is_dir)
             error("Could not deserialize index (is_dir)");
 
+        do
+            res = read(fd, &e.has_signature, sizeof e.has_signature);
+        while(res == -1 && errno == EINTR);
+        if (res != sizeof e.has_signature)
+            error("Could not deserialize index (has_signature)");
+
         do
             res = read(fd, &len , sizeof len);
         while(res == -1 && errno == EINTR);
@@ -515,6 +752,23 @@ free_index()
     myindex.search_until = 0;
 }
 
+/* Adds to an index block link where the data of the file goes on in the
+ * next block, if it does, for extracting byte ranges (--range). */
+void
+index_link_add_crossing(char *link, size_t len, unsigned long long data_start,
+        unsigned long long size)
+{
+    unsigned long long next_block = (data_start / command_line.blocksize + 1)
+        * command_line.blocksize;
+    size_t linklen = strlen(link);
+
+    if (data_start + size <= next_block)
+        return;
+
+    snprintf(link + linklen, len - linklen, ";c=%llu:%llu",
+            next_block - data_start, command_line.blocksize);
+}
+
 #ifdef INDEXTEST
 
 struct command_line command_line;
@@ -5,19 +5,32 @@ struct IndexElem {
     time_t mtime;
     int block;
     int nblocks;
+    long long offset; /* In the first block tar, or -1 if unknown */
+    unsigned long long size;
+    long long crossing; /* Offset in the file where its second block starts,
+                           or -1 if unknown */
+    unsigned long long crossing_blocksize;
     char *signature;
     int signaturelen;
     char seen;
     char is_dir;
+    char has_signature; /* Maybe in a signatures member, not loaded */
 } *ptr;
 
 void index_load_from_fd(int fd);
+void index_load_signatures_from_fd(int fd);
 struct IndexElem * index_find_element(const char *name);
 const struct IndexElem * index_get_elements(size_t *nelems);
 void send_index_to_fd(int fd);
 void recv_index_from_fd(int fd);
+struct directory;
+char * tar_find_member(int fd, const struct directory *dir, const char *prefix,
+        unsigned long long *size);
 char * index_find_in_tar(int fd, unsigned long long *size);
+void index_end_shard(size_t from, int endblock);
 int block_name_to_int(const char *str);
 void free_index();
 void index_sort();
 void index_sort_inverse();
+void index_link_add_crossing(char *link, size_t len,
+        unsigned long long data_start, unsigned long long size);
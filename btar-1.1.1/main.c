@@ -25,7 +25,9 @@
 #include <signal.h>
 #include <limits.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -40,6 +42,20 @@
 #include "filememory.h"
 #include "listindex.h"
 #include "extract.h"
+#include "directory.h"
+#include "frames.h"
+#include "checksums.h"
+#include "parity.h"
+#include "indexshard.h"
+#include "indexcache.h"
+#include "readtar.h"
+#include "restoreplan.h"
+#include "repair.h"
+#include "checkpoint.h"
+#include "append.h"
+#include "consolidate.h"
+#include "mangle.h"
+#include "repository.h"
 
 #define STRVERSION_(x) #x
 #define STRVERSION(x) STRVERSION_(x)
@@ -57,10 +73,16 @@ static struct main_archive
     int nextblock;
     char *data;
     size_t insize;
+    struct directory directory; /* Offsets of the members written */
+    struct frame_table frames; /* Of the blocks written, with --frame-size */
+    struct checksum_table checksums; /* Of the blocks written */
+    int blocks_written;
 } main_archive;
 static struct file_memory *im = 0; /* index.tar memory, received from the filters */
 static struct file_memory *dm = 0; /* deleted.tar memory, received from the filters */
+static struct file_memory *sm = 0; /* signatures.tar memory, received from the filters */
 static struct block_process *ref_reading_bp; /* Just for USR1 convenience */
+static struct append append; /* The btar as it was, on --append */
 unsigned long long total_read_in_full_blocks = 0;
 
 void
@@ -71,6 +93,10 @@ mainarchive_open(struct main_archive *ma, int outfd)
     mytar_open_fd(ma->archive, outfd);
 
     ma->nextblock = 0;
+    ma->blocks_written = 0;
+    directory_init(&ma->directory);
+    frame_table_init(&ma->frames, command_line.frame_size);
+    checksum_table_init(&ma->checksums);
 }
 
 void
@@ -171,6 +197,24 @@ void usr1_handler(int s)
     fputc('\n', stderr);
 }
 
+/* Once we stopped reading from them on purpose, the children may
+ * die or fail */
+static int children_may_fail;
+
+void let_children_fail()
+{
+    children_may_fail = 1;
+}
+
+/* Gets the children reaped before anything else; returning 1, the
+ * child was its own, and its exit is not checked here */
+static int (*child_exit_hook)(int pid, int status);
+
+void set_child_exit_hook(int (*hook)(int pid, int status))
+{
+    child_exit_hook = hook;
+}
+
 void child_handler(int s)
 {
     int status;
@@ -192,6 +236,12 @@ void child_handler(int s)
         if (pid == -1)
             error("Error on waitpid");
 
+        if (child_exit_hook && child_exit_hook(pid, status))
+            continue;
+
+        if (children_may_fail)
+            continue;
+
         if (WIFEXITED(status))
         {
             if (WEXITSTATUS(status) != 0)
@@ -236,9 +286,19 @@ void usage()
            "              In this case, non-options mean glob patterns to extract.\n");
     printf("   -T       Extract the btar contents as a tar to stdout.\n"
            "              In this case, non-options mean glob patterns to extract.\n");
-    printf("   -l       List the btar index contents.\n");
+    printf("   -O       Extract the contents of the btar files to stdout.\n"
+           "              In this case, non-options mean glob patterns to extract.\n");
+    printf("   -l       List the btar index contents.\n"
+           "              In this case, non-options mean glob patterns to list.\n");
     printf("   -L       Output the btar index as tar.\n");
     printf("   -m       Mangle filters and block size from stdin to output btar (-f or stdout)).\n");
+    printf("   --repair[=missing]  Rebuild the lost blocks of the btar from its parity,\n"
+           "              and output the repaired btar, or only the rebuilt blocks.\n");
+    printf("   --verify Check the blocks against their checksums, and their contents\n"
+           "              against the index, defiltering -j blocks at once.\n");
+    printf("   --consolidate  Output a full btar made of the btar files of -f, a full\n"
+           "              one and its differentials, copying the blocks still in use,\n"
+           "              to the file of -o or to stdout.\n");
     printf("   (none)   Make btar file from the standard input data (filter mode).\n");
     printf("options only meaningful when creating or filtering:\n");
     printf("   -b <blocksize>   Set the block size in megabytes (default 10MiB)\n");
@@ -248,19 +308,51 @@ void usage()
            "                      or stdin/out if ommitted.\n");
     printf("   -F <filter>      Filter each block through program named 'filter'.\n");
     printf("   -H               Delete files as noted in diff backups, when extracting.\n");
-    printf("   -j <n>           Number of blocks to filter in parallel.\n");
+    printf("   -j <n>           Number of blocks to filter in parallel, or to\n"
+           "                      defilter when extracting.\n");
     printf("   -N               Skip making an index in the btar, make only blocks.\n");
     printf("   -R               Add a XOR redundancy block.\n");
+    printf("   --keep-blocks    With -m, copy the blocks as they are even if -G or the\n"
+           "                      -F arguments differ from what their names say.\n");
+    printf("   --checkpoint <f> Write to the file 'f' where the btar is, at the end of\n"
+           "                      a block, for a later --resume (on action 'c', with -f).\n");
+    printf("   --checkpoint-interval <s>\n"
+           "                    Seconds between the checkpoints (default 60), or 0\n"
+           "                      for every block.\n");
+    printf("   --resume         Go on with the btar of -f from its --checkpoint file.\n");
+    printf("   --append         Add the new blocks to the btar of -f, taking it as\n"
+           "                      reference as -d, and merge their index into its own.\n");
+    printf("   --repository <d> Keep the blocks as content-defined chunks in the directory\n"
+           "                      'd', storing only those not there yet; needed also\n"
+           "                      to extract from the btar.\n");
+    printf("   --parity <k/n>   Add 'k' Reed-Solomon parity members for every 'n'\n"
+           "                      blocks.\n");
+    printf("   --xor-groups <n> As -R, with 'n' XOR blocks, block i going to the XOR\n"
+           "                      block i mod n, for any n damaged blocks in a row.\n");
+    printf("   -S <depth>       Split the index in members by the first 'depth' path\n"
+           "                      components, to load only those needed later.\n");
     printf("   -U <filter>      Filters for the index and deleted list.\n");
     printf("   -v               Output the file names on stderr (on action 'c').\n");
     printf("   -X <pattern>     Add glob exclude pattern.\n");
 #ifdef WITH_LIBRSYNC
-    printf("   -Y               Create and use rsync signatures in indices for binary diff.\n");
+    printf("   -Y               Create and use rsync signatures for binary diff.\n");
 #endif
     printf("other options:\n");
     printf("   -G <defilter>    Defilter each input block through program named 'filter'.\n"
            "                      May be relevant for '-d' when creating/filtering, or extracting.\n");
+    printf("   -C               Keep the decoded indices in a cache, under\n"
+           "                      $XDG_CACHE_HOME/btar, for later -l, -x, -T or -d.\n");
+    printf("   -W <n>           Create the extracted files from 'n' writer processes,\n"
+           "                      not to wait for them while decoding (on action 'x').\n");
     printf("   -V               Show traces of what goes on. More V mean more traces.\n");
+    printf("   -o <file>        Output file of --consolidate, instead of stdout.\n");
+    printf("   --range <off:len>  Extract only 'len' bytes from offset 'off' of the files,\n"
+           "                      into the existing files (-x) or to stdout (-O).\n");
+    printf("   --index-file <f> Write also the index to the file 'f' (on 'c', 'm' or filter),\n"
+           "                      or take it from there on extraction, to skip blocks\n"
+           "                      even reading the btar from a pipe.\n");
+    printf("   --frame-size <m> Filter the blocks in frames of 'm' megabytes, so extracting\n"
+           "                      with the index starts at the frame of the wanted files.\n");
     printf("examples:\n");
     printf("   tar c /home | btar -b 50 -F xz > /tmp/homebackup.btar\n");
     printf("   btar -F xz -c -f mydir.btar mydir\n");
@@ -281,12 +373,27 @@ void set_default_command_line()
     command_line.input_files = 0;
     command_line.paths = 0;
     command_line.parallelism = 1;
+    command_line.writers = 0;
     command_line.xorblock = 0;
+    command_line.parity_k = 0;
+    command_line.parity_n = 0;
     command_line.should_rsync = 0;
     command_line.should_delete = 0;
     command_line.rsync_block_size = 128*1024;
     command_line.rsync_minimal_size = 2 * command_line.rsync_block_size;
     command_line.rsync_max_delta = 100*1024*1024;
+    command_line.index_shard_depth = 0;
+    command_line.index_cache = 0;
+    command_line.range = 0;
+    command_line.index_file = 0;
+    command_line.frame_size = 0;
+    command_line.checkpoint_file = 0;
+    command_line.checkpoint_interval = 60;
+    command_line.resume = 0;
+    command_line.append = 0;
+    command_line.repository = 0;
+    command_line.output_file = 0;
+    command_line.keep_blocks = 0;
 }
 
 static void
@@ -324,6 +431,22 @@ add_path(const char *c)
     add_to_string_vector(&command_line.paths, c);
 }
 
+static void
+set_range(const char *arg)
+{
+    char *end;
+
+    command_line.range_offset = strtoull(arg, &end, 10);
+    if (end == arg || *end != ':')
+        fatal_error_no_core("The range should be <offset>:<length>");
+    arg = end + 1;
+    command_line.range_length = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0' || command_line.range_length == 0)
+        fatal_error_no_core("The range should be <offset>:<length>, "
+                "with a length of at least 1");
+    command_line.range = 1;
+}
+
 static void
 add_exclude_pattern(const char *c)
 {
@@ -369,19 +492,57 @@ add_reference(enum reftype t, char *c)
     add_to_string_vector(&command_line.references, c);
 }
 
+/* The options with no single letter */
+enum
+{
+    OPT_RANGE = 256,
+    OPT_INDEX_FILE,
+    OPT_FRAME_SIZE,
+    OPT_REPAIR,
+    OPT_XOR_GROUPS,
+    OPT_VERIFY,
+    OPT_CHECKPOINT,
+    OPT_RESUME,
+    OPT_APPEND,
+    OPT_CONSOLIDATE,
+    OPT_REPOSITORY,
+    OPT_PARITY,
+    OPT_CHECKPOINT_INTERVAL,
+    OPT_KEEP_BLOCKS
+};
+
+static const struct option long_options[] = {
+    { "range", required_argument, 0, OPT_RANGE },
+    { "index-file", required_argument, 0, OPT_INDEX_FILE },
+    { "frame-size", required_argument, 0, OPT_FRAME_SIZE },
+    { "repair", optional_argument, 0, OPT_REPAIR },
+    { "xor-groups", required_argument, 0, OPT_XOR_GROUPS },
+    { "verify", no_argument, 0, OPT_VERIFY },
+    { "checkpoint", required_argument, 0, OPT_CHECKPOINT },
+    { "checkpoint-interval", required_argument, 0, OPT_CHECKPOINT_INTERVAL },
+    { "resume", no_argument, 0, OPT_RESUME },
+    { "append", no_argument, 0, OPT_APPEND },
+    { "consolidate", no_argument, 0, OPT_CONSOLIDATE },
+    { "repository", required_argument, 0, OPT_REPOSITORY },
+    { "parity", required_argument, 0, OPT_PARITY },
+    { "keep-blocks", no_argument, 0, OPT_KEEP_BLOCKS },
+    { 0, 0, 0, 0 }
+};
+
 void parse_command_line(int argc, char *argv[])
 {
     int c;
+    int res;
 
     set_default_command_line();
 
     /* Parse options */
     while(1) {
-        c = getopt(argc, argv, "b:f:F:U:G:HNvVX:D:d:cxTlLj:Rhm"
+        c = getopt_long(argc, argv, "b:f:F:U:G:HNvVX:D:d:cxTOlLj:RhmS:CW:o:"
 #ifdef WITH_LIBRSYNC
                 "Y"
 #endif
-                );
+                , long_options, 0);
 
         if (c == -1)
             break;
@@ -436,6 +597,9 @@ void parse_command_line(int argc, char *argv[])
             case 'T':
                 command_line.action = EXTRACT_TO_TAR;
                 break;
+            case 'O':
+                command_line.action = EXTRACT_TO_STDOUT;
+                break;
             case 'l':
                 command_line.action = LIST_INDEX;
                 break;
@@ -448,28 +612,204 @@ void parse_command_line(int argc, char *argv[])
             case 'j':
                 command_line.parallelism = atoi(optarg);
                 break;
+            case 'W':
+                command_line.writers = atoi(optarg);
+                if (command_line.writers < 0)
+                    fatal_error_no_core("The number of writers cannot be negative");
+                break;
             case 'R':
-                command_line.xorblock = 1;
+                if (!command_line.xorblock)
+                    command_line.xorblock = 1;
                 break;
             case 'Y':
                 command_line.should_rsync = 1;
                 break;
+            case 'S':
+                command_line.index_shard_depth = atoi(optarg);
+                if (command_line.index_shard_depth <= 0)
+                    fatal_error_no_core("The index shard depth should be at least 1");
+                break;
+            case 'C':
+                command_line.index_cache = 1;
+                break;
+            case 'o':
+                command_line.output_file = optarg;
+                break;
+            case OPT_RANGE:
+                set_range(optarg);
+                break;
+            case OPT_INDEX_FILE:
+                command_line.index_file = optarg;
+                break;
+            case OPT_FRAME_SIZE:
+                command_line.frame_size = (size_t) 1024 * 1024 * atoi(optarg);
+                if (command_line.frame_size == 0)
+                    fatal_error_no_core("The frame size should be at least 1MiB");
+                break;
+            case OPT_REPAIR:
+                command_line.action = REPAIR;
+                if (optarg && strcmp(optarg, "missing") == 0)
+                    command_line.repair_missing = 1;
+                else if (optarg)
+                    fatal_error_no_core("--repair only takes 'missing'");
+                break;
+            case OPT_VERIFY:
+                command_line.action = VERIFY;
+                break;
+            case OPT_CHECKPOINT:
+                command_line.checkpoint_file = optarg;
+                break;
+            case OPT_CHECKPOINT_INTERVAL:
+                command_line.checkpoint_interval = atoi(optarg);
+                if (command_line.checkpoint_interval < 0)
+                    fatal_error_no_core("The checkpoint interval cannot be "
+                            "negative");
+                break;
+            case OPT_RESUME:
+                command_line.resume = 1;
+                break;
+            case OPT_APPEND:
+                command_line.append = 1;
+                break;
+            case OPT_CONSOLIDATE:
+                command_line.action = CONSOLIDATE;
+                break;
+            case OPT_REPOSITORY:
+                command_line.repository = optarg;
+                break;
+            case OPT_KEEP_BLOCKS:
+                command_line.keep_blocks = 1;
+                break;
+            case OPT_PARITY:
+                res = parity_parse(optarg, &command_line.parity_k,
+                        &command_line.parity_n);
+                if (res == 0)
+                    fatal_error_no_core("--parity should be given as k/n");
+                if (res == -1)
+                    fatal_error_no_core("The parity k/n should have k and n "
+                            "of at least 1, and k + n up to 256");
+                break;
+            case OPT_XOR_GROUPS:
+                command_line.xorblock = atoi(optarg);
+                if (command_line.xorblock <= 0)
+                    fatal_error_no_core("The XOR groups should be at least 1");
+                break;
             case '?':
                 fprintf(stderr, "Wrong option %c.\n", optopt);
                 exit(-1);
         }
     }
 
+    if (command_line.range && command_line.action != EXTRACT &&
+            command_line.action != EXTRACT_TO_STDOUT)
+        fatal_error_no_core("--range only works with -x or -O");
+
+    if (command_line.index_file && command_line.action != CREATE &&
+            command_line.action != FILTER && command_line.action != MANGLE &&
+            command_line.action != EXTRACT &&
+            command_line.action != EXTRACT_TO_TAR &&
+            command_line.action != EXTRACT_TO_STDOUT &&
+            command_line.action != VERIFY)
+        fatal_error_no_core("--index-file only works with -c, -m, -x, -T, -O, "
+                "--verify or filtering");
+
+    if (command_line.index_file && !command_line.add_create_index)
+        fatal_error_no_core("--index-file does not go with -N");
+
+    if (command_line.frame_size && (!filter ||
+                (command_line.action != CREATE && command_line.action != FILTER &&
+                 command_line.action != MANGLE &&
+                 command_line.action != CONSOLIDATE)))
+        fatal_error_no_core("--frame-size only works with -F, on -c, -m, "
+                "--consolidate or filtering");
+
+    /* Extracting, the frames of a block go through a single defilter */
+    if (command_line.frame_size && !filters_concatenate(filter))
+        fatal_error_no_core("--frame-size only works with filters that decode "
+                "their outputs concatenated: cat, gzip, pigz, bzip2, pbzip2, "
+                "lbzip2, xz, pxz, lzip, plzip, zstd, pzstd or lz4");
+
+    if (command_line.keep_blocks && command_line.action != MANGLE)
+        fatal_error_no_core("--keep-blocks only works with -m");
+
+    if (command_line.checkpoint_file && command_line.action != CREATE)
+        fatal_error_no_core("--checkpoint only works with -c");
+
+    if (command_line.resume && !command_line.checkpoint_file)
+        fatal_error_no_core("--resume needs the --checkpoint file");
+
+    /* The signatures would need the files already stored read again */
+    if (command_line.resume && command_line.should_rsync)
+        fatal_error_no_core("--resume does not go with -Y");
+
+    if (command_line.append && command_line.action != CREATE)
+        fatal_error_no_core("--append only works with -c");
+
+    if (command_line.append && !command_line.add_create_index)
+        fatal_error_no_core("--append does not go with -N");
+
+    /* The deltas would be of files in the same btar */
+    if (command_line.append && command_line.should_rsync)
+        fatal_error_no_core("--append does not go with -Y");
+
+    if (command_line.append && command_line.checkpoint_file)
+        fatal_error_no_core("--append does not go with --checkpoint");
+
+    if (command_line.repository && command_line.action != CREATE &&
+            command_line.action != FILTER && command_line.action != EXTRACT &&
+            command_line.action != EXTRACT_TO_TAR &&
+            command_line.action != EXTRACT_TO_STDOUT &&
+            command_line.action != VERIFY)
+        fatal_error_no_core("--repository only works with -c, -x, -T, -O, "
+                "--verify or filtering");
+
+    /* The chunks are filtered each on its own */
+    if (command_line.repository && command_line.frame_size)
+        fatal_error_no_core("--repository does not go with --frame-size");
+
+    if (command_line.repository && (command_line.append ||
+                command_line.checkpoint_file))
+        fatal_error_no_core("--repository does not go with --append or "
+                "--checkpoint");
+
+    /* The chunks are filtered one after another, as each block ends */
+    if (command_line.repository && command_line.parallelism > 1 &&
+            (command_line.action == CREATE || command_line.action == FILTER))
+        fatal_error_no_core("--repository does not go with -j on -c or "
+                "filtering");
+
+    /* The redundancy would be that of the lists of chunks only */
+    if (command_line.repository && (command_line.xorblock ||
+                command_line.parity_k))
+        fatal_error_no_core("--repository does not go with -R, --parity or "
+                "--xor-groups");
+
+    /* A frame as big as the block is the usual single frame */
+    if (command_line.frame_size >= command_line.blocksize)
+        command_line.frame_size = 0;
+
     if (!filterindex)
         filterindex = filter;
 
+    /* The blocks stay raw until cut in chunks, and the -F goes to those */
+    if (command_line.repository && (command_line.action == CREATE ||
+                command_line.action == FILTER))
+    {
+        repository_init(command_line.repository, filter);
+        filter = 0;
+    }
+    else if (command_line.repository)
+        repository_init(command_line.repository, 0);
+
     if (optind < argc)
     {
         if (command_line.action != EXTRACT &&
                 command_line.action != EXTRACT_TO_TAR &&
+                command_line.action != EXTRACT_TO_STDOUT &&
+                command_line.action != LIST_INDEX &&
                 command_line.action != CREATE)
         {
-            fatal_error_no_core("Paths not accepted unless -c or -x");
+            fatal_error_no_core("Paths not accepted unless -c, -x, -T, -O or -l");
         }
         while (optind < argc)
         {
@@ -489,7 +829,7 @@ set_cloexec(int fd)
 }
 
 void
-run_index_reader(int fdin, int *fdout, int closechild1)
+run_index_reader(int fdin, int *fdout, int closechild1, int cachefd)
 {
     int pid;
     int res;
@@ -510,6 +850,12 @@ run_index_reader(int fdin, int *fdout, int closechild1)
         close(closechild1);
         free_index();
         index_load_from_fd(fdin);
+        /* The cache first, so it is complete when the parent has all */
+        if (cachefd >= 0)
+        {
+            send_index_to_fd(cachefd);
+            close(cachefd);
+        }
         send_index_to_fd(mypipe[1]);
         exit(0);
     }
@@ -517,6 +863,8 @@ run_index_reader(int fdin, int *fdout, int closechild1)
     {
         close(fdin);
         close(mypipe[1]);
+        if (cachefd >= 0)
+            close(cachefd);
         *fdout = mypipe[0];
         if (command_line.debug)
             fprintf(stderr, "Starting index reader PID %i, reading from fd %i \n", pid,
@@ -524,48 +872,20 @@ run_index_reader(int fdin, int *fdout, int closechild1)
     }
 }
 
-void
-load_index_from_tar(int fd)
+/* Copies 'size' bytes of a member from the btar in 'fd' to 'outfd' */
+static void
+copy_member(int fd, int outfd, unsigned long long size)
 {
-    char *name;
-    int filterin, filterout;
-    int indexin;
-    unsigned long long indexsize;
-    struct filter *mydefilter;
     char *buffer;
 
-    name = index_find_in_tar(fd, &indexsize);
-    if (!name)
-    {
-        if (command_line.debug)
-            fprintf(stderr, "Cannot find index in btar\n");
-        return;
-    }
-
-    if (command_line.debug)
-        fprintf(stderr, "Index file name in main btar: %s\n", name);
-
-    if (defilter)
-        mydefilter = defilter;
-    else
-        mydefilter = defilters_from_extensions(name);
-
-    free(name);
-
-    run_filters(mydefilter, &filterin, &filterout);
-    set_cloexec(filterin);
-    set_cloexec(filterout);
-
-    run_index_reader(filterout, &indexin, filterin);
-
     buffer = malloc(buffersize);
     if (!buffer)
         fatal_error("Cannot allocate");
 
-    while(indexsize > 0)
+    while(size > 0)
     {
         int res;
-        unsigned long long toread = indexsize;
+        unsigned long long toread = size;
         int towrite;
         int written;
 
@@ -574,13 +894,15 @@ load_index_from_tar(int fd)
 
         res = read(fd, buffer, toread);
         if (res == -1)
-            error("Cannot read index file from the btar");
+            error("Cannot read member from the btar");
+        if (res == 0)
+            fatal_error("Unexpected end of btar reading a member");
 
         written = 0;
         towrite = res;
         while(towrite > 0)
         {
-            res = write(filterin, buffer + written, towrite);
+            res = write(outfd, buffer + written, towrite);
             if (res == -1)
             {
                 if (errno != EINTR)
@@ -591,20 +913,546 @@ load_index_from_tar(int fd)
             written += res;
         }
 
-        indexsize -= written;
+        size -= written;
     }
 
-    close(filterin);
     free(buffer);
+}
+
+static void
+load_index_member(int fd, const char *name, unsigned long long indexsize)
+{
+    int filterin, filterout;
+    int indexin;
+    struct filter *mydefilter;
+    struct index_cache cache;
+    int use_cache = 0;
+    int cachefd = -1;
+
+    if (command_line.debug)
+        fprintf(stderr, "Index file name in main btar: %s\n", name);
+
+    if (command_line.index_cache)
+        use_cache = index_cache_init(&cache, fd, name, indexsize);
+
+    if (use_cache && index_cache_load(&cache))
+    {
+        /* Leave fd as if we had read the member */
+        if (lseek(fd, indexsize, SEEK_CUR) == -1)
+            error("Cannot lseek the btar");
+        return;
+    }
+
+    if (use_cache)
+        cachefd = index_cache_create(&cache);
+
+    if (defilter)
+        mydefilter = defilter;
+    else
+        mydefilter = defilters_from_extensions(name);
+
+    run_filters(mydefilter, &filterin, &filterout);
+    set_cloexec(filterin);
+    set_cloexec(filterout);
+
+    run_index_reader(filterout, &indexin, filterin, cachefd);
+
+    copy_member(fd, filterin, indexsize);
+
+    close(filterin);
 
     recv_index_from_fd(indexin);
 
+    if (cachefd >= 0)
+        index_cache_commit(&cache);
+
     if (mydefilter != defilter)
         free(mydefilter);
 
     close(indexin);
 }
 
+/* Returns the number of blocks in the archive if the index is sharded,
+ * as then only the shards that 'paths' may match are loaded. Else -1,
+ * or -2 if there is no index at all. */
+int
+load_index_from_tar(int fd, const char **paths)
+{
+    struct directory dir;
+    int have_directory;
+    struct index_map map;
+    char *name;
+    unsigned long long indexsize;
+    int nblocks = -1;
+
+    have_directory = directory_load(&dir, fd);
+
+    name = tar_find_member(fd, have_directory ? &dir : 0, "index.tar",
+            &indexsize);
+    if (name)
+    {
+        load_index_member(fd, name, indexsize);
+        free(name);
+    }
+    else if (lseek(fd, 0, SEEK_SET) != -1 &&
+            index_map_load(&map, fd, have_directory ? &dir : 0))
+    {
+        int i;
+
+        for(i=0; i < map.nshards; ++i)
+        {
+            size_t first;
+
+            if (!index_shard_may_match(&map, i, paths))
+            {
+                if (command_line.debug)
+                    fprintf(stderr, "Skipping index shard %i (%s)\n", i,
+                            map.shards[i].prefix);
+                continue;
+            }
+
+            name = index_shard_find(fd, have_directory ? &dir : 0, i,
+                    &indexsize);
+            if (!name)
+                fatal_error("Cannot find the index shard %i in btar", i);
+
+            index_get_elements(&first);
+            load_index_member(fd, name, indexsize);
+            index_end_shard(first, index_shard_end_block(&map, i));
+            free(name);
+        }
+        nblocks = map.nblocks;
+        index_map_free(&map);
+    }
+    else
+    {
+        if (command_line.debug)
+            fprintf(stderr, "Cannot find index in btar\n");
+        nblocks = -2;
+    }
+
+    if (have_directory)
+        directory_free(&dir);
+
+    return nblocks;
+}
+
+/* An index file, as given to -D or --index-file. "-" is stdin. */
+void
+load_index_file(const char *name)
+{
+    struct filter *mydefilter = 0;
+    int fd;
+    int fdout;
+
+    if (strcmp(name, "-") == 0)
+        fd = dup(0);
+    else
+    {
+        fd = open(name, O_RDONLY);
+
+        if (fd == -1)
+            fatal_errno("Cannot open the index file %s", name);
+
+        if (defilter)
+            mydefilter = defilter;
+        else
+            mydefilter = defilters_from_extensions(name);
+    }
+
+    run_filters_given_fdin(mydefilter, fd, &fdout);
+
+    index_load_from_fd(fdout);
+
+    close(fdout);
+
+    if (mydefilter != defilter)
+        free_filters(mydefilter);
+}
+
+/* The rsync signatures are only needed for references of a -Y creation, and
+ * they live in their own member, so the index loading does not pay for them.
+ * The index has to be sorted. */
+static void
+load_signatures_from_tar(int fd)
+{
+    struct directory dir;
+    int have_directory;
+    char *name;
+    unsigned long long size;
+    int filterin, filterout;
+    struct filter *mydefilter;
+    int pid;
+
+    have_directory = directory_load(&dir, fd);
+
+    name = tar_find_member(fd, have_directory ? &dir : 0, "signatures.tar",
+            &size);
+
+    if (have_directory)
+        directory_free(&dir);
+
+    if (!name)
+    {
+        if (command_line.debug)
+            fprintf(stderr, "No signatures in the reference btar\n");
+        return;
+    }
+
+    if (defilter)
+        mydefilter = defilter;
+    else
+        mydefilter = defilters_from_extensions(name);
+
+    run_filters(mydefilter, &filterin, &filterout);
+    set_cloexec(filterin);
+    set_cloexec(filterout);
+
+    pid = fork();
+    if (pid == -1)
+        error("Cannot fork");
+    else if (pid == 0)
+    {
+        close(filterout);
+        copy_member(fd, filterin, size);
+        close(filterin);
+        exit(0);
+    }
+
+    close(filterin);
+
+    if (command_line.debug)
+        fprintf(stderr, "Loading signatures from %s, writer PID %i\n", name, pid);
+
+    index_load_signatures_from_fd(filterout);
+    close(filterout);
+
+    if (mydefilter != defilter)
+        free(mydefilter);
+    free(name);
+}
+
+struct deleted_cb
+{
+    void (*deleted)(const char *name, int is_dir);
+};
+
+static enum readtar_newfile_result
+deleted_new_file_cb(const struct readtar_file *file, void *userdata)
+{
+    const struct deleted_cb *dcb = (const struct deleted_cb *) userdata;
+
+    dcb->deleted(file->name, file->header->typeflag[0] == '5');
+    return READTAR_NORMAL;
+}
+
+static void
+deleted_new_data_cb(const char *data, size_t len, void *userdata)
+{
+    data = data;
+    len = len;
+    userdata = userdata;
+}
+
+/* Calls 'deleted' for every entry of the deleted list of the btar */
+void
+load_deleted_from_tar(int fd, void (*deleted)(const char *name, int is_dir))
+{
+    struct directory dir;
+    int have_directory;
+    char *name;
+    unsigned long long size;
+    int filterin, filterout;
+    struct filter *mydefilter;
+    struct readtar rt;
+    struct deleted_cb dcb = { deleted };
+    struct readtar_callbacks cb = { deleted_new_file_cb,
+        deleted_new_data_cb, &dcb };
+    int pid;
+
+    have_directory = directory_load(&dir, fd);
+
+    name = tar_find_member(fd, have_directory ? &dir : 0, "deleted.tar",
+            &size);
+
+    if (have_directory)
+        directory_free(&dir);
+
+    if (!name)
+        return;
+
+    if (defilter)
+        mydefilter = defilter;
+    else
+        mydefilter = defilters_from_extensions(name);
+
+    run_filters(mydefilter, &filterin, &filterout);
+    set_cloexec(filterin);
+    set_cloexec(filterout);
+
+    pid = fork();
+    if (pid == -1)
+        error("Cannot fork");
+    else if (pid == 0)
+    {
+        close(filterout);
+        copy_member(fd, filterin, size);
+        close(filterin);
+        exit(0);
+    }
+
+    close(filterin);
+
+    init_readtar(&rt, &cb);
+    read_full_tar(filterout, &rt);
+    close(filterout);
+
+    if (mydefilter != defilter)
+        free(mydefilter);
+    free(name);
+}
+
+static void
+plan_deleted(const char *name, int is_dir)
+{
+    /* The directories are not in the plan */
+    if (!is_dir)
+        restore_plan_deleted(name);
+}
+
+/* Before extracting a series of archives, find out from which of them
+ * each file has to come, not to write it once per archive. Returns 0 if
+ * any of them has no index, or cannot be seeked. */
+static int
+plan_restore()
+{
+    int i;
+
+    for(i=0; command_line.input_files[i]; ++i)
+    {
+        int fd;
+        int res;
+        size_t nelems;
+        size_t j;
+        const struct IndexElem *ptr;
+
+        fd = open(command_line.input_files[i], O_RDONLY);
+        if (fd == -1)
+            fatal_errno("Cannot open the btar file %s",
+                    command_line.input_files[i]);
+        set_cloexec(fd);
+
+        if (lseek(fd, 0, SEEK_CUR) == -1 ||
+                load_index_from_tar(fd, command_line.paths) == -2)
+        {
+            if (command_line.debug)
+                fprintf(stderr, "No restore plan, as %s has no index\n",
+                        command_line.input_files[i]);
+            close(fd);
+            free_index();
+            restore_plan_free();
+            return 0;
+        }
+
+        ptr = index_get_elements(&nelems);
+        for(j=0; j < nelems; ++j)
+            if (!ptr[j].is_dir)
+                restore_plan_add(ptr[j].name, i);
+        free_index();
+
+        /* Only with -H the deleted files are not restored */
+        if (command_line.should_delete)
+        {
+            res = lseek(fd, 0, SEEK_SET);
+            if (res == -1)
+                fatal_errno("Cannot lseek the btar");
+            load_deleted_from_tar(fd, plan_deleted);
+        }
+        close(fd);
+    }
+
+    return 1;
+}
+
+/* The same index as in the archive, for extracting from a pipe. The raw
+ * index of a sharded archive has to be filtered as a whole. */
+static void
+write_index_file(struct file_memory *im, struct filter *f)
+{
+    int fd;
+
+    if (command_line.debug)
+        fprintf(stderr, "Writing the index file %s\n", command_line.index_file);
+
+    fd = open(command_line.index_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd == -1)
+        fatal_errno("Cannot open the index file %s for writing",
+                command_line.index_file);
+
+    if (f)
+        index_shards_to_fd(im, f, fd);
+    else
+        file_memory_to_fd(im, fd);
+
+    if (close(fd) == -1)
+        fatal_errno("Cannot write the index file %s", command_line.index_file);
+}
+
+/* The btar loses whatever came after the blocks of the checkpoint */
+static void
+resume_archive(int fd)
+{
+    struct stat st;
+    int blocks;
+    unsigned long long offset;
+
+    checkpoint_load(command_line.checkpoint_file, &blocks, &offset,
+            &main_archive.directory, &main_archive.frames,
+            &main_archive.checksums);
+
+    if (fstat(fd, &st) == -1)
+        error("Cannot stat the btar file");
+    if (!S_ISREG(st.st_mode) || (unsigned long long) st.st_size < offset)
+        fatal_error_no_core("error: the btar file does not reach its checkpoint");
+
+    if (ftruncate(fd, offset) == -1)
+        fatal_errno("Cannot truncate the btar file to %llu bytes", offset);
+    if (lseek(fd, offset, SEEK_SET) == -1)
+        error("Cannot seek the btar file");
+
+    main_archive.archive->total_written = offset;
+    main_archive.nextblock = blocks;
+    main_archive.blocks_written = blocks;
+
+    if (command_line.verbose)
+        fprintf(stderr, "Resuming after block %i\n", blocks - 1);
+}
+
+/* The parity members of the group going on and the xorblocks are made
+ * again from the blocks kept, that are checked on the way */
+static void
+resume_redundancy(int fd, struct parity *parity, struct block **xorblocks)
+{
+    int group_start = main_archive.blocks_written;
+    int first;
+    char *data = 0;
+    size_t i;
+
+    if (command_line.parity_k)
+    {
+        group_start -= main_archive.blocks_written % command_line.parity_n;
+        parity->group = main_archive.blocks_written / command_line.parity_n;
+    }
+    first = xorblocks ? 0 : group_start;
+
+    for(i=0; i < main_archive.directory.nentries; ++i)
+    {
+        const struct directory_entry *e = &main_archive.directory.entries[i];
+        unsigned int raw, filtered;
+        int block;
+
+        if (sscanf(e->name, "block%i.tar", &block) != 1 || block < first)
+            continue;
+
+        data = realloc(data, e->size + 1);
+        if (!data)
+            fatal_error("Cannot realloc");
+        if (pread_all(fd, data, e->size, e->offset + 512) == -1)
+            fatal_error_no_core("error: cannot read the block %i kept in the btar",
+                    block);
+        if (checksum_table_find(&main_archive.checksums, block, &raw, &filtered)
+                && crc32c(0, data, e->size) != filtered)
+            fatal_error_no_core("error: the block %i kept in the btar is damaged",
+                    block);
+
+        if (xorblocks)
+            xor_data_to_xorblock(data, e->size,
+                    xorblocks[block % command_line.xorblock]);
+        if (command_line.parity_k && block >= group_start)
+            parity_add_block(parity, data, e->size);
+    }
+    free(data);
+}
+
+/* The btar loses the members after its blocks, which are kept in memory to
+ * be written again. Its index is the first reference. */
+static void
+append_archive(int fd)
+{
+    size_t i;
+
+    append_load(&append, fd);
+
+    frame_table_load(&main_archive.frames, fd, &append.dir);
+    if (!command_line.frame_size)
+        command_line.frame_size = main_archive.frames.framesize;
+    if (command_line.frame_size != main_archive.frames.framesize)
+        fatal_error_no_core("error: the --frame-size should be as in the btar");
+
+    checksum_table_load(&main_archive.checksums, fd, &append.dir);
+
+    for(i=0; i < append.dir.nentries; ++i)
+    {
+        const struct directory_entry *e = &append.dir.entries[i];
+        if (e->offset < append.end)
+            directory_add(&main_archive.directory, e->name, e->offset, e->size);
+    }
+
+    if (lseek(fd, 0, SEEK_SET) == -1)
+        error("Cannot seek the btar file");
+    load_index_from_tar(fd, 0);
+    index_sort();
+
+    if (ftruncate(fd, append.end) == -1)
+        fatal_errno("Cannot truncate the btar file to %llu bytes", append.end);
+    if (lseek(fd, append.end, SEEK_SET) == -1)
+        error("Cannot seek the btar file");
+
+    main_archive.archive->total_written = append.end;
+    main_archive.nextblock = append.nblocks;
+    main_archive.blocks_written = append.nblocks;
+
+    if (command_line.verbose)
+        fprintf(stderr, "Appending after block %i\n", append.nblocks - 1);
+}
+
+/* The raw list of the appended blocks, after the entries of the btar list
+ * 'old' that it does not replace, and through the filter 'f' */
+static struct file_memory *
+append_list(struct file_memory *fm, const struct block *old, struct filter *f)
+{
+    struct block *merged;
+    struct file_memory *res;
+
+    merged = append_merge(&append, old, fm ? fm->bo : 0);
+    res = filter_range(f, merged, 0, merged->total_written);
+    block_free(merged);
+    if (fm)
+        file_memory_free(fm);
+    return res;
+}
+
+/* The btar has to be on disk before the checkpoint says so. Each one
+ * costs two fsyncs, so they are written only every --checkpoint-interval. */
+static void
+write_checkpoint(int fd)
+{
+    static time_t last = 0;
+    time_t now = time(NULL);
+
+    if (last != 0 && now - last < command_line.checkpoint_interval)
+        return;
+
+    if (fsync(fd) == -1)
+        fatal_errno("Cannot sync the btar file for the checkpoint");
+
+    if (checkpoint_write(command_line.checkpoint_file,
+                main_archive.blocks_written,
+                main_archive.archive->total_written, &main_archive.directory,
+                &main_archive.frames, &main_archive.checksums))
+        last = now;
+}
+
 static void
 create_or_filter(int outfd)
 {
@@ -612,17 +1460,25 @@ create_or_filter(int outfd)
     int index_from_tar_fd = -1;
     int doing_index = 0;
     int doing_deleted = 0;
+    int doing_signatures = 0;
+    struct filter *index_filter = 0;
     int i;
 
     struct block_process **bp;
     int reading_bp;
     int writing_bp;
-    struct block *xorblock = 0;
+    struct block **xorblocks = 0;
+    struct parity parity;
 
     assert(main_archive.archive == 0);
     mainarchive_open(&main_archive, outfd);
     set_cloexec(outfd);
 
+    if (command_line.resume)
+        resume_archive(outfd);
+    else if (command_line.append)
+        append_archive(outfd);
+
     if (command_line.action == CREATE)
     {
         int mypipe[2];
@@ -632,6 +1488,8 @@ create_or_filter(int outfd)
         int index_filterout = -1;
         int deleted_filterin = -1;
         int deleted_filterout = -1;
+        int signatures_filterin = -1;
+        int signatures_filterout = -1;
 
         if (command_line.references)
         {
@@ -644,35 +1502,9 @@ create_or_filter(int outfd)
                             command_line.references[i]);
                 if (command_line.reference_types[i] == REF_INDEX)
                 {
-                    struct filter *mydefilter = 0;
-                    int fdout;
-
-                    if (strcmp(command_line.references[i], "-") == 0)
-                        fd = dup(0);
-                    else
-                    {
-                        fd = open(command_line.references[i], O_RDONLY);
-
-                        if (fd == -1)
-                            fatal_errno("Cannot open the index file %s",
-                                    command_line.references[i]);
-
-                        if (defilter)
-                            mydefilter = defilter;
-                        else
-                            mydefilter = defilters_from_extensions(command_line.references[i]);
-                    }
-
-                    run_filters_given_fdin(mydefilter, fd, &fdout);
-
-                    index_load_from_fd(fdout);
+                    load_index_file(command_line.references[i]);
 
                     index_sort();
-
-                    close(fdout);
-
-                    if (mydefilter != defilter)
-                        free_filters(mydefilter);
                 }
                 else if (command_line.reference_types[i] == REF_NOTAR)
                 {
@@ -686,10 +1518,17 @@ create_or_filter(int outfd)
 
                     set_cloexec(fd);
 
-                    load_index_from_tar(fd);
+                    load_index_from_tar(fd, 0);
 
                     index_sort();
 
+                    if (command_line.should_rsync)
+                    {
+                        if (lseek(fd, 0, SEEK_SET) == -1)
+                            error("Cannot seek the reference btar file");
+                        load_signatures_from_tar(fd);
+                    }
+
                     close(fd);
                 }
             }
@@ -699,18 +1538,32 @@ create_or_filter(int outfd)
         {
             if (command_line.debug)
                 fprintf(stderr, "Starting index creation\n");
-            run_filters(filterindex, &index_filterin, &index_filterout);
+            /* A sharded index is filtered at the end, by pieces, and
+             * that of --append once merged */
+            index_filter = filterindex;
+            run_filters(command_line.index_shard_depth || command_line.append ?
+                    0 : index_filter, &index_filterin, &index_filterout);
             set_cloexec(index_filterin);
             set_cloexec(index_filterout);
 
             doing_index = 1;
+
+            if (command_line.should_rsync)
+            {
+                run_filters(filterindex, &signatures_filterin, &signatures_filterout);
+                set_cloexec(signatures_filterin);
+                set_cloexec(signatures_filterout);
+
+                doing_signatures = 1;
+            }
         }
 
-        if (command_line.reference_types != 0)
+        if (command_line.reference_types != 0 || command_line.append)
         {
             if (command_line.debug)
                 fprintf(stderr, "Starting 'deleted' creation\n");
-            run_filters(filterindex, &deleted_filterin, &deleted_filterout);
+            run_filters(command_line.append ? 0 : filterindex,
+                    &deleted_filterin, &deleted_filterout);
             set_cloexec(deleted_filterin);
             set_cloexec(deleted_filterout);
 
@@ -737,8 +1590,10 @@ create_or_filter(int outfd)
 
             close(index_filterout);
             close(deleted_filterout);
+            close(signatures_filterout);
 
-            res = traverse(mypipe[1], index_filterin, deleted_filterin);
+            res = traverse(mypipe[1], index_filterin, deleted_filterin,
+                    signatures_filterin, command_line.append ? append.nblocks : 0);
             if (res == -1)
                 error("Cannot traverse");
 
@@ -755,6 +1610,7 @@ create_or_filter(int outfd)
             close(mypipe[0]);
             close(index_filterin);
             close(deleted_filterin);
+            close(signatures_filterin);
             if (command_line.debug)
                 fprintf(stderr, "Starting traverse PID %i, outputing to fd 0\n", pid);
 
@@ -762,6 +1618,8 @@ create_or_filter(int outfd)
                 im = file_memory_new(index_filterout);
             if (doing_deleted)
                 dm = file_memory_new(deleted_filterout);
+            if (doing_signatures)
+                sm = file_memory_new(signatures_filterout);
         }
     }
     else if (command_line.action == FILTER && command_line.add_create_index)
@@ -771,13 +1629,26 @@ create_or_filter(int outfd)
         int pid;
         int index_filterin;
         int index_filterout;
+        int signatures_filterin = -1;
+        int signatures_filterout = -1;
 
         doing_index = 1;
 
-        run_filters(filter, &index_filterin, &index_filterout);
+        index_filter = filter;
+        run_filters(command_line.index_shard_depth ? 0 : index_filter,
+                &index_filterin, &index_filterout);
         set_cloexec(index_filterin);
         set_cloexec(index_filterout);
 
+        if (command_line.should_rsync)
+        {
+            run_filters(filter, &signatures_filterin, &signatures_filterout);
+            set_cloexec(signatures_filterin);
+            set_cloexec(signatures_filterout);
+
+            doing_signatures = 1;
+        }
+
         /* Pipe for the index_from_tar */
         res = pipe(mypipe);
         if (res == -1)
@@ -796,10 +1667,12 @@ create_or_filter(int outfd)
             close(mypipe[1]);
 
             close(index_filterout);
+            close(signatures_filterout);
 
-            index_from_tar(mypipe[0], index_filterin);
+            index_from_tar(mypipe[0], index_filterin, signatures_filterin);
 
             close(index_filterin);
+            close(signatures_filterin);
             close(mypipe[0]);
             exit(0);
         }
@@ -814,6 +1687,7 @@ create_or_filter(int outfd)
 
             close(mypipe[0]);
             close(index_filterin);
+            close(signatures_filterin);
 
             if (command_line.debug)
                 fprintf(stderr, "Starting index_from_tar PID %i, we'll write to filter fd %i"
@@ -821,6 +1695,8 @@ create_or_filter(int outfd)
                         index_from_tar_fd, index_filterout);
 
             im = file_memory_new(index_filterout);
+            if (doing_signatures)
+                sm = file_memory_new(signatures_filterout);
         }
     }
     else if (command_line.action == MANGLE)
@@ -832,20 +1708,29 @@ create_or_filter(int outfd)
         int index_filterout = -1;
         int deleted_filterin = -1;
         int deleted_filterout = -1;
+        int signatures_filterin = -1;
+        int signatures_filterout = -1;
 
         if (command_line.paths)
             fatal_error_no_core("Cannot support paths in mangle (-m) mode");
 
         /* Run the filters for the index */
-        run_filters(filter, &index_filterin, &index_filterout);
+        index_filter = filterindex;
+        run_filters(command_line.index_shard_depth ? 0 : index_filter,
+                &index_filterin, &index_filterout);
         set_cloexec(index_filterin);
         set_cloexec(index_filterout);
 
         /* Run the filters for the deleter */
-        run_filters(filter, &deleted_filterin, &deleted_filterout);
+        run_filters(filterindex, &deleted_filterin, &deleted_filterout);
         set_cloexec(deleted_filterin);
         set_cloexec(deleted_filterout);
 
+        /* Run the filters for the signatures */
+        run_filters(filterindex, &signatures_filterin, &signatures_filterout);
+        set_cloexec(signatures_filterin);
+        set_cloexec(signatures_filterout);
+
         /* Pipe for the extraction */
         res = pipe(pipeextract);
         if (res == -1)
@@ -865,6 +1750,7 @@ create_or_filter(int outfd)
             close(pipeextract[1]);
             close(index_filterout);
             close(deleted_filterout);
+            close(signatures_filterout);
 
             command_line.action = EXTRACT_TO_TAR;
             /* We force the extractor not to recreate the tar, as mangle should
@@ -872,7 +1758,7 @@ create_or_filter(int outfd)
              * mangle now. */
             command_line.add_create_index = 0;
 
-            extract(0, index_filterin, deleted_filterin);
+            extract(0, index_filterin, deleted_filterin, signatures_filterin);
 
             exit(0);
         }
@@ -885,6 +1771,7 @@ create_or_filter(int outfd)
             close(pipeextract[0]);
             close(index_filterin);
             close(deleted_filterin);
+            close(signatures_filterin);
 
             if (command_line.debug)
                 fprintf(stderr, "Starting extract_to_tar PID %i\n", pid);
@@ -895,6 +1782,9 @@ create_or_filter(int outfd)
 
         doing_deleted = 1;
         dm = file_memory_new(deleted_filterout);
+
+        doing_signatures = 1;
+        sm = file_memory_new(signatures_filterout);
     }
 
     bp = malloc(sizeof(*bp)*command_line.parallelism);
@@ -911,15 +1801,35 @@ create_or_filter(int outfd)
     writing_bp = 0;
     ref_reading_bp = bp[reading_bp];
 
+    if (command_line.parity_k)
+        parity_init(&parity, command_line.parity_k, command_line.parity_n);
+
     if (command_line.xorblock)
     {
-        /* It will be reallocated if needed */
-        xorblock = block_new(1);
-        /* We start a block with a single byte to zero. The last byte in the xor block
-         * counts as any other byte there may come in the future. So, when making
-         * the block bigger, we expand repeating the last byte value, that will
-         * be properly xored since the beggining starting at zero. */
-        xorblock->data[0] = 0;
+        /* Block i goes to the xorblock i mod command_line.xorblock. They
+         * start as a single zero byte, and grow as the blocks come. */
+        xorblocks = malloc(command_line.xorblock * sizeof(*xorblocks));
+        if (!xorblocks)
+            fatal_error("Cannot allocate");
+        for(i=0; i < command_line.xorblock; ++i)
+        {
+            xorblocks[i] = block_new(1);
+            xorblocks[i]->data[0] = 0;
+        }
+    }
+
+    if (command_line.resume && (command_line.parity_k || xorblocks))
+        resume_redundancy(outfd, &parity, xorblocks);
+
+    /* The xorblocks go on from those of the btar, and only the parity
+     * group not full has to be read again */
+    if (command_line.append)
+    {
+        for(i=0; xorblocks && i < command_line.xorblock; ++i)
+            xor_data_to_xorblock(append.xorblocks[i]->data,
+                    append.xorblocks[i]->writer_pos, xorblocks[i]);
+        if (command_line.parity_k)
+            resume_redundancy(outfd, &parity, 0);
     }
 
     if (index_from_tar_fd >= 0)
@@ -948,6 +1858,8 @@ create_or_filter(int outfd)
             file_memory_prepare_readfds(im, &readfds, &nfds);
         if (dm)
             file_memory_prepare_readfds(dm, &readfds, &nfds);
+        if (sm)
+            file_memory_prepare_readfds(sm, &readfds, &nfds);
 
         if (index_from_tar_fd >= 0 && block_reader_can_read(br_to_index_tar))
             addfd(&writefds, index_from_tar_fd, &nfds);
@@ -968,6 +1880,8 @@ create_or_filter(int outfd)
             file_memory_check_readfds(im, &readfds);
         if (dm)
             file_memory_check_readfds(dm, &readfds);
+        if (sm)
+            file_memory_check_readfds(sm, &readfds);
 
         if (index_from_tar_fd >= 0 && FD_ISSET(index_from_tar_fd, &writefds))
         {
@@ -1033,10 +1947,29 @@ create_or_filter(int outfd)
                 fprintf(stderr, "Parallelism: Finished reading from filter, writing_bp=%i\n",
                         writing_bp);
 
-            if (xorblock)
-                xor_to_xorblock(bp[writing_bp], xorblock);
+            if (command_line.repository)
+                repository_store_block(bp[writing_bp]);
+            if (xorblocks)
+                xor_to_xorblock(bp[writing_bp], xorblocks[
+                        main_archive.blocks_written % command_line.xorblock]);
+            if (command_line.parity_k)
+                parity_add_block(&parity, bp[writing_bp]->bo->data,
+                        bp[writing_bp]->bo->writer_pos);
 
             dump_block_to_tar(bp[writing_bp], main_archive.archive);
+            directory_add_member(&main_archive.directory, main_archive.archive);
+            if (command_line.frame_size)
+                frame_table_add(&main_archive.frames, bp[writing_bp]->nblock,
+                        bp[writing_bp]->frames, bp[writing_bp]->nframes);
+            checksum_table_add(&main_archive.checksums, bp[writing_bp]->nblock,
+                    bp[writing_bp]->raw_crc, bp[writing_bp]->crc);
+            /* The parity goes just after the blocks it protects */
+            if (command_line.parity_k && parity_group_full(&parity))
+                parity_to_tar(&parity, main_archive.archive,
+                        &main_archive.directory);
+            main_archive.blocks_written++;
+            if (command_line.checkpoint_file)
+                write_checkpoint(outfd);
             block_process_reset(bp[writing_bp], main_archive.nextblock++);
 
             /* Go for the next, unless we override something */
@@ -1065,20 +1998,33 @@ create_or_filter(int outfd)
         if (bp[reading_bp]->closed_in
                 && (!im || file_memory_finished(im))
                 && (!dm || file_memory_finished(dm))
+                && (!sm || file_memory_finished(sm))
                 && block_process_finished(bp[writing_bp]))
             break;
     }
 
-    /* Write the xorblock */;
-    if (xorblock)
+    if (command_line.parity_k)
+    {
+        parity_to_tar(&parity, main_archive.archive, &main_archive.directory);
+        parity_free(&parity);
+    }
+
+    /* Write the xorblocks */;
+    for(i=0; xorblocks && i < command_line.xorblock; ++i)
     {
+        struct block *xorblock = xorblocks[i];
+        char name[100];
         ssize_t res;
 
         if (command_line.debug)
             fprintf(stderr, "Writing xor block to the btar stream\n");
 
         mytar_new_file(main_archive.archive);
-        mytar_set_filename(main_archive.archive, "xorblock");
+        if (command_line.xorblock == 1)
+            snprintf(name, sizeof name, "xorblock");
+        else
+            snprintf(name, sizeof name, "xorblock%i_%i", i, command_line.xorblock);
+        mytar_set_filename(main_archive.archive, name);
         mytar_set_gid(main_archive.archive, getgid());
         mytar_set_uid(main_archive.archive, getuid());
         mytar_set_size(main_archive.archive, xorblock->writer_pos);
@@ -1104,14 +2050,64 @@ create_or_filter(int outfd)
         res = mytar_write_end(main_archive.archive);
         if (res == -1)
             error("Could not write mytar file end");
+
+        directory_add_member(&main_archive.directory, main_archive.archive);
+        block_free(xorblock);
+    }
+    free(xorblocks);
+
+    if (command_line.append)
+    {
+        append_set_replaced(&append, im->bo, dm->bo);
+        im = append_list(im, append.index,
+                command_line.index_shard_depth ? 0 : index_filter);
+        dm = append_list(dm, append.deleted, filterindex);
+        if (append.signatures)
+        {
+            sm = append_list(0, append.signatures, filterindex);
+            doing_signatures = 1;
+        }
+        append_free(&append);
     }
 
     /* Write the index */;
     if (doing_index)
     {
         assert(im != 0 && file_memory_finished(im));
-        file_memory_to_tar(im, "index.tar%s", get_filter_extensions(filterindex),
-                main_archive.archive);
+        if (command_line.index_shard_depth)
+            index_shards_to_tar(im, index_filter, main_archive.blocks_written,
+                    main_archive.archive, &main_archive.directory);
+        else
+        {
+            file_memory_to_tar(im, "index.tar%s", get_filter_extensions(filterindex),
+                    main_archive.archive);
+            directory_add_member(&main_archive.directory, main_archive.archive);
+        }
+
+        if (command_line.index_file)
+            write_index_file(im, command_line.index_shard_depth ? index_filter : 0);
+
+        /* Frames are of use only seeking through the index */
+        if (command_line.frame_size)
+        {
+            frame_table_to_tar(&main_archive.frames, main_archive.archive);
+            directory_add_member(&main_archive.directory, main_archive.archive);
+        }
+
+        checksum_table_to_tar(&main_archive.checksums, main_archive.archive);
+        directory_add_member(&main_archive.directory, main_archive.archive);
+    }
+
+    if (doing_signatures)
+    {
+        assert(sm != 0 && file_memory_finished(sm));
+        /* Mangling a btar without signatures leaves nothing to store */
+        if (sm->bo->total_written > 0)
+        {
+            file_memory_to_tar(sm, "signatures.tar%s", get_filter_extensions(filterindex),
+                    main_archive.archive);
+            directory_add_member(&main_archive.directory, main_archive.archive);
+        }
     }
 
     if (doing_deleted)
@@ -1119,9 +2115,48 @@ create_or_filter(int outfd)
         assert(dm != 0 && file_memory_finished(dm));
         file_memory_to_tar(dm, "deleted.tar%s", get_filter_extensions(filterindex),
                 main_archive.archive);
+        directory_add_member(&main_archive.directory, main_archive.archive);
     }
 
+    /* The directory of members goes last, so readers can find it
+     * from the archive end. It is only useful with an index. */
+    if (doing_index)
+        directory_to_tar(&main_archive.directory, main_archive.archive);
+    directory_free(&main_archive.directory);
+    frame_table_free(&main_archive.frames);
+    checksum_table_free(&main_archive.checksums);
+
     mainarchive_close(&main_archive);
+
+    /* Nothing to resume any more */
+    if (command_line.checkpoint_file)
+        unlink(command_line.checkpoint_file);
+}
+
+/* The -o file of --consolidate, that cannot be one of the btars read */
+static int
+open_consolidate_output()
+{
+    struct stat out;
+    int fd;
+    int i;
+
+    if (stat(command_line.output_file, &out) == 0)
+        for(i=0; command_line.input_files[i]; ++i)
+        {
+            struct stat in;
+
+            if (stat(command_line.input_files[i], &in) == 0 &&
+                    in.st_dev == out.st_dev && in.st_ino == out.st_ino)
+                fatal_error_no_core("error: -o %s is one of the btars to "
+                        "consolidate", command_line.output_file);
+        }
+
+    fd = open(command_line.output_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd == -1)
+        fatal_errno("Cannot open the output file %s",
+                command_line.output_file);
+    return fd;
 }
 
 int main(int argc, char *argv[])
@@ -1134,6 +2169,31 @@ int main(int argc, char *argv[])
         fatal_error_no_core("error: please specify what paths to traverse");
     }
 
+    if (command_line.action == EXTRACT_TO_STDOUT && command_line.input_files &&
+            command_line.input_files[1])
+        fatal_error_no_core("error: -O extracts from a single btar file");
+
+    if (command_line.action == REPAIR && command_line.input_files &&
+            command_line.input_files[1])
+        fatal_error_no_core("error: --repair works on a single btar file");
+
+    if (command_line.checkpoint_file && !command_line.input_files)
+        fatal_error_no_core("error: --checkpoint needs the btar file given by -f");
+
+    if (command_line.append && !command_line.input_files)
+        fatal_error_no_core("error: --append needs the btar file given by -f");
+
+    if (command_line.action == CONSOLIDATE && !command_line.input_files)
+        fatal_error_no_core("error: --consolidate needs the btar files given "
+                "by -f");
+
+    if (command_line.output_file && command_line.action != CONSOLIDATE)
+        fatal_error_no_core("error: -o goes only with --consolidate");
+
+    if (command_line.index_file && command_line.input_files &&
+            command_line.input_files[1])
+        fatal_error_no_core("error: --index-file goes with a single btar file");
+
     register_child_handler();
     register_usr1_handler();
 
@@ -1145,38 +2205,55 @@ int main(int argc, char *argv[])
             if (command_line.input_files)
             {
                 int fd;
-                fd = open(command_line.input_files[0], O_CREAT | O_WRONLY | O_TRUNC, 0666);
+                if (command_line.resume || command_line.append)
+                    fd = open(command_line.input_files[0], O_RDWR);
+                else
+                    fd = open(command_line.input_files[0], O_CREAT | O_WRONLY | O_TRUNC, 0666);
                 if (fd == -1)
                     fatal_errno("Cannot open the btar file %s",
                             command_line.input_files[0]);
-                create_or_filter(fd);
+                if (command_line.action != MANGLE || !mangle_verbatim(0, fd))
+                    create_or_filter(fd);
                 close(fd);
             }
-            else
+            else if (command_line.action != MANGLE ||
+                    !mangle_verbatim(0, 1/*stdout*/))
                 create_or_filter(1/*stdout*/);
             break;
         case EXTRACT:
         case EXTRACT_TO_TAR:
+        case EXTRACT_TO_STDOUT:
+        case VERIFY:
             if (command_line.input_files)
             {
                 int i;
+                int planned = 0;
+
+                if (command_line.action == EXTRACT &&
+                        command_line.add_create_index &&
+                        command_line.input_files[1])
+                    planned = plan_restore();
+
                 for(i=0; command_line.input_files[i]; ++i)
                 {
                     int fd;
                     if (command_line.debug)
                         fprintf(stderr, "Extracting from the btar file %s\n",
                                 command_line.input_files[i]);
+                    if (planned)
+                        restore_plan_set_archive(i);
                     fd = open(command_line.input_files[i], O_RDONLY);
                     if (fd == -1)
                         fatal_errno("Cannot open the btar file %s",
                                 command_line.input_files[i]);
                     set_cloexec(fd);
-                    extract(fd, -1, -1);
+                    extract(fd, -1, -1, -1);
                     close(fd);
                 }
+                restore_plan_free();
             }
             else
-                extract(0, -1, -1);
+                extract(0, -1, -1, -1);
             break;
         case EXTRACT_INDEX:
         case LIST_INDEX:
@@ -1196,6 +2273,41 @@ int main(int argc, char *argv[])
             else
                 listindex(0);
             break;
+        case REPAIR:
+            if (command_line.input_files)
+            {
+                int fd;
+                fd = open(command_line.input_files[0], O_RDONLY);
+                if (fd == -1)
+                    fatal_errno("Cannot open the btar file %s",
+                            command_line.input_files[0]);
+                repair(fd, 1/*stdout*/);
+                close(fd);
+            }
+            else
+                repair(0, 1/*stdout*/);
+            break;
+        case CONSOLIDATE:
+            if (command_line.output_file)
+            {
+                int fd = open_consolidate_output();
+
+                consolidate(fd);
+                close(fd);
+            }
+            else
+                consolidate(1/*stdout*/);
+            break;
+    }
+
+    if (command_line.action == VERIFY && verify_failures())
+        return 1;
+
+    if (damaged_blocks_skipped())
+    {
+        fprintf(stderr, "%i damaged blocks were skipped\n",
+                damaged_blocks_skipped());
+        return 1;
     }
 
     return 0;
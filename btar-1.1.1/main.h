@@ -6,14 +6,32 @@ extern struct command_line {
     int verbose;
     int debug;
     unsigned long long blocksize;
+    unsigned long long frame_size; /* 0 for a single frame per block */
     int add_create_index;
     int parallelism;
-    int xorblock;
+    int writers;
+    int xorblock; /* Interleaved XOR blocks of -R, usually 1 */
+    int parity_k; /* Reed-Solomon parity members per parity_n blocks */
+    int parity_n;
+    int repair_missing; /* --repair outputs only the rebuilt blocks */
     int should_rsync;
     int should_delete;
     size_t rsync_minimal_size;
     size_t rsync_max_delta;
     size_t rsync_block_size;
+    int index_shard_depth;
+    int index_cache;
+    int range; /* Extract only a byte range of the files */
+    unsigned long long range_offset;
+    unsigned long long range_length;
+    const char *index_file; /* The index also as a file of its own */
+    const char *checkpoint_file; /* Written at the end of blocks of -c */
+    int checkpoint_interval; /* Seconds between checkpoints */
+    int resume; /* Going on from the checkpoint_file */
+    int append; /* New blocks into the btar given */
+    const char *repository; /* Where the block chunks are */
+    const char *output_file; /* -o, of --consolidate */
+    int keep_blocks; /* -m copies the blocks whatever -G and -F say */
     const char **paths;
     const char **input_files;
     const char **exclude_patterns;
@@ -25,16 +43,24 @@ extern struct command_line {
         CREATE,
         EXTRACT,
         EXTRACT_TO_TAR,
+        EXTRACT_TO_STDOUT,
         EXTRACT_INDEX,
         LIST_INDEX,
-        MANGLE
+        MANGLE,
+        REPAIR,
+        VERIFY,
+        CONSOLIDATE
     } action;
 } command_line;
 
 void set_cloexec(int fd);
 void addfd(fd_set *set, int fd, int *nfds);
+void let_children_fail();
+void set_child_exit_hook(int (*hook)(int pid, int status));
 
-void load_index_from_tar(int fd);
+int load_index_from_tar(int fd, const char **paths);
+void load_index_file(const char *name);
+void load_deleted_from_tar(int fd, void (*deleted)(const char *name, int is_dir));
 
 enum {
     buffersize = 1*1024*1024
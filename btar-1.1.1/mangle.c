@@ -0,0 +1,321 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include "main.h"
+#include "mytar.h"
+#include "block.h"
+#include "blockprocess.h"
+#include "filters.h"
+#include "filememory.h"
+#include "directory.h"
+#include "indexshard.h"
+#include "frames.h"
+#include "checksums.h"
+#include "parity.h"
+#include "append.h"
+#include "mangle.h"
+
+/* -m copies the block members of a seekable btar as they are, when they
+ * would come out the same: filtered as -F, of the block size of -b, and in
+ * the frames of --frame-size if given. Only the names of the members tell
+ * the filters, so it is done if the filters are those of the names, with no
+ * -G and no arguments to -F, or with --keep-blocks. Then the index and the
+ * lists are only defiltered to go through -U, and the redundancy of -R is
+ * computed again from the members. */
+
+extern struct filter *filter;
+extern struct filter *filterindex;
+extern struct filter *defilter;
+
+/* A -G or the arguments of -F, as the key of an encryption, may change the
+ * blocks with the same names */
+static int
+filters_as_names()
+{
+    const struct filter *f;
+
+    if (defilter)
+        return 0;
+    for(f = filter; f != 0; f = f->next)
+        if (f->args[1] != 0)
+            return 0;
+    return 1;
+}
+
+/* The number of blocks, if all are filtered as -F */
+static int
+blocks_as_filter(const struct directory *dir)
+{
+    const char *extensions = get_filter_extensions(filter);
+    int nblocks = 0;
+    size_t i;
+
+    for(i=0; i < dir->nentries; ++i)
+    {
+        char expected[PATH_MAX];
+        int b;
+
+        if (sscanf(dir->entries[i].name, "block%i.tar", &b) != 1)
+            continue;
+        snprintf(expected, sizeof expected, "block%i.tar%s", b, extensions);
+        if (b != nblocks || strcmp(dir->entries[i].name, expected) != 0)
+            return 0;
+        nblocks++;
+    }
+    return nblocks;
+}
+
+/* The first block tells the block size; it is the only one not full if
+ * there is no other */
+static int
+same_blocksize(int fd, const struct directory *dir, int nblocks)
+{
+    const struct directory_entry *e = directory_find(dir, "block0.tar");
+    struct filter *mydefilter;
+    struct file_memory *fm;
+    struct block *b;
+    unsigned long long size;
+
+    b = read_member(fd, e);
+    if (defilter)
+        mydefilter = defilter;
+    else
+        mydefilter = defilters_from_extensions(e->name);
+    fm = filter_range(mydefilter, b, 0, b->total_written);
+    size = fm->bo->total_written;
+    file_memory_free(fm);
+    block_free(b);
+    if (mydefilter != defilter)
+        free_filters(mydefilter);
+
+    if (nblocks == 1)
+        return size <= command_line.blocksize;
+    return size == command_line.blocksize;
+}
+
+static void
+write_member(struct mytar *tar, struct directory *dir, char *name,
+        const char *data, size_t len)
+{
+    ssize_t res;
+
+    mytar_new_file(tar);
+    mytar_set_filename(tar, name);
+    mytar_set_gid(tar, getgid());
+    mytar_set_uid(tar, getuid());
+    mytar_set_size(tar, len);
+    mytar_set_mode(tar, 0644 | S_IFREG);
+    mytar_set_mtime(tar, time(NULL));
+    mytar_set_filetype(tar, S_IFREG);
+    res = mytar_write_header(tar);
+    if (res == -1)
+        error("Failed to write header");
+
+    res = mytar_write_data(tar, data, len);
+    if (res == -1)
+        error("Could not write mytar data");
+
+    res = mytar_write_end(tar);
+    if (res == -1)
+        error("Could not write mytar file end");
+
+    directory_add_member(dir, tar);
+}
+
+/* A list member, through -U */
+static void
+copy_list(int fd, const struct directory *dir, const char *prefix,
+        const char *namepattern, struct mytar *tar, struct directory *newdir)
+{
+    const struct directory_entry *e = directory_find(dir, prefix);
+    struct file_memory *fm;
+    struct block *raw;
+
+    if (!e)
+        return;
+
+    raw = read_raw_member(fd, e);
+    fm = filter_range(filterindex, raw, 0, raw->total_written);
+    file_memory_to_tar(fm, namepattern, get_filter_extensions(filterindex),
+            tar);
+    directory_add_member(newdir, tar);
+    file_memory_free(fm);
+    block_free(raw);
+}
+
+static void
+copy_index(int fd, const struct directory *dir, int nblocks,
+        struct mytar *tar, struct directory *newdir)
+{
+    struct file_memory rawindex;
+
+    rawindex.bo = read_raw_index(fd, dir);
+    rawindex.fd = -1;
+    if (!rawindex.bo)
+        return;
+
+    if (command_line.index_shard_depth)
+        index_shards_to_tar(&rawindex, filterindex, nblocks, tar, newdir);
+    else
+    {
+        struct file_memory *fm;
+
+        fm = filter_range(filterindex, rawindex.bo, 0,
+                rawindex.bo->total_written);
+        file_memory_to_tar(fm, "index.tar%s",
+                get_filter_extensions(filterindex), tar);
+        directory_add_member(newdir, tar);
+        file_memory_free(fm);
+    }
+    block_free(rawindex.bo);
+}
+
+/* Returns 0, without writing anything, if the blocks have to be made
+ * again */
+int
+mangle_verbatim(int infd, int outfd)
+{
+    struct directory dir;
+    struct directory newdir;
+    struct frame_table frames;
+    struct checksum_table checksums;
+    struct parity parity;
+    struct block **xorblocks = 0;
+    struct mytar *tar;
+    int nblocks;
+    int i;
+
+    /* The index file is written by the btar made again */
+    if (command_line.index_file)
+        return 0;
+
+    if (!command_line.keep_blocks && !filters_as_names())
+        return 0;
+
+    if (lseek(infd, 0, SEEK_CUR) != 0 || !directory_load(&dir, infd))
+        return 0;
+
+    frame_table_load(&frames, infd, &dir);
+    nblocks = blocks_as_filter(&dir);
+    if (nblocks == 0 || (command_line.frame_size &&
+                command_line.frame_size != frames.framesize) ||
+            !same_blocksize(infd, &dir, nblocks))
+    {
+        frame_table_free(&frames);
+        directory_free(&dir);
+        return 0;
+    }
+
+    if (command_line.verbose || command_line.debug)
+        fprintf(stderr, "Copying the %i blocks as they are\n", nblocks);
+
+    checksum_table_load(&checksums, infd, &dir);
+    tar = mytar_new();
+    mytar_open_fd(tar, outfd);
+    directory_init(&newdir);
+
+    if (command_line.parity_k)
+        parity_init(&parity, command_line.parity_k, command_line.parity_n);
+    if (command_line.xorblock)
+    {
+        xorblocks = malloc(command_line.xorblock * sizeof(*xorblocks));
+        if (!xorblocks)
+            fatal_error("Cannot allocate");
+        for(i=0; i < command_line.xorblock; ++i)
+        {
+            xorblocks[i] = block_new(1);
+            xorblocks[i]->data[0] = 0;
+        }
+    }
+
+    for(i=0; i < nblocks; ++i)
+    {
+        const struct directory_entry *e;
+        char prefix[100];
+        struct block *b;
+
+        snprintf(prefix, sizeof prefix, "block%i.tar", i);
+        e = directory_find(&dir, prefix);
+        b = read_member(infd, e);
+        write_member(tar, &newdir, e->name, b->data, b->writer_pos);
+
+        if (xorblocks)
+            xor_data_to_xorblock(b->data, b->writer_pos,
+                    xorblocks[i % command_line.xorblock]);
+        if (command_line.parity_k)
+        {
+            parity_add_block(&parity, b->data, b->writer_pos);
+            if (parity_group_full(&parity))
+                parity_to_tar(&parity, tar, &newdir);
+        }
+        block_free(b);
+    }
+
+    if (command_line.parity_k)
+    {
+        parity_to_tar(&parity, tar, &newdir);
+        parity_free(&parity);
+    }
+
+    for(i=0; xorblocks && i < command_line.xorblock; ++i)
+    {
+        char name[100];
+
+        if (command_line.xorblock == 1)
+            snprintf(name, sizeof name, "xorblock");
+        else
+            snprintf(name, sizeof name, "xorblock%i_%i", i,
+                    command_line.xorblock);
+        write_member(tar, &newdir, name, xorblocks[i]->data,
+                xorblocks[i]->writer_pos);
+        block_free(xorblocks[i]);
+    }
+    free(xorblocks);
+
+    copy_index(infd, &dir, nblocks, tar, &newdir);
+
+    /* The frames and checksums of the members copied stay valid */
+    if (frames.framesize)
+    {
+        frame_table_to_tar(&frames, tar);
+        directory_add_member(&newdir, tar);
+    }
+    checksum_table_to_tar(&checksums, tar);
+    directory_add_member(&newdir, tar);
+
+    copy_list(infd, &dir, "signatures.tar", "signatures.tar%s", tar, &newdir);
+    copy_list(infd, &dir, "deleted.tar", "deleted.tar%s", tar, &newdir);
+
+    directory_to_tar(&newdir, tar);
+    if (mytar_write_archive_end(tar) == -1)
+        error("Could not write the archive end");
+
+    directory_free(&newdir);
+    directory_free(&dir);
+    frame_table_free(&frames);
+    checksum_table_free(&checksums);
+    free(tar);
+    return 1;
+}
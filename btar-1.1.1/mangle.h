@@ -0,0 +1 @@
+int mangle_verbatim(int infd, int outfd);
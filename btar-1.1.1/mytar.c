@@ -51,6 +51,25 @@ write_all(int fd, const void *buf, size_t n)
     return n;
 }
 
+/* The first t->skip bytes of the tar are only counted, not written */
+static ssize_t
+tar_write(struct mytar *t, const void *buf, size_t n)
+{
+    const char *ptr = buf;
+    size_t skipped = 0;
+
+    if (t->total_written < t->skip)
+    {
+        skipped = t->skip - t->total_written;
+        if (skipped > n)
+            skipped = n;
+    }
+
+    if (skipped < n && write_all(t->fd, ptr + skipped, n - skipped) == -1)
+        return -1;
+    return n;
+}
+
 struct mytar *
 mytar_new()
 {
@@ -274,7 +293,7 @@ mytar_write_header(struct mytar *t)
 
         set_checksum(&h2);
 
-        res = write_all(t->fd, &h2, sizeof(h2));
+        res = tar_write(t, &h2, sizeof(h2));
         if (res != 0)
             t->total_written += res;
         if (res == -1)
@@ -310,7 +329,7 @@ mytar_write_header(struct mytar *t)
 
         set_checksum(&h2);
 
-        res = write_all(t->fd, &h2, sizeof(h2));
+        res = tar_write(t, &h2, sizeof(h2));
         if (res != 0)
             t->total_written += res;
         if (res == -1)
@@ -326,7 +345,7 @@ mytar_write_header(struct mytar *t)
     }
     set_checksum(&t->header);
 
-    res = write_all(t->fd, &t->header, sizeof(t->header));
+    res = tar_write(t, &t->header, sizeof(t->header));
     if (res != 0)
         t->total_written += res;
 
@@ -345,7 +364,7 @@ mytar_write_data(struct mytar *t, const char *buffer, size_t n)
 {
     int res;
 
-    res = write_all(t->fd, buffer, n);
+    res = tar_write(t, buffer, n);
     if (res != -1)
     {
         t->file_data_written += res;
@@ -355,6 +374,15 @@ mytar_write_data(struct mytar *t, const char *buffer, size_t n)
     return res;
 }
 
+/* Data that would be skipped anyway, not even read by the caller */
+void
+mytar_skip_data(struct mytar *t, unsigned long long n)
+{
+    assert(t->total_written + n <= t->skip);
+    t->file_data_written += n;
+    t->total_written += n;
+}
+
 ssize_t
 mytar_write_end(struct mytar *t)
 {
@@ -368,7 +396,7 @@ mytar_write_end(struct mytar *t)
         int tail;
         int res;
         tail = 512 - over;
-        res = write_all(t->fd, c, tail);
+        res = tar_write(t, c, tail);
         if (res != -1)
             t->total_written += res;
         return res;
@@ -382,7 +410,7 @@ mytar_write_archive_end(struct mytar *t)
     static const char c[1024]; /* Will be zero */
     ssize_t res;
 
-    res = write_all(t->fd, c, sizeof(c));
+    res = tar_write(t, c, sizeof(c));
     if (res != -1)
         t->total_written += res;
     return res;
@@ -40,6 +40,7 @@ struct mytar
     unsigned long long file_data_written;
     int fd;
     unsigned long long total_written;
+    unsigned long long skip; /* Of the start, not written, for --resume */
 };
 
 struct mytar * mytar_new();
@@ -59,6 +60,7 @@ void mytar_set_uname(struct mytar *t, const char *uname);
 void mytar_set_gname(struct mytar *t, const char *gname);
 ssize_t mytar_write_header(struct mytar *t);
 ssize_t mytar_write_data(struct mytar *t, const char *buffer, size_t n);
+void mytar_skip_data(struct mytar *t, unsigned long long n);
 ssize_t mytar_write_end(struct mytar *t);
 ssize_t mytar_write_archive_end(struct mytar *t);
 int calc_checksum(const struct header_gnu_tar *h);
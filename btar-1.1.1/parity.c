@@ -0,0 +1,495 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+/* The AVX2 and SSSE3 loops are built whatever the -march, and chosen at
+ * run time by what the cpu has; SSE2 is always there */
+#define X86_DISPATCH
+#endif
+#if defined(X86_DISPATCH) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "main.h"
+#include "mytar.h"
+#include "directory.h"
+#include "parity.h"
+
+/* With --parity k/n, every group of n blocks gets k parity members,
+ * Reed-Solomon over GF(2^8), from which any k lost blocks of the group can
+ * be rebuilt. Parity member j of a group is the sum of its blocks i, zero
+ * padded to the longest one, times 1/(j + k+i): a Cauchy matrix, of which
+ * any square submatrix can be inverted.
+ *
+ * Each parity member, "parity<group>_<j>", starts with a text header padded
+ * with zeros to 512 bytes:
+ *    btar-parity <k> <n> <blocks in the group>\n
+ *    <size of each block of the group>...\n
+ * The blocks of group g are those from g*n on. */
+
+static const char parity_magic[] = "btar-parity";
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+static int gf_ready = 0;
+
+static void
+gf_init()
+{
+    int i;
+    int x = 1;
+
+    for(i=0; i < 255; ++i)
+    {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+    for(i=255; i < 512; ++i)
+        gf_exp[i] = gf_exp[i - 255];
+    gf_ready = 1;
+}
+
+unsigned char
+gf_mul(unsigned char a, unsigned char b)
+{
+    if (!gf_ready)
+        gf_init();
+    if (a == 0 || b == 0)
+        return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+unsigned char
+gf_inv(unsigned char a)
+{
+    if (!gf_ready)
+        gf_init();
+    assert(a != 0);
+    return gf_exp[255 - gf_log[a]];
+}
+
+unsigned char
+parity_coefficient(int k, int j, int i)
+{
+    return gf_inv(j ^ (k + i));
+}
+
+#ifdef X86_DISPATCH
+__attribute__((target("avx2")))
+static size_t
+xor_region_avx2(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    size_t i = 0;
+
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(d, s));
+    }
+    return i;
+}
+#endif
+
+/* dst ^= src, which is also dst += 1 * src */
+void
+xor_region(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    size_t i = 0;
+
+#ifdef X86_DISPATCH
+    if (__builtin_cpu_supports("avx2"))
+        i = xor_region_avx2(dst, src, len);
+#endif
+
+#if defined(__SSE2__)
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, s));
+    }
+#elif defined(__ARM_NEON)
+    for(; i + 16 <= len; i += 16)
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+#else
+    for(; i + sizeof(unsigned long) <= len; i += sizeof(unsigned long))
+    {
+        unsigned long s, d;
+
+        memcpy(&s, src + i, sizeof s);
+        memcpy(&d, dst + i, sizeof d);
+        d ^= s;
+        memcpy(dst + i, &d, sizeof d);
+    }
+#endif
+
+    for(; i < len; ++i)
+        dst[i] ^= src[i];
+}
+
+#ifdef X86_DISPATCH
+/* Both return up to where they got, the rest left for the byte loop */
+__attribute__((target("avx2")))
+static size_t
+gf_mul_add_avx2(unsigned char *dst, const unsigned char *src,
+        const unsigned char *lo, const unsigned char *hi, size_t len)
+{
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) lo));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) hi));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+        __m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask));
+        __m256i h = _mm256_shuffle_epi8(thi,
+                _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+
+        d = _mm256_xor_si256(d, _mm256_xor_si256(l, h));
+        _mm256_storeu_si256((__m256i *) (dst + i), d);
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t
+gf_mul_add_ssse3(unsigned char *dst, const unsigned char *src,
+        const unsigned char *lo, const unsigned char *hi, size_t len)
+{
+    __m128i tlo = _mm_loadu_si128((__m128i *) lo);
+    __m128i thi = _mm_loadu_si128((__m128i *) hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+        __m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(thi,
+                _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+
+        d = _mm_xor_si128(d, _mm_xor_si128(l, h));
+        _mm_storeu_si128((__m128i *) (dst + i), d);
+    }
+    return i;
+}
+#endif
+
+/* dst += c * src. The products by c come from two tables of 16, for the
+ * low and high nibbles, which fit a pshufb. */
+void
+gf_mul_add_region(unsigned char *dst, const unsigned char *src,
+        unsigned char c, size_t len)
+{
+    unsigned char lo[16];
+    unsigned char hi[16];
+    size_t i = 0;
+    int x;
+
+    if (c == 0)
+        return;
+    if (c == 1)
+    {
+        xor_region(dst, src, len);
+        return;
+    }
+
+    for(x=0; x < 16; ++x)
+    {
+        lo[x] = gf_mul(c, x);
+        hi[x] = gf_mul(c, x << 4);
+    }
+
+#ifdef X86_DISPATCH
+    if (__builtin_cpu_supports("avx2"))
+        i = gf_mul_add_avx2(dst, src, lo, hi, len);
+    else if (__builtin_cpu_supports("ssse3"))
+        i = gf_mul_add_ssse3(dst, src, lo, hi, len);
+#endif
+
+    for(; i < len; ++i)
+        dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+}
+
+/* Gauss-Jordan on the n x n matrix 'm', which is lost. Returns 0 if it
+ * cannot be inverted. */
+int
+gf_invert_matrix(unsigned char *m, unsigned char *inv, int n)
+{
+    int r, c, i;
+
+    memset(inv, 0, n * n);
+    for(i=0; i < n; ++i)
+        inv[i * n + i] = 1;
+
+    for(c=0; c < n; ++c)
+    {
+        unsigned char f;
+
+        for(r = c; r < n && m[r * n + c] == 0; ++r);
+        if (r == n)
+            return 0;
+        if (r != c)
+            for(i=0; i < n; ++i)
+            {
+                unsigned char t = m[r * n + i];
+                m[r * n + i] = m[c * n + i];
+                m[c * n + i] = t;
+                t = inv[r * n + i];
+                inv[r * n + i] = inv[c * n + i];
+                inv[c * n + i] = t;
+            }
+
+        f = gf_inv(m[c * n + c]);
+        for(i=0; i < n; ++i)
+        {
+            m[c * n + i] = gf_mul(m[c * n + i], f);
+            inv[c * n + i] = gf_mul(inv[c * n + i], f);
+        }
+
+        for(r=0; r < n; ++r)
+        {
+            if (r == c || m[r * n + c] == 0)
+                continue;
+            f = m[r * n + c];
+            for(i=0; i < n; ++i)
+            {
+                m[r * n + i] ^= gf_mul(f, m[c * n + i]);
+                inv[r * n + i] ^= gf_mul(f, inv[c * n + i]);
+            }
+        }
+    }
+    return 1;
+}
+
+/* Parses "k/n". Returns 1 if it is fine, 0 if it is not k/n, and -1 if
+ * k/n is out of range. */
+int
+parity_parse(const char *arg, int *k, int *n)
+{
+    int mk, mn;
+    int len = 0;
+
+    if (sscanf(arg, "%d/%d%n", &mk, &mn, &len) != 2 || arg[len] != '\0')
+        return 0;
+    if (mk < 1 || mn < 1 || mk + mn > 256)
+        return -1;
+    *k = mk;
+    *n = mn;
+    return 1;
+}
+
+void
+parity_init(struct parity *p, int k, int n)
+{
+    int j;
+
+    p->k = k;
+    p->n = n;
+    p->group = 0;
+    p->nblocks = 0;
+    p->len = 0;
+    p->allocated = 0;
+    p->sizes = malloc(n * sizeof(*p->sizes));
+    p->data = malloc(k * sizeof(*p->data));
+    if (!p->sizes || !p->data)
+        fatal_error("Cannot allocate");
+    for(j=0; j < k; ++j)
+        p->data[j] = 0;
+}
+
+void
+parity_add_block(struct parity *p, const char *data, size_t len)
+{
+    int j;
+
+    assert(p->nblocks < p->n);
+
+    if (len > p->allocated)
+    {
+        for(j=0; j < p->k; ++j)
+        {
+            p->data[j] = realloc(p->data[j], len);
+            if (!p->data[j])
+                fatal_error("Cannot realloc");
+            memset(p->data[j] + p->allocated, 0, len - p->allocated);
+        }
+        p->allocated = len;
+    }
+    if (len > p->len)
+        p->len = len;
+
+    for(j=0; j < p->k; ++j)
+        gf_mul_add_region(p->data[j], (const unsigned char *) data,
+                parity_coefficient(p->k, j, p->nblocks), len);
+
+    p->sizes[p->nblocks++] = len;
+}
+
+int
+parity_group_full(const struct parity *p)
+{
+    return p->nblocks == p->n;
+}
+
+/* Writes the parity members of the group, if it has any block, and
+ * starts the next group */
+void
+parity_to_tar(struct parity *p, struct mytar *tar, struct directory *dir)
+{
+    size_t hlen;
+    size_t hallocated;
+    char *header;
+    int i, j;
+
+    if (p->nblocks == 0)
+        return;
+
+    if (command_line.debug)
+        fprintf(stderr, "Writing the %i parity members of group %i\n",
+                p->k, p->group);
+
+    hallocated = 1024 + p->nblocks * 21;
+    header = malloc(hallocated);
+    if (!header)
+        fatal_error("Cannot allocate");
+
+    hlen = snprintf(header, hallocated, "%s %i %i %i\n", parity_magic,
+            p->k, p->n, p->nblocks);
+    for(i=0; i < p->nblocks; ++i)
+        hlen += snprintf(header + hlen, hallocated - hlen, "%llu%c",
+                p->sizes[i], i + 1 < p->nblocks ? ' ' : '\n');
+    /* At least a zero ends the text */
+    memset(header + hlen, 0, 512 - hlen % 512);
+    hlen += 512 - hlen % 512;
+
+    for(j=0; j < p->k; ++j)
+    {
+        char name[100];
+        ssize_t res;
+
+        snprintf(name, sizeof name, "parity%i_%i", p->group, j);
+
+        mytar_new_file(tar);
+        mytar_set_filename(tar, name);
+        mytar_set_gid(tar, getgid());
+        mytar_set_uid(tar, getuid());
+        mytar_set_size(tar, hlen + p->len);
+        mytar_set_mode(tar, 0644 | S_IFREG);
+        mytar_set_mtime(tar, time(NULL));
+        mytar_set_filetype(tar, S_IFREG);
+        res = mytar_write_header(tar);
+        if (res == -1)
+            error("Failed to write header");
+
+        res = mytar_write_data(tar, header, hlen);
+        if (res == -1)
+            error("Could not write the parity header");
+        res = mytar_write_data(tar, (char *) p->data[j], p->len);
+        if (res == -1)
+            error("Could not write the parity data");
+        assert((size_t) res == p->len);
+
+        res = mytar_write_end(tar);
+        if (res == -1)
+            error("Could not write mytar file end");
+
+        directory_add_member(dir, tar);
+
+        memset(p->data[j], 0, p->allocated);
+    }
+
+    free(header);
+
+    p->group++;
+    p->nblocks = 0;
+    p->len = 0;
+}
+
+/* Parses the start of a parity member, 'len' bytes of 'text'. Gives the
+ * sizes of the blocks of the group, to be freed, and where the parity data
+ * starts. Returns 0 if it is wrong. */
+int
+parity_header_parse(const char *text, size_t len, int *k, int *n,
+        int *nblocks, unsigned long long **sizes, size_t *hlen)
+{
+    const char *end = memchr(text, '\0', len);
+    const char *p;
+    int pos;
+    int i;
+
+    if (!end || strncmp(text, parity_magic, sizeof parity_magic - 1) != 0)
+        return 0;
+    p = text + sizeof parity_magic - 1;
+    if (sscanf(p, "%d %d %d%n", k, n, nblocks, &pos) != 3 ||
+            *k < 1 || *n < 1 || *k + *n > 256 || *nblocks < 1 || *nblocks > *n)
+        return 0;
+    p += pos;
+
+    *sizes = malloc(*nblocks * sizeof(**sizes));
+    if (!*sizes)
+        fatal_error("Cannot allocate");
+    for(i=0; i < *nblocks; ++i)
+    {
+        if (sscanf(p, "%llu%n", &(*sizes)[i], &pos) != 1)
+        {
+            free(*sizes);
+            return 0;
+        }
+        p += pos;
+    }
+
+    *hlen = end - text;
+    if (*hlen % 512 > 0)
+        *hlen += 512 - *hlen % 512;
+    return 1;
+}
+
+/* Enough to hold any parity header */
+size_t
+parity_header_max()
+{
+    return 1024 + 256 * 21;
+}
+
+void
+parity_free(struct parity *p)
+{
+    int j;
+
+    for(j=0; j < p->k; ++j)
+        free(p->data[j]);
+    free(p->data);
+    free(p->sizes);
+}
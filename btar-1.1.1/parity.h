@@ -0,0 +1,32 @@
+struct mytar;
+struct directory;
+
+struct parity
+{
+    int k; /* Parity members per group */
+    int n; /* Blocks per group */
+    int group;
+    int nblocks; /* Of the group, added so far */
+    unsigned long long *sizes; /* Of the blocks of the group */
+    unsigned char **data; /* The k parity members being computed */
+    size_t len; /* Of the longest block of the group */
+    size_t allocated;
+};
+
+int parity_parse(const char *arg, int *k, int *n);
+void parity_init(struct parity *p, int k, int n);
+void parity_add_block(struct parity *p, const char *data, size_t len);
+int parity_group_full(const struct parity *p);
+void parity_to_tar(struct parity *p, struct mytar *tar, struct directory *dir);
+int parity_header_parse(const char *text, size_t len, int *k, int *n,
+        int *nblocks, unsigned long long **sizes, size_t *hlen);
+size_t parity_header_max();
+void parity_free(struct parity *p);
+
+unsigned char gf_mul(unsigned char a, unsigned char b);
+unsigned char gf_inv(unsigned char a);
+unsigned char parity_coefficient(int k, int j, int i);
+void xor_region(unsigned char *dst, const unsigned char *src, size_t len);
+void gf_mul_add_region(unsigned char *dst, const unsigned char *src,
+        unsigned char c, size_t len);
+int gf_invert_matrix(unsigned char *m, unsigned char *inv, int n);
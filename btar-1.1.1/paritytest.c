@@ -0,0 +1,193 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+#include "parity.h"
+
+/* as parity.c will depend on it */
+struct command_line command_line;
+
+/* Odd lengths, so the vector loops leave some bytes to the byte loop */
+enum { max_block_len = 4099, max_group = 16 };
+
+int
+test_regions()
+{
+    unsigned char src[300], dst[300], expected[300];
+    int c, len, i;
+
+    for(c=0; c < 256; ++c)
+        for(len=0; len < 300; len += 13)
+        {
+            for(i=0; i < len; ++i)
+            {
+                src[i] = rand();
+                dst[i] = expected[i] = rand();
+                expected[i] ^= gf_mul(c, src[i]);
+            }
+            gf_mul_add_region(dst, src, c, len);
+            if (memcmp(dst, expected, len) != 0)
+            {
+                printf(" gf_mul_add_region(c=%i, len=%i) is wrong\n", c, len);
+                return 1;
+            }
+        }
+    return 0;
+}
+
+/* Rebuilds the blocks of the group in 'lost' as repair.c does: from the
+ * parity members 'use', the blocks still there taken out, and the rest
+ * times the inverse of the matrix of the lost ones. */
+int
+recover(struct parity *p, unsigned char **blocks, const int *lost,
+        int nlost, const int *use)
+{
+    unsigned char *matrix = malloc(nlost * nlost);
+    unsigned char *inverse = malloc(nlost * nlost);
+    unsigned char *rebuilt = malloc(p->len ? p->len : 1);
+    unsigned char **sums = malloc(nlost * sizeof(*sums));
+    int failed = 0;
+    int r, c, i;
+
+    if (!matrix || !inverse || !rebuilt || !sums)
+        fatal_error("Cannot allocate");
+
+    for(r=0; r < nlost; ++r)
+    {
+        sums[r] = malloc(p->len ? p->len : 1);
+        if (!sums[r])
+            fatal_error("Cannot allocate");
+        memcpy(sums[r], p->data[use[r]], p->len);
+
+        for(i=0; i < p->nblocks; ++i)
+        {
+            for(c=0; c < nlost && lost[c] != i; ++c);
+            if (c < nlost)
+                continue;
+            gf_mul_add_region(sums[r], blocks[i],
+                    parity_coefficient(p->k, use[r], i), p->sizes[i]);
+        }
+    }
+
+    for(r=0; r < nlost; ++r)
+        for(c=0; c < nlost; ++c)
+            matrix[r * nlost + c] = parity_coefficient(p->k, use[r], lost[c]);
+    if (!gf_invert_matrix(matrix, inverse, nlost))
+    {
+        printf(" cannot invert the matrix\n");
+        failed = 1;
+    }
+
+    for(c=0; !failed && c < nlost; ++c)
+    {
+        memset(rebuilt, 0, p->len);
+        for(r=0; r < nlost; ++r)
+            gf_mul_add_region(rebuilt, sums[r], inverse[c * nlost + r],
+                    p->len);
+        if (memcmp(rebuilt, blocks[lost[c]], p->sizes[lost[c]]) != 0)
+        {
+            printf(" the block %i is not rebuilt right\n", lost[c]);
+            failed = 1;
+        }
+    }
+
+    for(r=0; r < nlost; ++r)
+        free(sums[r]);
+    free(sums);
+    free(rebuilt);
+    free(inverse);
+    free(matrix);
+    return failed;
+}
+
+/* Every way to lose up to k blocks of a group of n, rebuilt with the
+ * last parity members */
+int
+test_group(int k, int n)
+{
+    struct parity p;
+    unsigned char **blocks = malloc(n * sizeof(*blocks));
+    int lost[max_group];
+    int use[max_group];
+    int failed = 0;
+    int tests = 0;
+    int mask, i, j;
+
+    if (!blocks)
+        fatal_error("Cannot allocate");
+
+    parity_init(&p, k, n);
+    for(i=0; i < n; ++i)
+    {
+        size_t len = rand() % max_block_len;
+
+        blocks[i] = malloc(len ? len : 1);
+        if (!blocks[i])
+            fatal_error("Cannot allocate");
+        for(j=0; j < (int) len; ++j)
+            blocks[i][j] = rand();
+        parity_add_block(&p, (char *) blocks[i], len);
+    }
+
+    for(mask=1; mask < 1 << n; ++mask)
+    {
+        int nlost = 0;
+
+        for(i=0; i < n; ++i)
+            if (mask & (1 << i))
+                lost[nlost++] = i;
+        if (nlost > k)
+            continue;
+        for(j=0; j < nlost; ++j)
+            use[j] = k - nlost + j;
+
+        if (recover(&p, blocks, lost, nlost, use))
+        {
+            printf(" --parity %i/%i, losing the blocks of mask 0x%x\n",
+                    k, n, mask);
+            failed = 1;
+        }
+        ++tests;
+    }
+
+    printf("--parity %i/%i: %i ways to lose blocks, %s\n", k, n, tests,
+            failed ? "FAILED" : "fine");
+
+    for(i=0; i < n; ++i)
+        free(blocks[i]);
+    free(blocks);
+    parity_free(&p);
+    return failed;
+}
+
+int main()
+{
+    int failed = 0;
+
+    srand(1);
+
+    failed |= test_regions();
+    failed |= test_group(1, 3);
+    failed |= test_group(2, 4);
+    failed |= test_group(3, 7);
+    failed |= test_group(4, 10);
+
+    return failed;
+}
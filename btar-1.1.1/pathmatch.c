@@ -0,0 +1,399 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include "main.h"
+#include "pathmatch.h"
+
+/* The path patterns are compiled once, instead of calling fnmatch() for every
+ * pattern on every name of an index or a tar. Each pattern is split into its
+ * literal prefix and a list of tokens, a star or a set of bytes, matched as
+ * fnmatch() does with no flags in the C locale: '*' and '?' also match '/'.
+ * The patterns are sorted by prefix, so for a name only those whose prefix
+ * can be a prefix of the name are tried.
+ * Equivalence classes, collating symbols and other rare syntax are left to
+ * fnmatch(). */
+
+struct glob_token
+{
+    int star;
+    unsigned char set[256 / 8];
+};
+
+static void
+set_add(struct glob_token *t, unsigned char c)
+{
+    t->set[c / 8] |= 1 << (c % 8);
+}
+
+static int
+set_has(const struct glob_token *t, unsigned char c)
+{
+    return t->set[c / 8] & (1 << (c % 8));
+}
+
+static int
+add_class(struct glob_token *t, const char *name, size_t len)
+{
+    static const struct
+    {
+        const char *name;
+        int (*is)(int);
+    } classes[] = {
+        { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank },
+        { "cntrl", iscntrl }, { "digit", isdigit }, { "graph", isgraph },
+        { "lower", islower }, { "print", isprint }, { "punct", ispunct },
+        { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit }
+    };
+    size_t i;
+    int c;
+
+    for(i=0; i < sizeof classes / sizeof classes[0]; ++i)
+        if (strlen(classes[i].name) == len &&
+                strncmp(classes[i].name, name, len) == 0)
+        {
+            for(c=1; c < 256; ++c)
+                if (classes[i].is(c))
+                    set_add(t, c);
+            return 1;
+        }
+    return 0;
+}
+
+/* 'p' points just after the '['. Returns where the bracket expression ends,
+ * or 0 if we leave the pattern to fnmatch. */
+static const char *
+parse_bracket(const char *p, struct glob_token *t)
+{
+    int negate = 0;
+    int first = 1;
+    int i;
+
+    if (*p == '!' || *p == '^')
+    {
+        negate = 1;
+        ++p;
+    }
+
+    while (first || *p != ']')
+    {
+        unsigned char c;
+
+        first = 0;
+        if (*p == '\0')
+            return 0;
+
+        if (*p == '[' && p[1] == ':')
+        {
+            const char *end = strstr(p + 2, ":]");
+            if (!end || !add_class(t, p + 2, end - (p + 2)))
+                return 0;
+            p = end + 2;
+            continue;
+        }
+        if (*p == '[' && (p[1] == '=' || p[1] == '.'))
+            return 0;
+
+        if (*p == '\\')
+        {
+            ++p;
+            if (*p == '\0')
+                return 0;
+        }
+        c = *p++;
+
+        if (*p == '-' && p[1] != ']' && p[1] != '\0')
+        {
+            unsigned char last;
+
+            ++p;
+            if (*p == '[')
+                return 0;
+            if (*p == '\\')
+                ++p;
+            if (*p == '\0')
+                return 0;
+            last = *p++;
+            if (last < c)
+                return 0;
+            for(i = c; i <= last; ++i)
+                set_add(t, i);
+        }
+        else
+            set_add(t, c);
+    }
+
+    if (negate)
+        for(i=0; i < (int) sizeof t->set; ++i)
+            t->set[i] = ~t->set[i];
+    /* The names never have it */
+    t->set[0] &= ~1;
+
+    return p + 1;
+}
+
+static void
+compile_pattern(struct path_pattern *pp, const char *pattern,
+        const char *suffix)
+{
+    size_t len = strlen(pattern) + (suffix ? strlen(suffix) : 0);
+    const char *p;
+    char *prefix;
+    int allocated;
+
+    pp->text = malloc(len + 1);
+    pp->prefix = malloc(len + 1);
+    if (!pp->text || !pp->prefix)
+        fatal_error("Cannot allocate");
+    strcpy(pp->text, pattern);
+    if (suffix)
+        strcat(pp->text, suffix);
+    pp->tokens = 0;
+    pp->ntokens = 0;
+    pp->use_fnmatch = 0;
+
+    /* The literal prefix */
+    p = pp->text;
+    prefix = pp->prefix;
+    while (*p != '\0' && *p != '*' && *p != '?' && *p != '[')
+    {
+        if (*p == '\\')
+        {
+            if (p[1] == '\0')
+                break;
+            ++p;
+        }
+        *prefix++ = *p++;
+    }
+    *prefix = '\0';
+    pp->prefixlen = prefix - pp->prefix;
+
+    /* The rest, as tokens */
+    allocated = strlen(p);
+    if (allocated > 0)
+    {
+        pp->tokens = malloc(allocated * sizeof(*pp->tokens));
+        if (!pp->tokens)
+            fatal_error("Cannot allocate");
+    }
+    while (*p != '\0')
+    {
+        struct glob_token *t;
+
+        if (*p == '*' && pp->ntokens > 0 && pp->tokens[pp->ntokens-1].star)
+        {
+            ++p;
+            continue;
+        }
+
+        t = &pp->tokens[pp->ntokens++];
+        memset(t, 0, sizeof(*t));
+
+        if (*p == '*')
+        {
+            t->star = 1;
+            ++p;
+        }
+        else if (*p == '?')
+        {
+            int c;
+            for(c=1; c < 256; ++c)
+                set_add(t, c);
+            ++p;
+        }
+        else if (*p == '[')
+        {
+            p = parse_bracket(p + 1, t);
+            if (!p)
+            {
+                pp->use_fnmatch = 1;
+                break;
+            }
+        }
+        else
+        {
+            if (*p == '\\')
+            {
+                ++p;
+                if (*p == '\0')
+                {
+                    pp->use_fnmatch = 1;
+                    break;
+                }
+            }
+            set_add(t, *p++);
+        }
+    }
+
+    if (command_line.debug > 1)
+        fprintf(stderr, "Path pattern \"%s\": prefix \"%s\", %i tokens%s\n",
+                pp->text, pp->prefix, pp->ntokens,
+                pp->use_fnmatch ? ", by fnmatch" : "");
+}
+
+static int
+compare_prefix(const void *p1, const void *p2)
+{
+    const struct path_pattern *a = p1;
+    const struct path_pattern *b = p2;
+
+    return strcmp(a->prefix, b->prefix);
+}
+
+void
+path_matcher_init(struct path_matcher *m, const char **patterns,
+        const char *suffix)
+{
+    int n = 0;
+    int i;
+
+    m->patterns = 0;
+    m->npatterns = 0;
+    m->first_with_prefix = 0;
+
+    if (!patterns)
+        return;
+
+    while (patterns[n] != 0)
+        ++n;
+    if (suffix)
+        n *= 2;
+    if (n == 0)
+        return;
+
+    m->patterns = malloc(n * sizeof(*m->patterns));
+    if (!m->patterns)
+        fatal_error("Cannot allocate");
+
+    for(i=0; patterns[i] != 0; ++i)
+    {
+        compile_pattern(&m->patterns[m->npatterns++], patterns[i], 0);
+        if (suffix)
+            compile_pattern(&m->patterns[m->npatterns++], patterns[i], suffix);
+    }
+
+    qsort(m->patterns, m->npatterns, sizeof(*m->patterns), compare_prefix);
+
+    while (m->first_with_prefix < m->npatterns &&
+            m->patterns[m->first_with_prefix].prefixlen == 0)
+        m->first_with_prefix++;
+}
+
+static int
+tokens_match(const struct glob_token *t, int n, const unsigned char *s)
+{
+    int i = 0;
+    int after_star = -1;
+    const unsigned char *star_s = 0;
+
+    while (*s != '\0')
+    {
+        if (i < n && t[i].star)
+        {
+            after_star = ++i;
+            if (i == n)
+                return 1;
+            star_s = s;
+            continue;
+        }
+        if (i < n && set_has(&t[i], *s))
+        {
+            ++i;
+            ++s;
+            continue;
+        }
+        /* Let the last star take one byte more */
+        if (after_star < 0)
+            return 0;
+        i = after_star;
+        s = ++star_s;
+    }
+
+    while (i < n && t[i].star)
+        ++i;
+    return i == n;
+}
+
+static int
+pattern_match(const struct path_pattern *pp, const char *name)
+{
+    if (pp->use_fnmatch)
+        return fnmatch(pp->text, name, 0) == 0;
+
+    if (strncmp(pp->prefix, name, pp->prefixlen) != 0)
+        return 0;
+
+    return tokens_match(pp->tokens, pp->ntokens,
+            (const unsigned char *) name + pp->prefixlen);
+}
+
+int
+path_matcher_match(const struct path_matcher *m, const char *name)
+{
+    int low, high;
+    int i;
+
+    for(i=0; i < m->first_with_prefix; ++i)
+        if (pattern_match(&m->patterns[i], name))
+            return 1;
+
+    /* Any prefix of the name sorts before it, among those starting
+     * with its first byte */
+    low = m->first_with_prefix;
+    high = m->npatterns;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (strcmp(m->patterns[mid].prefix, name) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for(i = low - 1; i >= m->first_with_prefix; --i)
+    {
+        const struct path_pattern *pp = &m->patterns[i];
+
+        if (pp->prefix[0] != name[0])
+            break;
+        if (pattern_match(pp, name))
+            return 1;
+    }
+
+    return 0;
+}
+
+void
+path_matcher_free(struct path_matcher *m)
+{
+    int i;
+
+    for(i=0; i < m->npatterns; ++i)
+    {
+        free(m->patterns[i].text);
+        free(m->patterns[i].prefix);
+        free(m->patterns[i].tokens);
+    }
+    free(m->patterns);
+    m->patterns = 0;
+    m->npatterns = 0;
+    m->first_with_prefix = 0;
+}
@@ -0,0 +1,23 @@
+struct glob_token;
+
+struct path_pattern
+{
+    char *text; /* For fnmatch */
+    char *prefix; /* The literal start of the pattern */
+    size_t prefixlen;
+    struct glob_token *tokens; /* What comes after the prefix */
+    int ntokens;
+    int use_fnmatch; /* Syntax we do not compile */
+};
+
+struct path_matcher
+{
+    struct path_pattern *patterns; /* Sorted by prefix */
+    int npatterns;
+    int first_with_prefix;
+};
+
+void path_matcher_init(struct path_matcher *m, const char **patterns,
+        const char *suffix);
+int path_matcher_match(const struct path_matcher *m, const char *name);
+void path_matcher_free(struct path_matcher *m);
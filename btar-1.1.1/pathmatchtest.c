@@ -0,0 +1,113 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <fnmatch.h>
+#include <stdio.h>
+#include "main.h"
+#include "pathmatch.h"
+
+/* as pathmatch.c will depend on it */
+struct command_line command_line;
+
+static const char *patterns[] = {
+    "home/*", "home/viric*", "home/viric/*", "home/viric/", "home*",
+    "ho", "*", "?", "*hola", "*/.xa/*", "home/?iric/*", "*a*a*",
+    "home/[a-v]iric/hola", "home/[!v]iric/*", "home/[^v]iric/*",
+    "home/[]x]*", "home/[a-]*", "*[[:digit:]]", "*[[:upper:]]*",
+    "home/viric/\\.xa/2", "home/viric/\\*", "*.[ch]", "**/*.c",
+    "home/[[.v.]]iric/*", "[", "home/[", "home/viric/[z-a]", "",
+    0
+};
+
+static const char *names[] = {
+    "home/viric/hola", "home/viric/.xa/2", "home/viric", "home/viric/",
+    "home", "ho", "h", "home/xiric/a", "home/]iric", "home/-", "src/a.c",
+    "src/sub/b.h", "home/viric/*", "home/Viric/hola", "aaa", "a/a", "",
+    "home/[", "[",
+    0
+};
+
+int
+test(const char *pattern, const char *name)
+{
+    struct path_matcher m;
+    const char *one[2];
+    int res, expected;
+
+    one[0] = pattern;
+    one[1] = 0;
+    path_matcher_init(&m, one, 0);
+    res = path_matcher_match(&m, name);
+    path_matcher_free(&m);
+
+    expected = fnmatch(pattern, name, 0) == 0;
+    if (res != expected)
+    {
+        printf(" pathmatch(\"%s\", \"%s\") = %i, fnmatch says %i\n",
+                pattern, name, res, expected);
+        return 1;
+    }
+    return 0;
+}
+
+/* All the patterns at once, as for the -x of extract */
+int
+test_all(const char *name)
+{
+    struct path_matcher m;
+    int res, expected = 0;
+    int i;
+
+    path_matcher_init(&m, patterns, 0);
+    res = path_matcher_match(&m, name);
+    path_matcher_free(&m);
+
+    for(i=0; patterns[i] != 0; ++i)
+        if (fnmatch(patterns[i], name, 0) == 0)
+            expected = 1;
+    if (res != expected)
+    {
+        printf(" pathmatch(all, \"%s\") = %i, fnmatch says %i\n",
+                name, res, expected);
+        return 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    int i, j;
+    int failed = 0;
+    int tests = 0;
+
+    for(i=0; patterns[i] != 0; ++i)
+        for(j=0; names[j] != 0; ++j)
+        {
+            failed += test(patterns[i], names[j]);
+            ++tests;
+        }
+
+    for(j=0; names[j] != 0; ++j)
+    {
+        failed += test_all(names[j]);
+        ++tests;
+    }
+
+    printf("%i of %i tests failed\n", failed, tests);
+
+    return failed != 0;
+}
@@ -34,6 +34,9 @@ process_part(struct readtar *readtar, const char *data, size_t len)
     switch(readtar->state)
     {
         case IN_HEADER:
+            if (readtar->data_read == 0 && !readtar->longfilename &&
+                    !readtar->longlinkname)
+                readtar->header_start = readtar->total_data_read;
             maxlen = (sizeof readtar->header - readtar->data_read);
             if (maxlen > len)
                 maxlen = len;
@@ -127,9 +130,11 @@ process_part(struct readtar *readtar, const char *data, size_t len)
         {
             /* Skip block, it should be final zero block. We could check it. */
             readtar->state = IN_HEADER;
+            readtar->at_end = 1;
             return amount_read;
         }
 
+        readtar->at_end = 0;
         checksum = read_octal_number(sh->checksum, sizeof sh->checksum);
         if (calc_checksum(sh) != checksum || strncmp(sh->magic, "ustar", 5))
         {
@@ -137,6 +142,8 @@ process_part(struct readtar *readtar, const char *data, size_t len)
             if (command_line.debug && readtar->good_header)
                 fprintf(stderr, "readtar: failed checksum interpreting tar, at pos %llu. "
                         "Searching header...\n", readtar->total_data_read);
+            if (readtar->good_header)
+                readtar->bad_headers++;
             readtar->good_header = 0;
             readtar->state = IN_HEADER;
             return amount_read;
@@ -202,6 +209,7 @@ process_part(struct readtar *readtar, const char *data, size_t len)
         {
             enum readtar_newfile_result rres;
             rres = readtar->cb.new_file(&file, readtar->cb.userdata);
+            readtar->skipping = (rres == READTAR_SKIPDATA);
             if (rres == READTAR_SKIPDATA && readtar->fd >= 0)
             {
                 int res;
@@ -213,6 +221,7 @@ process_part(struct readtar *readtar, const char *data, size_t len)
                     readtar->state = IN_HEADER;
                     readtar->filedata_left = 0;
                     readtar->until_header_left = 0;
+                    readtar->skipping = 0;
                 }
             }
         }
@@ -256,6 +265,43 @@ readtar_bytes_to_next_change(const struct readtar *readtar)
     return maxlen;
 }
 
+/* For the callers that skip the data themselves, after a
+ * READTAR_SKIPDATA: returns how much to skip, and leaves the readtar
+ * waiting for the next header. */
+unsigned long long
+readtar_take_skip(struct readtar *readtar)
+{
+    unsigned long long n;
+
+    if (!readtar->skipping || readtar->state == IN_HEADER)
+        return 0;
+
+    n = readtar->until_header_left;
+    readtar->state = IN_HEADER;
+    readtar->filedata_left = 0;
+    readtar->until_header_left = 0;
+    readtar->data_read = 0;
+    readtar->total_data_read += n;
+    readtar->skipping = 0;
+    return n;
+}
+
+/* To start parsing in the middle of the data of a file, whose header
+ * came before what we will process. 'left' bytes of data remain, and
+ * they start 512-aligned in the tar. The data goes to new_data
+ * without any new_file. */
+void
+readtar_start_in_data(struct readtar *readtar, unsigned long long left)
+{
+    readtar->filedata_left = left;
+    readtar->until_header_left = left;
+    if (readtar->until_header_left % 512 > 0)
+        readtar->until_header_left += 512 - readtar->until_header_left % 512;
+    readtar->data_read = 0;
+    readtar->skipping = 0;
+    readtar->state = left > 0 ? IN_DATA : IN_HEADER;
+}
+
 void
 process_this_tar_data(struct readtar *readtar, const char *data, size_t len)
 {
@@ -281,8 +327,12 @@ init_readtar(struct readtar *readtar, const struct readtar_callbacks *cb)
     readtar->until_header_left = 0;
     readtar->data_read = 0;
     readtar->total_data_read = 0;
+    readtar->header_start = 0;
     readtar->state = IN_HEADER;
     readtar->good_header = 1;
+    readtar->bad_headers = 0;
+    readtar->at_end = 0;
+    readtar->skipping = 0;
     readtar->fd = -1; /* For skip to work */
 }
 
@@ -35,8 +35,12 @@ struct readtar
     unsigned long long until_header_left;
     unsigned long long data_read;
     unsigned long long total_data_read;
+    unsigned long long header_start; /* Of the entry, its long names included */
     struct readtar_callbacks cb;
     int good_header;
+    unsigned long long bad_headers; /* Where a header was expected */
+    int at_end; /* The last record read was of the zeros ending the tar */
+    int skipping;
     int fd;
 };
 
@@ -44,3 +48,5 @@ void init_readtar(struct readtar *readtar, const struct readtar_callbacks *cb);
 void read_full_tar(int infd, struct readtar *readtar);
 void process_this_tar_data(struct readtar *readtar, const char *data, size_t len);
 size_t readtar_bytes_to_next_change(const struct readtar *readtar);
+unsigned long long readtar_take_skip(struct readtar *readtar);
+void readtar_start_in_data(struct readtar *readtar, unsigned long long left);
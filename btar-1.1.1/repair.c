@@ -0,0 +1,902 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "main.h"
+#include "mytar.h"
+#include "directory.h"
+#include "parity.h"
+#include "checksums.h"
+#include "repair.h"
+
+/* --repair finds the lost blocks of an archive, and rebuilds them from the
+ * rest of the blocks of their group and its parity members, of --parity
+ * k/n, or from the xorblocks of -R. The members come from the directory if
+ * it can be read, or else from the headers found in the archive. A block is
+ * lost if its member is missing, or it does not have the size of the parity
+ * or the CRC32C of the checksums member. */
+
+struct repair_member
+{
+    struct header_gnu_tar header;
+    char *name;
+    unsigned long long offset; /* of the header */
+    unsigned long long size;
+    int damaged;
+};
+
+struct repair_group
+{
+    int first; /* block */
+    int stride; /* between its blocks */
+    int nblocks;
+    int k;
+    int is_xor;
+    int *parity; /* member of each parity, or -1 */
+    size_t *parity_start; /* of the data in each parity member */
+    unsigned long long *sizes; /* of each block */
+    /* For the rebuilding */
+    int nlost;
+    int *lost; /* numbers in the group */
+    unsigned char **sums;
+    unsigned char *inverse;
+    int rebuilt;
+};
+
+struct repair_state
+{
+    int fd;
+    unsigned long long filesize;
+    struct repair_member *members;
+    size_t nmembers;
+    size_t allocated;
+    int have_directory;
+    int *blocks; /* member of each block, or -1 */
+    int nblocks;
+    char *block_suffix; /* the filter extensions after block<n> */
+    struct repair_group *groups;
+    int ngroups;
+    int n; /* blocks per group */
+    int xor_groups; /* interleaved xorblocks, if no parity members */
+    int *emitted; /* of the lost blocks */
+    struct checksum_table checksums;
+};
+
+static void
+add_member(struct repair_state *rs, const struct header_gnu_tar *h,
+        const char *name, unsigned long long offset, unsigned long long size,
+        int damaged)
+{
+    struct repair_member *m;
+
+    if (rs->nmembers == rs->allocated)
+    {
+        rs->allocated = rs->allocated ? rs->allocated * 2 : 100;
+        rs->members = realloc(rs->members, rs->allocated * sizeof(*rs->members));
+        if (!rs->members)
+            fatal_error("Cannot realloc");
+    }
+
+    m = &rs->members[rs->nmembers++];
+    if (h)
+        m->header = *h;
+    else
+        memset(&m->header, 0, sizeof m->header);
+    m->name = strdup(name);
+    if (!m->name)
+        fatal_error("Cannot allocate");
+    m->offset = offset;
+    m->size = size;
+    m->damaged = damaged;
+}
+
+static int
+header_is_valid(const struct header_gnu_tar *h)
+{
+    return h->name[0] != '\0' &&
+        calc_checksum(h) == (int) read_octal_number(h->checksum, sizeof h->checksum);
+}
+
+/* The member header at 'offset', if it is what the directory says */
+static int
+read_member_header(struct repair_state *rs, struct header_gnu_tar *h,
+        const struct directory_entry *e)
+{
+    if (pread_all(rs->fd, h, sizeof *h, e->offset) == -1)
+        return 0;
+    if (!header_is_valid(h) ||
+            strncmp(h->name, e->name, sizeof h->name) != 0 ||
+            read_size(h->size) != e->size)
+        return 0;
+    return e->offset + 512 + e->size <= rs->filesize;
+}
+
+static void
+members_from_directory(struct repair_state *rs, const struct directory *dir)
+{
+    size_t i;
+
+    for(i=0; i < dir->nentries; ++i)
+    {
+        const struct directory_entry *e = &dir->entries[i];
+        struct header_gnu_tar h;
+        int ok = read_member_header(rs, &h, e);
+
+        if (!ok)
+            fprintf(stderr, "The member %s at %llu is damaged\n", e->name,
+                    e->offset);
+        add_member(rs, ok ? &h : 0, e->name, e->offset, e->size, !ok);
+    }
+}
+
+static int
+is_btar_member(const char *name)
+{
+    static const char *prefixes[] = { "block", "xorblock", "parity", "index",
+        "signatures.tar", "deleted.tar", "frames", "checksums", "directory", 0 };
+    int i;
+
+    for(i=0; prefixes[i]; ++i)
+        if (strncmp(name, prefixes[i], strlen(prefixes[i])) == 0)
+            return 1;
+    return 0;
+}
+
+/* Without a directory, every valid header of a btar member is taken, and
+ * the records after a damaged one are looked at one by one */
+static void
+members_from_headers(struct repair_state *rs)
+{
+    unsigned long long pos = 0;
+    int in_sync = 1;
+
+    while (pos + 512 <= rs->filesize)
+    {
+        struct header_gnu_tar h;
+        unsigned long long size;
+        char name[sizeof h.name + 1];
+
+        if (pread_all(rs->fd, &h, sizeof h, pos) == -1)
+            fatal_errno("Cannot read the btar");
+
+        strcpyn(name, h.name, sizeof name);
+        if (!header_is_valid(&h) || !is_btar_member(name))
+        {
+            int zero = 1;
+            size_t i;
+
+            for(i=0; i < sizeof h && zero; ++i)
+                zero = ((char *) &h)[i] == 0;
+            if (in_sync && !zero)
+                fprintf(stderr, "Damaged tar header at %llu\n", pos);
+            in_sync = zero;
+            pos += 512;
+            continue;
+        }
+
+        size = read_size(h.size);
+        if (pos + 512 + size > rs->filesize)
+        {
+            fprintf(stderr, "The member %s at %llu is truncated\n", name, pos);
+            add_member(rs, &h, name, pos, size, 1);
+            break;
+        }
+        if (strcmp(name, "directory") != 0)
+            add_member(rs, &h, name, pos, size, 0);
+        in_sync = 1;
+
+        if (size % 512)
+            size += 512 - size % 512;
+        pos += 512 + size;
+    }
+}
+
+static struct repair_group *
+get_group(struct repair_state *rs, int g)
+{
+    if (g >= rs->ngroups)
+    {
+        int i;
+
+        rs->groups = realloc(rs->groups, (g + 1) * sizeof(*rs->groups));
+        if (!rs->groups)
+            fatal_error("Cannot realloc");
+        for(i = rs->ngroups; i <= g; ++i)
+        {
+            struct repair_group *gr = &rs->groups[i];
+
+            memset(gr, 0, sizeof *gr);
+            gr->first = -1;
+            gr->stride = 1;
+        }
+        rs->ngroups = g + 1;
+    }
+    return &rs->groups[g];
+}
+
+static void
+group_set_parity(struct repair_group *gr, int k, int j, int member,
+        size_t start)
+{
+    int i;
+
+    if (!gr->parity)
+    {
+        gr->k = k;
+        gr->parity = malloc(k * sizeof(*gr->parity));
+        gr->parity_start = malloc(k * sizeof(*gr->parity_start));
+        if (!gr->parity || !gr->parity_start)
+            fatal_error("Cannot allocate");
+        for(i=0; i < k; ++i)
+            gr->parity[i] = -1;
+    }
+    if (j < gr->k)
+    {
+        gr->parity[j] = member;
+        gr->parity_start[j] = start;
+    }
+}
+
+/* The parity members tell the groups, with the size of their blocks */
+static void
+find_groups(struct repair_state *rs)
+{
+    size_t hmax = parity_header_max();
+    char *text = malloc(hmax);
+    size_t i;
+
+    if (!text)
+        fatal_error("Cannot allocate");
+
+    for(i=0; i < rs->nmembers; ++i)
+    {
+        struct repair_member *m = &rs->members[i];
+        struct repair_group *gr;
+        int g, j, k, n, nblocks;
+        unsigned long long *sizes;
+        size_t len = m->size < hmax ? m->size : hmax;
+        size_t start;
+
+        if (m->damaged)
+            continue;
+
+        if (sscanf(m->name, "parity%d_%d", &g, &j) != 2 || g < 0 || j < 0)
+            continue;
+
+        if (pread_all(rs->fd, text, len, m->offset + 512) == -1 ||
+                !parity_header_parse(text, len, &k, &n, &nblocks, &sizes, &start))
+        {
+            fprintf(stderr, "The parity member %s is damaged\n", m->name);
+            m->damaged = 1;
+            continue;
+        }
+
+        rs->n = n;
+        gr = get_group(rs, g);
+        group_set_parity(gr, k, j, i, start);
+        if (gr->first == -1)
+        {
+            gr->first = g * n;
+            gr->nblocks = nblocks;
+            gr->sizes = sizes;
+        }
+        else
+            free(sizes);
+    }
+    free(text);
+
+    /* Else the xorblocks, each a group of a single parity */
+    for(i=0; i < rs->nmembers && rs->ngroups == 0; ++i)
+    {
+        struct repair_member *m = &rs->members[i];
+        int g = 0, ngroups = 1;
+
+        if (!m->damaged && (strcmp(m->name, "xorblock") == 0 ||
+                (sscanf(m->name, "xorblock%d_%d", &g, &ngroups) == 2 &&
+                 g >= 0 && g < ngroups)))
+            rs->xor_groups = ngroups;
+    }
+    for(i=0; i < rs->nmembers && rs->xor_groups > 0; ++i)
+    {
+        struct repair_member *m = &rs->members[i];
+        struct repair_group *gr;
+        int g = 0, ngroups = 1;
+
+        if (m->damaged || (strcmp(m->name, "xorblock") != 0 &&
+                (sscanf(m->name, "xorblock%d_%d", &g, &ngroups) != 2 ||
+                 ngroups != rs->xor_groups || g < 0 || g >= ngroups)))
+            continue;
+        gr = get_group(rs, g);
+        gr->is_xor = 1;
+        group_set_parity(gr, 1, 0, i, 0);
+    }
+}
+
+static int
+block_number(const char *name)
+{
+    int b;
+
+    if (strncmp(name, "block", 5) != 0 || sscanf(name + 5, "%d", &b) != 1)
+        return -1;
+    return b;
+}
+
+static void
+find_blocks(struct repair_state *rs)
+{
+    size_t i;
+    int g;
+
+    rs->nblocks = 0;
+    for(i=0; i < rs->nmembers; ++i)
+    {
+        int b = block_number(rs->members[i].name);
+
+        if (b + 1 > rs->nblocks)
+            rs->nblocks = b + 1;
+        if (b >= 0 && !rs->block_suffix)
+        {
+            const char *p = rs->members[i].name + 5;
+
+            while (*p >= '0' && *p <= '9')
+                ++p;
+            rs->block_suffix = strdup(p);
+        }
+    }
+    for(g=0; g < rs->ngroups; ++g)
+        if (!rs->groups[g].is_xor && rs->groups[g].first >= 0 &&
+                rs->groups[g].first + rs->groups[g].nblocks > rs->nblocks)
+            rs->nblocks = rs->groups[g].first + rs->groups[g].nblocks;
+
+    rs->blocks = malloc(rs->nblocks * sizeof(*rs->blocks));
+    rs->emitted = malloc(rs->nblocks * sizeof(*rs->emitted));
+    if (rs->nblocks > 0 && (!rs->blocks || !rs->emitted))
+        fatal_error("Cannot allocate");
+    for(g=0; g < rs->nblocks; ++g)
+    {
+        rs->blocks[g] = -1;
+        rs->emitted[g] = 1;
+    }
+
+    for(i=0; i < rs->nmembers; ++i)
+    {
+        int b = block_number(rs->members[i].name);
+
+        if (b >= 0 && !rs->members[i].damaged)
+            rs->blocks[b] = i;
+    }
+
+    /* The xorblock g has the blocks g, g + xor_groups... and their sizes
+     * come from the directory */
+    for(g=0; g < rs->ngroups && rs->xor_groups > 0; ++g)
+    {
+        struct repair_group *gr = &rs->groups[g];
+        int b;
+
+        gr->first = g;
+        gr->stride = rs->xor_groups;
+        gr->nblocks = g < rs->nblocks ?
+            (rs->nblocks - g + gr->stride - 1) / gr->stride : 0;
+        gr->sizes = malloc((gr->nblocks + 1) * sizeof(*gr->sizes));
+        if (!gr->sizes)
+            fatal_error("Cannot allocate");
+        for(b=0; b < gr->nblocks; ++b)
+            gr->sizes[b] = ULLONG_MAX;
+    }
+    for(i=0; i < rs->nmembers && rs->xor_groups > 0; ++i)
+    {
+        int b = block_number(rs->members[i].name);
+        struct repair_group *gr;
+
+        if (b < 0 || b % rs->xor_groups >= rs->ngroups)
+            continue;
+        gr = &rs->groups[b % rs->xor_groups];
+        if (rs->have_directory || !rs->members[i].damaged)
+            gr->sizes[b / rs->xor_groups] = rs->members[i].size;
+    }
+}
+
+static void
+load_checksums(struct repair_state *rs)
+{
+    size_t i;
+
+    checksum_table_init(&rs->checksums);
+    for(i=0; i < rs->nmembers; ++i)
+    {
+        struct repair_member *m = &rs->members[i];
+        char *text;
+
+        if (m->damaged || strcmp(m->name, "checksums") != 0)
+            continue;
+
+        text = malloc(m->size + 1);
+        if (!text)
+            fatal_error("Cannot allocate");
+        if (pread_all(rs->fd, text, m->size, m->offset + 512) == -1)
+            fatal_errno("Cannot read the checksums member");
+        text[m->size] = '\0';
+        if (!checksum_table_parse(&rs->checksums, text))
+            fprintf(stderr, "The checksums member is damaged\n");
+        free(text);
+        break;
+    }
+}
+
+/* Returns 0 if the block member does not have the CRC32C of the checksums */
+static int
+block_matches_checksum(struct repair_state *rs, int b)
+{
+    const struct repair_member *m = &rs->members[rs->blocks[b]];
+    char *buffer;
+    unsigned long long pos;
+    unsigned int expected;
+    unsigned int crc = 0;
+
+    if (!checksum_table_find(&rs->checksums, b, 0, &expected))
+        return 1;
+
+    buffer = malloc(buffersize);
+    if (!buffer)
+        fatal_error("Cannot allocate");
+    for(pos = 0; pos < m->size; pos += buffersize)
+    {
+        size_t n = m->size - pos < buffersize ? m->size - pos : buffersize;
+
+        if (pread_all(rs->fd, buffer, n, m->offset + 512 + pos) == -1)
+            fatal_errno("Cannot read the block %i", b);
+        crc = crc32c(crc, buffer, n);
+    }
+    free(buffer);
+
+    return crc == expected;
+}
+
+static struct repair_group *
+group_of_block(struct repair_state *rs, int b)
+{
+    struct repair_group *gr;
+
+    if (rs->xor_groups > 0 && b % rs->xor_groups < rs->ngroups)
+        gr = &rs->groups[b % rs->xor_groups];
+    else if (rs->n > 0 && b / rs->n < rs->ngroups)
+        gr = &rs->groups[b / rs->n];
+    else
+        return 0;
+
+    if (gr->first < 0 || (b - gr->first) / gr->stride >= gr->nblocks)
+        return 0;
+    return gr;
+}
+
+/* The number of the block b in its group */
+static int
+group_index(const struct repair_group *gr, int b)
+{
+    return (b - gr->first) / gr->stride;
+}
+
+/* Which blocks are lost, and whether we can rebuild them */
+static int
+find_lost(struct repair_state *rs)
+{
+    int b;
+    int g;
+    int nlost = 0;
+    int fine = 1;
+
+    for(b=0; b < rs->nblocks; ++b)
+    {
+        struct repair_group *gr = group_of_block(rs, b);
+        int lost = rs->blocks[b] == -1;
+
+        if (!lost && gr && rs->members[rs->blocks[b]].size !=
+                gr->sizes[group_index(gr, b)])
+        {
+            fprintf(stderr, "The block %i does not have the size of the parity\n",
+                    b);
+            lost = 1;
+        }
+        if (!lost && !block_matches_checksum(rs, b))
+        {
+            fprintf(stderr, "The block %i does not match its checksum\n", b);
+            lost = 1;
+        }
+        if (!lost)
+            continue;
+
+        /* Not to copy it, nor to take it as good for the rebuilding */
+        if (rs->blocks[b] >= 0)
+        {
+            rs->members[rs->blocks[b]].damaged = 1;
+            rs->blocks[b] = -1;
+        }
+        fprintf(stderr, "The block %i is lost\n", b);
+        ++nlost;
+        rs->emitted[b] = 0;
+        if (!gr)
+        {
+            fprintf(stderr, "There is no parity for the block %i\n", b);
+            fine = 0;
+            continue;
+        }
+        if (gr->sizes[group_index(gr, b)] == ULLONG_MAX)
+        {
+            fprintf(stderr, "The size of the block %i is not known\n", b);
+            fine = 0;
+            continue;
+        }
+        if (!gr->lost)
+        {
+            gr->lost = malloc(gr->nblocks * sizeof(*gr->lost));
+            if (!gr->lost)
+                fatal_error("Cannot allocate");
+        }
+        gr->lost[gr->nlost++] = group_index(gr, b);
+    }
+
+    for(g=0; g < rs->ngroups; ++g)
+    {
+        struct repair_group *gr = &rs->groups[g];
+        int j;
+        int available = 0;
+
+        for(j=0; j < gr->k; ++j)
+            if (gr->parity[j] >= 0)
+                ++available;
+            else
+                fprintf(stderr, "The parity %i of the group %i is lost\n", j, g);
+
+        if (gr->nlost > available)
+        {
+            fprintf(stderr, "The group %i has %i blocks lost, and only %i "
+                    "parity members\n", g, gr->nlost, available);
+            fine = 0;
+        }
+    }
+
+    if (nlost == 0)
+        fprintf(stderr, "No block is lost\n");
+
+    return fine;
+}
+
+static unsigned char
+coefficient(const struct repair_group *gr, int j, int i)
+{
+    if (gr->is_xor)
+        return 1;
+    return parity_coefficient(gr->k, j, i);
+}
+
+/* Each of the blocks still there is read once, to take it out of the
+ * parity members used. What remains is the lost blocks, times a matrix to
+ * invert. */
+static void
+rebuild_group(struct repair_state *rs, struct repair_group *gr)
+{
+    int *use = malloc(gr->nlost * sizeof(*use));
+    unsigned char *matrix = malloc(gr->nlost * gr->nlost);
+    unsigned char *buffer = malloc(buffersize);
+    unsigned long long len = 0;
+    int r, c, i, j;
+
+    if (!use || !matrix || !buffer)
+        fatal_error("Cannot allocate");
+
+    for(c=0; c < gr->nlost; ++c)
+        if (gr->sizes[gr->lost[c]] > len)
+            len = gr->sizes[gr->lost[c]];
+
+    gr->sums = malloc(gr->nlost * sizeof(*gr->sums));
+    gr->inverse = malloc(gr->nlost * gr->nlost);
+    if (!gr->sums || !gr->inverse)
+        fatal_error("Cannot allocate");
+
+    /* The first parity members there are */
+    for(r=0, j=0; r < gr->nlost; ++j)
+    {
+        const struct repair_member *m;
+        unsigned long long have;
+
+        if (gr->parity[j] < 0)
+            continue;
+        use[r] = j;
+        m = &rs->members[gr->parity[j]];
+
+        gr->sums[r] = calloc(len ? len : 1, 1);
+        if (!gr->sums[r])
+            fatal_error("Cannot allocate the parity of %llu bytes", len);
+        have = m->size - gr->parity_start[j];
+        if (have > len)
+            have = len;
+        if (pread_all(rs->fd, gr->sums[r], have,
+                    m->offset + 512 + gr->parity_start[j]) == -1)
+            fatal_errno("Cannot read the parity member %s", m->name);
+        ++r;
+    }
+
+    for(i=0; i < gr->nblocks; ++i)
+    {
+        const struct repair_member *m;
+        unsigned long long pos = 0;
+        unsigned long long size;
+        int b = gr->first + i * gr->stride;
+
+        if (rs->blocks[b] < 0 || !rs->emitted[b])
+            continue;
+        m = &rs->members[rs->blocks[b]];
+        size = m->size < len ? m->size : len;
+
+        while (pos < size)
+        {
+            size_t n = size - pos < buffersize ? size - pos : buffersize;
+
+            if (pread_all(rs->fd, buffer, n, m->offset + 512 + pos) == -1)
+                fatal_errno("Cannot read the block %i", b);
+            for(r=0; r < gr->nlost; ++r)
+                gf_mul_add_region(gr->sums[r] + pos, buffer,
+                        coefficient(gr, use[r], i), n);
+            pos += n;
+        }
+    }
+
+    for(r=0; r < gr->nlost; ++r)
+        for(c=0; c < gr->nlost; ++c)
+            matrix[r * gr->nlost + c] = coefficient(gr, use[r], gr->lost[c]);
+    if (!gf_invert_matrix(matrix, gr->inverse, gr->nlost))
+        fatal_error("Cannot invert the parity matrix of the blocks from %i",
+                gr->first);
+
+    gr->rebuilt = 1;
+    free(use);
+    free(matrix);
+    free(buffer);
+}
+
+static void
+free_group_sums(struct repair_group *gr)
+{
+    int r;
+
+    for(r=0; r < gr->nlost; ++r)
+        free(gr->sums[r]);
+    free(gr->sums);
+    gr->sums = 0;
+    free(gr->inverse);
+    gr->inverse = 0;
+}
+
+static void
+emit_block(struct repair_state *rs, int b, struct mytar *tar,
+        struct directory *dir)
+{
+    struct repair_group *gr = group_of_block(rs, b);
+    unsigned char *buffer;
+    char name[PATH_MAX];
+    unsigned long long size;
+    unsigned long long pos;
+    ssize_t res;
+    int c, r;
+    int left = 0;
+
+    assert(gr);
+    if (!gr->rebuilt)
+        rebuild_group(rs, gr);
+
+    for(c=0; gr->lost[c] != group_index(gr, b); ++c);
+    size = gr->sizes[group_index(gr, b)];
+
+    if (command_line.verbose || command_line.debug)
+        fprintf(stderr, "Rebuilding the block %i\n", b);
+
+    snprintf(name, sizeof name, "block%i%s", b,
+            rs->block_suffix ? rs->block_suffix : ".tar");
+    mytar_new_file(tar);
+    mytar_set_filename(tar, name);
+    mytar_set_gid(tar, getgid());
+    mytar_set_uid(tar, getuid());
+    mytar_set_size(tar, size);
+    mytar_set_mode(tar, 0644 | S_IFREG);
+    mytar_set_mtime(tar, time(NULL));
+    mytar_set_filetype(tar, S_IFREG);
+    res = mytar_write_header(tar);
+    if (res == -1)
+        error("Failed to write header");
+
+    buffer = malloc(buffersize);
+    if (!buffer)
+        fatal_error("Cannot allocate");
+    for(pos = 0; pos < size; pos += buffersize)
+    {
+        size_t n = size - pos < buffersize ? size - pos : buffersize;
+
+        memset(buffer, 0, n);
+        for(r=0; r < gr->nlost; ++r)
+            gf_mul_add_region(buffer, gr->sums[r] + pos,
+                    gr->inverse[c * gr->nlost + r], n);
+        res = mytar_write_data(tar, (char *) buffer, n);
+        if (res == -1)
+            error("Could not write mytar data");
+    }
+    free(buffer);
+
+    res = mytar_write_end(tar);
+    if (res == -1)
+        error("Could not write mytar file end");
+    if (dir)
+        directory_add_member(dir, tar);
+
+    rs->emitted[b] = 1;
+    for(c=0; c < gr->nlost; ++c)
+        if (!rs->emitted[gr->first + gr->lost[c] * gr->stride])
+            left = 1;
+    if (!left)
+        free_group_sums(gr);
+}
+
+/* The lost blocks before 'limit', in order */
+static void
+emit_lost_before(struct repair_state *rs, int limit, struct mytar *tar,
+        struct directory *dir)
+{
+    int b;
+
+    for(b=0; b < rs->nblocks && b < limit; ++b)
+        if (!rs->emitted[b])
+            emit_block(rs, b, tar, dir);
+}
+
+static void
+copy_member(struct repair_state *rs, const struct repair_member *m,
+        struct mytar *tar, struct directory *dir)
+{
+    char *buffer = malloc(buffersize);
+    unsigned long long pos;
+    ssize_t res;
+
+    if (!buffer)
+        fatal_error("Cannot allocate");
+
+    mytar_new_file(tar);
+    tar->header = m->header;
+    res = mytar_write_header(tar);
+    if (res == -1)
+        error("Failed to write header");
+
+    for(pos = 0; pos < m->size; pos += buffersize)
+    {
+        size_t n = m->size - pos < buffersize ? m->size - pos : buffersize;
+
+        if (pread_all(rs->fd, buffer, n, m->offset + 512 + pos) == -1)
+            fatal_errno("Cannot read the member %s", m->name);
+        res = mytar_write_data(tar, buffer, n);
+        if (res == -1)
+            error("Could not write mytar data");
+    }
+    free(buffer);
+
+    res = mytar_write_end(tar);
+    if (res == -1)
+        error("Could not write mytar file end");
+    directory_add_member(dir, tar);
+}
+
+void
+repair(int fd, int outfd)
+{
+    struct repair_state rs;
+    struct directory dir;
+    struct directory newdir;
+    struct stat st;
+    struct mytar *tar;
+    size_t i;
+    int g;
+
+    memset(&rs, 0, sizeof rs);
+    rs.fd = fd;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        fatal_error_no_core("--repair needs the btar as a file");
+    rs.filesize = st.st_size;
+
+    rs.have_directory = directory_load(&dir, fd);
+    if (rs.have_directory)
+    {
+        members_from_directory(&rs, &dir);
+        directory_free(&dir);
+    }
+    else
+    {
+        fprintf(stderr, "No btar directory; looking at every member header\n");
+        members_from_headers(&rs);
+    }
+
+    find_groups(&rs);
+    find_blocks(&rs);
+    load_checksums(&rs);
+
+    if (!find_lost(&rs))
+        fatal_error_no_core("The archive cannot be repaired");
+
+    tar = mytar_new();
+    mytar_open_fd(tar, outfd);
+    directory_init(&newdir);
+
+    if (command_line.repair_missing)
+        emit_lost_before(&rs, rs.nblocks, tar, 0);
+    else
+    {
+        int have_index = 0;
+
+        for(i=0; i < rs.nmembers; ++i)
+        {
+            const struct repair_member *m = &rs.members[i];
+            int b = block_number(m->name);
+
+            if (b >= 0)
+                emit_lost_before(&rs, b, tar, &newdir);
+            else if (sscanf(m->name, "parity%d_", &g) == 1 && rs.n > 0)
+                emit_lost_before(&rs, (g + 1) * rs.n, tar, &newdir);
+            else
+                emit_lost_before(&rs, rs.nblocks, tar, &newdir);
+
+            if (strncmp(m->name, "index", 5) == 0)
+                have_index = 1;
+            if (m->damaged)
+            {
+                if (b < 0)
+                    fprintf(stderr, "The member %s is lost\n", m->name);
+                continue;
+            }
+            copy_member(&rs, m, tar, &newdir);
+        }
+        emit_lost_before(&rs, rs.nblocks, tar, &newdir);
+
+        if (rs.have_directory || have_index)
+            directory_to_tar(&newdir, tar);
+    }
+
+    if (mytar_write_archive_end(tar) == -1)
+        error("Could not write archive end");
+
+    directory_free(&newdir);
+    for(i=0; i < rs.nmembers; ++i)
+        free(rs.members[i].name);
+    free(rs.members);
+    for(g=0; g < rs.ngroups; ++g)
+    {
+        free(rs.groups[g].parity);
+        free(rs.groups[g].parity_start);
+        free(rs.groups[g].sizes);
+        free(rs.groups[g].lost);
+    }
+    free(rs.groups);
+    free(rs.blocks);
+    free(rs.emitted);
+    free(rs.block_suffix);
+    checksum_table_free(&rs.checksums);
+    free(tar);
+}
@@ -0,0 +1 @@
+void repair(int fd, int outfd);
@@ -0,0 +1,360 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include "main.h"
+#include "mytar.h"
+#include "block.h"
+#include "blockprocess.h"
+#include "filters.h"
+#include "filememory.h"
+#include "indexshard.h"
+#include "checksums.h"
+#include "repository.h"
+
+/* With --repository, each block of the tar stream is cut into chunks where
+ * its contents say, so the same data gives the same chunks wherever it is
+ * in the stream. The chunks go through -F one by one, to files of the
+ * repository directory named by the SHA-256 of their data, and only those
+ * not there yet are written. The block member in the btar is the list of
+ * its chunks; extracting it gives the defilter the chunk files one after
+ * the other, as the frames of a block. */
+
+enum
+{
+    chunk_min = 128 * 1024,
+    chunk_avg = 512 * 1024,
+    chunk_max = 2 * 1024 * 1024,
+    /* Bits of the gear hash that have to be zero for a cut, more before
+     * chunk_avg and less after it, for sizes closer to chunk_avg */
+    chunk_bits_small = 21,
+    chunk_bits_large = 17
+};
+
+static const char *repository;
+static struct filter *repository_filter;
+static unsigned long long gear[256];
+
+/* Fixed, as the cuts have to be the same in every run */
+static void
+init_gear()
+{
+    unsigned long long x = 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    for(i=0; i < 256; ++i)
+    {
+        unsigned long long z;
+
+        x += 0x9e3779b97f4a7c15ULL;
+        z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* FastCDC: the length of the chunk starting at 'p' */
+static size_t
+next_cut(const unsigned char *p, size_t len)
+{
+    unsigned long long h = 0;
+    size_t normal = chunk_avg;
+    size_t max = chunk_max;
+    size_t i;
+
+    if (len <= chunk_min)
+        return len;
+    if (normal > len)
+        normal = len;
+    if (max > len)
+        max = len;
+
+    for(i = chunk_min; i < normal; ++i)
+    {
+        h = (h << 1) + gear[p[i]];
+        if ((h >> (64 - chunk_bits_small)) == 0)
+            return i + 1;
+    }
+    for(; i < max; ++i)
+    {
+        h = (h << 1) + gear[p[i]];
+        if ((h >> (64 - chunk_bits_large)) == 0)
+            return i + 1;
+    }
+    return max;
+}
+
+static const unsigned int sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block(unsigned int *h, const unsigned char *p)
+{
+    unsigned int w[64];
+    unsigned int a, b, c, d, e, f, g, k;
+    int i;
+
+    for(i=0; i < 16; ++i)
+        w[i] = (unsigned int) p[4*i] << 24 | (unsigned int) p[4*i+1] << 16 |
+            (unsigned int) p[4*i+2] << 8 | p[4*i+3];
+    for(; i < 64; ++i)
+    {
+        unsigned int s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+        unsigned int s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; k = h[7];
+    for(i=0; i < 64; ++i)
+    {
+        unsigned int s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+        unsigned int t1 = k + s1 + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        unsigned int s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+        unsigned int t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+/* The SHA-256 of the data, in hexadecimal */
+static void
+sha256_hex(const char *data, size_t len, char *hex)
+{
+    unsigned int h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    unsigned char last[128];
+    unsigned long long bits = (unsigned long long) len * 8;
+    size_t full = len - len % 64;
+    size_t rest = len % 64;
+    size_t nlast;
+    size_t i;
+
+    for(i=0; i < full; i += 64)
+        sha256_block(h, (const unsigned char *) data + i);
+
+    memset(last, 0, sizeof last);
+    memcpy(last, data + full, rest);
+    last[rest] = 0x80;
+    nlast = rest + 9 <= 64 ? 64 : 128;
+    for(i=0; i < 8; ++i)
+        last[nlast - 1 - i] = (unsigned char) (bits >> (8 * i));
+    for(i=0; i < nlast; i += 64)
+        sha256_block(h, last + i);
+
+    for(i=0; i < 8; ++i)
+        sprintf(hex + 8 * i, "%08x", h[i]);
+}
+
+void
+repository_init(const char *dir, struct filter *f)
+{
+    repository = dir;
+    repository_filter = f;
+    init_gear();
+}
+
+const char *
+repository_extensions()
+{
+    return get_filter_extensions(repository_filter);
+}
+
+int
+repository_is_chunk_list(const char *name)
+{
+    size_t len = strlen(name);
+
+    return len > sizeof ".chunks" - 1 &&
+        strcmp(name + len - (sizeof ".chunks" - 1), ".chunks") == 0;
+}
+
+static void
+chunk_path(char *path, size_t len, const char *hex, const char *extensions)
+{
+    int res;
+
+    res = snprintf(path, len, "%s/%.2s/%s%s", repository, hex, hex,
+            extensions);
+    if (res < 0 || (size_t) res >= len)
+        fatal_error_no_core("error: the repository path is too long");
+}
+
+/* Returns 1 if the chunk was not in the repository */
+static int
+store_chunk(const struct block *b, size_t start, size_t end, const char *hex)
+{
+    char path[PATH_MAX];
+    char tmppath[PATH_MAX];
+    struct file_memory *fm;
+    int fd;
+
+    chunk_path(path, sizeof path, hex, repository_extensions());
+    if (access(path, F_OK) == 0)
+        return 0;
+
+    /* The directories are made as needed */
+    snprintf(tmppath, sizeof tmppath, "%s/%.2s", repository, hex);
+    if (mkdir(repository, 0777) == -1 && errno != EEXIST)
+        fatal_errno("Cannot create the repository %s", repository);
+    if (mkdir(tmppath, 0777) == -1 && errno != EEXIST)
+        fatal_errno("Cannot create the repository directory %s", tmppath);
+
+    /* Renamed once complete, so a chunk there is always whole */
+    if (snprintf(tmppath, sizeof tmppath, "%s.XXXXXX", path) >=
+            (int) sizeof tmppath)
+        fatal_error_no_core("error: the repository path is too long");
+    fd = mkstemp(tmppath);
+    if (fd == -1)
+        fatal_errno("Cannot create the chunk %s", tmppath);
+    set_cloexec(fd);
+
+    if (repository_filter)
+    {
+        fm = filter_range(repository_filter, b, start, end);
+        file_memory_to_fd(fm, fd);
+        file_memory_free(fm);
+    }
+    else if (write_all(fd, b->data + start, end - start) == -1)
+        fatal_errno("Cannot write the chunk %s", tmppath);
+    if (close(fd) == -1)
+        fatal_errno("Cannot write the chunk %s", tmppath);
+    if (rename(tmppath, path) == -1)
+        fatal_errno("Cannot rename the chunk %s", tmppath);
+
+    return 1;
+}
+
+/* The block data becomes the list of its chunks, after storing them */
+void
+repository_store_block(struct block_process *bp)
+{
+    struct block *b = bp->bo;
+    char *list;
+    size_t listlen = 0;
+    size_t pos = 0;
+    int nchunks = 0;
+    int nnew = 0;
+
+    bp->raw_crc = crc32c(0, b->data, b->writer_pos);
+
+    /* A line per chunk: its hash and its size */
+    list = malloc((b->writer_pos / chunk_min + 1) * 100 + 1);
+    if (!list)
+        fatal_error("Cannot allocate");
+
+    while (pos < b->writer_pos)
+    {
+        size_t len = next_cut((const unsigned char *) b->data + pos,
+                b->writer_pos - pos);
+        char hex[65];
+
+        sha256_hex(b->data + pos, len, hex);
+        nnew += store_chunk(b, pos, pos + len, hex);
+        listlen += sprintf(list + listlen, "%s %zu\n", hex, len);
+        pos += len;
+        nchunks++;
+    }
+
+    if (command_line.debug)
+        fprintf(stderr, "Block %i: %i chunks, %i new in the repository\n",
+                bp->nblock, nchunks, nnew);
+
+    if (listlen > b->allocated)
+        block_realloc_set(b, listlen, 0);
+    memcpy(b->data, list, listlen);
+    b->writer_pos = listlen;
+    free(list);
+}
+
+/* Writes to 'fd' the chunks of the list, for the defilter of the block
+ * member 'name' without its .chunks */
+void
+repository_chunks_to_fd(const char *name, const char *list, int fd)
+{
+    const char *extensions;
+    const char *p;
+    char *buffer;
+
+    if (!repository)
+        fatal_error_no_core("error: the btar keeps the blocks in a "
+                "repository; give it with --repository");
+
+    extensions = strstr(name, ".tar");
+    if (!extensions)
+        fatal_error_no_core("error: wrong block member name %s", name);
+    extensions += sizeof ".tar" - 1;
+
+    buffer = malloc(buffersize);
+    if (!buffer)
+        fatal_error("Cannot allocate");
+
+    for(p = list; *p != '\0'; p = strchr(p, '\n') + 1)
+    {
+        char path[PATH_MAX];
+        char hex[65];
+        size_t size;
+        ssize_t nread;
+        int chunkfd;
+
+        if (sscanf(p, "%64s %zu", hex, &size) != 2 || strlen(hex) != 64 ||
+                !strchr(p, '\n'))
+            fatal_error_no_core("error: wrong chunk list in %s", name);
+
+        chunk_path(path, sizeof path, hex, extensions);
+        chunkfd = open(path, O_RDONLY);
+        if (chunkfd == -1)
+            fatal_errno("Cannot open the chunk %s", path);
+
+        while ((nread = read(chunkfd, buffer, buffersize)) > 0)
+            if (write_all(fd, buffer, nread) == -1)
+                fatal_errno("Cannot write the chunk %s to the defilter",
+                        path);
+        if (nread == -1)
+            fatal_errno("Cannot read the chunk %s", path);
+        close(chunkfd);
+    }
+
+    free(buffer);
+}
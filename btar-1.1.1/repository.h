@@ -0,0 +1,8 @@
+struct filter;
+struct block_process;
+
+void repository_init(const char *dir, struct filter *f);
+const char * repository_extensions();
+int repository_is_chunk_list(const char *name);
+void repository_store_block(struct block_process *bp);
+void repository_chunks_to_fd(const char *name, const char *list, int fd);
@@ -0,0 +1,211 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+#include "restoreplan.h"
+
+/* When extracting a series of archives (a full one and its differentials),
+ * the plan says from which of them to extract each file: only from the last
+ * one that has it whole, and from the later ones with rsync patches for it.
+ * With -H, the files deleted later are not extracted at all. Directories
+ * are not in the plan, and are extracted from any archive. --consolidate
+ * plans the directories too, and the files deleted always. */
+
+/* From traverse.c */
+extern const char rdiff_extension[];
+extern const size_t rdiff_extension_len;
+
+struct plan_entry
+{
+    char *name;
+    int first; /* -1 if deleted */
+    int last;
+};
+
+static struct plan_entry *table;
+static size_t table_size;
+static size_t nentries;
+static int current_archive = -1;
+
+static unsigned int
+hash_name(const char *name, size_t len)
+{
+    unsigned int hash = 2166136261u;
+    size_t i;
+
+    for(i=0; i < len; ++i)
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    return hash;
+}
+
+/* The length of the name without the rdiff extension */
+static size_t
+base_length(const char *name, int *is_patch)
+{
+    size_t len = strlen(name);
+
+    *is_patch = 0;
+    if (len > rdiff_extension_len &&
+            strcmp(name + len - rdiff_extension_len, rdiff_extension) == 0)
+    {
+        *is_patch = 1;
+        len -= rdiff_extension_len;
+    }
+    return len;
+}
+
+static struct plan_entry *
+find_slot(struct plan_entry *t, size_t size, const char *name, size_t len)
+{
+    size_t i = hash_name(name, len) & (size - 1);
+
+    while (t[i].name)
+    {
+        if (strncmp(t[i].name, name, len) == 0 && t[i].name[len] == '\0')
+            break;
+        i = (i + 1) & (size - 1);
+    }
+    return &t[i];
+}
+
+static struct plan_entry *
+get_entry(const char *name, size_t len)
+{
+    struct plan_entry *e;
+
+    if (2 * (nentries + 1) > table_size)
+    {
+        size_t newsize = table_size ? 2 * table_size : 1024;
+        struct plan_entry *newtable;
+        size_t i;
+
+        newtable = calloc(newsize, sizeof(*newtable));
+        if (!newtable)
+            fatal_error("Cannot allocate");
+        for(i=0; i < table_size; ++i)
+            if (table[i].name)
+                *find_slot(newtable, newsize, table[i].name,
+                        strlen(table[i].name)) = table[i];
+        free(table);
+        table = newtable;
+        table_size = newsize;
+    }
+
+    e = find_slot(table, table_size, name, len);
+    if (!e->name)
+    {
+        e->name = malloc(len + 1);
+        if (!e->name)
+            fatal_error("Cannot allocate");
+        memcpy(e->name, name, len);
+        e->name[len] = '\0';
+        e->first = -1;
+        e->last = -1;
+        nentries++;
+    }
+    return e;
+}
+
+/* The archives have to be added in order */
+void
+restore_plan_add(const char *name, int archive)
+{
+    int is_patch;
+    size_t len = base_length(name, &is_patch);
+    struct plan_entry *e = get_entry(name, len);
+
+    /* A patch needs what came before; a whole file does not */
+    if (!is_patch || e->first == -1)
+        e->first = archive;
+    e->last = archive;
+}
+
+void
+restore_plan_deleted(const char *name)
+{
+    struct plan_entry *e = get_entry(name, strlen(name));
+
+    e->first = -1;
+    e->last = -1;
+}
+
+void
+restore_plan_set_archive(int archive)
+{
+    current_archive = archive;
+}
+
+int
+restore_plan_active()
+{
+    return current_archive >= 0;
+}
+
+int
+restore_plan_wants(const char *name)
+{
+    int is_patch;
+    size_t len;
+    struct plan_entry *e;
+
+    if (current_archive < 0 || table_size == 0)
+        return 1;
+
+    len = base_length(name, &is_patch);
+    e = find_slot(table, table_size, name, len);
+    if (!e->name)
+        return 1;
+
+    return e->first >= 0 && e->first <= current_archive
+        && current_archive <= e->last;
+}
+
+/* Whether the last archive still has the name, or it was never in the plan */
+int
+restore_plan_kept(const char *name)
+{
+    int is_patch;
+    size_t len;
+    struct plan_entry *e;
+
+    if (table_size == 0)
+        return 1;
+
+    len = base_length(name, &is_patch);
+    e = find_slot(table, table_size, name, len);
+    return !e->name || e->last >= 0;
+}
+
+void
+restore_plan_free()
+{
+    size_t i;
+
+    if (command_line.debug && table_size > 0)
+        fprintf(stderr, "The restore plan had %zu files\n", nentries);
+
+    for(i=0; i < table_size; ++i)
+        free(table[i].name);
+    free(table);
+    table = 0;
+    table_size = 0;
+    nentries = 0;
+    current_archive = -1;
+}
@@ -0,0 +1,7 @@
+void restore_plan_add(const char *name, int archive);
+void restore_plan_deleted(const char *name);
+void restore_plan_set_archive(int archive);
+int restore_plan_active();
+int restore_plan_wants(const char *name);
+int restore_plan_kept(const char *name);
+void restore_plan_free();
@@ -0,0 +1,153 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE /* For fallocate() in Linux */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "main.h"
+#include "mytar.h"
+#include "sparsefile.h"
+
+/* Writing the extracted files. The big ones get their final size allocated
+ * at once, not to be fragmented by many small writes. The aligned runs of
+ * zeros are not written but skipped, leaving holes: punched in the
+ * preallocated space where the system can, and made by the final
+ * ftruncate() otherwise. */
+
+enum {
+    zero_chunk = 4096,
+    preallocate_min = 1024*1024
+};
+
+static int
+is_zero(const char *data, size_t len)
+{
+    return data[0] == 0 && memcmp(data, data + 1, len - 1) == 0;
+}
+
+/* Not posix_fallocate() in Linux: where the filesystem cannot (NFSv3,
+ * older ZFS), glibc writes every block, and there would be no holes left.
+ * The fallocate() call fails with EOPNOTSUPP there instead, and we go on
+ * without. */
+static int
+preallocate(int fd, unsigned long long size)
+{
+#ifdef __linux__
+    return fallocate(fd, 0, 0, size);
+#else
+    return posix_fallocate(fd, 0, size) == 0 ? 0 : -1;
+#endif
+}
+
+void
+sparse_file_start(struct sparse_file *s, int fd, unsigned long long size)
+{
+    s->fd = fd;
+    s->pos = 0;
+    s->size = size;
+    s->in_zeros = 0;
+    s->preallocated = 0;
+
+    /* Not all filesystems can, and then it does not matter */
+    if (size >= preallocate_min && preallocate(fd, size) == 0)
+        s->preallocated = 1;
+}
+
+/* The zeros before 'pos' end; the next write goes after them */
+static int
+end_zeros(struct sparse_file *s)
+{
+    if (!s->in_zeros)
+        return 0;
+    s->in_zeros = 0;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (s->preallocated)
+        fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                s->zeros_start, s->pos - s->zeros_start);
+#endif
+
+    if (lseek(s->fd, s->pos, SEEK_SET) == -1)
+        return -1;
+    return 0;
+}
+
+ssize_t
+sparse_file_write(struct sparse_file *s, const char *data, size_t len)
+{
+    const char *run = data; /* Of data to write */
+    size_t runlen = 0;
+    size_t left = len;
+
+    while (left > 0)
+    {
+        size_t n = zero_chunk - s->pos % zero_chunk;
+
+        if (n > left)
+            n = left;
+
+        /* A whole chunk, or the end of the file */
+        if ((n == zero_chunk || s->pos + n == s->size) && is_zero(data, n))
+        {
+            if (runlen > 0 && write_all(s->fd, run, runlen) != (ssize_t) runlen)
+                return -1;
+            runlen = 0;
+            if (!s->in_zeros)
+            {
+                s->in_zeros = 1;
+                s->zeros_start = s->pos;
+            }
+        }
+        else
+        {
+            if (runlen == 0)
+            {
+                if (end_zeros(s) == -1)
+                    return -1;
+                run = data;
+            }
+            runlen += n;
+        }
+
+        s->pos += n;
+        data += n;
+        left -= n;
+    }
+
+    if (runlen > 0 && write_all(s->fd, run, runlen) != (ssize_t) runlen)
+        return -1;
+
+    return len;
+}
+
+/* Before closing the file. Its size is that of the data written, even if
+ * it was cut. */
+int
+sparse_file_end(struct sparse_file *s)
+{
+    int zeros_at_end = s->in_zeros;
+
+    if (end_zeros(s) == -1)
+        return -1;
+
+    if ((zeros_at_end || s->pos < s->size) && ftruncate(s->fd, s->pos) == -1)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,13 @@
+struct sparse_file
+{
+    int fd;
+    unsigned long long pos; /* Where the next data goes */
+    unsigned long long size; /* From the tar header */
+    unsigned long long zeros_start; /* Of the zeros not written */
+    int in_zeros;
+    int preallocated;
+};
+
+void sparse_file_start(struct sparse_file *s, int fd, unsigned long long size);
+ssize_t sparse_file_write(struct sparse_file *s, const char *data, size_t len);
+int sparse_file_end(struct sparse_file *s);
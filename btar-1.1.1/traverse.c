@@ -38,6 +38,7 @@
 #include "mytar.h"
 #include "loadindex.h"
 #include "rsync.h"
+#include "checkpoint.h"
 
 struct traverse
 {
@@ -59,12 +60,15 @@ static int npath; /* pointer to the list of paths */
 static struct mytar *intar;
 static struct mytar *indextar;
 static struct mytar *deletedtar;
+static struct mytar *signaturestar;
 
 static char *buffer;
 static int inbuffer;
 static int bufferoffset;
 
 static int current_block = 0;
+static int first_block = 0; /* Of the tar, after those of the btar on --append */
+static unsigned long long entry_offset; /* Of the file header in current_block */
 
 static struct rsync_signature *rsync_signature = 0;
 static struct rsync_delta *rsync_delta = 0;
@@ -76,6 +80,10 @@ static char delta_filename[PATH_MAX];
 
 static int creating_delta = 0;
 
+static const struct checkpoint_entry *resume_entry;
+static int resume_start_seen;
+static int resume_checked;
+
 static unsigned long long size_expected;
 static time_t mtime_expected;
 
@@ -121,6 +129,49 @@ matches_exclude_pattern(const char *path)
     return 0;
 }
 
+static void
+resume_mismatch()
+{
+    fatal_error_no_core("error: the files changed since the checkpoint, "
+            "and the btar cannot go on from it");
+}
+
+/* On --resume, the entry at the end of the blocks already stored has to
+ * come at the same place, and the next one just after it */
+static void
+check_resume(const char *name)
+{
+    unsigned long long pos = intar->total_written;
+
+    if (!resume_entry || resume_checked)
+        return;
+
+    if (pos == resume_entry->start)
+    {
+        if (strcmp(name, resume_entry->name) != 0)
+            resume_mismatch();
+        resume_start_seen = 1;
+    }
+    else if (pos == resume_entry->next && resume_start_seen)
+        resume_checked = 1;
+    else if (pos > resume_entry->start)
+        resume_mismatch();
+}
+
+static void
+check_resume_end()
+{
+    unsigned long long pos = intar->total_written;
+
+    check_resume("");
+
+    /* The blocks may have ended in the zero records of the tar end */
+    if (resume_entry && !resume_checked &&
+            !(resume_entry->name[0] == '\0' && resume_entry->start >= pos &&
+                resume_entry->start <= pos + 512))
+        resume_mismatch();
+}
+
 static void
 emit_until_this(struct traverse *t)
 {
@@ -146,11 +197,13 @@ emit_until_this(struct traverse *t)
     strcpy(dirname_with_slash, t->displayname);
     strcat(dirname_with_slash, "/");
 
-    if (command_line.verbose)
+    if (command_line.verbose && intar->total_written >= intar->skip)
     {
         fprintf(stderr, "%s\n", dirname_with_slash);
     }
 
+    check_resume(dirname_with_slash);
+
     mytar_set_filename(intar, dirname_with_slash);
 
     if (indextar)
@@ -498,11 +551,13 @@ int find_next_file()
         mytar_new_file(indextar);
     }
 
-    if (command_line.verbose)
+    if (command_line.verbose && intar->total_written >= intar->skip)
     {
         fprintf(stderr, "%s\n", display_filename);
     }
 
+    check_resume(display_filename);
+
     mytar_set_filename(intar, display_filename);
     if (indextar)
         mytar_set_filename(indextar, display_filename);
@@ -523,11 +578,12 @@ int find_next_file()
     }
 
     /* Just before the write_header of intar, let's calculate
-     * what block we are in */
-    while (intar->total_written > (current_block+1) * command_line.blocksize)
+     * what block we are in, and where in it */
+    while (intar->total_written >= (current_block+1) * command_line.blocksize)
     {
         ++current_block;
     }
+    entry_offset = intar->total_written - current_block * command_line.blocksize;
 
     if (!creating_delta)
     {
@@ -541,7 +597,7 @@ int find_next_file()
     {
         int should_rsync = 0;
 
-        if (command_line.should_rsync &&
+        if (command_line.should_rsync && signaturestar &&
                 S_ISREG(bufstat.st_mode) &&
                 bufstat.st_size > (off_t) command_line.rsync_minimal_size)
         {
@@ -551,25 +607,36 @@ int find_next_file()
         assert(!S_ISDIR(bufstat.st_mode));
 
         snprintf(block_filename, sizeof block_filename,
-                "block%i.tar%s_%lli", current_block,
+                "block%i.tar%s_%lli;o=%llu", first_block + current_block,
                 get_filter_extensions(filter),
-                (long long int) bufstat.st_size);
+                (long long int) bufstat.st_size, entry_offset);
 
-        /* In case of non-regular file, we write the header directly,
-         * as we are going to reenter find_next. */
-        if (!should_rsync)
-        {
-            mytar_set_filetype(indextar, S_IFLNK);
-            mytar_set_linkname(indextar, block_filename);
+        /* Where the data goes on into the next block, for --range */
+        if (S_ISREG(bufstat.st_mode) && !creating_delta)
+            index_link_add_crossing(block_filename, sizeof block_filename,
+                    intar->total_written, bufstat.st_size);
 
-            mytar_set_size(indextar, 0);
-            res = mytar_write_header(indextar);
-            if (res == -1)
-                error("Cannot write index tar");
-        }
-        else
+        /* The signature goes to its own tar, not to clutter the index.
+         * The index only gets a mark at the end of the link name. */
+        if (should_rsync)
+            strncat(block_filename, ";s",
+                    sizeof block_filename - strlen(block_filename) - 1);
+
+        mytar_set_filetype(indextar, S_IFLNK);
+        mytar_set_linkname(indextar, block_filename);
+
+        mytar_set_size(indextar, 0);
+        res = mytar_write_header(indextar);
+        if (res == -1)
+            error("Cannot write index tar");
+
+        if (should_rsync)
         {
-            mytar_set_filetype(indextar, S_IFREG);
+            /* Written when we have the signature size */
+            mytar_new_file(signaturestar);
+            mytar_set_filename(signaturestar, display_filename);
+            mytar_set_from_stat(signaturestar, &bufstat);
+            mytar_set_filetype(signaturestar, S_IFREG);
             rsync_signature = rsync_signature_new();
         }
     }
@@ -639,12 +706,18 @@ dump_deleted()
 }
 
 int
-traverse(int datafd, int indexfd, int deletedfd)
+traverse(int datafd, int indexfd, int deletedfd, int signaturesfd,
+        int firstblock)
 {
     if (!mytraverse)
     {
+        first_block = firstblock;
         intar = mytar_new();
         mytar_open_fd(intar, datafd);
+        resume_entry = checkpoint_resume_entry();
+        if (resume_entry)
+            intar->skip = (unsigned long long) resume_entry->block *
+                command_line.blocksize;
         if (indexfd != -1)
         {
             indextar = mytar_new();
@@ -655,6 +728,11 @@ traverse(int datafd, int indexfd, int deletedfd)
             deletedtar = mytar_new();
             mytar_open_fd(deletedtar, deletedfd);
         }
+        if (signaturesfd != -1)
+        {
+            signaturestar = mytar_new();
+            mytar_open_fd(signaturestar, signaturesfd);
+        }
 #ifndef USE_MMAP
         buffer = malloc(buffersize);
         if (!buffer)
@@ -675,6 +753,7 @@ traverse(int datafd, int indexfd, int deletedfd)
         else if (res == -2)
         {
             /* End of tar */
+            check_resume_end();
             res = mytar_write_archive_end(intar);
             if (res == -1)
                 error("Cannot write internal tar - mytar_write_archive_end");
@@ -689,6 +768,13 @@ traverse(int datafd, int indexfd, int deletedfd)
             if (deletedtar)
                 dump_deleted();
 
+            if (signaturestar)
+            {
+                res = mytar_write_archive_end(signaturestar);
+                if (res == -1)
+                    error("Cannot write signatures tar - mytar_write_archive_end");
+            }
+
             free(buffer);
             return 0;
         }
@@ -697,6 +783,20 @@ traverse(int datafd, int indexfd, int deletedfd)
         skipping_data = 0;
         skipped_data = 0;
 
+        /* On --resume, the data already in the blocks is not even read */
+        if (intar->total_written < intar->skip)
+        {
+            unsigned long long ahead = intar->skip - intar->total_written;
+
+            if (ahead > size_expected)
+                ahead = size_expected;
+            if (ahead > 0 &&
+                    lseek(mytraverse->filefd, ahead, SEEK_SET) == (off_t) -1)
+                error("Cannot seek the file to resume");
+            mytar_skip_data(intar, ahead);
+            total_read = ahead;
+        }
+
         while(1)
         {
             size_t max_to_read = buffersize;
@@ -846,35 +946,28 @@ traverse(int datafd, int indexfd, int deletedfd)
                 if (rsync_signature)
                 {
                     size_t siglen;
-                    size_t len;
 
                     /* Mark end of file to rsync */
                     rsync_signature_work(rsync_signature, 0, 0);
 
-                    /* Should output the block name too */
                     siglen = rsync_signature_size(rsync_signature);
-                    len = siglen + strlen(block_filename) + 1 /*\0*/;
 
-                    mytar_set_size(indextar, len);
-                    mytar_write_header(indextar);
-
-                    /* The name, and \0 */
-                    res = mytar_write_data(indextar, block_filename,
-                            strlen(block_filename) + 1);
+                    mytar_set_size(signaturestar, siglen);
+                    res = mytar_write_header(signaturestar);
                     if (res == -1)
-                        error("Cannot write index tar 1 - mytar_write_data");
-                    /* Then the rsync signature */
-                    res = mytar_write_data(indextar, rsync_signature->output,
+                        error("Cannot write signatures tar");
+
+                    res = mytar_write_data(signaturestar, rsync_signature->output,
                             siglen);
                     if (res == -1)
-                        error("Cannot write index tar 2 - mytar_write_data");
+                        error("Cannot write signatures tar - mytar_write_data");
 
                     rsync_signature_free(rsync_signature);
                     rsync_signature = 0;
 
-                    res = mytar_write_end(indextar);
+                    res = mytar_write_end(signaturestar);
                     if (res == -1)
-                        error("Cannot write index tar - mytar_write_end");
+                        error("Cannot write signatures tar - mytar_write_end");
                 }
             }
 
@@ -1,3 +1,4 @@
 #include <dirent.h>
 
-int traverse(int datafd, int indexfd, int deletedfd);
+int traverse(int datafd, int indexfd, int deletedfd, int signaturesfd,
+        int firstblock);
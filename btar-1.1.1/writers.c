@@ -0,0 +1,377 @@
+/*
+    btar - no-tape archiver.
+    Copyright (C) 2011  Lluis Batlle i Rossell
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include "main.h"
+#include "mytar.h"
+#include "writers.h"
+#include "sparsefile.h"
+
+/* The writers are processes that create the extracted files, so the
+ * open/write/chmod/lchown/lutimes/close of many small files do not stop the
+ * decoding. Each job goes through the pipe of a writer: the struct below, the
+ * name, the link name, and then for files the data in chunks, each after its
+ * length, ending with a zero length. The pipes bound the buffering. The same
+ * name always goes to the same writer, so the jobs on a path keep their
+ * order. */
+
+enum writer_job_type
+{
+    WRITER_FILE,
+    WRITER_SYMLINK
+};
+
+struct writer_job
+{
+    enum writer_job_type type;
+    int mode;
+    int uid;
+    int gid;
+    int atime;
+    int mtime;
+    unsigned long long size;
+    size_t namelen;
+    size_t linknamelen;
+};
+
+struct writer
+{
+    int fd;
+};
+
+static struct writer *writers;
+static int nwriters;
+/* Gives EOF when all the writers are gone */
+static int done_fd = -1;
+
+static int
+read_all(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+
+    while (n > 0)
+    {
+        ssize_t res = read(fd, p, n);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return -1;
+        p += res;
+        n -= res;
+    }
+    return 0;
+}
+
+static void
+set_times(const char *name, int atime, int mtime)
+{
+    int res;
+    struct timeval t[2];
+
+    t[0].tv_sec = atime;
+    t[0].tv_usec = 0;
+    t[1].tv_sec = mtime;
+    t[1].tv_usec = 0;
+    res = lutimes(name, t);
+    if (res == -1)
+        fprintf(stderr, "Cannot set times to %s: %s\n", name,
+                strerror(errno));
+}
+
+static void
+writer_file(int fd, const struct writer_job *job, const char *name)
+{
+    char *buffer;
+    size_t len;
+    int out;
+    int res;
+    struct sparse_file sparse;
+
+    buffer = malloc(buffersize);
+    if (!buffer)
+        fatal_error("Cannot allocate");
+
+    if (command_line.debug)
+        fprintf(stderr, "Creating file %s\n", name);
+    out = open(name, O_CREAT | O_TRUNC | O_WRONLY, job->mode);
+    if (out == -1)
+        fprintf(stderr, "Cannot create %s: %s\n", name, strerror(errno));
+    else
+        sparse_file_start(&sparse, out, job->size);
+
+    /* The data comes anyway */
+    while (1)
+    {
+        if (read_all(fd, &len, sizeof len) == -1 || len > buffersize)
+            fatal_error("Writer: the data of %s did not arrive", name);
+        if (len == 0)
+            break;
+        if (read_all(fd, buffer, len) == -1)
+            fatal_error("Writer: the data of %s did not arrive", name);
+        if (out >= 0)
+        {
+            res = sparse_file_write(&sparse, buffer, len);
+            if ((size_t) res != len)
+                fatal_errno("Cannot write to file");
+        }
+    }
+    free(buffer);
+
+    if (out == -1)
+        return;
+    if (sparse_file_end(&sparse) == -1)
+        fatal_errno("Cannot write to file");
+    close(out);
+
+    res = chmod(name, job->mode);
+    if (res == -1)
+        fprintf(stderr, "Cannot set mode to %s: %s\n", name,
+                strerror(errno));
+
+    res = lchown(name, job->uid, job->gid);
+    if (res == -1)
+        fprintf(stderr, "Cannot set uid/gid to %s: %s\n", name,
+                strerror(errno));
+
+    set_times(name, job->atime, job->mtime);
+}
+
+static void
+writer_symlink(const struct writer_job *job, const char *name,
+        const char *linkname)
+{
+    int res;
+
+    res = symlink(linkname, name);
+    if (res == -1)
+        fprintf(stderr, "Could not create symlink %s: %s\n", name,
+                strerror(errno));
+
+    res = lchown(name, job->uid, job->gid);
+    if (res == -1)
+        fprintf(stderr, "Cannot set uid/gid to %s: %s\n", name,
+                strerror(errno));
+
+    set_times(name, job->atime, job->mtime);
+}
+
+static void
+writer_loop(int fd)
+{
+    struct writer_job job;
+    char name[PATH_MAX];
+    char linkname[PATH_MAX];
+
+    while (read_all(fd, &job, sizeof job) == 0)
+    {
+        if (job.namelen >= sizeof name || job.linknamelen >= sizeof linkname)
+            fatal_error("Writer: wrong job");
+        if (read_all(fd, name, job.namelen) == -1 ||
+                read_all(fd, linkname, job.linknamelen) == -1)
+            fatal_error("Writer: truncated job");
+        name[job.namelen] = '\0';
+        linkname[job.linknamelen] = '\0';
+
+        if (job.type == WRITER_FILE)
+            writer_file(fd, &job, name);
+        else
+            writer_symlink(&job, name, linkname);
+    }
+}
+
+void
+writers_start(int n)
+{
+    int done[2];
+    int i;
+    int res;
+
+    assert(nwriters == 0);
+
+    if (n <= 0)
+        return;
+
+    writers = malloc(sizeof(*writers) * n);
+    if (!writers)
+        fatal_error("Cannot allocate");
+
+    res = pipe(done);
+    if (res == -1)
+        error("Cannot create pipe");
+
+    /* Do not let the children repeat what is pending */
+    fflush(stdout);
+
+    for(i=0; i < n; ++i)
+    {
+        int mypipe[2];
+        int pid;
+
+        res = pipe(mypipe);
+        if (res == -1)
+            error("Cannot create pipe");
+
+        pid = fork();
+        if (pid == -1)
+            error("Cannot fork");
+
+        if (pid == 0)
+        {
+            int j;
+
+            close(mypipe[1]);
+            close(done[0]);
+            for(j=0; j < i; ++j)
+                close(writers[j].fd);
+            writer_loop(mypipe[0]);
+            exit(0);
+        }
+
+        close(mypipe[0]);
+        /* The filters started later should not keep the writers alive */
+        set_cloexec(mypipe[1]);
+        writers[i].fd = mypipe[1];
+    }
+    nwriters = n;
+
+    close(done[1]);
+    set_cloexec(done[0]);
+    done_fd = done[0];
+
+    if (command_line.debug)
+        fprintf(stderr, "Started %i writers\n", n);
+}
+
+static int
+send_job(struct writer_job *job, const char *name, const char *linkname)
+{
+    unsigned int hash = 2166136261u;
+    const char *p;
+    int fd;
+
+    if (nwriters == 0)
+        return -1;
+
+    for(p = name; *p; ++p)
+        hash = (hash ^ (unsigned char) *p) * 16777619u;
+    fd = writers[hash % nwriters].fd;
+
+    job->namelen = strlen(name);
+    job->linknamelen = linkname ? strlen(linkname) : 0;
+
+    if (write_all(fd, job, sizeof *job) == -1 ||
+            write_all(fd, name, job->namelen) == -1 ||
+            (linkname && write_all(fd, linkname, job->linknamelen) == -1))
+        fatal_errno("Cannot send a job to the writers");
+
+    return fd;
+}
+
+/* Returns the fd for writers_data(), or -1 if there are no writers */
+int
+writers_file(const char *name, unsigned long long size, int mode, int uid,
+        int gid, int atime, int mtime)
+{
+    struct writer_job job;
+
+    job.type = WRITER_FILE;
+    job.size = size;
+    job.mode = mode;
+    job.uid = uid;
+    job.gid = gid;
+    job.atime = atime;
+    job.mtime = mtime;
+
+    return send_job(&job, name, 0);
+}
+
+void
+writers_data(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t chunk = len;
+
+        if (chunk > buffersize)
+            chunk = buffersize;
+        if (write_all(fd, &chunk, sizeof chunk) == -1 ||
+                write_all(fd, data, chunk) == -1)
+            fatal_errno("Cannot send data to the writers");
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+void
+writers_file_end(int fd)
+{
+    size_t len = 0;
+
+    if (write_all(fd, &len, sizeof len) == -1)
+        fatal_errno("Cannot send data to the writers");
+}
+
+int
+writers_symlink(const char *name, const char *linkname, int uid, int gid,
+        int atime, int mtime)
+{
+    struct writer_job job;
+
+    job.type = WRITER_SYMLINK;
+    job.mode = 0;
+    job.uid = uid;
+    job.gid = gid;
+    job.atime = atime;
+    job.mtime = mtime;
+
+    return send_job(&job, name, linkname) == -1 ? -1 : 0;
+}
+
+/* Waits for all the jobs to be done. The child handler reaps the writers,
+ * and fails if any of them did. */
+void
+writers_wait()
+{
+    int i;
+    char c;
+    ssize_t res;
+
+    if (nwriters == 0)
+        return;
+
+    for(i=0; i < nwriters; ++i)
+        close(writers[i].fd);
+
+    do
+        res = read(done_fd, &c, 1);
+    while (res == -1 && errno == EINTR);
+    if (res == -1)
+        fatal_errno("Cannot wait for the writers");
+
+    close(done_fd);
+    done_fd = -1;
+    free(writers);
+    writers = 0;
+    nwriters = 0;
+}
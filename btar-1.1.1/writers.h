@@ -0,0 +1,8 @@
+void writers_start(int n);
+int writers_file(const char *name, unsigned long long size, int mode, int uid,
+        int gid, int atime, int mtime);
+void writers_data(int fd, const char *data, size_t len);
+void writers_file_end(int fd);
+int writers_symlink(const char *name, const char *linkname, int uid, int gid,
+        int atime, int mtime);
+void writers_wait();